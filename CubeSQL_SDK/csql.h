@@ -28,6 +28,7 @@
 #ifdef WIN32
 #include <Shlwapi.h>
 #include <io.h>
+#include <sys/stat.h>
 #include <float.h>
 #include "zlib.h"
 #else
@@ -68,6 +69,7 @@ extern "C"
 #pragma warning (disable: 4068)
 #define snprintf		    _snprintf
 #define strdup			    _strdup
+#define strcasecmp		    _stricmp
 #define strtoll(x,y,z)	    _strtoi64(x,y,z)
 #define BSD_FD_ISSET	    FD_ISSET
 #define SHUT_RDWR           2
@@ -99,6 +101,23 @@ extern "C"
 typedef int socklen_t;
 typedef int ssize_t;
 typedef unsigned long in_addr_t;
+typedef CRITICAL_SECTION            csql_mutex;
+#define csql_mutex_init(m)          InitializeCriticalSection(m)
+#define csql_mutex_lock(m)          EnterCriticalSection(m)
+#define csql_mutex_unlock(m)        LeaveCriticalSection(m)
+#define csql_mutex_destroy(m)       DeleteCriticalSection(m)
+typedef CONDITION_VARIABLE          csql_cond;
+#define csql_cond_init(c)           InitializeConditionVariable(c)
+#define csql_cond_broadcast(c)      WakeAllConditionVariable(c)
+#define csql_cond_destroy(c)
+typedef HANDLE                      csql_thread;
+#define CSQL_THREAD_PROC            DWORD WINAPI
+#define csql_thread_create(t,f,a)   (((*(t) = CreateThread(NULL, 0, (f), (a), 0, NULL)) != NULL) ? 0 : -1)
+#define csql_thread_join(t)         do {WaitForSingleObject((t), INFINITE); CloseHandle(t);} while (0)
+#define CSQL_THREAD_LOCAL           __declspec(thread)
+#define csql_atomic_xchg(p,v)       InterlockedExchangePointer((PVOID volatile *)(p), (v))
+#define csql_atomic_load(p)         InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#define csql_atomic_store(p,v)      ((void)InterlockedExchangePointer((PVOID volatile *)(p), (v)))
 	
 #else
 // UNIX
@@ -116,8 +135,28 @@ typedef unsigned long in_addr_t;
 #define sock_read                       read
 #define Pause()                         pause()
 #define mssleep(ms)                     usleep((ms)*1000)
+typedef pthread_mutex_t                 csql_mutex;
+#define csql_mutex_init(m)              pthread_mutex_init(m, NULL)
+#define csql_mutex_lock(m)              pthread_mutex_lock(m)
+#define csql_mutex_unlock(m)            pthread_mutex_unlock(m)
+#define csql_mutex_destroy(m)           pthread_mutex_destroy(m)
+typedef pthread_cond_t                  csql_cond;
+#define csql_cond_init(c)               pthread_cond_init(c, NULL)
+#define csql_cond_broadcast(c)          pthread_cond_broadcast(c)
+#define csql_cond_destroy(c)            pthread_cond_destroy(c)
+typedef pthread_t                       csql_thread;
+#define CSQL_THREAD_PROC                void *
+#define csql_thread_create(t,f,a)       pthread_create((t), NULL, (f), (a))
+#define csql_thread_join(t)             pthread_join((t), NULL)
+#define CSQL_THREAD_LOCAL               __thread
+#define csql_atomic_xchg(p,v)           __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define csql_atomic_load(p)             __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define csql_atomic_store(p,v)          __atomic_store_n((p), (v), __ATOMIC_RELEASE)
 #endif
 	
+#define csql_isneterror(code)			(((code) >= ERR_SOCKET_INVALID_PORT_HOST) && ((code) <= ERR_SSL))
+#define csql_ascii_lower(c)				((((c) >= 'A') && ((c) <= 'Z')) ? ((c) | 0x20) : (c))
+	
 /* PROTOCOL MACROS */
 #define SETBIT(x, b)					((x) |= (b))
 #define CLEARBIT(x, b)					((x) &= ~(b))
@@ -172,8 +211,33 @@ typedef unsigned long in_addr_t;
 #define NULL_VALUE						-1
 #define kNUMBUFFER						1000
 #define kMAXCHUNK						(100*1024)
+#define kEXPORT_BUFFER					(1024*1024)
+#define kCACHE_SLOTS					64
+#define kFLIGHT_TIMEOUT					(CUBESQL_DEFAULT_TIMEOUT*1000)	// ms a cache lookup waits for an identical query of a connection without timeout
+#define kCURSOR_CONCAT					-2			// cursor_id of a cursor made of other cursors
+#define kSHARD_POINTS					160			// points of each shard on the hash ring
+#define kMAX_SORTKEYS					16
+#define kREPLICA_RETRY					5000		// ms before a failed replica is used again
+#define kREPLICA_WEIGHT					0.2			// weight of the last latency sample
+#define kMAX_HOSTS						64			// hosts remembered by the multi-host connect
+#define kHOST_COOLDOWN					2000		// ms a failed host is skipped (doubled at each consecutive failure)
+#define kHOST_MAXCOOLDOWN				60000
+#define kHOST_PROBE_INTERVAL			30000		// ms before an unused host is measured again in background
+#define kHOST_WEIGHT					0.3			// weight of the last connect time sample
+#define kSCHED_CLASSES					4
+#define kSCHED_THROTTLE					5			// default ms of pause between bulk chunks while interactive work waits
+#define kMAX_COALESCE					1000		// maximum number of writes in a single coalesced transaction
+#define kBATCH_REPLIES					256			// replies in flight during a batch execute of a prepared statement
+#define kBIND_WINDOW					1048576		// bytes of column chunks in flight during a bind
+#define kNUMBER_SIZE					32			// buffer size for a number formatted as text
+#define kSTREAM_PIECE					65536		// bytes read and written at a time by a streamed BLOB bind (multiple of BLOCK_LEN)
 #define NO_TIMEOUT						0
 #define CONNECT_TIMEOUT					5
+#define CSQL_HASH_SEED					14695981039346656037ULL
+#define CSQL_HASH_PRIME					1099511628211ULL
+#define CSQL_ARROW_MAGIC				"ARROW1"
+#define CSQL_ARROW_CONTINUATION			0xFFFFFFFF
+#define CSQL_ARROW_VERSION				4			// MetadataVersion V5
 	
 #if defined(HAVE_BZERO) || defined(bzero)
 // do nothing
@@ -299,6 +363,8 @@ typedef struct {
 	unsigned short	reserved2;					// unused in this version
 } outhead;
 	
+typedef struct csqlrouter csqlrouter;
+	
 struct csqldb {
 	int				        timeout;					// timeout used in the socket I/O operations
 	int			 	        sockfd;						// the socket
@@ -334,11 +400,47 @@ struct csqldb {
 	
 	void (*trace) (const char*, void*);                 // trace callback
 	void                    *data;                      // user argument to be passed to the callbacks function
+	
+	csqlcache               *cache;                     // optional result cache (it can be shared between connections)
+	unsigned long long      cache_scope;                // hash of the last USE DATABASE statement (part of the cache keys)
+	
+	csqlrouter              *router;                    // optional read replicas (reads are sent to them)
+	csqldb                  *primary;                   // set when the connection is a replica of another one
+	
+	csqlsched               *sched;                     // set while the connection is acquired through a scheduler
+	int                     sched_class;                // priority class of the current acquirer
+	
+	csqlvm                  *vmcurrent;                 // last VM prepared on the server (NULL once closed)
+	csqlvm                  *vmcache;                   // VM reused by cubesql_vmprepare_cached
+	int                     vmclose;                    // kTRUE if a VM no longer owned must still be closed on the server
+	
+	csqlpager               *pager;                     // pagers that prefetch on the connection (linked by nextpager)
 };
+	
+typedef struct csqlcacheentry csqlcacheentry;
+typedef struct csqlflight csqlflight;
 
+// parameter bound to a VM, buffered until the statement is executed
+typedef struct {
+	int			index;
+	int			type;
+	int			len;
+	char		*value;					// owned copy (NULL for NULL and ZEROBLOB binds)
+	cubesql_blob_reader	reader;			// streamed BLOB, read at send time (value is NULL)
+	void		*ctx;
+	int			fd;						// streamed file owned by the bind (-1 if none)
+} csqlbind;
+	
 struct csqlvm {
 	csqldb		*db;
 	int			vmindex;
+	csqlbind	*binds;					// sent in a single burst by cubesql_vmexecute and cubesql_vmselect
+	int			nbinds;
+	int			nalloc;
+	int			errindex;				// parameter whose bind failed in the last execute (0 if none)
+	int			maxindex;				// highest parameter sent since the statement was prepared on the server
+	char		*sql;					// statement prepared again when another VM has replaced it on the server
+	int			cached;					// kTRUE if the VM belongs to the connection (cubesql_vmprepare_cached)
 };
 	
 struct csqlc {
@@ -373,8 +475,329 @@ struct csqlc {
 	int			*rowcount;
 	int			nbuffer;
 	int			nalloc;
+	
+	csqlcacheentry *shared;					// set when buffers are owned by a cache entry
+	csqlc		**parts;					// concatenated cursors (rowcount holds the cumulative rows)
+	int			nparts;						// buffer and size0 point to the fields of the parts once merged
+};
+
+// a list of rows (1-based) pointing inside a cursor, no field data is copied
+struct csqlsel {
+	csqlc		*c;
+	int			*rows;
+	int			nrows;
+	int			nalloc;
+};
+
+// result of cubesql_cursor_diff (inserted and updated point to the new cursor, deleted and updated_old to the old one)
+struct csqldiff {
+	csqlsel		*inserted;
+	csqlsel		*deleted;
+	csqlsel		*updated;
+	csqlsel		*updated_old;
+};
+	
+// raw view of one receive buffer of a cursor (one for each chunk)
+typedef struct {
+	char		*data;						// data section of the buffer (NULL for custom created cursors)
+	int			*size;						// size of each field (-1 means NULL)
+	int			*psum;						// running sum of the field sizes
+	int			firstrow;					// 1-based index of the first row stored in the buffer
+	int			nrows;						// number of rows stored in the buffer
+} csqlchunk;
+	
+// cached cursor, returned cursors are shallow copies that share its buffers
+struct csqlcacheentry {
+	unsigned long long	hash;
+	char				*key;				// scope, sql and params
+	int					keylen;
+	char				*tables;			// lowercase table names (each one NULL terminated, list ends with an empty name)
+	csqlc				*c;					// the cursor that owns the buffers
+	int64				bytes;				// memory used by the cursor
+	int64				expire;				// expiration time in ms (0 means never)
+	int					refcount;			// one for the cache itself plus one for each returned cursor
+	csqlcache			*cache;
+	csqlcacheentry		*prev;				// LRU list (head is the most recently used)
+	csqlcacheentry		*next;
+	csqlcacheentry		*hnext;				// hash chain
+};
+	
+// a query in progress, identical lookups wait for its result instead of sending the same query
+struct csqlflight {
+	unsigned long long	hash;
+	char				*key;
+	int					keylen;
+	csqldb				*leader;			// connection that is running the query
+	csqlcacheentry		*result;			// shared result (NULL if the query failed)
+	int					done;
+	int					stale;				// cache has been invalidated while the query was running
+	int					refcount;			// leader plus waiting connections
+	csqlflight			*next;
+};
+	
+// cursor refreshed by fetching only rows at or above a high-water mark
+struct csqlrefresh {
+	csqldb				*db;
+	char				*sql;				// source query
+	char				*mark;				// name of the column compared with the high-water mark
+	int					markcolumn;			// 1-based index of the mark column
+	int					keycolumn;			// 1-based index of the column that identifies a row
+	int					resync;				// a full query is performed every resync refreshes (0 means never)
+	int					count;				// refreshes since the last full query
+	char				*hwm;				// current high-water mark
+	int					hwmlen;
+	int					hwmnumeric;			// compare marks as numbers
+	csqlc				*c;					// merged rows (custom cursor)
+	int					*slots;				// key index (open addressing, 1-based rows)
+	int					nslots;
+};
+	
+// keyset pagination, the next page is fetched in background on a second connection
+struct csqlpager {
+	csqldb				*db;
+	csqldb				*prefetchdb;		// connection used by the prefetch thread (NULL disables prefetch)
+	csqlpager			*nextpager;			// next pager that prefetches on the same connection
+	char				*sql;				// source query
+	char				*key;				// name of the ordered (and unique) key column
+	int					keycolumn;			// 1-based index of the key column (resolved on the first page)
+	int					pagesize;
+	char				*last;				// key of the last row returned
+	int					lastlen;
+	int					numeric;			// compare keys as numbers
+	int					npages;				// pages returned so far
+	int					eof;
+	csqlc				*next;				// page fetched by the prefetch thread
+	char				*nextsql;			// its query, traced by the calling thread after the join
+	int					running;			// prefetch thread must be joined
+	csql_thread			thread;
+};
+	
+// connections shared by concurrent operations (they are not owned by the pool)
+struct csqlpool {
+	csql_mutex			mutex;
+	csql_cond			cond;				// signaled when a connection is released
+	csqldb				**dbs;
+	int					*busy;
+	int					count;
+	int					nalloc;
+	csqlsched			*sched;				// notified when a connection is released
+};
+	
+// requests waiting for a pooled connection, grouped by priority class
+typedef struct csqlwaiter {
+	csqldb				*db;				// connection handed to the waiter
+	struct csqlwaiter	*next;
+} csqlwaiter;
+	
+typedef struct {
+	int					weight;				// share of the connections when several classes are waiting
+	int					maxactive;			// 0 means no limit, -1 means all the connections but one
+	int					throttle;			// ms of pause between chunks while a more urgent class is waiting
+	int					active;
+	double				vtime;				// virtual time of the next grant (weighted fair queueing)
+	csqlwaiter			*head;
+	csqlwaiter			*tail;
+} csqlclass;
+	
+struct csqlsched {
+	csqlpool			*pool;
+	csql_mutex			mutex;
+	csql_cond			cond;				// signaled when a waiter receives a connection
+	csqlclass			classes[kSCHED_CLASSES];
+	double				vclock;				// virtual time of the last grant
+};
+	
+// request of a shared connection, it also holds the per-call error state
+struct csqlresult {
+	struct csqlresult	*next;				// updated atomically (multiple producers queue)
+	char				*sql;
+	int					is_select;
+	int					done;
+	int					errcode;
+	char				errmsg[512];
+	csqlc				*c;
+};
+	
+// connection used by many threads: requests are queued lock-free and served in FIFO order by a single I/O thread
+struct csqlshared {
+	csqldb				*db;
+	csqlresult			*head;				// last queued request (swapped atomically by the producers)
+	csqlresult			*tail;				// next request to serve (used only by the I/O thread)
+	csqlresult			stub;
+	csql_mutex			mutex;
+	csql_cond			queued;				// signaled when a request is queued
+	csql_cond			served;				// signaled when a request is completed
+	csql_thread			thread;
+	int					stopping;
+	
+	// write coalescing (disabled when window is 0)
+	int					window;				// ms to wait for other writes after the first one
+	int					maxbatch;
+	int					intransaction;		// writes are not coalesced inside a transaction opened by a caller
+	csqlresult			*pending;			// request popped while collecting a batch but not part of it
+};
+	
+// connections of a shard group, keys are routed with a consistent hash ring
+typedef struct {
+	unsigned long long	hash;
+	int					shard;
+} csqlringpoint;
+	
+struct csqlshards {
+	csqldb				**dbs;				// NULL if a shard is not available
+	char				**names;			// stable names used to place the shards on the ring
+	int					count;
+	int					nalloc;
+	csqlringpoint		*ring;				// sorted by hash (rebuilt when a shard is added)
+	int					nring;
+};
+	
+// read replicas of a connection
+typedef struct {
+	csqldb				*db;
+	double				latency;			// moving average of the select time in ms (0 means not measured yet)
+	int64				retry;				// unhealthy until this time (csql_mstime)
+} csqlreplica;
+	
+struct csqlrouter {
+	csqlreplica			*replicas;
+	int					count;
+	int					nalloc;
+	int					intransaction;		// statements are pinned to the primary until COMMIT or ROLLBACK
+};
+	
+// health of a host used in a multi-host connect (shared by all the connections of the process)
+typedef struct {
+	char				name[520];			// host:port
+	double				latency;			// moving average of the connect time in ms (0 means not measured yet)
+	int					failures;			// consecutive network failures
+	int64				open_until;			// circuit is open (host skipped) until this time
+	int64				sampled;			// time of the last sample
+} csqlhost;
+	
+typedef struct {
+	char				host[512];
+	int					port;
+	int					index;				// position in the connection string
+	double				latency;
+	int64				sampled;
+} csqlcandidate;
+	
+typedef struct {
+	csqlhost			hosts[kMAX_HOSTS];
+	int					count;
+	csql_mutex			mutex;
+	csql_thread			probe;
+	int					probing;			// a background probe is running
+	int					joinable;			// probe thread must be joined before starting a new one
+} csqlhosts;
+	
+typedef struct {
+	csqlcandidate		*candidates;
+	int					count;
+	int					timeout;
+} csqlprobe;
+	
+// ORDER BY term resolved against the columns of a cursor
+typedef struct {
+	int					column;				// 1-based (0 means the rowid column)
+	int					desc;
+	int					numeric;
+} csqlsortkey;
+	
+// position of a k-way merge inside one of the concatenated cursors
+typedef struct {
+	csqlc				*c;
+	csqlchunk			chunk;
+	int					nchunk;
+	int					row;				// 0-based inside chunk
+} csqlmergepos;
+	
+// one range of a parallel select (or one shard of a scatter select)
+typedef struct {
+	csqlpool			*pool;
+	csqldb				*db;				// used when pool is NULL
+	char				*sql;
+	csqlc				*c;
+	int					errcode;
+	char				errmsg[512];
+	csqldb				*tracedb;			// connection that ran sql, traced by the calling thread after the join
+	csql_thread			thread;
+	int					running;
+} csqlpart;
+	
+struct csqlcache {
+	csql_mutex			mutex;
+	csql_cond			cond;				// signaled when a query in progress completes
+	csqlflight			*flights;
+	csqlcacheentry		**slots;
+	int					nslots;
+	int					count;
+	csqlcacheentry		*head;
+	csqlcacheentry		*tail;
+	int64				bytes;
+	int64				max_bytes;
+	int					ttl;				// ms
+	int					refcount;			// creator, attached connections and returned cursors
+	
+	int64				hits;				// lookups served by a cached entry
+	int64				misses;				// lookups that had to run the query
+	int64				merged;				// lookups served by a query in progress on another connection
 };
 
+// called by csql_read_cursor_stream for each received buffer (returns kFALSE to stop)
+typedef int (*csql_chunk_callback) (csqlc *c, csqlchunk *chunk, void *arg);
+	
+// buffered writer used by cubesql_export
+typedef struct {
+	int				fd;						// destination file descriptor
+	char			*buffer;				// pending data
+	int				used;					// pending bytes
+	int				size;					// buffer size
+	int				error;					// set when a write fails
+} csqlwriter;
+	
+// cubesql_export state
+typedef struct {
+	csqlwriter		w;
+	int				format;					// CUBESQL_EXPORT_CSV or CUBESQL_EXPORT_JSON
+	int				options;				// CUBESQL_EXPORT_* flags
+	int				nrows;					// rows written so far
+	int				started;				// header (or JSON keys) already prepared
+	char			*keys;					// JSON escaped column names, each one followed by a colon
+	int				*keylen;
+} csqlexport;
+	
+// minimal flatbuffers builder used by the Arrow writer (the buffer grows downward like in the reference implementation)
+typedef struct {
+	unsigned char	*buf;					// allocated buffer (content lives at its end)
+	int				cap;					// allocated size
+	int				size;					// used bytes, counted from the end of the buffer
+	int				minalign;				// largest alignment requested so far
+	int				tstart;					// size when the current table has been started
+	int				nfields;				// number of vtable slots used by the current table
+	int				fields[16];				// location of each field of the current table
+	int				error;					// set when a memory allocation fails
+} csqlfb;
+	
+// one body buffer of an Arrow record batch
+typedef struct {
+	const char		*ptr;					// content (it can point straight inside the cursor buffers)
+	int				len;					// content length
+	int				lead;					// zero bytes written before ptr (used to reuse psum as an offsets array)
+	int				owned;					// ptr must be freed
+} csqlarrowbuf;
+	
+// Arrow IPC writer state
+typedef struct {
+	int				fd;						// destination file descriptor
+	int				format;					// CUBESQL_ARROW_STREAM or CUBESQL_ARROW_FILE
+	int64			offset;					// bytes written so far
+	int64			*blocks;				// offset, metadata length and body length of each record batch
+	int				nblocks;
+	int				nalloc;
+} csqlarrow;
+	
 // private functions
 void	csql_libinit (void);
 csqldb *csql_dbinit (const char *host, int port, const char *username, const char *password, int timeout, int encryption, const char *ssl_certificate, const char *root_certificate, const char *ssl_certificate_password, const char *ssl_chiper_list);
@@ -385,6 +808,7 @@ int		csql_connect (csqldb *db, int encryption);
 int		csql_connect_encrypted (csqldb *db);
 int		csql_netread (csqldb *db, int expected_size, int expected_nfields, int is_chunk, int *end_chunk, int timeout);
 csqlc  *csql_read_cursor (csqldb *db, csqlc *existing_c);
+csqlc  *csql_read_cursor_stream (csqldb *db, csqlc *existing_c, csql_chunk_callback callback, void *arg);
 int		csql_checkinbuffer (csqldb *db);
 int		csql_netwrite (csqldb *db, char *size_array, int nsize_array, char *buffer, int nbuffer);
 int		csql_ack(csqldb *db, int chunk_code);
@@ -405,7 +829,22 @@ int		encrypt_buffer (char *buffer, int dim, char random[], csql_aes_encrypt_ctx
 int		decrypt_buffer (char *buffer, int dim, csql_aes_decrypt_ctx ctx[1]);
 int		generate_session_key (csqldb *db, int encryption, char *password, char *rand1, char *rand2);
 int		csql_bindexecute(csqldb *db, const char *sql, char **colvalue, int *colsize, int *coltype, int ncols);
-int		csql_bind_value (csqldb *db, int index, int bindtype, char *value, int len);
+int		csql_bind_readack (csqldb *db, int *errcode, char *errmsg);
+void	csql_trace (csqldb *db, const char *sql);
+int		csql_vm_send (csqldb *db, const char *sql);
+csqlvm	*csql_vm_prepare (csqldb *db, const char *sql);
+int		csql_vm_current (csqlvm *vm);
+const	char *csql_vm_sql (csqlvm *vm);
+void	csql_vm_free (csqlvm *vm);
+int		csql_bind_value (csqlvm *vm, int index, int bindtype, char *value, int len);
+int		csql_bind_send (csqldb *db, csqlbind *b);
+csqlbind *csql_bind_slot (csqlvm *vm, int index);
+void	csql_bind_release (csqlbind *b);
+int		csql_bind_read (csqlbind *b, char *buffer, int64 offset, int len);
+int		csql_bind_stream (csqldb *db, char *size_array, int nsize_array, csqlbind *b);
+int		csql_bind_flush (csqlvm *vm);
+void	csql_bind_clear (csqlvm *vm);
+int		csql_batch_sendrow (csqlvm *vm, int ncols, char **values, int *sizes, int *types, int changes);
 csqlc	*csql_cursor_alloc (csqldb *db);
 int		csql_cursor_reallocate (csqlc *c);
 int		csql_cursor_close (csqlc *c);
@@ -414,6 +853,124 @@ void	csql_load_ssl (void);
 const	char *ssl_error(void);
 int		encryption_is_ssl (int encryption);
 int		wildcmp(const char *wild, const char *string);
+int		wildcmp_len(const char *wild, const char *string, int len, int nocase);
+int		csql_cursor_nchunks (csqlc *c);
+int		csql_cursor_chunk (csqlc *c, int nindex, csqlchunk *chunk);
+char	*csql_chunk_field (csqlc *c, csqlchunk *chunk, int row, int column, int *len);
+int		csql_memfind (const char *s, int slen, const char *p, int plen, int nocase);
+int		csql_format_int64 (int64 value, char *buffer);
+int		csql_format_double (double value, char *buffer);
+char	*csql_insert_sql (const char *table, const char *columns, int ncols, int nrows);
+csqlsel	*csql_selection_alloc (csqlc *c, int nalloc);
+unsigned long long csql_hash64 (unsigned long long h, const char *data, int len);
+unsigned long long csql_chunk_rowhash (csqlc *c, csqlchunk *chunk, int row);
+int		csql_selection_add (csqlsel *sel, int row);
+int		csql_fdwrite (int fd, const void *buffer, int64 len);
+void	csql_fdclose (int fd);
+void	csql_fb_init (csqlfb *fb);
+void	csql_fb_free (csqlfb *fb);
+void	csql_fb_scalar (csqlfb *fb, unsigned long long value, int n);
+int		csql_fb_string (csqlfb *fb, const char *s, int len);
+int		csql_fb_vector (csqlfb *fb, const int *refs, int n);
+int		csql_fb_structs (csqlfb *fb, const void *data, int elemsize, int n);
+void	csql_fb_start (csqlfb *fb);
+void	csql_fb_add_scalar (csqlfb *fb, int id, unsigned long long value, int n);
+void	csql_fb_add_offset (csqlfb *fb, int id, int ref);
+int		csql_fb_end (csqlfb *fb);
+int		csql_fb_finish (csqlfb *fb, int root);
+int		csql_arrow_type (int type);
+int		csql_arrow_schema (csqlfb *fb, csqlc *c);
+int		csql_arrow_message (csqlarrow *w, csqlfb *fb, int header_type, int header, int64 body_len);
+int		csql_arrow_batch (csqlarrow *w, csqlc *c, csqlchunk *chunk);
+int		csql_arrow_footer (csqlarrow *w, csqlc *c);
+int64	csql_mstime (void);
+int64	csql_cursor_bytes (csqlc *c);
+char	*csql_sql_tables (const char *sql, const char *coltables, int ncoltables, int *is_write);
+int		csql_tables_match (const char *tables, const char *table);
+int		csql_sql_isuse (const char *sql);
+unsigned long long csql_cache_scope (csqldb *db);
+char	*csql_cache_key (csqldb *db, const char *sql, const char *params, int paramslen, int *keylen);
+csqlcacheentry *csql_cache_lookup (csqlcache *cache, unsigned long long hash, const char *key, int keylen);
+void	csql_cache_touch (csqlcache *cache, csqlcacheentry *e);
+csqlc	*csql_cache_view (csqlcacheentry *e, csqldb *db);
+void	csql_cache_entry_free (csqlcacheentry *e);
+void	csql_cache_unlink (csqlcache *cache, csqlcacheentry *e);
+void	csql_cache_entry_release (csqlcacheentry *e);
+void	csql_cache_release (csqlcache *cache);
+void	csql_cache_written (csqldb *db, const char *sql);
+int		csql_cond_wait (csql_cond *cond, csql_mutex *mutex, int ms);
+csqlc	*csql_refresh_newcursor (csqlc *src, int nrows);
+int		csql_refresh_addrow (csqlc *c, csqlc *src, csqlchunk *chunk, int row);
+int		csql_refresh_compare (const char *s1, int len1, const char *s2, int len2, int numeric);
+int		csql_refresh_mark (csqlrefresh *r, const char *field, int len);
+int		csql_refresh_find (csqlrefresh *r, const char *key, int keylen);
+int		csql_refresh_index (csqlrefresh *r, int row);
+int		csql_refresh_full (csqlrefresh *r);
+int		csql_refresh_equal (csqlc *c, int row, csqlc *delta, csqlchunk *chunk, int j);
+int		csql_refresh_merge (csqlrefresh *r, csqlc *delta);
+void	csql_sql_strip (char *sql);
+char	*csql_sql_identifier (char *p, const char *name);
+char	*csql_sql_literal (char *p, const char *value, int len, int numeric);
+csqlc	*csql_pager_fetch (csqlpager *p, csqldb *db, char **query);
+void	csql_pager_join (csqlpager *p);
+CSQL_THREAD_PROC csql_pager_thread (void *arg);
+int		csql_pager_advance (csqlpager *p, csqlc *c);
+int		csql_parallel_bounds (csqldb *db, const char *sql, const char *partcolumn, int64 *lo, int64 *hi);
+char	*csql_parallel_sql (const char *sql, const char *partcolumn, int first, int last, int64 lo, int64 hi);
+CSQL_THREAD_PROC csql_parallel_thread (void *arg);
+csqlc	*csql_cursor_concat (csqlc **parts, int nparts);
+csqlc	*csql_parts_run (csqlpart *parts, int n, csqldb *errdb);
+int		csql_concat_chunk (csqlc *c, int nindex, csqlchunk *chunk);
+char	*csql_concat_field (csqlc *c, int row, int column, int *len);
+unsigned long long csql_hash_mix (unsigned long long h);
+int		csql_shards_ring (csqlshards *s);
+int		csql_sql_orderby (const char *sql, csqlc *c, csqlsortkey *keys, int maxkeys);
+int		csql_sql_limit (const char *sql, int *limit, int *offset);
+int		csql_merge_compare (csqlmergepos *a, csqlmergepos *b, csqlsortkey *keys, int nkeys);
+int		csql_merge_next (csqlmergepos *m);
+int		csql_cursor_merge (csqlc *c, csqlsortkey *keys, int nkeys, int offset, int limit);
+int		csql_sql_isread (const char *sql);
+void	csql_router_track (csqldb *db, const char *sql);
+csqlreplica *csql_router_pick (csqldb *db, const char *sql);
+void	csql_router_sample (csqlreplica *r, int64 start);
+int		csql_router_failed (csqldb *db, csqlreplica *r);
+void	csql_router_free (csqldb *db);
+void	csql_hosts_init (void);
+int		csql_hosts_parse (const char *list, int port, csqlcandidate *candidates, int max);
+void	csql_hosts_name (csqlcandidate *c, char *name, int size);
+csqlhost *csql_hosts_lookup (const char *name, int add);
+void	csql_hosts_record (csqlcandidate *c, int ok, double ms);
+int		csql_hosts_compare (const void *a, const void *b);
+void	csql_hosts_probe (csqlcandidate *candidates, int count, int timeout);
+CSQL_THREAD_PROC csql_hosts_thread (void *arg);
+csqldb	*csql_pool_tryacquire (csqlpool *pool);
+int		csql_sched_eligible (csqlsched *s, int priority);
+int		csql_sched_pick (csqlsched *s);
+void	csql_sched_dispatch (csqlsched *s);
+void	csql_sched_dequeue (csqlsched *s, int priority, csqlwaiter *w);
+void	csql_sched_throttle (csqldb *db);
+void	csql_shared_push (csqlshared *s, csqlresult *r);
+csqlresult *csql_shared_pop (csqlshared *s);
+csqlresult *csql_shared_submit (csqlshared *s, const char *sql, int is_select);
+void	csql_shared_serve (csqlshared *s, csqlresult *r);
+csqlresult *csql_shared_next (csqlshared *s, int ms);
+void	csql_shared_complete (csqlshared *s, csqlresult *r);
+int		csql_shared_coalescable (csqlshared *s, csqlresult *r);
+void	csql_shared_batch (csqlshared *s, csqlresult **batch, int n);
+int		csql_sql_transaction (const char *sql);
+CSQL_THREAD_PROC csql_shared_thread (void *arg);
+int		csql_connect_hosts (csqldb **db, const char *host, int port, const char *username, const char *password, int timeout, int encryption, char *token, int useOldProtocol, const char *ssl_certificate, const char *root_certificate, const char *ssl_certificate_password, const char *ssl_chiper_list);
+csqlflight *csql_flight_lookup (csqlcache *cache, unsigned long long hash, const char *key, int keylen);
+csqlflight *csql_flight_begin (csqlcache *cache, unsigned long long hash, const char *key, int keylen, csqldb *leader);
+void	csql_flight_release (csqlflight *f);
+void	csql_writer_put (csqlwriter *w, const char *buffer, int len);
+void	csql_writer_flush (csqlwriter *w);
+int		csql_escape_scan (const char *s, int len, int json);
+void	csql_export_csv (csqlwriter *w, const char *s, int len);
+void	csql_export_json (csqlwriter *w, const char *s, int len);
+void	csql_export_base64 (csqlwriter *w, const unsigned char *s, int len);
+int		csql_export_isnumber (const char *s, int len);
+int		csql_export_chunk (csqlc *c, csqlchunk *chunk, void *arg);
 	
 #if defined(__cplusplus)
 }
@@ -9,10 +9,25 @@
 #include "cubesql.h"
 #include "csql.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define CSQL_SIMD_SSE2	1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define CSQL_SIMD_NEON	1
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 // maximum number of socket descriptor to try to connect to
 // this change is required to support IPv4/IPv6 connections
 #define	MAX_SOCK_LIST	6
 
+// set on the worker threads of the SDK, the trace callback is then called by the thread that started them
+static CSQL_THREAD_LOCAL int csql_untraced = 0;
+
 // MARK: cubeSQL -
 const char *cubesql_version (void) {
 	return CUBESQL_SDK_VERSION;
@@ -51,6 +66,9 @@ int cubesql_connect_token (csqldb **db, const char *host, int port, const char *
 	// init library and winsock under Win32
 	csql_libinit();
 	
+	// a comma separated list of hosts connects to the best available one
+	if (strchr(host, ',')) return csql_connect_hosts(db, host, port, username, password, timeout, encryption, token, useOldProtocol, ssl_certificate, root_certificate, ssl_certificate_password, ssl_chiper_list);
+	
 	// allocate db struct
 	rdb = csql_dbinit (host, port, username, password, timeout, encryption,
 					   ssl_certificate, root_certificate, ssl_certificate_password, ssl_chiper_list);
@@ -74,6 +92,22 @@ void cubesql_disconnect (csqldb *db, int gracefully) {
 
 	// clear errors first
 	cubesql_clear_errors(db);
+	
+	// the pagers that prefetch on this connection fetch their pages on their own connection from now on,
+	// a prefetch in progress is stopped (its blocked read returns once the socket is shut down) and waited
+	while (db->pager) {
+		csqlpager *p = db->pager;
+		if (p->running) {
+			if (db->sockfd > 0) bsd_shutdown(db->sockfd, SHUT_RDWR);
+			gracefully = kFALSE;
+			csql_pager_join(p);
+			if (p->next) cubesql_cursor_free(p->next);
+			p->next = NULL;
+		}
+		db->pager = p->nextpager;
+		p->nextpager = NULL;
+		p->prefetchdb = NULL;
+	}
 
 	if (db->sockfd > 0) {
 		// disconnect
@@ -92,27 +126,55 @@ void cubesql_disconnect (csqldb *db, int gracefully) {
 }
 
 int cubesql_execute (csqldb *db, const char *sql) {
+	int rc;
+	
 	// clear errors first
 	cubesql_clear_errors(db);
 	
 	// check for trace function
-	if (db->trace) db->trace(sql, db->data);
+	csql_trace(db, sql);
 	
 	// send sql statement
 	if (csql_send_statement (db, kCOMMAND_EXECUTE, sql, kFALSE, kFALSE) != CUBESQL_NOERR) return CUBESQL_ERR;
 	
 	// read replay
-	return csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT);
+	rc = csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT);
+	
+	if (rc != CUBESQL_NOERR) return rc;
+	
+	// current database is part of the cache keys
+	if (csql_sql_isuse(sql)) db->cache_scope = csql_hash64(CSQL_HASH_SEED, sql, (int)strlen(sql));
+	
+	// drop cached results that could have been modified by the statement
+	if (db->cache) csql_cache_written(db, sql);
+	
+	// transactions are pinned to the primary and the current database is changed on the replicas too
+	if (db->router) csql_router_track(db, sql);
+	return rc;
 }
 
 csqlc *cubesql_select (csqldb *db, const char *sql, int is_serverside) {
 	// serverside is disabled in this version
+	csqlreplica	*r;
+	csqlc		*c;
+	int64		start;
+	
+	// reads are sent to the fastest healthy replica, the primary answers if the replica cannot be reached
+	if ((db->router) && ((r = csql_router_pick(db, sql)) != NULL)) {
+		start = csql_mstime();
+		c = cubesql_select(r->db, sql, is_serverside);
+		if (c) {
+			csql_router_sample(r, start);
+			return c;
+		}
+		if (csql_router_failed(db, r) == kFALSE) return NULL;
+	}
 	
 	// clear errors first
 	cubesql_clear_errors(db);
 	
 	// check for trace function
-	if (db->trace) db->trace(sql, db->data);
+	csql_trace(db, sql);
 	
 	// send sql statement
 	if (csql_send_statement (db, kCOMMAND_SELECT, sql, kFALSE, kFALSE) != CUBESQL_NOERR) return NULL;
@@ -134,9 +196,15 @@ int cubesql_begintransaction (csqldb *db) {
 }
 
 int cubesql_bind (csqldb *db, const char *sql, char **colvalue, int *colsize, int *coltype, int ncols) {
+	int rc;
+	
 	// clear errors first
 	cubesql_clear_errors(db);
-	return csql_bindexecute(db, sql, colvalue, colsize, coltype, ncols);
+	rc = csql_bindexecute(db, sql, colvalue, colsize, coltype, ncols);
+	
+	// drop cached results that could have been modified by the statement
+	if ((rc == CUBESQL_NOERR) && (db->cache)) csql_cache_written(db, sql);
+	return rc;
 }
 
 int cubesql_ping (csqldb *db) {
@@ -250,7 +318,10 @@ void cubesql_setpath (int type, char *path) {
 // MARK: - Binary Data -
 
 int cubesql_send_data (csqldb *db, const char *buffer, int len) {
-	int err = csql_sendchunk(db, (char *)buffer, len, 0, kFALSE);
+	int err;
+	
+	if (db->sched) csql_sched_throttle(db);
+	err = csql_sendchunk(db, (char *)buffer, len, 0, kFALSE);
 	if (err != CUBESQL_NOERR) return err;
 	return csql_netread(db, -1, -1, kTRUE, NULL, NO_TIMEOUT);
 }
@@ -365,6 +436,9 @@ char *cubesql_cursor_field (csqlc *c, int row, int column, int *len) {
 		return result;
 	}
 	
+	// cursor made of other cursors (rows are never copied)
+	if (c->cursor_id == kCURSOR_CONCAT) return csql_concat_field(c, row, column, len);
+	
 	if (column == CUBESQL_ROWID) {
 		if (c->has_rowid == kFALSE) return NULL;
 		column = 0;
@@ -536,6 +610,24 @@ void cubesql_cursor_free (csqlc *c) {
 	// close the cursor on server side also
 	if (c->server_side) csql_cursor_close(c);
 	
+	// cursor returned by the cache, buffers are owned by the cache entry
+	if (c->shared) {
+		csql_cache_entry_release(c->shared);
+		free(c);
+		return;
+	}
+	
+	// cursor made of other cursors, names and types are owned by the first part
+	if (c->cursor_id == kCURSOR_CONCAT) {
+		for (i=0; i<c->nparts; i++) cubesql_cursor_free(c->parts[i]);
+		free(c->parts);
+		free(c->rowcount);
+		if (c->buffer) free(c->buffer);
+		if (c->size0) free(c->size0);
+		free(c);
+		return;
+	}
+	
 	// check for special custom created cursor
 	if (c->cursor_id == -1) {
 		if (c->names) free(c->names);
@@ -573,413 +665,2111 @@ void cubesql_cursor_free (csqlc *c) {
 	free(c);
 }
 
-// MARK: - VM -
-
-csqlvm *cubesql_vmprepare (csqldb *db, const char *sql) {
-	csqlvm	*vm = NULL;
-	
-	// clear errors first
-	cubesql_clear_errors(db);
-	
-	// check for trace function
-	if (db->trace) db->trace(sql, db->data);
-	
-	// send sql statement
-	if (csql_send_statement (db, kVM_PREPARE, sql, kFALSE, kFALSE) != CUBESQL_NOERR) return NULL;
+// MARK: - Selection -
+
+csqlsel *cubesql_cursor_filter (csqlc *c, int column, const char *pattern, int flags) {
+	csqlsel		*sel = NULL;
+	csqlchunk	chunk;
+	char		*field, *p = NULL;
+	int			i, j, nchunks, len, plen, nocase, wildcard;
+	
+	// sanity check parameters (server side cursors do not keep all the rows on the client)
+	if ((c == NULL) || (pattern == NULL) || (c->server_side)) return NULL;
+	if ((column <= 0) || (column > c->ncols)) return NULL;
+	
+	sel = csql_selection_alloc(c, c->nrows);
+	if (sel == NULL) return NULL;
+	
+	// wildcard comparison always uses the pattern as is
+	plen = (int)strlen(pattern);
+	nocase = TESTBIT(flags, CUBESQL_FILTER_NOCASE);
+	wildcard = TESTBIT(flags, CUBESQL_FILTER_WILDCARD);
+	if ((nocase) && (!wildcard) && (plen > 0)) {
+		// fold pattern once so only the field bytes need to be folded while scanning
+		p = (char *) malloc(plen);
+		if (p == NULL) goto abort;
+		for (i=0; i<plen; i++) p[i] = (char)csql_ascii_lower((unsigned char)pattern[i]);
+		pattern = p;
+	}
 	
-	// read replay
-	if (csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT) != CUBESQL_NOERR) return NULL;
+	// scan raw field bytes buffer by buffer (data is never copied)
+	nchunks = csql_cursor_nchunks(c);
+	for (i=0; i<nchunks; i++) {
+		if (csql_cursor_chunk(c, i, &chunk) == kFALSE) goto abort;
+		for (j=0; j<chunk.nrows; j++) {
+			field = csql_chunk_field(c, &chunk, j, column, &len);
+			if (len < 0) len = 0;
+			if (wildcard) {
+				if (wildcmp_len(pattern, (field) ? field : "", len, nocase) == 0) continue;
+			} else if (plen > 0) {
+				if ((field == NULL) || (csql_memfind(field, len, pattern, plen, nocase) == kFALSE)) continue;
+			}
+			if (csql_selection_add(sel, chunk.firstrow + j) == kFALSE) goto abort;
+		}
+	}
 	
-	// allocate space for csqlvm
-	vm = (csqlvm *) malloc (sizeof(csqlvm));
-	if (vm == NULL) return NULL;
+	if (p) free(p);
+	return sel;
 	
-	vm->db = db;
-	vm->vmindex = 0;
-	return vm;
+abort:
+	if (p) free(p);
+	cubesql_selection_free(sel);
+	return NULL;
 }
 
-int cubesql_vmbind_int (csqlvm *vm, int index, int intvalue) {
-	char	value[256];
-	
-	// convert int to text
-	snprintf(value, sizeof(value), "%d", intvalue);
-	return csql_bind_value(vm->db, index, CUBESQL_BIND_INTEGER, value, -1);
+int cubesql_selection_count (csqlsel *sel) {
+	return (sel) ? sel->nrows : 0;
 }
 
-int cubesql_vmbind_double (csqlvm *vm, int index, double dvalue) {
-	char	value[256];
+int cubesql_selection_row (csqlsel *sel, int index) {
+	if ((sel == NULL) || (index <= 0) || (index > sel->nrows)) return -1;
+	return sel->rows[index-1];
+}
+
+char *cubesql_selection_field (csqlsel *sel, int index, int column, int *len) {
+	int row = cubesql_selection_row(sel, index);
 	
-	// convert double to text
-	snprintf(value, sizeof(value), "%f", dvalue);
-	return csql_bind_value(vm->db, index, CUBESQL_BIND_DOUBLE, value, -1);
+	if (row <= 0) {
+		if (len) *len = 0;
+		return NULL;
+	}
+	return cubesql_cursor_field(sel->c, row, column, len);
 }
 
-int cubesql_vmbind_text (csqlvm *vm, int index, char *value, int len) {
-	return csql_bind_value(vm->db, index, CUBESQL_BIND_TEXT, value, len);
+void cubesql_selection_free (csqlsel *sel) {
+	if (sel == NULL) return;
+	if (sel->rows) free(sel->rows);
+	free(sel);
 }
 
-int cubesql_vmbind_blob (csqlvm *vm, int index, void *value, int len) {
-	return csql_bind_value(vm->db, index, CUBESQL_BIND_BLOB, (char *)value, len);
+// MARK: - Diff -
+
+int64 cubesql_cursor_rowhash (csqlc *c, int row) {
+	unsigned long long h = CSQL_HASH_SEED;
+	char	*field;
+	int		i, len;
+	
+	if (c == NULL) return 0;
+	if (row == CUBESQL_CURROW) row = c->current_row;
+	if ((row <= 0) || (row > c->nrows)) return 0;
+	
+	for (i=1; i<=c->ncols; i++) {
+		field = cubesql_cursor_field(c, row, i, &len);
+		h = csql_hash64(h, field, len);
+	}
+	return (int64)h;
 }
 
-int cubesql_vmbind_null (csqlvm *vm, int index) {
-	return csql_bind_value(vm->db, index, CUBESQL_BIND_NULL, NULL, 0);
+typedef struct {
+	unsigned long long	keyhash;
+	unsigned long long	rowhash;
+	char				*key;
+	int					keylen;
+	int					row;
+	int					matched;
+} csqldiffrow;
+
+csqldiff *cubesql_cursor_diff (csqlc *oldc, csqlc *newc, int keycolumn) {
+	csqldiff	*diff = NULL;
+	csqldiffrow	*rows = NULL, r;
+	csqlchunk	chunk;
+	int			*table = NULL;
+	int			i, j, k, n, nold, mask, nchunks;
+	
+	// rows can be matched only if both cursors are fully loaded and share the same columns
+	if ((oldc == NULL) || (newc == NULL) || (oldc->server_side) || (newc->server_side)) return NULL;
+	if (oldc->ncols != newc->ncols) return NULL;
+	
+	// rowid column is preferred, otherwise the user must specify a key column
+	if ((oldc->has_rowid) && (newc->has_rowid)) keycolumn = 0;
+	else if ((keycolumn <= 0) || (keycolumn > oldc->ncols)) return NULL;
+	
+	diff = (csqldiff *) malloc(sizeof(csqldiff));
+	if (diff == NULL) return NULL;
+	bzero(diff, sizeof(csqldiff));
+	
+	diff->inserted = csql_selection_alloc(newc, 0);
+	diff->deleted = csql_selection_alloc(oldc, 0);
+	diff->updated = csql_selection_alloc(newc, 0);
+	diff->updated_old = csql_selection_alloc(oldc, 0);
+	if (!diff->inserted || !diff->deleted || !diff->updated || !diff->updated_old) goto abort;
+	
+	// hash every row of the old cursor
+	nold = oldc->nrows;
+	rows = (csqldiffrow *) malloc(sizeof(csqldiffrow) * ((nold > 0) ? nold : 1));
+	if (rows == NULL) goto abort;
+	
+	nchunks = csql_cursor_nchunks(oldc);
+	for (i=0, n=0; i<nchunks; i++) {
+		if (csql_cursor_chunk(oldc, i, &chunk) == kFALSE) goto abort;
+		for (j=0; (j<chunk.nrows) && (n<nold); j++, n++) {
+			rows[n].key = csql_chunk_field(oldc, &chunk, j, keycolumn, &rows[n].keylen);
+			rows[n].keyhash = csql_hash64(CSQL_HASH_SEED, rows[n].key, rows[n].keylen);
+			rows[n].rowhash = csql_chunk_rowhash(oldc, &chunk, j);
+			rows[n].row = chunk.firstrow + j;
+			rows[n].matched = kFALSE;
+		}
+	}
+	nold = n;
+	
+	// build an open addressing table indexed by key hash (size is a power of 2, at most half full)
+	for (mask = 16; mask < nold * 2; mask <<= 1);
+	table = (int *) malloc(sizeof(int) * mask);
+	if (table == NULL) goto abort;
+	for (i=0; i<mask; i++) table[i] = -1;
+	mask--;
+	
+	for (i=0; i<nold; i++) {
+		k = (int)(rows[i].keyhash & mask);
+		while (table[k] != -1) k = (k + 1) & mask;
+		table[k] = i;
+	}
+	
+	// lookup every row of the new cursor
+	nchunks = csql_cursor_nchunks(newc);
+	for (i=0; i<nchunks; i++) {
+		if (csql_cursor_chunk(newc, i, &chunk) == kFALSE) goto abort;
+		for (j=0; j<chunk.nrows; j++) {
+			r.key = csql_chunk_field(newc, &chunk, j, keycolumn, &r.keylen);
+			r.keyhash = csql_hash64(CSQL_HASH_SEED, r.key, r.keylen);
+			r.row = chunk.firstrow + j;
+			
+			// duplicated keys are matched in order (first unmatched old row wins)
+			for (k = (int)(r.keyhash & mask); table[k] != -1; k = (k + 1) & mask) {
+				csqldiffrow *o = &rows[table[k]];
+				if ((o->matched) || (o->keyhash != r.keyhash) || (o->keylen != r.keylen)) continue;
+				if ((r.keylen > 0) && (memcmp(o->key, r.key, r.keylen) != 0)) continue;
+				break;
+			}
+			
+			if (table[k] == -1) {
+				if (csql_selection_add(diff->inserted, r.row) == kFALSE) goto abort;
+				continue;
+			}
+			
+			rows[table[k]].matched = kTRUE;
+			if (rows[table[k]].rowhash == csql_chunk_rowhash(newc, &chunk, j)) continue;
+			if (csql_selection_add(diff->updated, r.row) == kFALSE) goto abort;
+			if (csql_selection_add(diff->updated_old, rows[table[k]].row) == kFALSE) goto abort;
+		}
+	}
+	
+	// everything not matched has been deleted
+	for (i=0; i<nold; i++) {
+		if (rows[i].matched) continue;
+		if (csql_selection_add(diff->deleted, rows[i].row) == kFALSE) goto abort;
+	}
+	
+	free(table);
+	free(rows);
+	return diff;
+	
+abort:
+	if (table) free(table);
+	if (rows) free(rows);
+	cubesql_diff_free(diff);
+	return NULL;
 }
 
-int cubesql_vmbind_int64 (csqlvm *vm, int index, int64 int64value) {
-	char	value[256];
+csqlsel *cubesql_diff_rows (csqldiff *diff, int kind) {
+	// returned selection is owned by the diff object
+	if (diff == NULL) return NULL;
 	
-	// convert int to text
-	snprintf(value, sizeof(value), "%lld", int64value);
-	return csql_bind_value(vm->db, index, CUBESQL_BIND_INT64, value, -1);
+	switch (kind) {
+		case CUBESQL_DIFF_INSERTED: return diff->inserted;
+		case CUBESQL_DIFF_DELETED: return diff->deleted;
+		case CUBESQL_DIFF_UPDATED: return diff->updated;
+		case CUBESQL_DIFF_UPDATED_OLD: return diff->updated_old;
+	}
+	return NULL;
 }
 
-int cubesql_vmbind_zeroblob (csqlvm *vm, int index, int len) {
-	return csql_bind_value(vm->db, index, CUBESQL_BIND_ZEROBLOB, NULL, len);
+void cubesql_diff_free (csqldiff *diff) {
+	if (diff == NULL) return;
+	
+	cubesql_selection_free(diff->inserted);
+	cubesql_selection_free(diff->deleted);
+	cubesql_selection_free(diff->updated);
+	cubesql_selection_free(diff->updated_old);
+	free(diff);
 }
 
-int cubesql_vmexecute (csqlvm *vm) {
-	csqldb *db = vm->db;
+// MARK: - Arrow -
+
+int cubesql_cursor_arrow (csqlc *c, int fd, int format) {
+	// writes the cursor as an Apache Arrow IPC stream (or file), one record batch for each receive buffer
+	csqlarrow	w;
+	csqlchunk	chunk;
+	csqlfb		fb;
+	unsigned char eos[8] = {0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0};
+	int			i, nchunks, rc = CUBESQL_ERR;
+	
+	// server side cursors do not keep their rows around
+	if ((c == NULL) || (c->server_side) || (fd < 0)) return CUBESQL_PARAMETER_ERROR;
+	if ((format != CUBESQL_ARROW_STREAM) && (format != CUBESQL_ARROW_FILE)) return CUBESQL_PARAMETER_ERROR;
+	
+	bzero(&w, sizeof(csqlarrow));
+	w.fd = fd;
+	w.format = format;
+	csql_fb_init(&fb);
+	
+	// file format starts with the magic string padded to 8 bytes
+	if (format == CUBESQL_ARROW_FILE) {
+		char magic[8] = {0};
+		memcpy(magic, CSQL_ARROW_MAGIC, 6);
+		if (csql_fdwrite(fd, magic, sizeof(magic)) == kFALSE) goto abort;
+		w.offset += sizeof(magic);
+	}
 	
-	// clear errors first
-	cubesql_clear_errors(db);
+	// schema message (Message.header_type 1 is Schema)
+	if (csql_arrow_message(&w, &fb, 1, csql_arrow_schema(&fb, c), 0) == kFALSE) goto abort;
 	
-	// send VMEXECUTE command
-	csql_initrequest(db, 0, 0, kVM_EXECUTE, kNO_SELECTOR);
-	csql_netwrite(db, NULL, 0, NULL, 0);
+	nchunks = csql_cursor_nchunks(c);
+	for (i=0; i<nchunks; i++) {
+		if (csql_cursor_chunk(c, i, &chunk) == kFALSE) goto abort;
+		if (chunk.nrows <= 0) continue;
+		if (csql_arrow_batch(&w, c, &chunk) == kFALSE) goto abort;
+	}
 	
-	// read replay
-	return csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT);
+	// end of stream marker
+	if (csql_fdwrite(fd, eos, sizeof(eos)) == kFALSE) goto abort;
+	w.offset += sizeof(eos);
+	
+	if ((format == CUBESQL_ARROW_FILE) && (csql_arrow_footer(&w, c) == kFALSE)) goto abort;
+	rc = CUBESQL_NOERR;
+	
+abort:
+	csql_fb_free(&fb);
+	if (w.blocks) free(w.blocks);
+	return rc;
 }
 
-csqlc *cubesql_vmselect (csqlvm *vm) {
-	csqldb *db = vm->db;
+// MARK: - Export -
+
+int cubesql_export (csqldb *db, const char *sql, int format, int fd, int options) {
+	// rows are escaped and written while the cursor is received, every chunk is released once written
+	csqlexport	e;
+	csqlc		*c;
+	
+	if ((db == NULL) || (sql == NULL) || (fd < 0)) return CUBESQL_PARAMETER_ERROR;
+	if ((format != CUBESQL_EXPORT_CSV) && (format != CUBESQL_EXPORT_JSON)) return CUBESQL_PARAMETER_ERROR;
 	
 	// clear errors first
 	cubesql_clear_errors(db);
 	
-	// send VMSELECT command
-	csql_initrequest(db, 0, 0, kVM_SELECT, kNO_SELECTOR);
-	csql_netwrite(db, NULL, 0, NULL, 0);
-	
-	// read the cursor
-	return csql_read_cursor(db, NULL);
-}
-
-int cubesql_vmclose (csqlvm *vm) {
-	if (!vm) return CUBESQL_NOERR;
+	// check for trace function
+	csql_trace(db, sql);
+	
+	bzero(&e, sizeof(csqlexport));
+	e.format = format;
+	e.options = options;
+	e.w.fd = fd;
+	e.w.size = kEXPORT_BUFFER;
+	e.w.buffer = (char *) malloc(e.w.size);
+	if (e.w.buffer == NULL) {
+		csql_seterror(db, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate export buffer");
+		return CUBESQL_MEMORY_ERROR;
+	}
 	
-	csqldb *db = vm->db;
+	if (csql_send_statement (db, kCOMMAND_SELECT, sql, kFALSE, kFALSE) != CUBESQL_NOERR) goto abort;
+	c = csql_read_cursor_stream(db, NULL, csql_export_chunk, (void *)&e);
+	if (c == NULL) goto abort;
+	cubesql_cursor_free(c);
 	
-	csql_initrequest(db, 0, 0, kVM_CLOSE, kNO_SELECTOR);
-	csql_netwrite(db, NULL, 0, NULL, 0);
-	csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT);
+	// close the JSON array
+	if ((format == CUBESQL_EXPORT_JSON) && ((options & CUBESQL_EXPORT_JSONLINES) == 0)) {
+		if (e.started == kFALSE) csql_writer_put(&e.w, "[", 1);
+		if (e.nrows) csql_writer_put(&e.w, "\n", 1);
+		csql_writer_put(&e.w, "]\n", 2);
+	}
+	csql_writer_flush(&e.w);
+	if (e.w.error) {
+		csql_seterror(db, CUBESQL_ERR, "Unable to write exported data");
+		goto abort;
+	}
 	
-	free(vm);
+	free(e.w.buffer);
+	if (e.keys) free(e.keys);
+	if (e.keylen) free(e.keylen);
 	return CUBESQL_NOERR;
+	
+abort:
+	free(e.w.buffer);
+	if (e.keys) free(e.keys);
+	if (e.keylen) free(e.keylen);
+	return CUBESQL_ERR;
 }
 
-// MARK: - Private -
-
-void cubesql_clear_errors (csqldb *db) {
-	if (db) {
-		db->errcode = CUBESQL_NOERR;
-		db->errmsg[0] = 0;
-	}
-}
-
-csqldb *cubesql_cursor_db (csqlc *cursor) {
-	return cursor->db;
-}
-
-void cubesql_setuserptr (csqldb *db, void *userptr) {
-	db->userptr = userptr;
-}
-
-void *cubesql_getuserptr (csqldb *db) {
-	return db->userptr;
-}
+// MARK: - Cache -
 
-void cubesql_settoken (csqldb *db, char *token) {
-	if ((token) && (strlen(token)==0)) token = NULL;
-	db->token = token;
+csqlcache *cubesql_cache_create (int64 max_bytes, int ttl) {
+	// ttl is expressed in milliseconds (0 means that entries never expire)
+	csqlcache *cache;
+	
+	if (max_bytes <= 0) return NULL;
+	
+	cache = (csqlcache *) malloc(sizeof(csqlcache));
+	if (cache == NULL) return NULL;
+	bzero(cache, sizeof(csqlcache));
+	
+	cache->nslots = kCACHE_SLOTS;
+	cache->slots = (csqlcacheentry **) calloc(cache->nslots, sizeof(csqlcacheentry *));
+	if (cache->slots == NULL) {free(cache); return NULL;}
+	
+	csql_mutex_init(&cache->mutex);
+	csql_cond_init(&cache->cond);
+	cache->max_bytes = max_bytes;
+	cache->ttl = (ttl > 0) ? ttl : 0;
+	cache->refcount = 1;
+	return cache;
 }
 
-void cubesql_sethostverification (csqldb *db, char *hostverification) {
-	if ((hostverification) && (strlen(hostverification)==0)) hostverification = NULL;
-	db->hostverification = hostverification;
+void cubesql_cache_free (csqlcache *cache) {
+	// cached entries are dropped now, memory is released when the last connection and cursor are gone
+	if (cache == NULL) return;
+	
+	cubesql_cache_invalidate(cache, NULL);
+	csql_cache_release(cache);
 }
 
-char *cubesql_gettoken (csqldb *db) {
-	return db->token;
+void cubesql_set_cache (csqldb *db, csqlcache *cache) {
+	if (db == NULL) return;
+	
+	if (cache) {
+		csql_mutex_lock(&cache->mutex);
+		cache->refcount++;
+		csql_mutex_unlock(&cache->mutex);
+	}
+	if (db->cache) csql_cache_release(db->cache);
+	
+	db->cache = cache;
 }
 
-csqlc *cubesql_cursor_create (csqldb *db, int nrows, int ncolumns, int *types, char **names) {
-	csqlc *cursor = NULL;
-	char  *p = NULL, *s = NULL;
-	int  i, len = 0;
+void cubesql_cache_invalidate (csqlcache *cache, const char *table) {
+	// NULL table means all entries, entries without known tables are always dropped
+	csqlcacheentry	*e, *next;
+	csqlflight		*f;
 	
-	// simple sanity check
-	if ((nrows < 0) || (ncolumns <= 0) || (types == NULL) || (names == NULL)) return NULL;
+	if (cache == NULL) return;
 	
-	// allocate cursor
-	cursor = csql_cursor_alloc(db);
-	if (cursor == NULL) return NULL;
+	csql_mutex_lock(&cache->mutex);
 	
-	// init fields
-	cursor->server_side = kFALSE;
-	cursor->has_rowid = kFALSE;
-	cursor->ncols = ncolumns;
-	cursor->nrows = 0;
-	cursor->current_row = -1;
-	cursor->cursor_id = -1; // means custom created
+	// results of queries in progress could be older than the write
+	for (f = cache->flights; f; f = f->next) f->stale = kTRUE;
 	
-	// allocate memory for names and types
-	for (i=0; i< cursor->ncols; i++) {
-		p = names[i];
-		if (p == NULL) p = "";
-		len += strlen(p)+1;
+	for (e = cache->head; e; e = next) {
+		next = e->next;
+		if ((table == NULL) || (csql_tables_match(e->tables, table))) csql_cache_unlink(cache, e);
 	}
-	cursor->names = (char*) malloc(len);
-	if (cursor->names == NULL) goto abort;
+	csql_mutex_unlock(&cache->mutex);
+}
+
+csqlc *cubesql_cache_get (csqldb *db, const char *sql, const char *params, int paramslen) {
+	// params is an opaque serialization of the bound values (it is part of the key)
+	// a miss must always be followed by cubesql_cache_put (with a NULL cursor if the query failed)
+	// because identical lookups from other connections wait for that result
+	csqlcache			*cache;
+	csqlcacheentry		*e;
+	csqlflight			*f;
+	csqlc				*c = NULL;
+	char				*key;
+	int					keylen, timedout;
+	unsigned long long	hash;
+	
+	if ((db == NULL) || (db->cache == NULL) || (sql == NULL)) return NULL;
+	cache = db->cache;
+	
+	key = csql_cache_key(db, sql, params, paramslen, &keylen);
+	if (key == NULL) return NULL;
+	hash = csql_hash64(CSQL_HASH_SEED, key, keylen);
+	
+	csql_mutex_lock(&cache->mutex);
+	while (1) {
+		e = csql_cache_lookup(cache, hash, key, keylen);
+		if ((e) && (e->expire) && (csql_mstime() >= e->expire)) {
+			csql_cache_unlink(cache, e);
+			e = NULL;
+		}
+		if (e) {
+			csql_cache_touch(cache, e);
+			c = csql_cache_view(e, db);
+			if (c) cache->hits++;
+			break;
+		}
 		
-	cursor->types = (int*) malloc(cursor->ncols * sizeof(int));
-	if (cursor->types == NULL) goto abort;
+		// no identical query in progress so this connection runs it
+		f = csql_flight_lookup(cache, hash, key, keylen);
+		if ((f == NULL) || (f->leader == db)) {
+			if (f == NULL) csql_flight_begin(cache, hash, key, keylen, db);
+			cache->misses++;
+			break;
+		}
 		
-	if (nrows > 0)
-		cursor->nalloc = nrows;
-	else
-		cursor->nalloc = kDEFAULT_ALLOC_ROWS;
+		// wait for the result of the query sent by another connection
+		f->refcount++;
+		timedout = kFALSE;
+		while ((f->done == kFALSE) && (timedout == kFALSE)) timedout = csql_cond_wait(&cache->cond, &cache->mutex, (db->timeout > 0) ? db->timeout * 1000 : kFLIGHT_TIMEOUT);
+		if (f->result) {
+			c = csql_cache_view(f->result, db);
+			if (c) cache->merged++;
+		}
+		csql_flight_release(f);
+		if (c) break;
 		
-	cursor->buffer = (char**) malloc(sizeof(char*) * cursor->ncols * cursor->nalloc);
-	if (cursor->buffer == NULL) goto abort;
+		// the query is taking too long, it is sent again by this connection without waiting anymore
+		if (timedout) {
+			cache->misses++;
+			break;
+		}
 		
-	cursor->size0 = (int*) malloc(sizeof(int) * cursor->ncols * cursor->nalloc);
-	if (cursor->size0 == NULL) goto abort;
+		// query failed on the other connection, try again (this connection could now lead)
+	}
+	csql_mutex_unlock(&cache->mutex);
 	
-	// set column names
-	p = cursor->names;
-	for (i=0; i< cursor->ncols; i++) {
-		s = names[i];
-		if (s == NULL) s = "";
-		len = (int)strlen(s)+1;
-		memcpy(p, s, len);
-		p += len;
+	free(key);
+	return c;
+}
+
+csqlc *cubesql_cache_put (csqldb *db, const char *sql, const char *params, int paramslen, csqlc *c) {
+	// the cache takes ownership of c and returns a cursor that shares its buffers
+	// c is returned untouched when it cannot be shared
+	csqlcache		*cache;
+	csqlcacheentry	*e, *old;
+	csqlflight		*f, **pf;
+	csqlc			*view = NULL;
+	int				cnum, keep;
+	
+	if ((db == NULL) || (db->cache == NULL) || (sql == NULL)) return c;
+	cache = db->cache;
+	
+	e = (csqlcacheentry *) malloc(sizeof(csqlcacheentry));
+	if (e == NULL) goto complete;
+	bzero(e, sizeof(csqlcacheentry));
+	
+	e->key = csql_cache_key(db, sql, params, paramslen, &e->keylen);
+	if (e->key == NULL) goto complete;
+	e->hash = csql_hash64(CSQL_HASH_SEED, e->key, e->keylen);
+	
+	if ((c) && (!c->server_side) && (!c->shared) && (c->cursor_id != -1)) {
+		cnum = c->ncols + ((c->has_rowid) ? 1 : 0);
+		e->tables = csql_sql_tables(sql, c->tables, cnum, NULL);
+		e->bytes = csql_cursor_bytes(c);
+		e->expire = (cache->ttl) ? csql_mstime() + cache->ttl : 0;
+		e->cache = cache;
+		e->refcount = 1;
+		e->c = c;
 	}
 	
-	// set columns types
-	for (i=0; i< cursor->ncols; i++) {
-		cursor->types[i] = types[i];
+complete:
+	csql_mutex_lock(&cache->mutex);
+	
+	// query in progress started by this connection
+	f = NULL;
+	if ((e) && (e->key)) {
+		for (pf = &cache->flights; *pf; pf = &(*pf)->next) {
+			if (((*pf)->leader == db) && ((*pf)->hash == e->hash) && ((*pf)->keylen == e->keylen) && (memcmp((*pf)->key, e->key, e->keylen) == 0)) {
+				f = *pf;
+				*pf = f->next;
+				break;
+			}
+		}
 	}
 	
-	return cursor;
+	// entry is kept in the cache when it fits and no write happened while the query was running
+	keep = ((e) && (e->c) && (e->tables) && (e->bytes <= cache->max_bytes) && ((f == NULL) || (f->stale == kFALSE)));
+	if (((keep) || (f)) && (e) && (e->c) && (e->tables)) view = csql_cache_view(e, db);
 	
-abort:
-	cubesql_cursor_free(cursor);
-	return NULL;
+	if (view) {
+		// the original cursor could have been created by a connection that will be closed before the entry
+		c->db = NULL;
+		
+		if (f) {
+			f->result = e;
+			e->refcount++;
+		}
+		
+		if (keep) {
+			// replace an existing entry with the same key
+			old = csql_cache_lookup(cache, e->hash, e->key, e->keylen);
+			if (old) csql_cache_unlink(cache, old);
+			
+			e->hnext = cache->slots[e->hash % cache->nslots];
+			cache->slots[e->hash % cache->nslots] = e;
+			e->next = cache->head;
+			if (cache->head) cache->head->prev = e;
+			cache->head = e;
+			if (cache->tail == NULL) cache->tail = e;
+			cache->bytes += e->bytes;
+			cache->count++;
+			
+			// evict least recently used entries until the budget is respected
+			while ((cache->bytes > cache->max_bytes) && (cache->tail != e)) csql_cache_unlink(cache, cache->tail);
+		} else {
+			// entry is only shared with the waiting connections, it is released with the last cursor
+			e->refcount--;
+		}
+	}
+	
+	// wake up connections waiting for this query
+	if (f) {
+		f->done = kTRUE;
+		csql_cond_broadcast(&cache->cond);
+		csql_flight_release(f);
+	}
+	csql_mutex_unlock(&cache->mutex);
+	
+	if (view) return view;
+	if (e) {
+		if (e->key) free(e->key);
+		if (e->tables) free(e->tables);
+		free(e);
+	}
+	return c;
 }
 
-int cubesql_cursor_addrow (csqlc *cursor, char **row, int *len) {
-	int i, j, index, rlen;
+csqlc *cubesql_cache_select (csqldb *db, const char *sql) {
+	csqlc *c;
 	
-	// row can be added to a custom created cursor only
-	if (cursor->cursor_id != -1) return kFALSE;
+	if ((db == NULL) || (db->cache == NULL)) return cubesql_select(db, sql, kFALSE);
 	
-	// check if there is enough space for the new row
-	index = cursor->nrows * cursor->ncols;
-	if (cursor->nalloc < index + cursor->ncols) {
-		int newsize = cursor->nalloc + (kDEFAULT_ALLOC_ROWS * 2);
-		
-		char **tmp_buffer = (char**) realloc(cursor->buffer, sizeof(char*) * cursor->ncols * newsize);
-		if (tmp_buffer == NULL) return kFALSE;
-		cursor->buffer = tmp_buffer;
-
-		int *tmp_size = (int*) realloc(cursor->size0, sizeof(int) * cursor->ncols * newsize);
-		if (tmp_size == NULL) return kFALSE;
-		cursor->size0 = tmp_size;
-		
-		cursor->nalloc = newsize;
+	c = cubesql_cache_get(db, sql, NULL, 0);
+	if (c) {
+		cubesql_clear_errors(db);
+		return c;
 	}
 	
-	// append new row to the cursor
-	for (j=0, i=index; j < cursor->ncols; j++, i++) {
-		rlen = len[j];
-		if (rlen < 0) rlen = 0;
-		
-		cursor->buffer[i] = (char *) malloc (rlen);
-		if ((cursor->buffer[i] == NULL) && (rlen > 0)) return kFALSE;
-		
-		if ((row[j]) && (rlen)) memcpy (cursor->buffer[i], row[j], rlen);
-		cursor->size0[i] = len[j];
+	c = cubesql_select(db, sql, kFALSE);
+	return cubesql_cache_put(db, sql, NULL, 0, c);
+}
+
+void cubesql_cache_stats (csqlcache *cache, int64 *hits, int64 *misses, int64 *merged) {
+	if (cache == NULL) return;
+	
+	csql_mutex_lock(&cache->mutex);
+	if (hits) *hits = cache->hits;
+	if (misses) *misses = cache->misses;
+	if (merged) *merged = cache->merged;
+	csql_mutex_unlock(&cache->mutex);
+}
+
+// MARK: - Refresh -
+
+csqlrefresh *cubesql_refresh_create (csqldb *db, const char *sql, const char *markcolumn, int keycolumn, int resync) {
+	// markcolumn is the name of the column compared with the high-water mark (NULL means a column named rowid)
+	// keycolumn identifies a row (0 means the mark column), a full query is performed every resync refreshes
+	csqlrefresh	*r;
+	
+	if (db == NULL) return NULL;
+	if ((sql == NULL) || (keycolumn < 0)) {
+		csql_seterror(db, CUBESQL_PARAMETER_ERROR, "Invalid parameters for refreshable query");
+		return NULL;
 	}
 	
-	cursor->nrows++;
-	if (cursor->current_row == -1) cursor->current_row = 1;
+	r = (csqlrefresh *) malloc(sizeof(csqlrefresh));
+	if (r == NULL) goto abort_memory;
+	bzero(r, sizeof(csqlrefresh));
 	
-	return kTRUE;
+	// source query is wrapped by the delta query so trailing semicolons are removed
+	r->sql = strdup(sql);
+	r->mark = strdup((markcolumn) ? markcolumn : "rowid");
+	if ((r->sql == NULL) || (r->mark == NULL)) goto abort_memory;
+	csql_sql_strip(r->sql);
+	
+	r->db = db;
+	r->keycolumn = keycolumn;
+	r->resync = (resync > 0) ? resync : 0;
+	
+	if (csql_refresh_full(r) < 0) goto abort;
+	return r;
+	
+abort_memory:
+	csql_seterror(db, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate refreshable query");
+abort:
+	cubesql_refresh_free(r);
+	return NULL;
 }
 
-void cubesql_seterror(csqldb *db, int errcode, const char *errmsg) {
-	csql_seterror(db, errcode, errmsg);
+int cubesql_refresh (csqlrefresh *r, int full) {
+	// returns the number of new or modified rows (all rows after a full query) or -1 in case of error
+	csqlc	*c;
+	char	*sql, *p;
+	int		n;
+	
+	if (r == NULL) return -1;
+	
+	// periodic full query is the only way to find out deleted rows
+	if ((r->resync) && (++r->count >= r->resync)) full = kTRUE;
+	if ((full) || (r->c == NULL) || (r->hwm == NULL)) return csql_refresh_full(r);
+	
+	// >= is used because other rows could share the same mark (unchanged rows are skipped by the merge)
+	sql = (char *) malloc(strlen(r->sql) + (strlen(r->mark) * 2) + (r->hwmlen * 2) + 64);
+	if (sql == NULL) {
+		csql_seterror(r->db, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate refresh query");
+		return -1;
+	}
+	p = sql + sprintf(sql, "SELECT * FROM (%s) WHERE ", r->sql);
+	p = csql_sql_identifier(p, r->mark);
+	p += sprintf(p, " >= ");
+	p = csql_sql_literal(p, r->hwm, r->hwmlen, r->hwmnumeric);
+	strcpy(p, ";");
+	
+	c = cubesql_select(r->db, sql, kFALSE);
+	free(sql);
+	if (c == NULL) return -1;
+	
+	// layout changed (or the delta query cannot be wrapped the same way), rows are reloaded
+	if (c->ncols != r->c->ncols) {
+		cubesql_cursor_free(c);
+		return csql_refresh_full(r);
+	}
+	
+	// a row with a NULL key that cannot be matched to an identical one is only handled by reloading all rows
+	n = csql_refresh_merge(r, c);
+	cubesql_cursor_free(c);
+	return (n == -2) ? csql_refresh_full(r) : n;
 }
 
-// MARK: - Reserved -
-
-void csql_libinit (void) {
-	#ifdef WIN32
-	WSADATA wsaData;
-	#else
-	struct sigaction act;
-	#endif
-	static int lib_inited = kFALSE;
+csqlc *cubesql_refresh_cursor (csqlrefresh *r) {
+	// snapshot of the merged rows, it is not modified by the next refresh and it must be freed by the caller
+	csqlc	*c, *src;
+	int		i, n, nfields;
 	
-	if (lib_inited == kFALSE) {
-		lib_inited = kTRUE;
-		csql_static_randinit();
-		csql_gen_tabs();
+	if ((r == NULL) || (r->c == NULL)) return NULL;
+	src = r->c;
+	
+	c = csql_refresh_newcursor(src, src->nrows);
+	if (c == NULL) return NULL;
+	
+	nfields = src->nrows * src->ncols;
+	for (i=0; i<nfields; i++) {
+		n = (src->size0[i] > 0) ? src->size0[i] : 0;
+		c->buffer[i] = (char *) malloc((n) ? n : 1);
+		if (c->buffer[i] == NULL) {c->nrows = i / c->ncols; goto abort;}
+		if (n) memcpy(c->buffer[i], src->buffer[i], n);
+		c->size0[i] = src->size0[i];
 		
-		#ifdef WIN32
-		WSAStartup(MAKEWORD(2,2), &wsaData);
-		#else
-		// IGNORE SIGPIPE and SIGABORT
-		act.sa_handler = SIG_IGN;
-		sigemptyset(&act.sa_mask);
-		act.sa_flags = 0;
-		sigaction(SIGPIPE, &act, (struct sigaction *)NULL);
-		sigaction(SIGABRT, &act, (struct sigaction *)NULL);
-		#endif
+		// fields of a row are all allocated before the row is counted
+		if (((i + 1) % c->ncols) == 0) c->nrows++;
 	}
+	c->current_row = (c->nrows) ? 1 : -1;
+	return c;
+	
+abort:
+	// free the fields of the partially copied row
+	for (n = c->nrows * c->ncols; n < i; n++) free(c->buffer[n]);
+	cubesql_cursor_free(c);
+	csql_seterror(r->db, CUBESQL_MEMORY_ERROR, "Not enough memory to copy refreshed rows");
+	return NULL;
 }
 
-csqldb *csql_dbinit (const char *host, int port, const char *username, const char *password, int timeout, int encryption, const char *ssl_certificate, const char *root_certificate, const char *ssl_certificate_password, const char *ssl_chiper_list) {
-	csqldb	*db = NULL;
+void cubesql_refresh_free (csqlrefresh *r) {
+	if (r == NULL) return;
 	
-	db = (csqldb *) malloc (sizeof(csqldb));
-	if (db == NULL) return NULL;
+	if (r->c) cubesql_cursor_free(r->c);
+	if (r->slots) free(r->slots);
+	if (r->hwm) free(r->hwm);
+	if (r->sql) free(r->sql);
+	if (r->mark) free(r->mark);
+	free(r);
+}
+
+// MARK: - Pager -
+
+csqlpager *cubesql_pager_create (csqldb *db, csqldb *prefetchdb, const char *sql, const char *keycolumn, int pagesize) {
+	// keycolumn must be a unique column of the result, prefetchdb can be NULL (no background prefetch)
+	// while a prefetch is in progress prefetchdb must not be used by anyone else, disconnecting it stops the
+	// prefetch and the next pages are fetched on db
+	csqlpager	*p;
 	
-	// zero all the struct
-	bzero(db, sizeof(csqldb));
+	if ((db == NULL) || (sql == NULL) || (keycolumn == NULL) || (pagesize <= 0)) return NULL;
 	
-	// save db fields
-	db->port = port;
-	db->timeout = timeout;
-	db->encryption = encryption;
-	db->token = NULL;
-	db->useOldProtocol = kFALSE;
-	db->verifyPeer = kFALSE;
+	p = (csqlpager *) malloc(sizeof(csqlpager));
+	if (p == NULL) return NULL;
+	bzero(p, sizeof(csqlpager));
 	
-	snprintf((char *) db->host, sizeof(db->host), "%s", host);
-	snprintf((char *) db->username, sizeof(db->username),  "%s", username);
-	snprintf((char *) db->password, sizeof(db->password),  "%s", password);
+	// source query is wrapped by the page query so trailing semicolons are removed
+	p->sql = strdup(sql);
+	p->key = strdup(keycolumn);
+	if ((p->sql == NULL) || (p->key == NULL)) {
+		cubesql_pager_free(p);
+		return NULL;
+	}
+	csql_sql_strip(p->sql);
 	
-	#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
-	if (encryption_is_ssl(encryption) == kTRUE) {
-		struct tls_config *tls_conf = NULL;
-		struct tls *tls_context = NULL;
-		int rc;
+	p->db = db;
+	p->pagesize = pagesize;
+	
+	// the prefetch connection knows its pagers so that cubesql_disconnect can detach them
+	if ((prefetchdb) && (prefetchdb != db)) {
+		p->prefetchdb = prefetchdb;
+		p->nextpager = prefetchdb->pager;
+		prefetchdb->pager = p;
+	}
+	return p;
+}
 
-		if (tls_init() < 0) {
-			fprintf(stderr, "Error while initializing TLS library.");
-			goto load_ssl_abort;
+csqlc *cubesql_pager_next (csqlpager *p) {
+	// returns the next page (it must be freed by the caller) or NULL at the end or in case of error
+	csqlc	*c;
+	
+	if (p == NULL) return NULL;
+	
+	// page has been (or is being) fetched in background, if that failed it is fetched again on db (to report the error)
+	csql_pager_join(p);
+	c = p->next;
+	p->next = NULL;
+	if (c == NULL) {
+		if (p->eof) return NULL;
+		c = csql_pager_fetch(p, p->db, NULL);
+		if (c == NULL) {
+			p->eof = kTRUE;
+			return NULL;
 		}
+	}
+	
+	if (csql_pager_advance(p, c) == kFALSE) {
+		cubesql_cursor_free(c);
+		p->eof = kTRUE;
+		return NULL;
+	}
+	
+	// an empty page is returned only if the first page is empty
+	if ((c->nrows == 0) && (p->npages > 0)) {
+		cubesql_cursor_free(c);
+		p->eof = kTRUE;
+		return NULL;
+	}
+	p->npages++;
+	
+	// start fetching the next page while the caller consumes this one
+	if ((p->eof == kFALSE) && (p->prefetchdb)) {
+		if (csql_thread_create(&p->thread, csql_pager_thread, p) == 0) p->running = kTRUE;
+	}
+	return c;
+}
 
-		tls_conf = tls_config_new();
-		if (!tls_conf) {
-			fprintf(stderr, "Error while initializing a new TLS configuration.");
-			goto load_ssl_abort;
-		}
+int cubesql_pager_eof (csqlpager *p) {
+	return ((p == NULL) || ((p->eof) && (p->running == kFALSE)));
+}
 
-		if (ssl_certificate_password) {
-			rc = tls_config_set_key_file(tls_conf, ssl_certificate_password);
-			if (rc < 0) {
-				fprintf(stderr, "Error in tls_config_set_key_file: %s.", tls_config_error(tls_conf));
-				goto load_ssl_abort;
-			}
+void cubesql_pager_free (csqlpager *p) {
+	csqlpager **link;
+	
+	if (p == NULL) return;
+	
+	csql_pager_join(p);
+	if (p->prefetchdb) {
+		for (link = &p->prefetchdb->pager; *link; link = &(*link)->nextpager) {
+			if (*link == p) {*link = p->nextpager; break;}
 		}
+	}
+	if (p->next) cubesql_cursor_free(p->next);
+	if (p->last) free(p->last);
+	if (p->sql) free(p->sql);
+	if (p->key) free(p->key);
+	free(p);
+}
 
-		#ifdef TLS_DEFAULT_CA_FILE
-		if (!root_certificate) root_certificate = TLS_DEFAULT_CA_FILE;
-		#endif
+// MARK: - Pool -
 
-		if (root_certificate) {
-			rc = tls_config_set_ca_file(tls_conf, root_certificate);
-			if (rc < 0) {
-				fprintf(stderr, "Error in tls_config_set_ca_file: %s.", tls_config_error(tls_conf));
-				goto load_ssl_abort;
-			}
-		} else {
-			// if no root certificate is provided then disable certificate and name verification
-			tls_config_insecure_noverifycert(tls_conf);
-			tls_config_insecure_noverifyname(tls_conf);
-		}
+csqlpool *cubesql_pool_create (void) {
+	csqlpool *pool = (csqlpool *) malloc(sizeof(csqlpool));
+	if (pool == NULL) return NULL;
+	
+	bzero(pool, sizeof(csqlpool));
+	csql_mutex_init(&pool->mutex);
+	csql_cond_init(&pool->cond);
+	return pool;
+}
 
-		if (ssl_certificate) {
-			rc = tls_config_set_cert_file(tls_conf, ssl_certificate);
-			if (rc < 0) {
-				fprintf(stderr, "Error in tls_config_set_cert_file: %s.", tls_config_error(tls_conf));
-				goto load_ssl_abort;
-			}
+int cubesql_pool_add (csqlpool *pool, csqldb *db) {
+	// connections are not owned by the pool, they must be disconnected after cubesql_pool_free
+	csqldb	**dbs;
+	int		*busy, newsize;
+	
+	if ((pool == NULL) || (db == NULL)) return CUBESQL_PARAMETER_ERROR;
+	
+	csql_mutex_lock(&pool->mutex);
+	if (pool->count >= pool->nalloc) {
+		newsize = (pool->nalloc) ? pool->nalloc * 2 : 8;
+		dbs = (csqldb **) realloc(pool->dbs, sizeof(csqldb *) * newsize);
+		if (dbs) pool->dbs = dbs;
+		busy = (int *) realloc(pool->busy, sizeof(int) * newsize);
+		if (busy) pool->busy = busy;
+		if ((dbs == NULL) || (busy == NULL)) {
+			csql_mutex_unlock(&pool->mutex);
+			return CUBESQL_MEMORY_ERROR;
 		}
+		pool->nalloc = newsize;
+	}
+	pool->dbs[pool->count] = db;
+	pool->busy[pool->count] = kFALSE;
+	pool->count++;
+	csql_cond_broadcast(&pool->cond);
+	csql_mutex_unlock(&pool->mutex);
+	
+	return CUBESQL_NOERR;
+}
 
-		// apply cipher list
-		if (ssl_chiper_list) {
-			rc = tls_config_set_ciphers(tls_conf, ssl_chiper_list);
-			if (rc < 0) {
-				// report error but not abort
-				fprintf(stderr, "Error in tls_config_set_ciphers: %s.", tls_config_error(tls_conf));
-			}
-		}
+int cubesql_pool_size (csqlpool *pool) {
+	return (pool) ? pool->count : 0;
+}
 
-		tls_context = tls_client();
-		if (!tls_context) {
-			fprintf(stderr, "Error while initializing a new TLS client.");
-			goto load_ssl_abort;
+csqldb *cubesql_pool_acquire (csqlpool *pool, int timeout_ms) {
+	// wait for a free connection, 0 means no timeout (NULL is returned if the timeout expires)
+	csqldb	*db = NULL;
+	int		i;
+	
+	if ((pool == NULL) || (pool->count == 0)) return NULL;
+	
+	csql_mutex_lock(&pool->mutex);
+	while (db == NULL) {
+		for (i=0; i<pool->count; i++) {
+			if (pool->busy[i] == kFALSE) {
+				pool->busy[i] = kTRUE;
+				db = pool->dbs[i];
+				break;
+			}
 		}
+		if ((db == NULL) && (csql_cond_wait(&pool->cond, &pool->mutex, timeout_ms))) break;
+	}
+	csql_mutex_unlock(&pool->mutex);
+	
+	return db;
+}
 
-		// apply configuration to context
-		rc = tls_configure(tls_context, tls_conf);
-		if (rc < 0) {
-			fprintf(stderr, "Error in tls_configure: %s.", tls_error(tls_context));
-			goto load_ssl_abort;
+void cubesql_pool_release (csqlpool *pool, csqldb *db) {
+	csqlsched	*s;
+	int			i;
+	
+	if ((pool == NULL) || (db == NULL)) return;
+	
+	csql_mutex_lock(&pool->mutex);
+	for (i=0; i<pool->count; i++) {
+		if (pool->dbs[i] == db) {
+			pool->busy[i] = kFALSE;
+			break;
 		}
+	}
+	csql_cond_broadcast(&pool->cond);
+	s = pool->sched;
+	csql_mutex_unlock(&pool->mutex);
+	
+	// scheduler is locked before the pool, so it is notified after the pool has been unlocked
+	if (s) {
+		csql_mutex_lock(&s->mutex);
+		csql_sched_dispatch(s);
+		csql_mutex_unlock(&s->mutex);
+	}
+}
 
-		// save TLS context
-		db->tls_context = tls_context;
-		tls_config_free(tls_conf);
-		goto load_ssl_done;
+void cubesql_pool_free (csqlpool *pool) {
+	if (pool == NULL) return;
+	
+	if (pool->dbs) free(pool->dbs);
+	if (pool->busy) free(pool->busy);
+	csql_cond_destroy(&pool->cond);
+	csql_mutex_destroy(&pool->mutex);
+	free(pool);
+}
 
-	load_ssl_abort:
-		if (tls_context) tls_free(tls_context);
-		if (tls_conf) tls_config_free(tls_conf);
-		free(db);
+csqlc *cubesql_parallel_select (csqlpool *pool, const char *sql, const char *partcolumn, int n) {
+	// split the scan of sql in n ranges of the integer partcolumn (usually rowid), each range runs on its own
+	// pooled connection and the returned cursor concatenates the results (ordered by range, not by sql)
+	// in case of error NULL is returned and the error is set on the first connection of the pool
+	csqlpart	*parts = NULL;
+	csqlc		*c = NULL;
+	csqldb		*db;
+	char		*source;
+	int64		lo = 0, hi = 0;
+	uint64_t	span, step;
+	int			i;
+	
+	if ((pool == NULL) || (pool->count == 0)) return NULL;
+	if ((sql == NULL) || (partcolumn == NULL)) {
+		csql_seterror(pool->dbs[0], CUBESQL_PARAMETER_ERROR, "SQL and partition column cannot be NULL");
 		return NULL;
-
-	load_ssl_done: ;
 	}
-	#endif
+	if (n <= 0) n = pool->count;
+	
+	// source query is wrapped by each range query so trailing semicolons are removed
+	source = strdup(sql);
+	if (source == NULL) {
+		csql_seterror(pool->dbs[0], CUBESQL_MEMORY_ERROR, "Not enough memory to allocate parallel select");
+		return NULL;
+	}
+	csql_sql_strip(source);
+	sql = source;
+	
+	db = cubesql_pool_acquire(pool, 0);
+	if (csql_parallel_bounds(db, sql, partcolumn, &lo, &hi) == kFALSE) {
+		if (db != pool->dbs[0]) csql_seterror(pool->dbs[0], db->errcode, db->errmsg);
+		cubesql_pool_release(pool, db);
+		free(source);
+		return NULL;
+	}
+	cubesql_pool_release(pool, db);
+	
+	// no rows (or a single value) means a single range
+	span = (uint64_t)hi - (uint64_t)lo;
+	if (span < (uint64_t)n) n = (int)span + 1;
+	step = (span / n) + 1;
+	
+	parts = (csqlpart *) malloc(sizeof(csqlpart) * n);
+	if (parts == NULL) goto abort_memory;
+	bzero(parts, sizeof(csqlpart) * n);
+	
+	for (i=0; i<n; i++) {
+		parts[i].pool = pool;
+		parts[i].sql = csql_parallel_sql(sql, partcolumn, (i == 0), (i == n-1), (int64)((uint64_t)lo + (step * i)), (int64)((uint64_t)lo + (step * (i + 1))));
+		if (parts[i].sql == NULL) goto abort_memory;
+	}
+	
+	c = csql_parts_run(parts, n, pool->dbs[0]);
+	goto cleanup;
+	
+abort_memory:
+	csql_seterror(pool->dbs[0], CUBESQL_MEMORY_ERROR, "Not enough memory to allocate parallel select");
+cleanup:
+	if (parts) {
+		for (i=0; i<n; i++) {
+			if (parts[i].sql) free(parts[i].sql);
+		}
+		free(parts);
+	}
+	free(source);
+	return c;
+}
 
-	return db;
+// MARK: - Scheduler -
+
+csqlsched *cubesql_sched_create (csqlpool *pool) {
+	// a pool can be used by a single scheduler, connections acquired directly from the pool are still allowed
+	csqlsched	*s;
+	int			i;
+	
+	if ((pool == NULL) || (pool->sched)) return NULL;
+	
+	s = (csqlsched *) malloc(sizeof(csqlsched));
+	if (s == NULL) return NULL;
+	bzero(s, sizeof(csqlsched));
+	
+	s->pool = pool;
+	csql_mutex_init(&s->mutex);
+	csql_cond_init(&s->cond);
+	for (i=0; i<kSCHED_CLASSES; i++) s->classes[i].weight = 1;
+	
+	// by default interactive requests get 4 connections out of 5 and bulk jobs leave at least one connection free
+	s->classes[CUBESQL_PRIORITY_INTERACTIVE].weight = 4;
+	s->classes[CUBESQL_PRIORITY_BULK].maxactive = -1;
+	s->classes[CUBESQL_PRIORITY_BULK].throttle = kSCHED_THROTTLE;
+	
+	csql_mutex_lock(&pool->mutex);
+	pool->sched = s;
+	csql_mutex_unlock(&pool->mutex);
+	return s;
 }
 
-void csql_dbfree (csqldb *db) {
-	if (db->inbuffer) free(db->inbuffer);
-	free(db);
+int cubesql_sched_setclass (csqlsched *s, int priority, int weight, int maxactive, int throttle_ms) {
+	if ((s == NULL) || (priority < 0) || (priority >= kSCHED_CLASSES) || (weight <= 0) || (maxactive < -1)) return CUBESQL_PARAMETER_ERROR;
+	
+	csql_mutex_lock(&s->mutex);
+	s->classes[priority].weight = weight;
+	s->classes[priority].maxactive = maxactive;
+	s->classes[priority].throttle = (throttle_ms > 0) ? throttle_ms : 0;
+	csql_sched_dispatch(s);
+	csql_mutex_unlock(&s->mutex);
+	return CUBESQL_NOERR;
 }
 
-void csql_socketclose (csqldb *db) {
-	if (db->sockfd <= 0) return;
+csqldb *cubesql_sched_acquire (csqlsched *s, int priority, int timeout_ms) {
+	// wait for a pooled connection in the given class, 0 means no timeout (NULL is returned if the timeout expires)
+	csqlwaiter	w;
+	csqlclass	*c;
+	int64		deadline = 0, left = 0;
 	
-	#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
-	if (db->tls_context) {
-		tls_close(db->tls_context);
-		tls_free(db->tls_context);
-		db->tls_context = NULL;
+	if ((s == NULL) || (priority < 0) || (priority >= kSCHED_CLASSES) || (s->pool->count == 0)) return NULL;
+	if (timeout_ms > 0) deadline = csql_mstime() + timeout_ms;
+	
+	bzero(&w, sizeof(csqlwaiter));
+	c = &s->classes[priority];
+	
+	csql_mutex_lock(&s->mutex);
+	
+	// a class that was idle cannot claim the share it did not use
+	if ((c->head == NULL) && (c->vtime < s->vclock)) c->vtime = s->vclock;
+	if (c->tail) c->tail->next = &w;
+	else c->head = &w;
+	c->tail = &w;
+	
+	csql_sched_dispatch(s);
+	while (w.db == NULL) {
+		if (deadline) {
+			left = deadline - csql_mstime();
+			if (left <= 0) break;
+		}
+		csql_cond_wait(&s->cond, &s->mutex, (int)left);
 	}
-	#endif
 	
-	bsd_shutdown(db->sockfd, SHUT_RDWR);
-	closesocket(db->sockfd);
+	if (w.db == NULL) csql_sched_dequeue(s, priority, &w);
+	csql_mutex_unlock(&s->mutex);
+	
+	return w.db;
+}
+
+void cubesql_sched_release (csqlsched *s, csqldb *db) {
+	if ((s == NULL) || (db == NULL) || (db->sched != s)) return;
+	
+	csql_mutex_lock(&s->mutex);
+	s->classes[db->sched_class].active--;
+	db->sched = NULL;
+	db->sched_class = 0;
+	csql_mutex_unlock(&s->mutex);
+	
+	// the pool hands the connection to the next waiter
+	cubesql_pool_release(s->pool, db);
+}
+
+int cubesql_sched_waiting (csqlsched *s, int priority) {
+	csqlwaiter	*w;
+	int			n = 0;
+	
+	if ((s == NULL) || (priority < 0) || (priority >= kSCHED_CLASSES)) return 0;
+	
+	csql_mutex_lock(&s->mutex);
+	for (w = s->classes[priority].head; w; w = w->next) n++;
+	csql_mutex_unlock(&s->mutex);
+	return n;
+}
+
+void cubesql_sched_free (csqlsched *s) {
+	// all the connections must have been released and no thread can be waiting
+	if (s == NULL) return;
+	
+	csql_mutex_lock(&s->pool->mutex);
+	s->pool->sched = NULL;
+	csql_mutex_unlock(&s->pool->mutex);
+	
+	csql_cond_destroy(&s->cond);
+	csql_mutex_destroy(&s->mutex);
+	free(s);
+}
+
+// MARK: - Shared Connection -
+
+csqlshared *cubesql_shared_create (csqldb *db) {
+	// once shared, db must be used only through the cubesql_shared functions until cubesql_shared_free
+	csqlshared *s;
+	
+	if (db == NULL) return NULL;
+	
+	s = (csqlshared *) malloc(sizeof(csqlshared));
+	if (s == NULL) return NULL;
+	bzero(s, sizeof(csqlshared));
+	
+	s->db = db;
+	s->head = &s->stub;
+	s->tail = &s->stub;
+	csql_mutex_init(&s->mutex);
+	csql_cond_init(&s->queued);
+	csql_cond_init(&s->served);
+	
+	if (csql_thread_create(&s->thread, csql_shared_thread, s) != 0) {
+		csql_cond_destroy(&s->served);
+		csql_cond_destroy(&s->queued);
+		csql_mutex_destroy(&s->mutex);
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+csqlresult *cubesql_shared_execute (csqlshared *s, const char *sql) {
+	return csql_shared_submit(s, sql, kFALSE);
+}
+
+csqlresult *cubesql_shared_select (csqlshared *s, const char *sql) {
+	return csql_shared_submit(s, sql, kTRUE);
+}
+
+int cubesql_shared_coalesce (csqlshared *s, int window_ms, int maxstatements) {
+	// small writes (INSERT, UPDATE, DELETE, REPLACE) queued within window_ms are executed in a single transaction
+	if ((s == NULL) || (window_ms < 0)) return CUBESQL_PARAMETER_ERROR;
+	if ((maxstatements <= 0) || (maxstatements > kMAX_COALESCE)) maxstatements = kMAX_COALESCE;
+	
+	csql_mutex_lock(&s->mutex);
+	s->window = window_ms;
+	s->maxbatch = maxstatements;
+	csql_mutex_unlock(&s->mutex);
+	return CUBESQL_NOERR;
+}
+
+void cubesql_shared_free (csqlshared *s) {
+	// requests already queued are served before the I/O thread exits, db is not disconnected
+	if (s == NULL) return;
+	
+	csql_mutex_lock(&s->mutex);
+	s->stopping = kTRUE;
+	csql_cond_broadcast(&s->queued);
+	csql_mutex_unlock(&s->mutex);
+	csql_thread_join(s->thread);
+	
+	csql_cond_destroy(&s->served);
+	csql_cond_destroy(&s->queued);
+	csql_mutex_destroy(&s->mutex);
+	free(s);
+}
+
+int cubesql_result_errcode (csqlresult *r) {
+	return (r) ? r->errcode : CUBESQL_MEMORY_ERROR;
+}
+
+const char *cubesql_result_errmsg (csqlresult *r) {
+	return (r) ? r->errmsg : "Not enough memory to allocate request";
+}
+
+csqlc *cubesql_result_cursor (csqlresult *r) {
+	// ownership of the cursor moves to the caller
+	csqlc *c;
+	
+	if (r == NULL) return NULL;
+	c = r->c;
+	r->c = NULL;
+	return c;
+}
+
+void cubesql_result_free (csqlresult *r) {
+	if (r == NULL) return;
+	
+	if (r->c) cubesql_cursor_free(r->c);
+	if (r->sql) free(r->sql);
+	free(r);
+}
+
+// MARK: - Shards -
+
+csqlshards *cubesql_shards_create (void) {
+	csqlshards *s = (csqlshards *) malloc(sizeof(csqlshards));
+	if (s == NULL) return NULL;
+	
+	bzero(s, sizeof(csqlshards));
+	return s;
+}
+
+int cubesql_shards_add (csqlshards *s, csqldb *db, const char *name) {
+	// name places the shard on the ring (NULL means host:port), it must not change when connections are reopened
+	// db can be NULL for a shard that is not available (its keys are not moved to the other shards)
+	csqldb	**dbs;
+	char	**names, buffer[600];
+	int		newsize;
+	
+	if ((s == NULL) || ((db == NULL) && (name == NULL))) return CUBESQL_PARAMETER_ERROR;
+	
+	if (s->count >= s->nalloc) {
+		newsize = (s->nalloc) ? s->nalloc * 2 : 8;
+		dbs = (csqldb **) realloc(s->dbs, sizeof(csqldb *) * newsize);
+		if (dbs) s->dbs = dbs;
+		names = (char **) realloc(s->names, sizeof(char *) * newsize);
+		if (names) s->names = names;
+		if ((dbs == NULL) || (names == NULL)) return CUBESQL_MEMORY_ERROR;
+		s->nalloc = newsize;
+	}
+	
+	if (name == NULL) {
+		snprintf(buffer, sizeof(buffer), "%s:%d", db->host, db->port);
+		name = buffer;
+	}
+	s->names[s->count] = strdup(name);
+	if (s->names[s->count] == NULL) return CUBESQL_MEMORY_ERROR;
+	s->dbs[s->count] = db;
+	s->count++;
+	
+	// ring is rebuilt by the next lookup
+	if (s->ring) free(s->ring);
+	s->ring = NULL;
+	s->nring = 0;
+	return CUBESQL_NOERR;
+}
+
+int cubesql_shards_count (csqlshards *s) {
+	return (s) ? s->count : 0;
+}
+
+int cubesql_shards_index (csqlshards *s, const char *key, int keylen) {
+	// 0-based shard that owns key (first point of the ring at or after the hash of the key) or -1
+	unsigned long long	h;
+	int					lo, hi, mid;
+	
+	if ((s == NULL) || (s->count == 0) || (key == NULL)) return -1;
+	if ((s->ring == NULL) && (csql_shards_ring(s) == kFALSE)) return -1;
+	if (keylen < 0) keylen = (int)strlen(key);
+	
+	h = csql_hash_mix(csql_hash64(CSQL_HASH_SEED, key, keylen));
+	lo = 0; hi = s->nring;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (s->ring[mid].hash < h) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == s->nring) lo = 0;
+	return s->ring[lo].shard;
+}
+
+csqldb *cubesql_shards_route (csqlshards *s, const char *key, int keylen) {
+	// connection that owns key, statements about a single key can be sent directly to it
+	int index = cubesql_shards_index(s, key, keylen);
+	return (index >= 0) ? s->dbs[index] : NULL;
+}
+
+csqlc *cubesql_shards_select (csqlshards *s, const char *sql) {
+	// sql runs on all the shards concurrently, results of a query with a simple ORDER BY (column names or
+	// positions) are merged in order, otherwise they are concatenated; with LIMIT n OFFSET m each shard returns
+	// its first n+m rows and the offset and the limit are applied to the merged rows
+	// in case of error NULL is returned and the error is set on the first available shard
+	csqlsortkey	keys[kMAX_SORTKEYS];
+	csqlpart	*parts;
+	csqlc		*c;
+	csqldb		*errdb = NULL;
+	char		*shardsql = NULL;
+	int			i, nkeys, limit, offset, limitpos;
+	
+	if ((s == NULL) || (s->count == 0) || (sql == NULL)) return NULL;
+	
+	for (i=0; i<s->count; i++) {
+		if (s->dbs[i]) {errdb = s->dbs[i]; break;}
+	}
+	if (errdb == NULL) return NULL;
+	for (i=0; i<s->count; i++) {
+		if (s->dbs[i] == NULL) {
+			csql_seterror(errdb, CUBESQL_PARAMETER_ERROR, "Unable to select from a shard group with an unavailable shard");
+			return NULL;
+		}
+	}
+	
+	// a single shard runs the statement as is
+	limitpos = (s->count > 1) ? csql_sql_limit(sql, &limit, &offset) : -1;
+	if ((limitpos >= 0) && (limit == -2)) {
+		csql_seterror(errdb, CUBESQL_PARAMETER_ERROR, "Unable to select from a shard group with a LIMIT or OFFSET that is not an integer literal");
+		return NULL;
+	}
+	
+	// the rows skipped by the offset could come from any shard
+	if ((limitpos >= 0) && (offset > 0)) {
+		shardsql = (char *) malloc(limitpos + 32);
+		if (shardsql == NULL) {
+			csql_seterror(errdb, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate shards select");
+			return NULL;
+		}
+		memcpy(shardsql, sql, limitpos);
+		shardsql[limitpos] = 0;
+		if (limit >= 0) sprintf(shardsql + limitpos, " LIMIT %lld;", (long long)limit + (long long)offset);
+		else strcpy(shardsql + limitpos, ";");
+	}
+	
+	parts = (csqlpart *) malloc(sizeof(csqlpart) * s->count);
+	if (parts == NULL) {
+		if (shardsql) free(shardsql);
+		csql_seterror(errdb, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate shards select");
+		return NULL;
+	}
+	bzero(parts, sizeof(csqlpart) * s->count);
+	for (i=0; i<s->count; i++) {
+		parts[i].db = s->dbs[i];
+		parts[i].sql = (shardsql) ? shardsql : (char *)sql;
+	}
+	
+	c = csql_parts_run(parts, s->count, errdb);
+	free(parts);
+	if (shardsql) free(shardsql);
+	if ((c == NULL) || (c->cursor_id != kCURSOR_CONCAT)) return c;
+	
+	nkeys = csql_sql_orderby(sql, c, keys, kMAX_SORTKEYS);
+	if (limitpos < 0) {
+		limit = -1;
+		offset = 0;
+	}
+	if ((nkeys < 0) && ((limit >= 0) || (offset > 0))) {
+		cubesql_cursor_free(c);
+		csql_seterror(errdb, CUBESQL_PARAMETER_ERROR, "Unable to apply LIMIT to a shard group select whose ORDER BY is not made of result columns");
+		return NULL;
+	}
+	
+	// without an ORDER BY the parts are taken one after the other (all the keys compare equal)
+	if ((nkeys < 0) || ((nkeys == 0) && (limit < 0) && (offset == 0))) return c;
+	if (csql_cursor_merge(c, keys, nkeys, offset, limit) == kFALSE) {
+		cubesql_cursor_free(c);
+		csql_seterror(errdb, CUBESQL_MEMORY_ERROR, "Not enough memory to merge shards results");
+		return NULL;
+	}
+	return c;
+}
+
+void cubesql_shards_free (csqlshards *s) {
+	// connections are not owned by the shard group
+	int i;
+	
+	if (s == NULL) return;
+	
+	for (i=0; i<s->count; i++) free(s->names[i]);
+	if (s->names) free(s->names);
+	if (s->dbs) free(s->dbs);
+	if (s->ring) free(s->ring);
+	free(s);
+}
+
+// MARK: - Replicas -
+
+int cubesql_replica_add (csqldb *db, csqldb *replica) {
+	// replica is not owned by db, it is removed automatically when it is disconnected
+	csqlrouter	*router;
+	csqlreplica	*replicas;
+	int			i, newsize;
+	
+	if ((db == NULL) || (replica == NULL) || (replica == db) || (replica->router) || (db->primary)) return CUBESQL_PARAMETER_ERROR;
+	if (replica->primary == db) return CUBESQL_NOERR;
+	if (replica->primary) cubesql_replica_remove(replica->primary, replica);
+	
+	if (db->router == NULL) {
+		router = (csqlrouter *) malloc(sizeof(csqlrouter));
+		if (router == NULL) return CUBESQL_MEMORY_ERROR;
+		bzero(router, sizeof(csqlrouter));
+		db->router = router;
+	}
+	router = db->router;
+	
+	if (router->count >= router->nalloc) {
+		newsize = (router->nalloc) ? router->nalloc * 2 : 4;
+		replicas = (csqlreplica *) realloc(router->replicas, sizeof(csqlreplica) * newsize);
+		if (replicas == NULL) return CUBESQL_MEMORY_ERROR;
+		router->replicas = replicas;
+		router->nalloc = newsize;
+	}
+	
+	i = router->count++;
+	bzero(&router->replicas[i], sizeof(csqlreplica));
+	router->replicas[i].db = replica;
+	replica->primary = db;
+	return CUBESQL_NOERR;
+}
+
+void cubesql_replica_remove (csqldb *db, csqldb *replica) {
+	csqlrouter	*router;
+	int			i;
+	
+	if ((db == NULL) || (db->router == NULL) || (replica == NULL)) return;
+	router = db->router;
+	
+	for (i=0; i<router->count; i++) {
+		if (router->replicas[i].db != replica) continue;
+		memmove(&router->replicas[i], &router->replicas[i+1], sizeof(csqlreplica) * (router->count - i - 1));
+		router->count--;
+		replica->primary = NULL;
+		break;
+	}
+}
+
+int cubesql_replica_count (csqldb *db) {
+	return ((db) && (db->router)) ? db->router->count : 0;
+}
+
+double cubesql_replica_latency (csqldb *db, int index) {
+	// average select time in ms of a replica, -1 if the replica is not healthy
+	csqlreplica *r;
+	
+	if ((db == NULL) || (db->router == NULL) || (index < 0) || (index >= db->router->count)) return -1;
+	r = &db->router->replicas[index];
+	return (r->retry > csql_mstime()) ? -1 : r->latency;
+}
+
+// MARK: - VM -
+
+csqlvm *cubesql_vmprepare (csqldb *db, const char *sql) {
+	csqlvm		*vm = NULL;
+	csqlreplica	*r;
+	
+	// a read statement is prepared (and then executed) on a replica
+	if ((db->router) && ((r = csql_router_pick(db, sql)) != NULL)) {
+		vm = cubesql_vmprepare(r->db, sql);
+		if (vm) return vm;
+		if (csql_router_failed(db, r) == kFALSE) return NULL;
+	}
+	
+	return csql_vm_prepare(db, sql);
+}
+
+csqlvm *cubesql_vmprepare_cached (csqldb *db, const char *sql) {
+	// requests carry no VM identifier so the server keeps a single VM per connection: the cache is the statement
+	// prepared last, reused as long as no other VM has been prepared or closed on the connection in the meantime
+	// (the returned VM belongs to the connection, cubesql_vmclose ignores it)
+	csqlvm		*vm;
+	csqlreplica	*r;
+	
+	// a read statement is cached on the replica it is routed to
+	if ((db->router) && ((r = csql_router_pick(db, sql)) != NULL)) {
+		vm = cubesql_vmprepare_cached(r->db, sql);
+		if (vm) return vm;
+		if (csql_router_failed(db, r) == kFALSE) return NULL;
+	}
+	
+	vm = db->vmcache;
+	if ((vm) && (db->vmcurrent == vm) && (strcmp(vm->sql, sql) == 0)) {
+		// parameters buffered and never executed are dropped, the ones bound by the previous execute are reset to NULL
+		// by the next one unless they are bound again
+		cubesql_clear_errors(db);
+		csql_trace(db, sql);
+		csql_bind_clear(vm);
+		vm->errindex = 0;
+		return vm;
+	}
+	
+	// the replaced VM is closed lazily: its kVM_CLOSE is sent together with the next prepare
+	if (vm) {
+		if (db->vmcurrent == vm) db->vmclose = kTRUE;
+		db->vmcache = NULL;
+		csql_vm_free(vm);
+	}
+	
+	vm = csql_vm_prepare(db, sql);
+	if (vm == NULL) return NULL;
+	
+	vm->cached = kTRUE;
+	db->vmcache = vm;
+	return vm;
+}
+
+int cubesql_vmbind_int (csqlvm *vm, int index, int intvalue) {
+	char	value[kNUMBER_SIZE];
+	int		len;
+	
+	// convert int to text
+	len = csql_format_int64((int64)intvalue, value);
+	return csql_bind_value(vm, index, CUBESQL_BIND_INTEGER, value, len);
+}
+
+int cubesql_vmbind_double (csqlvm *vm, int index, double dvalue) {
+	char	value[kNUMBER_SIZE];
+	int		len;
+	
+	// convert double to the shortest text that preserves its value
+	len = csql_format_double(dvalue, value);
+	return csql_bind_value(vm, index, CUBESQL_BIND_DOUBLE, value, len);
+}
+
+int cubesql_vmbind_text (csqlvm *vm, int index, char *value, int len) {
+	return csql_bind_value(vm, index, CUBESQL_BIND_TEXT, value, len);
+}
+
+int cubesql_vmbind_blob (csqlvm *vm, int index, void *value, int len) {
+	return csql_bind_value(vm, index, CUBESQL_BIND_BLOB, (char *)value, len);
+}
+
+int cubesql_vmbind_null (csqlvm *vm, int index) {
+	return csql_bind_value(vm, index, CUBESQL_BIND_NULL, NULL, 0);
+}
+
+int cubesql_vmbind_int64 (csqlvm *vm, int index, int64 int64value) {
+	char	value[kNUMBER_SIZE];
+	int		len;
+	
+	// convert int to text
+	len = csql_format_int64(int64value, value);
+	return csql_bind_value(vm, index, CUBESQL_BIND_INT64, value, len);
+}
+
+int cubesql_vmbind_zeroblob (csqlvm *vm, int index, int len) {
+	return csql_bind_value(vm, index, CUBESQL_BIND_ZEROBLOB, NULL, len);
+}
+
+int cubesql_vmbind_blob_stream (csqlvm *vm, int index, int len, cubesql_blob_reader reader, void *ctx) {
+	// reader is called while the statement is executed (ctx must be valid until then) to fill the parameter piece by piece,
+	// the binding is consumed by that execute
+	csqlbind *b;
+	
+	if ((len <= 0) || (reader == NULL)) return csql_bind_value(vm, index, CUBESQL_BIND_BLOB, NULL, 0);
+	
+	b = csql_bind_slot(vm, index);
+	if (b == NULL) {
+		csql_seterror(vm->db, CUBESQL_MEMORY_ERROR, "Not enough memory to bind parameter");
+		return CUBESQL_MEMORY_ERROR;
+	}
+	b->type = CUBESQL_BIND_BLOB;
+	b->len = len;
+	b->reader = reader;
+	b->ctx = ctx;
+	return CUBESQL_NOERR;
+}
+
+int cubesql_vmbind_blob_fd (csqlvm *vm, int index, int fd) {
+	// the content of the file is streamed when the statement is executed, fd is owned by the VM and closed
+	// once the parameter has been sent (like any other bind it must be set again before the next execute)
+	csqlbind	*b;
+	#ifdef WIN32
+	struct _stat64	st;
+	int				rc = (fd >= 0) ? _fstat64(fd, &st) : -1;
+	#else
+	struct stat		st;
+	int				rc = (fd >= 0) ? fstat(fd, &st) : -1;
+	#endif
+	
+	if ((rc != 0) || ((int64)st.st_size > 0x7FFFFFFF)) {
+		if (fd >= 0) csql_fdclose(fd);
+		csql_seterror(vm->db, CUBESQL_PARAMETER_ERROR, "Unable to bind the file (not readable or larger than 2GB)");
+		return CUBESQL_ERR;
+	}
+	
+	if (st.st_size == 0) {
+		csql_fdclose(fd);
+		return csql_bind_value(vm, index, CUBESQL_BIND_BLOB, NULL, 0);
+	}
+	
+	b = csql_bind_slot(vm, index);
+	if (b == NULL) {
+		csql_fdclose(fd);
+		csql_seterror(vm->db, CUBESQL_MEMORY_ERROR, "Not enough memory to bind parameter");
+		return CUBESQL_MEMORY_ERROR;
+	}
+	b->type = CUBESQL_BIND_BLOB;
+	b->len = (int)st.st_size;
+	b->fd = fd;
+	return CUBESQL_NOERR;
+}
+
+int cubesql_vmexecute (csqlvm *vm) {
+	csqldb	*db = vm->db;
+	int		rc;
+	
+	// clear errors first
+	cubesql_clear_errors(db);
+	
+	// buffered parameters are sent first, the statement is not executed if one of them fails
+	if (csql_vm_current(vm) != CUBESQL_NOERR) return CUBESQL_ERR;
+	if (csql_bind_flush(vm) != CUBESQL_NOERR) return CUBESQL_ERR;
+	
+	// send VMEXECUTE command
+	csql_initrequest(db, 0, 0, kVM_EXECUTE, kNO_SELECTOR);
+	csql_netwrite(db, NULL, 0, NULL, 0);
+	
+	// read replay
+	rc = csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT);
+	
+	// drop cached results that could have been modified by the statement
+	if ((rc == CUBESQL_NOERR) && (db->cache) && (csql_vm_sql(vm))) csql_cache_written(db, csql_vm_sql(vm));
+	return rc;
+}
+
+csqlc *cubesql_vmselect (csqlvm *vm) {
+	csqldb *db = vm->db;
+	
+	// clear errors first
+	cubesql_clear_errors(db);
+	
+	// buffered parameters are sent first, the statement is not executed if one of them fails
+	if (csql_vm_current(vm) != CUBESQL_NOERR) return NULL;
+	if (csql_bind_flush(vm) != CUBESQL_NOERR) return NULL;
+	
+	// send VMSELECT command
+	csql_initrequest(db, 0, 0, kVM_SELECT, kNO_SELECTOR);
+	csql_netwrite(db, NULL, 0, NULL, 0);
+	
+	// read the cursor
+	return csql_read_cursor(db, NULL);
+}
+
+int cubesql_vmclose (csqlvm *vm) {
+	if (!vm) return CUBESQL_NOERR;
+	
+	// cached VMs are released together with the connection
+	if (vm->cached) return CUBESQL_NOERR;
+	
+	csqldb *db = vm->db;
+	
+	// a VM replaced on the server by another one has nothing left to close (the close would hit the other VM)
+	if ((db->vmcurrent == vm) || (db->vmcurrent == NULL)) {
+		db->vmcurrent = NULL;
+		csql_initrequest(db, 0, 0, kVM_CLOSE, kNO_SELECTOR);
+		csql_netwrite(db, NULL, 0, NULL, 0);
+		csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT);
+	}
+	
+	csql_vm_free(vm);
+	return CUBESQL_NOERR;
+}
+
+int cubesql_vmbind_errindex (csqlvm *vm) {
+	// 1-based index of the parameter that caused the last execute or select to fail (0 if binds succeeded)
+	return (vm) ? vm->errindex : 0;
+}
+
+int cubesql_vmexecute_batch (csqlvm *vm, int nrows, int ncols, char **values, int *sizes, int *types, int transaction, int64 *changes) {
+	// values, sizes and types are nrows x ncols row-major arrays (sizes and types can be NULL)
+	// rows are pipelined in windows of kBATCH_REPLIES replies, the first row is sent alone so bad parameters
+	// are caught before the rest is streamed; returns 0, the 1-based index of the first failed row or CUBESQL_ERR
+	// with transaction the failed batch is rolled back, without it the rows before the failed one are committed and
+	// the rows of the same window after it have been sent already, so they are executed too (changes[row] >= 0)
+	// a row whose bind fails has been executed with the parameter of the previous row: without transaction each window
+	// runs in a savepoint, rolled back and sent again without its failed rows
+	csqldb	*db = vm->db;
+	csqlc	*c;
+	char	failed[kBATCH_REPLIES];
+	int		row, start, end, sent, window, i, bindfailed, rowfailed, stale, replay, failedrow = 0, errrow = 0;
+	int		savepoint = kFALSE, spfailed = kFALSE, executed = kFALSE, errcode = CUBESQL_NOERR;
+	char	errmsg[sizeof(db->errmsg) + 64];
+	
+	// clear errors first
+	cubesql_clear_errors(db);
+	vm->errindex = 0;
+	if (nrows <= 0) return CUBESQL_NOERR;
+	if ((ncols < 0) || ((ncols > 0) && (values == NULL))) {
+		csql_seterror(db, CUBESQL_ERR, "Invalid parameters for batch execute");
+		return CUBESQL_ERR;
+	}
+	if (changes) for (row=0; row<nrows; row++) changes[row] = -1;
+	
+	// parameters bound before the batch are the same for every row
+	if (csql_vm_current(vm) != CUBESQL_NOERR) return CUBESQL_ERR;
+	if (csql_bind_flush(vm) != CUBESQL_NOERR) return CUBESQL_ERR;
+	if ((transaction) && (cubesql_execute(db, "BEGIN TRANSACTION;") != CUBESQL_NOERR)) return CUBESQL_ERR;
+	if (ncols > vm->maxindex) vm->maxindex = ncols;
+	
+	window = kBATCH_REPLIES / (ncols + ((changes) ? 2 : 1));
+	if (window < 1) window = 1;
+	
+	for (start=0; (start < nrows) && (failedrow == 0); start=end) {
+		end = (start == 0) ? 1 : start + window;
+		if (end > nrows) end = nrows;
+		bzero(failed, sizeof(failed));
+		
+		for (replay=kFALSE; ; replay=kTRUE) {
+			// without transaction the savepoint of the previous window is released and a new one is opened (a replayed
+			// window is still inside its own savepoint)
+			if ((!transaction) && (!replay)) {
+				if (savepoint) {
+					csql_trace(db, "RELEASE csql_batch;");
+					if (csql_send_statement(db, kCOMMAND_EXECUTE, "RELEASE csql_batch;", kFALSE, kFALSE) != CUBESQL_NOERR) goto abort_network;
+				}
+				csql_trace(db, "SAVEPOINT csql_batch;");
+				if (csql_send_statement(db, kCOMMAND_EXECUTE, "SAVEPOINT csql_batch;", kFALSE, kFALSE) != CUBESQL_NOERR) goto abort_network;
+			}
+			
+			// write the whole window: binds, execute and optionally SELECT changes() for each row
+			for (sent=start; sent<end; sent++) {
+				if (failed[sent - start]) continue;
+				if (csql_batch_sendrow(vm, ncols, &values[sent * ncols], (sizes) ? &sizes[sent * ncols] : NULL, (types) ? &types[sent * ncols] : NULL, (changes != NULL)) != CUBESQL_NOERR) break;
+			}
+			
+			// every request that has been sent has a reply, also when a previous one failed
+			if ((!transaction) && (!replay)) {
+				for (i=(savepoint) ? 0 : 1; i<2; i++) {
+					if (csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT) == CUBESQL_NOERR) continue;
+					if (csql_isneterror(db->errcode)) goto abort_network;
+					if (spfailed == kFALSE) {
+						errcode = db->errcode;
+						snprintf(errmsg, sizeof(errmsg), "%s", db->errmsg);
+					}
+					spfailed = kTRUE;
+				}
+				savepoint = kTRUE;
+			}
+			
+			stale = kFALSE;
+			for (row=start; row<sent; row++) {
+				if (failed[row - start]) continue;
+				bindfailed = kFALSE;
+				rowfailed = kFALSE;
+				for (i=0; i<ncols; i++) {
+					if (csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT) == CUBESQL_NOERR) continue;
+					if ((bindfailed == kFALSE) && (spfailed == kFALSE) && ((errrow == 0) || (row + 1 < errrow))) {
+						errrow = row + 1;
+						vm->errindex = i + 1;
+						errcode = db->errcode;
+						snprintf(errmsg, sizeof(errmsg), "Row %d: bind of parameter %d failed: %s", row + 1, i + 1, db->errmsg);
+					}
+					bindfailed = kTRUE;
+					if (csql_isneterror(db->errcode)) goto abort_network;
+				}
+				
+				if (csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT) != CUBESQL_NOERR) {
+					if ((bindfailed == kFALSE) && (spfailed == kFALSE) && ((errrow == 0) || (row + 1 < errrow))) {
+						errrow = row + 1;
+						vm->errindex = 0;
+						errcode = db->errcode;
+						snprintf(errmsg, sizeof(errmsg), "Row %d: %s", row + 1, db->errmsg);
+					}
+					rowfailed = kTRUE;
+					if (csql_isneterror(db->errcode)) goto abort_network;
+				} else if (bindfailed) stale = kTRUE;
+				if (bindfailed) rowfailed = kTRUE;
+				
+				if (changes) {
+					c = csql_read_cursor(db, NULL);
+					if (c == NULL) {
+						if (csql_isneterror(db->errcode)) goto abort_network;
+					} else {
+						if (rowfailed == kFALSE) changes[row] = cubesql_cursor_int64(c, 1, 1, 0);
+						cubesql_cursor_free(c);
+					}
+				}
+				
+				if (rowfailed == kFALSE) executed = kTRUE;
+				else failed[row - start] = 1;
+			}
+			if (sent < end) goto abort_network;
+			if (spfailed) goto abort_savepoint;
+			
+			// with transaction the failed batch is rolled back anyway, without it the rows executed with a stale
+			// parameter are undone together with the rest of the window, which is sent again
+			if ((stale == kFALSE) || (transaction)) break;
+			if (cubesql_execute(db, "ROLLBACK TO csql_batch;") != CUBESQL_NOERR) {
+				if (csql_isneterror(db->errcode)) goto abort_network;
+				errcode = db->errcode;
+				snprintf(errmsg, sizeof(errmsg), "%s", db->errmsg);
+				goto abort_savepoint;
+			}
+			if (changes) for (row=start; row<end; row++) changes[row] = -1;
+		}
+		failedrow = errrow;
+	}
+	
+	// the savepoint of the last window is released (that commits its rows when no transaction was open)
+	if ((savepoint) && (cubesql_execute(db, "RELEASE csql_batch;") != CUBESQL_NOERR)) {
+		if (csql_isneterror(db->errcode)) goto abort_network;
+		if (failedrow == 0) return CUBESQL_ERR;
+	}
+	
+	if ((failedrow == 0) && (transaction) && (cubesql_execute(db, "COMMIT;") != CUBESQL_NOERR)) {
+		if (csql_isneterror(db->errcode)) return CUBESQL_ERR;
+		errcode = db->errcode;
+		snprintf(errmsg, sizeof(errmsg), "%s", db->errmsg);
+		cubesql_execute(db, "ROLLBACK;");
+		csql_seterror(db, errcode, errmsg);
+		return CUBESQL_ERR;
+	}
+	if ((failedrow) && (transaction)) cubesql_execute(db, "ROLLBACK;");
+	
+	// drop cached results that could have been modified by the statement
+	if ((executed) && ((failedrow == 0) || (!transaction)) && (db->cache) && (csql_vm_sql(vm))) csql_cache_written(db, csql_vm_sql(vm));
+	
+	if (failedrow) csql_seterror(db, errcode, errmsg);
+	return failedrow;
+	
+abort_savepoint:
+	// the rows of the window cannot be undone (or the savepoint could not be opened), the batch stops with its error
+	if (savepoint) cubesql_execute(db, "RELEASE csql_batch;");
+	if ((executed) && (db->cache) && (csql_vm_sql(vm))) csql_cache_written(db, csql_vm_sql(vm));
+	csql_seterror(db, errcode, errmsg);
+	return CUBESQL_ERR;
+	
+abort_network:
+	// the connection is lost, the server rolls back the open transaction
+	if ((executed) && (!transaction) && (db->cache) && (csql_vm_sql(vm))) csql_cache_written(db, csql_vm_sql(vm));
+	return CUBESQL_ERR;
+}
+
+// MARK: - Private -
+
+void cubesql_clear_errors (csqldb *db) {
+	if (db) {
+		db->errcode = CUBESQL_NOERR;
+		db->errmsg[0] = 0;
+	}
+}
+
+csqldb *cubesql_cursor_db (csqlc *cursor) {
+	return cursor->db;
+}
+
+void cubesql_setuserptr (csqldb *db, void *userptr) {
+	db->userptr = userptr;
+}
+
+void *cubesql_getuserptr (csqldb *db) {
+	return db->userptr;
+}
+
+void cubesql_settoken (csqldb *db, char *token) {
+	if ((token) && (strlen(token)==0)) token = NULL;
+	db->token = token;
+}
+
+void cubesql_sethostverification (csqldb *db, char *hostverification) {
+	if ((hostverification) && (strlen(hostverification)==0)) hostverification = NULL;
+	db->hostverification = hostverification;
+}
+
+char *cubesql_gettoken (csqldb *db) {
+	return db->token;
+}
+
+csqlc *cubesql_cursor_create (csqldb *db, int nrows, int ncolumns, int *types, char **names) {
+	csqlc *cursor = NULL;
+	char  *p = NULL, *s = NULL;
+	int  i, len = 0;
+	
+	// simple sanity check
+	if ((nrows < 0) || (ncolumns <= 0) || (types == NULL) || (names == NULL)) return NULL;
+	
+	// allocate cursor
+	cursor = csql_cursor_alloc(db);
+	if (cursor == NULL) return NULL;
+	
+	// init fields
+	cursor->server_side = kFALSE;
+	cursor->has_rowid = kFALSE;
+	cursor->ncols = ncolumns;
+	cursor->nrows = 0;
+	cursor->current_row = -1;
+	cursor->cursor_id = -1; // means custom created
+	
+	// allocate memory for names and types
+	for (i=0; i< cursor->ncols; i++) {
+		p = names[i];
+		if (p == NULL) p = "";
+		len += strlen(p)+1;
+	}
+	cursor->names = (char*) malloc(len);
+	if (cursor->names == NULL) goto abort;
+		
+	cursor->types = (int*) malloc(cursor->ncols * sizeof(int));
+	if (cursor->types == NULL) goto abort;
+		
+	if (nrows > 0)
+		cursor->nalloc = nrows;
+	else
+		cursor->nalloc = kDEFAULT_ALLOC_ROWS;
+		
+	cursor->buffer = (char**) malloc(sizeof(char*) * cursor->ncols * cursor->nalloc);
+	if (cursor->buffer == NULL) goto abort;
+		
+	cursor->size0 = (int*) malloc(sizeof(int) * cursor->ncols * cursor->nalloc);
+	if (cursor->size0 == NULL) goto abort;
+	
+	// set column names
+	p = cursor->names;
+	for (i=0; i< cursor->ncols; i++) {
+		s = names[i];
+		if (s == NULL) s = "";
+		len = (int)strlen(s)+1;
+		memcpy(p, s, len);
+		p += len;
+	}
+	
+	// set columns types
+	for (i=0; i< cursor->ncols; i++) {
+		cursor->types[i] = types[i];
+	}
+	
+	return cursor;
+	
+abort:
+	cubesql_cursor_free(cursor);
+	return NULL;
+}
+
+int cubesql_cursor_addrow (csqlc *cursor, char **row, int *len) {
+	int i, j, index, rlen;
+	
+	// row can be added to a custom created cursor only
+	if (cursor->cursor_id != -1) return kFALSE;
+	
+	// check if there is enough space for the new row
+	index = cursor->nrows * cursor->ncols;
+	if (cursor->nalloc < index + cursor->ncols) {
+		int newsize = cursor->nalloc + (kDEFAULT_ALLOC_ROWS * 2);
+		
+		char **tmp_buffer = (char**) realloc(cursor->buffer, sizeof(char*) * cursor->ncols * newsize);
+		if (tmp_buffer == NULL) return kFALSE;
+		cursor->buffer = tmp_buffer;
+
+		int *tmp_size = (int*) realloc(cursor->size0, sizeof(int) * cursor->ncols * newsize);
+		if (tmp_size == NULL) return kFALSE;
+		cursor->size0 = tmp_size;
+		
+		cursor->nalloc = newsize;
+	}
+	
+	// append new row to the cursor
+	for (j=0, i=index; j < cursor->ncols; j++, i++) {
+		rlen = len[j];
+		if (rlen < 0) rlen = 0;
+		
+		cursor->buffer[i] = (char *) malloc (rlen);
+		if ((cursor->buffer[i] == NULL) && (rlen > 0)) return kFALSE;
+		
+		if ((row[j]) && (rlen)) memcpy (cursor->buffer[i], row[j], rlen);
+		cursor->size0[i] = len[j];
+	}
+	
+	cursor->nrows++;
+	if (cursor->current_row == -1) cursor->current_row = 1;
+	
+	return kTRUE;
+}
+
+void cubesql_seterror(csqldb *db, int errcode, const char *errmsg) {
+	csql_seterror(db, errcode, errmsg);
+}
+
+// MARK: - Reserved -
+
+void csql_libinit (void) {
+	#ifdef WIN32
+	WSADATA wsaData;
+	#else
+	struct sigaction act;
+	#endif
+	static int lib_inited = kFALSE;
+	
+	if (lib_inited == kFALSE) {
+		lib_inited = kTRUE;
+		csql_static_randinit();
+		csql_gen_tabs();
+		csql_hosts_init();
+		
+		#ifdef WIN32
+		WSAStartup(MAKEWORD(2,2), &wsaData);
+		#else
+		// IGNORE SIGPIPE and SIGABORT
+		act.sa_handler = SIG_IGN;
+		sigemptyset(&act.sa_mask);
+		act.sa_flags = 0;
+		sigaction(SIGPIPE, &act, (struct sigaction *)NULL);
+		sigaction(SIGABRT, &act, (struct sigaction *)NULL);
+		#endif
+	}
+}
+
+csqldb *csql_dbinit (const char *host, int port, const char *username, const char *password, int timeout, int encryption, const char *ssl_certificate, const char *root_certificate, const char *ssl_certificate_password, const char *ssl_chiper_list) {
+	csqldb	*db = NULL;
+	
+	db = (csqldb *) malloc (sizeof(csqldb));
+	if (db == NULL) return NULL;
+	
+	// zero all the struct
+	bzero(db, sizeof(csqldb));
+	
+	// save db fields
+	db->port = port;
+	db->timeout = timeout;
+	db->encryption = encryption;
+	db->token = NULL;
+	db->useOldProtocol = kFALSE;
+	db->verifyPeer = kFALSE;
+	
+	snprintf((char *) db->host, sizeof(db->host), "%s", host);
+	snprintf((char *) db->username, sizeof(db->username),  "%s", username);
+	snprintf((char *) db->password, sizeof(db->password),  "%s", password);
+	
+	#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
+	if (encryption_is_ssl(encryption) == kTRUE) {
+		struct tls_config *tls_conf = NULL;
+		struct tls *tls_context = NULL;
+		int rc;
+
+		if (tls_init() < 0) {
+			fprintf(stderr, "Error while initializing TLS library.");
+			goto load_ssl_abort;
+		}
+
+		tls_conf = tls_config_new();
+		if (!tls_conf) {
+			fprintf(stderr, "Error while initializing a new TLS configuration.");
+			goto load_ssl_abort;
+		}
+
+		if (ssl_certificate_password) {
+			rc = tls_config_set_key_file(tls_conf, ssl_certificate_password);
+			if (rc < 0) {
+				fprintf(stderr, "Error in tls_config_set_key_file: %s.", tls_config_error(tls_conf));
+				goto load_ssl_abort;
+			}
+		}
+
+		#ifdef TLS_DEFAULT_CA_FILE
+		if (!root_certificate) root_certificate = TLS_DEFAULT_CA_FILE;
+		#endif
+
+		if (root_certificate) {
+			rc = tls_config_set_ca_file(tls_conf, root_certificate);
+			if (rc < 0) {
+				fprintf(stderr, "Error in tls_config_set_ca_file: %s.", tls_config_error(tls_conf));
+				goto load_ssl_abort;
+			}
+		} else {
+			// if no root certificate is provided then disable certificate and name verification
+			tls_config_insecure_noverifycert(tls_conf);
+			tls_config_insecure_noverifyname(tls_conf);
+		}
+
+		if (ssl_certificate) {
+			rc = tls_config_set_cert_file(tls_conf, ssl_certificate);
+			if (rc < 0) {
+				fprintf(stderr, "Error in tls_config_set_cert_file: %s.", tls_config_error(tls_conf));
+				goto load_ssl_abort;
+			}
+		}
+
+		// apply cipher list
+		if (ssl_chiper_list) {
+			rc = tls_config_set_ciphers(tls_conf, ssl_chiper_list);
+			if (rc < 0) {
+				// report error but not abort
+				fprintf(stderr, "Error in tls_config_set_ciphers: %s.", tls_config_error(tls_conf));
+			}
+		}
+
+		tls_context = tls_client();
+		if (!tls_context) {
+			fprintf(stderr, "Error while initializing a new TLS client.");
+			goto load_ssl_abort;
+		}
+
+		// apply configuration to context
+		rc = tls_configure(tls_context, tls_conf);
+		if (rc < 0) {
+			fprintf(stderr, "Error in tls_configure: %s.", tls_error(tls_context));
+			goto load_ssl_abort;
+		}
+
+		// save TLS context
+		db->tls_context = tls_context;
+		tls_config_free(tls_conf);
+		goto load_ssl_done;
+
+	load_ssl_abort:
+		if (tls_context) tls_free(tls_context);
+		if (tls_conf) tls_config_free(tls_conf);
+		free(db);
+		return NULL;
+
+	load_ssl_done: ;
+	}
+	#endif
+
+	return db;
+}
+
+void csql_dbfree (csqldb *db) {
+	if (db->primary) cubesql_replica_remove(db->primary, db);
+	if (db->router) csql_router_free(db);
+	if (db->cache) csql_cache_release(db->cache);
+	if (db->vmcache) csql_vm_free(db->vmcache);
+	if (db->inbuffer) free(db->inbuffer);
+	free(db);
+}
+
+void csql_socketclose (csqldb *db) {
+	if (db->sockfd <= 0) return;
+	
+	#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
+	if (db->tls_context) {
+		tls_close(db->tls_context);
+		tls_free(db->tls_context);
+		db->tls_context = NULL;
+	}
+	#endif
+	
+	bsd_shutdown(db->sockfd, SHUT_RDWR);
+	closesocket(db->sockfd);
 }
 
 int csql_socketconnect (csqldb *db) {
@@ -987,1634 +2777,5116 @@ int csql_socketconnect (csqldb *db) {
 	// so I must explicitly connect using IPv4 if I want to be able to connect with older cubeSQL versions
 	// https://stackoverflow.com/questions/16480729/connecting-ipv4-client-to-ipv6-server-connection-refused
 	
-	// ipv4/ipv6 specific variables
-	struct sockaddr_storage serveraddr;
-	struct addrinfo hints, *addr_list = NULL, *addr;
+	// ipv4/ipv6 specific variables
+	struct sockaddr_storage serveraddr;
+	struct addrinfo hints, *addr_list = NULL, *addr;
+	
+	// ipv6 code from https://www.ibm.com/support/knowledgecenter/ssw_ibm_i_72/rzab6/xip6client.htm
+	memset(&hints, 0x00, sizeof(hints));
+	hints.ai_flags    = AI_NUMERICSERV;
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	
+	// check if we were provided the address of the server using
+	// inet_pton() to convert the text form of the address to binary form.
+	// If it is numeric then we want to prevent getaddrinfo() from doing any name resolution.
+	int rc = inet_pton(AF_INET, (const char *) db->host, &serveraddr);
+	if (rc == 1) { /* valid IPv4 text address? */
+		hints.ai_family = AF_INET;
+		hints.ai_flags |= AI_NUMERICHOST;
+	}
+	else {
+		rc = inet_pton(AF_INET6, (const char *) db->host, &serveraddr);
+		if (rc == 1) { /* valid IPv6 text address? */
+			hints.ai_family = AF_INET6;
+			hints.ai_flags |= AI_NUMERICHOST;
+		}
+	}
+	
+	// get the address information for the server using getaddrinfo()
+	char port_string[256];
+	snprintf(port_string, sizeof(port_string), "%d", db->port);
+	rc = getaddrinfo((const char *) db->host, port_string, &hints, &addr_list);
+	if (rc != 0 || addr_list == NULL) {
+		csql_seterror(db, ERR_SOCKET, "Error while resolving getaddrinfo (host not found)");
+		return -1;
+	}
+	
+	const char *lastConnectionErrorMessage = NULL;
+	int sock_index = 0;
+	int sock_current = 0;
+	int sock_list[MAX_SOCK_LIST] = {0};
+	for (addr = addr_list; addr != NULL; addr = addr->ai_next, ++sock_index) {
+		if (sock_index >= MAX_SOCK_LIST) break;
+
+		// placeholder; successfully instantiated sockets will have > 0
+		sock_list[sock_index] = -1;
+		
+		// display protocol specific formatted address
+		/*
+		char szHost[256], szPort[16];
+		getnameinfo(addr->ai_addr, addr->ai_addrlen, szHost, sizeof(szHost), szPort, sizeof(szPort), NI_NUMERICHOST | NI_NUMERICSERV);
+		printf("getnameinfo(): host=%s, port=%s, family=%d\n", szHost, szPort, addr->ai_family);
+		*/
+		sock_current = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (sock_current < 0) continue;
+		
+		// set socket options
+		int len = 1;
+		bsd_setsockopt(sock_current, SOL_SOCKET, SO_KEEPALIVE, (const char *) &len, sizeof(len));
+		len = 1;
+		bsd_setsockopt(sock_current, IPPROTO_TCP, TCP_NODELAY, (const char *) &len, sizeof(len));
+		#ifdef SO_NOSIGPIPE
+		len = 1;
+		bsd_setsockopt(sock_current, SOL_SOCKET, SO_NOSIGPIPE, (const char *) &len, sizeof(len));
+		#endif
+		
+		// by default, an IPv6 socket created on Windows Vista and later only operates over the IPv6 protocol
+		// in order to make an IPv6 socket into a dual-stack socket, the setsockopt function must be called
+		if (addr->ai_family == AF_INET6) {
+			#ifdef WIN32
+			DWORD ipv6only = 0;
+			#else
+			int   ipv6only = 0;
+			#endif
+			bsd_setsockopt(sock_current, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&ipv6only, sizeof(ipv6only));
+		}
+		
+		// turn on non-blocking
+		unsigned long ioctl_blocking = 1;    /* ~0; //TRUE; */
+		ioctl(sock_current, FIONBIO, &ioctl_blocking);
+		
+		// initiate non-blocking connect ignoring return code
+		rc = connect(sock_current, addr->ai_addr, addr->ai_addrlen);
+		if (rc < 0) {
+			if (errno != 0 && errno != EINTR && errno != EAGAIN && errno != EINPROGRESS)
+			{
+				// obvious error (e.g. network not reachable) - don't use this socket
+				lastConnectionErrorMessage = strerror(errno);
+				/*
+				printf("connect error: %s (%i)\n", strerror(errno), errno);
+				*/
+				closesocket(sock_current);
+				continue;
+			}
+		}
+		
+		// add sock_current to internal list of trying to connect sockets
+		sock_list[sock_index] = sock_current;
+	}
+	
+	// free not more needed memory
+	freeaddrinfo(addr_list);
+	
+	// calculate the connection timeout and reset timers
+	int connect_timeout = (db->timeout > 0) ? db->timeout : CUBESQL_DEFAULT_TIMEOUT;
+	time_t start = time(NULL);
+	time_t now = start;
+	rc = 0;
+	
+	int sockfd = 0;
+	fd_set write_fds;
+	fd_set except_fds;
+	struct timeval tv;
+
+	while ((now - start) < connect_timeout) {
+		FD_ZERO(&write_fds);
+		FD_ZERO(&except_fds);
+		
+		tv.tv_sec = connect_timeout;
+		tv.tv_usec = 0;
+
+		for (int i=0; i<MAX_SOCK_LIST; ++i) {
+			if (sock_list[i] > 0) {
+				FD_SET(sock_list[i], &write_fds);
+				FD_SET(sock_list[i], &except_fds);
+
+				rc = bsd_select(sock_list[i] + 1, NULL, &write_fds, &except_fds, &tv);
+				
+				if (rc == 0) {
+					// timeout - we can't use this socket
+					closesocket(sock_list[i]);
+					sock_list[i] = -1;
+					continue;
+				}
+
+				if (rc < 0) {
+					if (errno == 0 || errno == EINTR || errno == EAGAIN || errno == EINPROGRESS) {
+						// socket is still connecting
+						continue;
+					}
+					
+					// socket bsd_select error - don't use this socket
+					/*
+					printf("socket bsd_select error: %s (%i)\n", strerror(errno), errno);
+					*/
+					lastConnectionErrorMessage = strerror(errno);
+					closesocket(sock_list[i]);
+					sock_list[i] = -1;
+					continue;
+				}
+			}
+		}
+		
+		// check for error
+		for (int i=0; i<MAX_SOCK_LIST; ++i) {
+			if (sock_list[i] > 0) {
+				if (FD_ISSET(sock_list[i], &except_fds)) {
+					int err = csql_socketerror(sock_list[i]);
+					if (err > 0) {
+						lastConnectionErrorMessage = strerror(err);
+					}
+
+					closesocket(sock_list[i]);
+					sock_list[i] = -1;
+				}
+			}
+		}
+		
+		// check which file descriptor is ready for writing (need to check for socket error also)
+		for (int i=0; i<MAX_SOCK_LIST; ++i) {
+			if (sock_list[i] > 0) {
+				if (FD_ISSET(sock_list[i], &write_fds)) {
+					int err = csql_socketerror(sock_list[i]);
+					if (err > 0) {
+						lastConnectionErrorMessage = strerror(err);
+
+						closesocket(sock_list[i]);
+						sock_list[i] = -1;
+					} else {
+						//use this socket - break loop (use first one, don't overwrite sockfd with next possible one)
+						sockfd = sock_list[i];
+						break;
+					}
+				}
+			}
+		}
+
+		// check if a valid descriptor has been found
+		if (sockfd != 0) break;
+
+		// are there still unclosed sockets trying to connect?
+		int remainingSocketCount = 0;
+		for (int i=0; i<MAX_SOCK_LIST; ++i) {
+			if (sock_list[i] > 0) {
+				remainingSocketCount++;
+			}
+		}
+
+		// no sockets remaining - break loop
+		if (remainingSocketCount < 1) break;
+		
+		// no socket ready yet
+		now = time(NULL);
+	}
+	
+	// cleanup: close unneeded, still opened sockets
+	for (int i=0; i<MAX_SOCK_LIST; ++i) {
+		if ((sock_list[i] > 0) && (sock_list[i] != sockfd)) closesocket(sock_list[i]);
+	}
+	
+	// bail if no socket has been connected because of an error
+	if ((sockfd <= 0) && lastConnectionErrorMessage && (strstr(lastConnectionErrorMessage, "Unknown") == NULL)) {
+		char errorConnectMessage[1024];
+
+		// set error message
+		snprintf(errorConnectMessage, sizeof(errorConnectMessage), "An error occurred while trying to connect: %s", lastConnectionErrorMessage);
+		csql_seterror(db, ERR_SOCKET, errorConnectMessage);
+		return -1;
+	}
+	
+	// bail if there was a timeout
+	if ((time(NULL) - start) >= connect_timeout) {
+		csql_seterror(db, ERR_SOCKET_TIMEOUT, "Connection timeout while trying to connect");
+		return -1;
+	}
+	
+	// bail if no socket has been connected (but we didn't catch an error message to be shown)
+	if (sockfd <= 0) {
+		// set error message
+		csql_seterror(db, ERR_SOCKET, "An error occurred while trying to connect");
+		return -1;
+	}
+
+	// turn off non-blocking
+	unsigned long ioctl_blocking2 = 0;
+	ioctl(sockfd, FIONBIO, &ioctl_blocking2);
+	
+	// socket is connected - now check for SSL
+	#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
+	if (encryption_is_ssl(db->encryption)) {
+		int rc = tls_connect_socket(db->tls_context, sockfd, db->host);
+		if (rc < 0) {
+			db->errcode = ERR_SSL;
+			snprintf(db->errmsg, sizeof(db->errmsg), "Error on tls_connect_socket: %s", tls_error(db->tls_context));
+			closesocket(sockfd);
+			return -1;
+		}
+		db->encryption -= CUBESQL_ENCRYPTION_SSL;
+	}
+	#endif
+	
+	return sockfd;
+}
+
+void csql_trace (csqldb *db, const char *sql) {
+	if ((db->trace) && (csql_untraced == 0)) db->trace(sql, db->data);
+}
+
+int csql_vm_send (csqldb *db, const char *sql) {
+	// prepares sql as the single VM of the connection on the server
+	int closing = db->vmclose;
+	
+	// clear errors first
+	cubesql_clear_errors(db);
+	
+	// check for trace function
+	csql_trace(db, sql);
+	
+	// the previous VM is replaced on the server
+	db->vmcurrent = NULL;
+	db->vmclose = kFALSE;
+	
+	// a pending close of a cached VM is written right before the statement and both replies are read afterwards
+	if (closing) {
+		csql_initrequest(db, 0, 0, kVM_CLOSE, kNO_SELECTOR);
+		if (csql_netwrite(db, NULL, 0, NULL, 0) != CUBESQL_NOERR) return CUBESQL_ERR;
+	}
+	
+	// send sql statement
+	if (csql_send_statement (db, kVM_PREPARE, sql, kFALSE, kFALSE) != CUBESQL_NOERR) return CUBESQL_ERR;
+	
+	// read replay
+	if ((closing) && (csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT) != CUBESQL_NOERR)) {
+		if (csql_isneterror(db->errcode)) return CUBESQL_ERR;
+		cubesql_clear_errors(db);
+	}
+	return csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT);
+}
+
+csqlvm *csql_vm_prepare (csqldb *db, const char *sql) {
+	csqlvm	*vm = NULL;
+	
+	if (csql_vm_send(db, sql) != CUBESQL_NOERR) return NULL;
+	
+	// allocate space for csqlvm
+	vm = (csqlvm *) malloc (sizeof(csqlvm));
+	if (vm == NULL) goto abort;
+	bzero(vm, sizeof(csqlvm));
+	
+	// the statement is kept to prepare it again if another VM replaces it on the server
+	vm->sql = strdup(sql);
+	if (vm->sql == NULL) goto abort;
+	
+	vm->db = db;
+	vm->vmindex = 0;
+	db->vmcurrent = vm;
+	return vm;
+	
+abort:
+	if (vm) free(vm);
+	db->vmclose = kTRUE;
+	csql_seterror(db, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate the prepared statement");
+	return NULL;
+}
+
+int csql_vm_current (csqlvm *vm) {
+	// requests carry no VM identifier, so a VM replaced on the server by another prepare (or closed) is prepared again
+	// before its parameters are sent
+	csqldb *db = vm->db;
+	
+	if (db->vmcurrent == vm) return CUBESQL_NOERR;
+	if (csql_vm_send(db, vm->sql) != CUBESQL_NOERR) return CUBESQL_ERR;
+	db->vmcurrent = vm;
+	vm->maxindex = 0;
+	return CUBESQL_NOERR;
+}
+
+const char *csql_vm_sql (csqlvm *vm) {
+	return vm->sql;
+}
+
+void csql_vm_free (csqlvm *vm) {
+	if ((vm->db) && (vm->db->vmcurrent == vm)) vm->db->vmcurrent = NULL;
+	csql_bind_clear(vm);
+	if (vm->binds) free(vm->binds);
+	if (vm->sql) free(vm->sql);
+	free(vm);
+}
+
+int csql_bind_value (csqlvm *vm, int index, int bindtype, char *value, int len) {
+	// the value is copied and sent later together with the other parameters (a second bind of index replaces the first one)
+	csqlbind	*b;
+	char		*copy = NULL;
+	
+	if ((bindtype != CUBESQL_BIND_NULL) && (bindtype != CUBESQL_BIND_ZEROBLOB)) {
+		if (!value) {value = ""; len = 0;}
+		if (len == -1) len = (int)strlen(value);
+		copy = (char *) malloc((len > 0) ? len : 1);
+		if (copy == NULL) goto abort_memory;
+		if (len > 0) memcpy(copy, value, len);
+	} else if (bindtype == CUBESQL_BIND_NULL) len = 0;
+	
+	b = csql_bind_slot(vm, index);
+	if (b == NULL) goto abort_memory;
+	
+	b->type = bindtype;
+	b->len = len;
+	b->value = copy;
+	return CUBESQL_NOERR;
+	
+abort_memory:
+	if (copy) free(copy);
+	csql_seterror(vm->db, CUBESQL_MEMORY_ERROR, "Not enough memory to bind parameter");
+	return CUBESQL_MEMORY_ERROR;
+}
+
+csqlbind *csql_bind_slot (csqlvm *vm, int index) {
+	// buffered parameter for index, a previous value is released (NULL if out of memory)
+	csqlbind	*b = NULL, *binds;
+	int			i, newsize;
+	
+	for (i=0; i<vm->nbinds; i++) {
+		if (vm->binds[i].index == index) {b = &vm->binds[i]; break;}
+	}
+	
+	if (b == NULL) {
+		if (vm->nbinds >= vm->nalloc) {
+			newsize = (vm->nalloc) ? vm->nalloc * 2 : 8;
+			binds = (csqlbind *) realloc(vm->binds, sizeof(csqlbind) * newsize);
+			if (binds == NULL) return NULL;
+			vm->binds = binds;
+			vm->nalloc = newsize;
+		}
+		b = &vm->binds[vm->nbinds++];
+	} else csql_bind_release(b);
+	
+	bzero(b, sizeof(csqlbind));
+	b->index = index;
+	b->fd = -1;
+	return b;
+}
+
+void csql_bind_release (csqlbind *b) {
+	if (b->value) free(b->value);
+	if (b->fd >= 0) csql_fdclose(b->fd);
+	b->value = NULL;
+	b->fd = -1;
+}
+
+int csql_bind_send (csqldb *db, csqlbind *b) {
+	int field_size[1];
+	int nfields = 0, nsizedim = 0, packet_size = 0, datasize = 0;
+	
+	if ((b->value) || (b->reader) || (b->fd >= 0)) {
+		nfields = 1;
+		nsizedim = sizeof(int) * nfields;
+		datasize = b->len;
+		packet_size = datasize + nsizedim;
+		field_size[0] = htonl(datasize);
+	}
+	
+	// prepare BIND command
+	csql_initrequest(db, packet_size, nfields, kVM_BIND, kNO_SELECTOR);
+	db->request.flag3 = (unsigned char) b->type;
+	db->request.reserved1 = htons(b->index);
+	if (b->type == CUBESQL_BIND_ZEROBLOB) db->request.expandedSize = htonl(b->len);
+	
+	// send request (reply is read later)
+	if ((b->reader) || (b->fd >= 0)) return csql_bind_stream(db, (char *) field_size, nsizedim, b);
+	return csql_netwrite(db, (char *) field_size, nsizedim, b->value, datasize);
+}
+
+int csql_bind_flush (csqlvm *vm) {
+	// all the BIND requests are written back-to-back and then all the replies are read, so the cost
+	// is a single round trip instead of one per parameter (the first failure is reported with its index)
+	csqldb	*db = vm->db;
+	int		i, j, sent, errcode = CUBESQL_NOERR;
+	char	errmsg[sizeof(db->errmsg) + 64];
+	
+	vm->errindex = 0;
+	
+	// the server keeps the parameters of the previous execute, a reused cached VM resets to NULL the ones not bound again
+	if (vm->cached) {
+		for (i=1; i<=vm->maxindex; i++) {
+			for (j=0; j<vm->nbinds; j++) if (vm->binds[j].index == i) break;
+			if ((j == vm->nbinds) && (csql_bind_value(vm, i, CUBESQL_BIND_NULL, NULL, 0) != CUBESQL_NOERR)) {
+				csql_bind_clear(vm);
+				return CUBESQL_ERR;
+			}
+		}
+	}
+	if (vm->nbinds == 0) return CUBESQL_NOERR;
+	
+	for (i=0; i<vm->nbinds; i++) {
+		if (vm->binds[i].index > vm->maxindex) vm->maxindex = vm->binds[i].index;
+	}
+	
+	for (sent=0; sent<vm->nbinds; sent++) {
+		if (csql_bind_send(db, &vm->binds[sent]) != CUBESQL_NOERR) break;
+	}
+	
+	for (i=0; i<sent; i++) {
+		if (csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT) == CUBESQL_NOERR) continue;
+		if (vm->errindex == 0) {
+			vm->errindex = vm->binds[i].index;
+			errcode = db->errcode;
+			snprintf(errmsg, sizeof(errmsg), "Bind of parameter %d failed: %s", vm->binds[i].index, db->errmsg);
+		}
+		if (csql_isneterror(db->errcode)) break;
+	}
+	if ((sent < vm->nbinds) && (vm->errindex == 0)) {
+		vm->errindex = vm->binds[sent].index;
+		errcode = db->errcode;
+		snprintf(errmsg, sizeof(errmsg), "Bind of parameter %d failed: %s", vm->binds[sent].index, db->errmsg);
+	}
+	
+	csql_bind_clear(vm);
+	if (vm->errindex == 0) return CUBESQL_NOERR;
+	
+	csql_seterror(db, errcode, errmsg);
+	return CUBESQL_ERR;
+}
+
+void csql_bind_clear (csqlvm *vm) {
+	int i;
+	
+	for (i=0; i<vm->nbinds; i++) {
+		csql_bind_release(&vm->binds[i]);
+	}
+	vm->nbinds = 0;
+}
+
+int csql_bind_read (csqlbind *b, char *buffer, int64 offset, int len) {
+	// fills buffer with len bytes of the streamed value
+	int n, done = 0;
+	
+	while (done < len) {
+		if (b->fd >= 0) {
+			#ifdef WIN32
+			if (_lseeki64(b->fd, offset + done, SEEK_SET) < 0) return kFALSE;
+			n = _read(b->fd, buffer + done, (unsigned int)(len - done));
+			#else
+			n = (int)pread(b->fd, buffer + done, (size_t)(len - done), (off_t)(offset + done));
+			if ((n < 0) && (errno == EINTR)) continue;
+			#endif
+		} else n = b->reader(b->ctx, buffer + done, offset + done, len - done);
+		if (n <= 0) return kFALSE;
+		done += n;
+	}
+	return kTRUE;
+}
+
+int csql_bind_stream (csqldb *db, char *size_array, int nsize_array, csqlbind *b) {
+	// same bytes as csql_netwrite but the value is read and written kSTREAM_PIECE bytes at a time, so memory use
+	// does not depend on its size; on encrypted channels the CBC chain continues from the last block of the previous
+	// piece and the final piece (at least BLOCK_LEN bytes unless the whole value is shorter) carries the stolen tail
+	char	rand1[kRANDPOOLSIZE], *buffer;
+	int		len;
+	int64	offset = 0, remaining;
+	
+	buffer = (char *) malloc(kSTREAM_PIECE + BLOCK_LEN);
+	if (buffer == NULL) {
+		csql_seterror(db, CUBESQL_MEMORY_ERROR, "Unable to allocate the buffer of a streamed parameter");
+		return CUBESQL_ERR;
+	}
+	
+	// send header request and size array
+	if (csql_socketwrite(db, (char *)&db->request, kHEADER_SIZE) != CUBESQL_NOERR) goto abort;
+	if (csql_socketwrite(db, size_array, nsize_array) != CUBESQL_NOERR) goto abort;
+	if (db->encryption != CUBESQL_ENCRYPTION_NONE) csql_rand_fill(rand1);
+	
+	while (offset < b->len) {
+		remaining = b->len - offset;
+		len = (remaining > kSTREAM_PIECE + BLOCK_LEN) ? kSTREAM_PIECE : (int)remaining;
+		
+		// the packet size has already been sent, the connection cannot be recovered if the source fails
+		if (csql_bind_read(b, buffer, offset, len) == kFALSE) {
+			csql_socketclose(db);
+			db->sockfd = 0;
+			csql_seterror(db, ERR_SOCKET, "Unable to read a streamed parameter, the connection has been closed");
+			goto abort;
+		}
+		
+		if (db->encryption != CUBESQL_ENCRYPTION_NONE) {
+			// the random pool is the IV of the first piece (modified by the encryption only when it is a single short piece)
+			encrypt_buffer(buffer, len, rand1, db->encryptkey);
+			if ((offset == 0) && (csql_socketwrite(db, rand1, BLOCK_LEN) != CUBESQL_NOERR)) goto abort;
+			if (offset + len < b->len) memcpy(rand1, buffer + len - BLOCK_LEN, BLOCK_LEN);
+		}
+		
+		if (csql_socketwrite(db, buffer, len) != CUBESQL_NOERR) goto abort;
+		offset += len;
+	}
+	
+	free(buffer);
+	return CUBESQL_NOERR;
+	
+abort:
+	free(buffer);
+	return CUBESQL_ERR;
+}
+
+int csql_batch_sendrow (csqlvm *vm, int ncols, char **values, int *sizes, int *types, int changes) {
+	// writes the binds and the execute of a single batch row (replies are read later)
+	csqldb		*db = vm->db;
+	csqlbind	b;
+	int			i;
+	
+	bzero(&b, sizeof(csqlbind));
+	b.fd = -1;
+	for (i=0; i<ncols; i++) {
+		b.index = i + 1;
+		b.type = (types) ? types[i] : CUBESQL_BIND_TEXT;
+		b.value = values[i];
+		b.len = (sizes) ? sizes[i] : -1;
+		
+		if ((b.value == NULL) && (b.type != CUBESQL_BIND_ZEROBLOB)) b.type = CUBESQL_BIND_NULL;
+		if (b.type == CUBESQL_BIND_NULL) {b.value = NULL; b.len = 0;}
+		else if (b.type == CUBESQL_BIND_ZEROBLOB) b.value = NULL;
+		else if (b.len < 0) b.len = (int)strlen(b.value);
+		
+		if (csql_bind_send(db, &b) != CUBESQL_NOERR) return CUBESQL_ERR;
+	}
+	
+	csql_initrequest(db, 0, 0, kVM_EXECUTE, kNO_SELECTOR);
+	if (csql_netwrite(db, NULL, 0, NULL, 0) != CUBESQL_NOERR) return CUBESQL_ERR;
+	
+	if (!changes) return CUBESQL_NOERR;
+	return csql_send_statement(db, kCOMMAND_SELECT, "SELECT changes();", kFALSE, kFALSE);
+}
+
+int csql_bindexecute(csqldb *db, const char *sql, char **colvalue, int *colsize, int *coltype, int nvalues) {
+	// column chunks are written back-to-back and their acks drained afterwards, so a row costs two round trips
+	// instead of one per column; at most kBIND_WINDOW bytes and kBATCH_REPLIES acks are in flight at any time
+	int		i, acked = 0, inflight = 0, errcode = CUBESQL_NOERR;
+	char	errmsg[sizeof(db->errmsg)];
+	
+	// check for trace function
+	csql_trace(db, sql);
+	
+	// send sql statement first
+	if (csql_send_statement(db, kCOMMAND_CHUNK_BIND, sql, kFALSE, kFALSE) != CUBESQL_NOERR) return CUBESQL_ERR;
+	
+	// read and check header first
+	if (csql_socketread(db, kTRUE, NO_TIMEOUT) != CUBESQL_NOERR) return CUBESQL_ERR;
+	if (csql_checkheader(db, -1, -1, NULL) != CUBESQL_NOERR) return CUBESQL_ERR;
+	
+	// send individual fields
+	for (i=0; (i<nvalues) && (errcode == CUBESQL_NOERR); i++) {
+		// fix to null values
+		if ((coltype[i] == CUBESQL_BIND_NULL) || (coltype[i] == CUBESQL_BIND_TEXT && colvalue[i] == NULL)) {
+			colvalue[i] = "";
+			colsize[i] = 0;
+		}
+		
+		// includes the terminal 0
+		if (coltype[i] != CUBESQL_BIND_BLOB) {
+			colsize[i]++;
+		}
+		
+		// flow control: the oldest acks are read before the window is exceeded
+		while ((acked < i) && ((i - acked >= kBATCH_REPLIES) || (inflight + colsize[i] > kBIND_WINDOW))) {
+			if (csql_bind_readack(db, &errcode, errmsg) != CUBESQL_NOERR) return CUBESQL_ERR;
+			inflight -= colsize[acked++];
+		}
+		if (errcode != CUBESQL_NOERR) break;
+		
+		if (csql_sendchunk(db, colvalue[i], colsize[i], coltype[i], kTRUE) == CUBESQL_ERR)
+			return CUBESQL_ERR;
+		inflight += colsize[i];
+	}
+	
+	// every chunk that has been sent has an ack, also when a previous one failed
+	for (; acked<i; acked++) {
+		if (csql_bind_readack(db, &errcode, errmsg) != CUBESQL_NOERR) return CUBESQL_ERR;
+	}
+	if (errcode != CUBESQL_NOERR) {
+		csql_seterror(db, errcode, errmsg);
+		return CUBESQL_ERR;
+	}
+	
+	// send BIND FINALIZE command
+	return csql_ack(db, kBIND_FINALIZE);
+}
+
+int csql_bind_readack (csqldb *db, int *errcode, char *errmsg) {
+	// reads the ack of a bind chunk, the first failure is saved in errcode/errmsg (only network errors are returned)
+	if (csql_socketread(db, kTRUE, NO_TIMEOUT) != CUBESQL_NOERR) return CUBESQL_ERR;
+	if (csql_checkheader(db, -1, -1, NULL) == CUBESQL_NOERR) return CUBESQL_NOERR;
+	if (csql_isneterror(db->errcode)) return CUBESQL_ERR;
+	
+	if (*errcode == CUBESQL_NOERR) {
+		*errcode = db->errcode;
+		memcpy(errmsg, db->errmsg, sizeof(db->errmsg));
+	}
+	return CUBESQL_NOERR;
+}
+
+int csql_send_statement (csqldb *db, int command_type, const char *sql, int is_partial, int server_side) {
+	int field_size[1];
+	int nfields, nsizedim, packet_size, datasize = 0;
+	
+	nfields = 1;
+	nsizedim = sizeof(int) * nfields;
+	datasize = (int)strlen(sql) + 1;
+	
+	// build packet
+	packet_size = datasize + nsizedim;
+	csql_initrequest(db, packet_size, nfields, command_type, kNO_SELECTOR);
+	field_size[0] = htonl(datasize);
+	
+	if (command_type == kCOMMAND_SELECT) {
+		if (server_side == kTRUE) SETBIT(db->request.flag1, CLIENT_REQUEST_SERVER_SIDE);
+	}
+	else if (is_partial == kTRUE)
+		SETBIT(db->request.flag1, CLIENT_PARTIAL_PACKET);
+	
+	return csql_netwrite(db, (char *) field_size, nsizedim, (char *) sql, datasize);
+}
+
+csqlc *csql_read_cursor (csqldb *db, csqlc *existing_c) {
+	return csql_read_cursor_stream(db, existing_c, NULL, NULL);
+}
+
+csqlc *csql_read_cursor_stream (csqldb *db, csqlc *existing_c, csql_chunk_callback callback, void *arg) {
+	// when a callback is set each received buffer is passed to it and then released (except the first one which owns names and types)
+	csqlc	*c = NULL;
+	csqlchunk chunk;
+	int		index, gdone = kFALSE, is_partial = kFALSE, stream_failed = kFALSE;
+	int		has_tables, has_rowid, nfields, server_rowcount, server_colcount, cursor_colcount;
+	char	*buffer;
+	int		i, nrows, ncols, count, data_seek = 0, end_chunk;
+	int		*server_types, *server_sizes, *server_sum;
+	char	*server_names, *server_data, *server_tables;
+	
+	// allocate basic cursor struct
+	if (existing_c == NULL) {
+		index = 0;
+		c = csql_cursor_alloc(db);
+	}
+	else {
+		index = 1;
+		c = existing_c;
+	}
+			
+	if (c == NULL) {
+		csql_seterror(db, CUBESQL_MEMORY_ERROR, "Unable to allocate cursor struct");
+		return NULL;
+	}
+
+	// loop to receive cursor
+	do {
+		if (csql_netread (db, -1, -1, kFALSE, &end_chunk, NO_TIMEOUT) != CUBESQL_NOERR) goto abort;
+		if (end_chunk == kTRUE) {
+			
+			gdone = kTRUE;
+			if (c->server_side) c->eof = kTRUE;
+			//else if (db->client_version == k2007PROTOCOL) csql_ack(db, kCHUNK_OK);
+			continue;
+		}
+		
+		// decode reply
+		has_tables = kFALSE;
+		has_rowid = kFALSE;
+		if (TESTBIT(db->reply.flag1, SERVER_HAS_TABLE_NAME)) has_tables = kTRUE;
+		if (TESTBIT(db->reply.flag1, SERVER_PARTIAL_PACKET)) is_partial = kTRUE;
+		if (TESTBIT(db->reply.flag1, SERVER_HAS_ROWID_COLUMN)) has_rowid = kTRUE;
+		if (TESTBIT(db->reply.flag1, SERVER_SERVER_SIDE)) c->server_side = kTRUE;
+		if (c->server_side) is_partial = kFALSE;
+		
+		nfields = ntohl(db->reply.numFields);
+		server_rowcount = ntohl(db->reply.rows);
+		server_colcount = ntohl(db->reply.cols);
+		cursor_colcount = (has_rowid ? server_colcount-1 : server_colcount);
+		nrows = server_rowcount;
+		ncols = cursor_colcount;
+		
+		// adjust pointers
+		buffer = db->inbuffer;
+		if (c->server_side == kFALSE)
+			server_sum = (int *) malloc(server_rowcount * server_colcount * sizeof(int));
+		else
+		{
+			if (c->psum == NULL)
+				server_sum = (int *) malloc(server_rowcount * server_colcount * sizeof(int));
+			else
+				server_sum = c->psum;
+		}
+		if (server_sum == NULL) goto abort_memory;
+		
+		// set buffers
+		server_tables = NULL;
+		if (index == 0) {
+			char	*temp;
+			int		len;
+			
+			if (c->server_side) c->p0 = buffer;
+			server_types = (int *) buffer;
+			server_sizes = (int *) (buffer + (sizeof(int) * server_colcount));
+			server_names = (char *) server_sizes + (server_rowcount * server_colcount * sizeof(int));
+			server_data = server_names;
+			temp = server_names;
+			for (i=0; i < server_colcount; i++) {
+				len = (int)strlen(temp) + 1;
+				data_seek += len;
+				temp += len;
+				server_types[i] = ntohl(server_types[i]);
+			}
+			
+			if (has_tables) {
+				server_tables = server_data + data_seek;
+				temp = server_tables;
+				for (i=0; i < server_colcount; i++) {
+					len = (int)strlen(temp) + 1;
+					data_seek += len;
+					temp += len;
+				}
+			}
+			server_data += data_seek;
+			c->data_seek = data_seek;
+		} else {
+			server_types = NULL;
+			server_names = NULL;
+			server_tables = NULL;
+			server_sizes = (int *) buffer;
+			server_data = (char *) server_sizes + (server_rowcount * server_colcount * sizeof(int));
+		}
+		
+		// adjust endianess of the size buffer and compute the sum buffer
+		count = server_colcount * server_rowcount;
+		for (i=0; i < count; i++) {
+			server_sizes[i] = ntohl(server_sizes[i]);
+			if (server_sizes[i] == -1) {
+				// special NULL case
+				if (i == 0) server_sum[i] = 0;
+				else server_sum[i] = server_sum[i-1];
+			} else {
+				if (i == 0) server_sum[i] = server_sizes[i];
+				else server_sum[i] = server_sizes[i] + server_sum[i-1];
+			}
+		}
+		
+		if ((is_partial) && (c->nbuffer >= c->nalloc)) {
+			if (csql_cursor_reallocate (c) == kFALSE) { free(server_sum); goto abort_memory; }
+		}
+		
+		// adjust others counters/pointers
+		if (index == 0) {
+			c->types = server_types;
+			c->size = server_sizes;
+			c->names = server_names;
+			c->tables = server_tables;
+			c->data = server_data;
+			c->psum = server_sum;
+			
+			// to speedup cubesql_cursor_value in the in_chunk case
+			c->data0 = server_data;
+			c->size0 = server_sizes;
+		}
+		
+		// adjust pointers for server side cursors
+		if ((c->server_side) && (index > 0)) {
+			c->index++;
+			if ((c->index > 1) && (c->p0 != (char *)c->size)) free(c->size);
+			c->types = (int *) c->p0;
+			c->names = (char *) (c->p0 + (sizeof(int) * server_colcount));
+			c->size = server_sizes;
+			c->data = server_data;
+			c->psum = server_sum;
+			
+			// to speedup csqlcursor_value in the in_chunk case
+			c->data0 = c->data;
+			c->size0 = c->size;
+		}
+		 
+		//if (db->protocol == k2009PROTOCOL) c->cursor_id = ntohs(db->reply.index);
+		c->has_rowid = has_rowid;
+		c->nrows += nrows;
+		c->ncols = ncols;
+		
+		if (is_partial == kFALSE) {
+			c->p = buffer;
+			c->psum = server_sum;
+		} else {
+			c->buffer[c->nbuffer] = buffer;
+			c->rowsum[c->nbuffer] = server_sum;
+			c->rowcount[c->nbuffer] = c->nrows;
+			c->nbuffer++;
+		}
+		
+		// reset inbuffer
+		db->inbuffer = NULL;
+		db->insize = 0;
+		
+		// streaming mode (once the callback fails the remaining buffers are just drained)
+		if (callback) {
+			int nindex = (c->nbuffer) ? c->nbuffer-1 : 0;
+			if ((stream_failed == kFALSE) && (csql_cursor_chunk(c, nindex, &chunk) == kTRUE) && (callback(c, &chunk, arg) == kFALSE)) stream_failed = kTRUE;
+			if (nindex > 0) {
+				free(c->buffer[nindex]);
+				free(c->rowsum[nindex]);
+				c->buffer[nindex] = NULL;
+				c->rowsum[nindex] = NULL;
+			}
+		}
+		
+		// send ACK only in case of chunk cursor
+		if ((is_partial == kTRUE) && (c->server_side == kFALSE) && (db->sched)) csql_sched_throttle(db);
+		if ((is_partial == kTRUE) && (c->server_side == kFALSE)) csql_ack(db, kCHUNK_OK);
+		else gdone = kTRUE;
+		index++;
+	}
+	while (gdone != kTRUE);
+	return c;
+
+abort_memory:
+	csql_seterror(db, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate buffer required to build the cursor");
+	
+abort:
+	if ((c) && (existing_c == NULL)) cubesql_cursor_free(c);
+	return NULL;
+}
+
+int csql_connect_encrypted (csqldb *db) {
+	unsigned char	rand1[kRANDPOOLSIZE], rand2[kRANDPOOLSIZE], rand3[kRANDPOOLSIZE];
+	unsigned char	hash1[SHA1_DIGEST_SIZE], hash2[SHA1_DIGEST_SIZE], hash3[SHA1_DIGEST_SIZE];
+	char			buffer1[SHA1_DIGEST_SIZE+kRANDPOOLSIZE];
+	char			hash[SHA1_DIGEST_SIZE*2+2];
+	char			*p = NULL;
+	int				len, nfields, nsizedim, datasize0, packet_size, field_size[4];
+	int				encryption = db->encryption;
+	int				len2 = 0, is_token = kFALSE;
+	char			*token = NULL, *enc_token = NULL;
+	csql_aes_encrypt_ctx ctx[1];
+	csql_aes_decrypt_ctx ctxd[1];
+	
+	// reset encryption
+	// because session key hasn't yet been computed
+	db->encryption = CUBESQL_ENCRYPTION_NONE;
+	
+	// check if its a token connect
+	token = cubesql_gettoken(db);
+	if (token != NULL) is_token = kTRUE;
+	
+	// ENCRYPT CONNECT PHASE 1
+	// CLIENT SENDS HASH(USERNAME,X)
+	// AND AESCBC(X;H(X),H(H(P))) WHERE X is a 20-byte random number
+	
+	// Generate the 20-byte random number X
+	csql_rand_fill((char *)rand1);
+	
+	// Compute H(X)
+	hash_field ((unsigned char*) hash1, (const char *)rand1, kRANDPOOLSIZE, 1);
+	
+	// Compute H(H(P))
+	hash_field ((unsigned char*) hash2, (const char *)db->password, (int)strlen(db->password), 2);
+	
+	// Prepare the 128 bit encryption key
+	csql_aes_encrypt_key ((unsigned char*) hash2, 16, ctx);
+	
+	// Prepare X;H(X)
+	memcpy (buffer1, rand1, kRANDPOOLSIZE);
+	memcpy (buffer1+kRANDPOOLSIZE, hash1, SHA1_DIGEST_SIZE);
+	
+	// Generate AESCBC(X;H(X),H(H(P)))
+	csql_rand_fill((char *)rand2);
+	len = encrypt_buffer (buffer1, SHA1_DIGEST_SIZE+kRANDPOOLSIZE, (char *)rand2, ctx);
+	
+	// PHASE 1: SEND DATA
+	
+	// build packet
+	nfields = 2;
+	nsizedim = sizeof(int) * nfields;
+	
+	if (db->useOldProtocol == kFALSE) {
+		hex_hash_field2(hash, db->username, rand2);
+		datasize0 = (int)strlen(hash) + 1;
+		p = (char *)hash;
+	} else {
+		p = (char *)db->username;
+		datasize0 = (int)strlen(db->username) + 1;
+	}
+	
+	packet_size = datasize0 + len + nsizedim;
+	csql_initrequest(db, packet_size, nfields, kCOMMAND_CONNECT, (is_token) ? kENCRYPT_TOKEN_CONNECT1 : kENCRYPT_CONNECT_PHASE1);
+	db->request.encryptedPacket = encryption;
+	field_size[0] = htonl(datasize0);
+	field_size[1] = htonl(len);
+	
+	// send header request
+	if (csql_socketwrite(db, (char *)&db->request, kHEADER_SIZE) != CUBESQL_NOERR) goto abort_connect;
+	
+	// send size array
+	if (csql_socketwrite(db, (char *)field_size, nsizedim) != CUBESQL_NOERR) goto abort_connect;
+	
+	// send username
+	if (csql_socketwrite(db, (char *)p, datasize0) != CUBESQL_NOERR) goto abort_connect;
+	
+	// send rand2
+	if (csql_socketwrite(db, (char *)rand2, BLOCK_LEN) != CUBESQL_NOERR) goto abort_connect;
+	
+	// send encrypted data
+	if (csql_socketwrite(db, (char *)buffer1, SHA1_DIGEST_SIZE+kRANDPOOLSIZE) != CUBESQL_NOERR) goto abort_connect;
+	
+	// ENCRYPT CONNECT PHASE 1.5
+	// CLIENT RECEIVES A 20B RANDOM NUMBER FROM THE SERVER:
+	// AESCBC(Y;H(Y),H(H(P))) WHERE Y is a 20-byte random number
+	
+	// read reply (encrypted random pool)
+	if (csql_netread(db, BLOCK_LEN + kRANDPOOLSIZE + SHA1_DIGEST_SIZE, 1, kFALSE, NULL, CONNECT_TIMEOUT) != CUBESQL_NOERR) goto abort_connect;
+	
+	// Decrypt message using H(H(P))
+	// Prepare the 128 bit decryption key
+	csql_aes_decrypt_key ((unsigned char*) hash2, 16, ctxd);
+	decrypt_buffer(db->inbuffer, db->insize, ctxd);
+	
+	// Now inbuffer is Y;H(Y)
+	// Generate H(Y) from Y and compares it to the H(Y) sent by the server 
+	hash_field (hash3, (const char *)db->inbuffer, kRANDPOOLSIZE, 1);
+	if (memcmp((const void *)hash3, (const void *) (db->inbuffer+kRANDPOOLSIZE), SHA1_DIGEST_SIZE) != 0) goto abort_connect;
+	
+	// Generate SessionKey by both client and server
+	generate_session_key(db, encryption, (char *)hash2, (char *)rand1, (char *)db->inbuffer);
+	
+	// ENCRYPT CONNECT PHASE 2
+	// CLIENT SENDS AESCBC(H(P),S) where S is the session_key
+	
+	// Compute H(P)
+	hash_field ((unsigned char*) hash2, (const char *)db->password, (int)strlen(db->password), 1);
+	csql_rand_fill ((char *)rand2);
+	len = encrypt_buffer ((char *)hash2, SHA1_DIGEST_SIZE, (char *)rand2, db->encryptkey);
+	
+	if (is_token) {
+		int tlen = 0;
+		csql_rand_fill ((char *)rand3);
+		tlen = (int)strlen(token)+1;
+		enc_token = (char *) malloc(tlen + kRANDPOOLSIZE);
+		if (enc_token == NULL) goto abort_connect;
+		enc_token[0] = 0;
+		strcpy(enc_token, token);
+		len2 = encrypt_buffer ((char *)enc_token, tlen, (char *)rand3, db->encryptkey);
+	}
+	
+	// PHASE 1: SEND DATA
+	nfields = 1;
+	if (is_token) nfields++;
+	nsizedim = sizeof(int) * nfields;
+	
+	// build packet
+	packet_size = len + nsizedim;
+	if (is_token) packet_size += len2;
+	csql_initrequest(db, packet_size, nfields, kCOMMAND_CONNECT, (is_token) ? kENCRYPT_TOKEN_CONNECT2 : kENCRYPT_CONNECT_PHASE2);
+	field_size[0] = htonl(len);
+	if (is_token) field_size[1] = htonl(len2);
+	
+	// send header request
+	if (csql_socketwrite(db, (char *)&db->request, kHEADER_SIZE) != CUBESQL_NOERR) goto abort_connect;
+	
+	// send size array
+	if (csql_socketwrite(db, (char *)field_size, nsizedim) != CUBESQL_NOERR) goto abort_connect;
+	
+	// send rand2
+	if (csql_socketwrite(db, (char *)rand2, BLOCK_LEN) != CUBESQL_NOERR) goto abort_connect;
+	
+	// send hash2
+	if (csql_socketwrite(db, (char *)hash2, SHA1_DIGEST_SIZE) != CUBESQL_NOERR) goto abort_connect;
+	
+	// send token
+	if (is_token) {
+		if (csql_socketwrite(db, (char *)rand3, BLOCK_LEN) != CUBESQL_NOERR) goto abort_connect;
+		if (csql_socketwrite(db, (char *)enc_token, (int)strlen(token)+1) != CUBESQL_NOERR) goto abort_connect;
+	}
+	
+	// read header reply and sanity check it
+	if (csql_netread(db, 0, 0, kFALSE, NULL, CONNECT_TIMEOUT) != CUBESQL_NOERR) goto abort_connect;
+	
+	if ((is_token) && (enc_token)) free(enc_token);
+	db->encryption = encryption;
+	return CUBESQL_NOERR;
+	
+abort_connect:
+	if ((is_token) && (enc_token)) free(enc_token);
+	db->encryption = encryption;
+	return CUBESQL_ERR;
+}
+
+int csql_connect (csqldb *db, int encryption) {
+	int		field_size[2];
+	int		is_token = kFALSE;
+	int		nfields, nsizedim, packet_size, datasize = 0;
+	char	hval[SHA1_DIGEST_SIZE];
+	char	hash[SHA1_DIGEST_SIZE*2+2];
+	char	*token = NULL, *p = NULL;
+	
+	db->sockfd = csql_socketconnect(db);
+	if (db->sockfd <= 0) goto abort_connect;
+	
+	if (encryption_is_ssl(encryption)) encryption -= CUBESQL_ENCRYPTION_SSL;
+	if (encryption != CUBESQL_ENCRYPTION_NONE) return csql_connect_encrypted (db);
+	
+	// check if its a token connect
+	token = cubesql_gettoken(db);
+	if (token != NULL) is_token = kTRUE;
+	
+	// CLEAR CONNECT PHASE 1
+	// CLIENT SENDS HASH(USERNAME)
+	// AND RECEIVE A 20bytes RANDOM POOL DATA FROM THE SERVER
+	// in the old protocol username was sent in clear
+	nfields = 1;
+	nsizedim = sizeof(int) * nfields;
+	if (db->useOldProtocol == kFALSE) {
+		hex_hash_field(hash, db->username, (int)strlen(db->username));
+		datasize = (int)strlen(hash) + 1;
+		p = (char *)hash;
+	} else {
+		datasize = (int)strlen(db->username) + 1;
+		p = (char *)db->username;
+	}
+	
+	// build packet
+	packet_size = datasize + nsizedim;
+	csql_initrequest(db, packet_size, nfields, kCOMMAND_CONNECT, (is_token) ? kCLEAR_TOKEN_CONNECT1 : kCLEAR_CONNECT_PHASE1);
+	field_size[0] = htonl(datasize);
+	
+	// send header
+	if (csql_socketwrite(db, (char *)&db->request, kHEADER_SIZE) != CUBESQL_NOERR) goto abort_connect;
+	
+	// send size array
+	if (csql_socketwrite(db, (char *)field_size, nsizedim) != CUBESQL_NOERR) goto abort_connect;
+	
+	// send hash (username)
+	if (csql_socketwrite(db, (char *)p, datasize) != CUBESQL_NOERR) goto abort_connect;
+	
+	// read random pool
+	if (csql_netread(db, kRANDPOOLSIZE, 1, kFALSE, NULL, CONNECT_TIMEOUT) != CUBESQL_NOERR) goto abort_connect;
+	
+	// CLEAR CONNECT PHASE 2
+	// CLIENT ENCRYPT PASSWORD WITH THE RANDOM POOL
+	// AND SEND ITS HASH TO THE SERVER
+	
+	// encrypt password with random pool
+	random_hash_field((unsigned char *)hval, (const char *)db->inbuffer, db->password);
+	
+	nfields = 1;
+	if (is_token) nfields++;
+	nsizedim = sizeof(int) * nfields;
+	datasize = SHA1_DIGEST_SIZE;
+	if (is_token) datasize += strlen(token)+1;
+	
+	// build packet
+	packet_size = datasize + nsizedim;
+	csql_initrequest(db, packet_size, nfields, kCOMMAND_CONNECT, (is_token) ? kCLEAR_TOKEN_CONNECT2 : kCLEAR_CONNECT_PHASE2);
+	field_size[0] = htonl(SHA1_DIGEST_SIZE);
+	if (is_token) field_size[1] = htonl(strlen(token)+1);
+	
+	// send header
+	if (csql_socketwrite(db, (char *)&db->request, kHEADER_SIZE) != CUBESQL_NOERR) goto abort_connect;
+	
+	// send size array
+	if (csql_socketwrite(db, (char *)field_size, nsizedim) != CUBESQL_NOERR) goto abort_connect;
+	
+	// send SH1 (Encrypted password)
+	if (csql_socketwrite(db, (char *)hval, SHA1_DIGEST_SIZE) != CUBESQL_NOERR) goto abort_connect;
+	
+	// send token
+	if (is_token) if (csql_socketwrite(db, (char *)token, (int)strlen(token)+1) != CUBESQL_NOERR) goto abort_connect;
+	
+	// read header reply and sanity check it
+	if (csql_netread(db, 0, 0, kFALSE, NULL, CONNECT_TIMEOUT) != CUBESQL_NOERR) goto abort_connect;
+	
+	return CUBESQL_NOERR;
+	
+abort_connect:
+	return CUBESQL_ERR;
+}
+
+int csql_netread (csqldb *db, int expected_size, int expected_nfields, int is_chunk, int *end_chunk, int timeout) {
+	int is_end_chunk = kFALSE;
+	
+	// read header first
+	if (csql_socketread(db, kTRUE, timeout) != CUBESQL_NOERR) return CUBESQL_ERR;
+	
+	// check header
+	if (csql_checkheader(db, expected_size, expected_nfields, &is_end_chunk) != CUBESQL_NOERR) return CUBESQL_ERR;
+	
+	// check end_chunk case
+	if (end_chunk) *end_chunk = is_end_chunk;
+	if ((is_chunk) && (is_end_chunk)) {*end_chunk = is_end_chunk; return CUBESQL_NOERR;}
+	if (db->toread == 0) return CUBESQL_NOERR;
+	
+	// if there is something more to read, then read everything into the inbuffer
+	if (csql_checkinbuffer(db) != CUBESQL_NOERR) return CUBESQL_ERR;
+	if (csql_socketread(db, kFALSE, timeout) != CUBESQL_NOERR) return CUBESQL_ERR;
+	
+	// check if packet is encrypted
+	if (db->reply.encryptedPacket != CUBESQL_ENCRYPTION_NONE)
+		decrypt_buffer(db->inbuffer, db->toread, db->decryptkey);
+	
+	// check if packet is compressed
+	if (TESTBIT(db->reply.flag1, SERVER_COMPRESSED_PACKET)) {
+		int		exp_size = ntohl(db->reply.expandedSize);
+		uLong	zExpSize = (uLong)exp_size;
+		char	*buffer;
+		
+		buffer = (char *) malloc(exp_size);
+		if (buffer == NULL) {
+			csql_seterror(db, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate buffer required by the cursor");
+			return CUBESQL_ERR;
+		}
+		
+		if (uncompress((Bytef *)buffer, &zExpSize, (Bytef *)db->inbuffer, (uLong)db->toread) != Z_OK) {
+			csql_seterror(db, CUBESQL_ZLIB_ERROR, "An error occurred while trying to uncompress received cursor");
+			free(buffer);
+			return CUBESQL_ERR;
+		}
+		
+		free (db->inbuffer);
+		db->inbuffer = buffer;
+		db->insize = exp_size;
+	}
+	
+	return CUBESQL_NOERR;
+}
+
+int csql_checkinbuffer (csqldb *db) {
+	if (db->insize >= db->toread) return CUBESQL_NOERR;
+	
+	if (db->inbuffer) free(db->inbuffer);
+	db->insize = 0;
+	db->inbuffer = (char *) malloc (db->toread);
+	if (db->inbuffer == NULL) {
+		csql_seterror(db, CUBESQL_MEMORY_ERROR, "Unable to allocate inbuffer");
+		return CUBESQL_ERR;
+	}
+		
+	db->insize = db->toread;
+	return CUBESQL_NOERR;
+}
+
+int csql_netwrite (csqldb *db, char *size_array, int nsize_array, char *buffer, int nbuffer) {
+	char rand1[kRANDPOOLSIZE], *encbuffer = NULL;
+	
+	// send header request
+	if (csql_socketwrite(db, (char *)&db->request, kHEADER_SIZE) != CUBESQL_NOERR) return CUBESQL_ERR;
+	
+	// send size array
+	if (size_array) if (csql_socketwrite(db, size_array, nsize_array) != CUBESQL_NOERR) return CUBESQL_ERR;
+	
+	// send buffer as is if it's a not encrypted channel
+	if (db->encryption == CUBESQL_ENCRYPTION_NONE) {
+		if (buffer) if (csql_socketwrite(db, buffer, nbuffer) != CUBESQL_NOERR) return CUBESQL_ERR;
+		return CUBESQL_NOERR;
+	}
+	
+	// case buffer is NULL
+	if (buffer == NULL) return CUBESQL_NOERR;
+	
+	// generate random pool and encrypt buffer
+	csql_rand_fill(rand1);
+	encbuffer = (char *) malloc (nbuffer+1);
+	if (encbuffer == NULL) {
+		csql_seterror(db, CUBESQL_MEMORY_ERROR, "Unable to allocate encbuffer");
+		return CUBESQL_ERR;
+	}
+	memcpy (encbuffer, buffer, nbuffer);
+	encrypt_buffer ((char *)encbuffer, nbuffer, rand1, db->encryptkey);
+	
+	// send random pool
+	if (csql_socketwrite(db, rand1, BLOCK_LEN) != CUBESQL_NOERR) goto abort;
+	
+	// send encrypted buffer
+	if (csql_socketwrite(db, encbuffer, nbuffer) != CUBESQL_NOERR) goto abort;
+	
+	if (encbuffer) free(encbuffer);
+	return CUBESQL_NOERR;
+
+abort:
+	if (encbuffer) free(encbuffer);
+	return CUBESQL_ERR;
+}
+
+int csql_sendchunk (csqldb *db, char *buffer, int bufferlen, int buffertype, int is_bind) {
+	int		err, bsize, is_compressed;
+	char	*b, *dest;
+	uLong	newlen;
+	
+	b = buffer;
+	dest = NULL;
+	bsize = bufferlen;
+	is_compressed = kFALSE;
+	
+	// try to compress buffer, in case of error just use the uncompressed one
+	newlen = compressBound(bufferlen);
+	dest = (char *) malloc (newlen);
+	if (dest != NULL) {
+		if (compress2((Bytef*)dest, &newlen, (Bytef*)buffer, (uLong)bufferlen, Z_DEFAULT_COMPRESSION) == Z_OK) {
+			b = dest;
+			bsize = (int)newlen;
+			is_compressed = kTRUE;
+		} else {free(dest); dest = NULL;}
+	}
+	
+	// build packet, the chunk command never sends the field_size, nfield should be set to 1
+	if (is_bind) {
+		csql_initrequest(db, bsize, 1, kCOMMAND_CHUNK_BIND, kBIND_STEP);
+		db->request.flag3 = (unsigned char) buffertype;
+	}
+	else csql_initrequest(db, bsize, 1, kCOMMAND_CHUNK, kNO_SELECTOR);
+	SETBIT(db->request.flag1, CLIENT_PARTIAL_PACKET);
+	
+	if (is_compressed == kTRUE) {
+		SETBIT(db->request.flag1, CLIENT_COMPRESSED_PACKET);
+		db->request.expandedSize = htonl(bufferlen);
+	}
+	
+	err = csql_netwrite(db, NULL, 0, b, bsize);
+	if (dest != NULL) free(b);
+	
+	return err;
+}
+
+char *csql_receivechunk (csqldb *db, int *len, int *is_end_chunk) {
+	int err = csql_netread(db, -1, -1, kTRUE, is_end_chunk, NO_TIMEOUT);
+	if (err == CUBESQL_ERR) csql_ack(db, kCHUNK_ABORT);
+	if (err != CUBESQL_NOERR) return NULL;
+	
+	*len = db->insize;
+	return db->inbuffer;
+}
+
+int csql_ack(csqldb *db, int chunk_code) {
+	if (chunk_code == kCOMMAND_ENDCHUNK) {
+		csql_initrequest(db, 0, 0, kCOMMAND_ENDCHUNK, kNO_SELECTOR);
+		csql_netwrite(db, NULL, 0, NULL, 0);
+		goto read_reply;
+	}
+	
+	if ((chunk_code == kBIND_FINALIZE) || (chunk_code == kBIND_ABORT)) {
+		csql_initrequest(db, 0, 0, kCOMMAND_CHUNK_BIND, chunk_code);
+		csql_netwrite(db, NULL, 0, NULL, 0);
+		goto read_reply;
+	}
+	
+	// other cases
+	csql_initrequest(db, 0, 0, kCOMMAND_CHUNK, chunk_code);
+	return csql_netwrite(db, NULL, 0, NULL, 0);
+	
+read_reply:	
+	return csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT);
+}
+
+int csql_socketwrite (csqldb *db, const char *buffer, int nbuffer) {
+	int fd, ret, nwritten, nleft = nbuffer;
+	const char *ptr = buffer;
+	fd_set except_fds;
+	fd_set write_fds;
+	struct timeval tv;
+	
+	fd = db->sockfd;
+	while (nleft > 0) {
+		FD_ZERO(&write_fds);
+		FD_SET(fd, &write_fds);
+		FD_ZERO(&except_fds);
+		FD_SET(fd, &except_fds);
+		
+		tv.tv_sec = db->timeout;
+		tv.tv_usec = 0;
+		
+		ret = bsd_select(fd+1, NULL, &write_fds, &except_fds, &tv);
+		
+		// something wrong occurred
+		if (FD_ISSET(fd, &except_fds)) {
+			csql_seterror(db, ERR_SOCKET, "select returns except_fds inside csql_socketwrite");
+			return CUBESQL_ERR;
+		}
+		
+		// check if it is a real error
+		if (ret == -1) {
+			int err = csql_socketerror(fd);
+			if (err == 0) continue;
+			
+			csql_seterror(db, err, "An error occurred inside csql_socketwrite");
+			return CUBESQL_ERR;
+		}
+		
+		// ret = 0 means timeout
+		if (ret <= 0) {
+			csql_seterror(db, ERR_SOCKET_TIMEOUT, "A timeout error occurred inside csql_socketwrite");
+			return CUBESQL_ERR;
+		}
+		
+		if (FD_ISSET(fd, &write_fds)) {
+			FD_CLR(fd, &write_fds);
+
+			#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
+			nwritten = (db->tls_context) ? (int)tls_write(db->tls_context, ptr, nleft) : (int)sock_write(fd, ptr, nleft);
+			if (nwritten == TLS_WANT_POLLIN || nwritten == TLS_WANT_POLLOUT) continue;
+			#else
+			nwritten = (int)sock_write(fd, ptr, nleft);
+			#endif
+
+			if (nwritten <= 0) {
+				csql_seterror(db, ERR_SOCKET_WRITE, "An error occurred while trying to execute sock_write");
+				return CUBESQL_ERR;
+			}
+
+			nleft -= nwritten;
+			ptr += nwritten;
+		}
+	}
+	
+	return CUBESQL_NOERR;
+}
+
+int csql_socketread (csqldb *db, int is_header, int timeout) {
+	int		nread, nleft, ret, fd = db->sockfd;
+	char	*ptr;
+	fd_set read_fds;
+	fd_set except_fds;
+	struct timeval tv;
+	
+	if (is_header == kTRUE) {
+		ptr = (char *)&db->reply;
+		nleft = kHEADER_SIZE;
+	}
+	else {
+		ptr = (char *)db->inbuffer;
+		nleft = db->toread;
+	}
+	
+	while (1) {
+		FD_ZERO(&read_fds);
+		FD_SET(fd, &read_fds);
+		FD_ZERO(&except_fds);
+		FD_SET(fd, &except_fds);
+		
+		if (timeout != NO_TIMEOUT) {
+			tv.tv_sec = timeout;
+			tv.tv_usec = 0;
+			ret = bsd_select(fd+1, &read_fds, NULL, &except_fds, &tv);
+		} else
+			ret = bsd_select(fd+1, &read_fds, NULL, &except_fds, NULL);
+		
+		if (FD_ISSET(fd, &except_fds)) {
+			// this may only happen on Windows
+			csql_seterror(db, ERR_SOCKET_READ, "select returns except_fds inside csql_socketread");
+			return CUBESQL_ERR;
+		}
+		
+		// check if it is a real error
+		if (ret == -1) {
+			int err = csql_socketerror(fd);
+			if (err == 0) continue;
+			
+			csql_seterror(db, err, "An error occurred while executing csql_socketread");
+			return CUBESQL_ERR;
+		}
+
+		// ret = 0 means timeout
+		if (ret <= 0) {
+			csql_seterror(db, ERR_SOCKET_TIMEOUT, "A timeout error occurred inside csql_socketread");
+			return CUBESQL_ERR;
+		}
+		
+		#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
+		nread = (db->tls_context) ? (int)tls_read(db->tls_context, ptr, nleft) : (int)sock_read(fd, ptr, nleft);
+		if (nread == TLS_WANT_POLLIN || nread == TLS_WANT_POLLOUT) continue;
+		#else
+		nread = (int)sock_read(fd, ptr, nleft);
+		#endif
+
+		if (nread <= 0) {
+			csql_seterror(db, ERR_SOCKET_READ, "An error occurred while executing sock_read");
+			return CUBESQL_ERR;
+		}
+		
+		nleft -= nread;
+		ptr += nread;
+		
+		if (nleft == 0)
+			return CUBESQL_NOERR;
+	}
+}
+
+void csql_seterror(csqldb *db, int errcode, const char *errmsg) {
+	db->errcode = errcode;
+	snprintf(db->errmsg, sizeof(db->errmsg), "%s", errmsg);
+}
+
+int csql_socketerror (int fd) {
+	int			err, sockerr;
+	socklen_t	errlen = sizeof(err);
+
+	sockerr = bsd_getsockopt(fd, SOL_SOCKET, SO_ERROR, (char *)&err, &errlen);
+
+	if (sockerr < 0)
+		return -1;
+	
+	if (err == 0 || err == EINTR || err == EAGAIN || err == EINPROGRESS)
+		return 0;
+	
+	return err;	
+}
+
+int csql_checkheader(csqldb *db, int expected_size, int expected_nfields, int *end_chunk) {
+	outhead *header = &db->reply;
+	unsigned int	signature;
+	int	err, dsize, nfields;
+	
+	if (end_chunk) *end_chunk = kFALSE;
+	db->toread = 0;
+
+	signature = ntohl(header->signature);
+	if (signature != PROTOCOL_SIGNATURE) {
+		csql_seterror (db, ERR_WRONG_SIGNATURE, "Wrong SIGNATURE HEADER from the server");
+		return CUBESQL_ERR;
+	}
+	
+	err = ntohs(header->errorCode);
+	if (err == END_CHUNK) {
+		if (end_chunk) *end_chunk = kTRUE;
+		err = 0;
+	}
+	
+	dsize = ntohl(header->packetSize);
+	if ((err == 0) && (expected_size != -1) && (expected_size != dsize)) {
+		csql_seterror (db, ERR_WRONG_SIGNATURE, "Wrong PACKET SIZE received from the server");
+		return CUBESQL_ERR;
+	}
+	db->toread = dsize;
+	
+	nfields = ntohl(header->numFields);
+	if ((err == 0) && (expected_nfields != -1) && (expected_nfields != nfields)) {
+		csql_seterror (db, ERR_WRONG_SIGNATURE, "Wrong NUMBER OF FIELDS received from the server");
+		return CUBESQL_ERR;
+	}
+	
+	if ((err != 0) && (dsize)) {
+		// read error string
+		// it is an error and it is dsize long, so check if we can reuse the static buffer
+		int	use_static = kFALSE;
+		
+		if (dsize < sizeof(db->errmsg)) {
+			use_static = kTRUE;
+			db->inbuffer = db->errmsg;
+			db->inbuffer[dsize] = 0;
+			db->insize = dsize;
+			db->errcode = err;
+		}
+		else if (csql_checkinbuffer(db) != CUBESQL_NOERR) return CUBESQL_ERR;
+		
+		if (csql_socketread(db, kFALSE, NO_TIMEOUT) != CUBESQL_NOERR) {
+			if (use_static) { db->inbuffer = NULL; db->insize = 0; }
+			return CUBESQL_ERR;
+		}
+		db->toread = 0;
+		
+		if (db->reply.encryptedPacket != CUBESQL_ENCRYPTION_NONE)
+			decrypt_buffer(db->inbuffer, dsize, db->decryptkey);
+		
+		if (use_static == kFALSE) csql_seterror (db, err, db->inbuffer);
+		if ((use_static == kFALSE) && (db->inbuffer)) free(db->inbuffer);
+		
+		db->inbuffer = NULL;
+		db->insize = 0;
+		return CUBESQL_ERR;
+	}
+	
+	return CUBESQL_NOERR;
+}
+
+void csql_initrequest (csqldb *db, int packetsize, int nfields, char command, char selector) {
+	inhead *request = &db->request;
+	
+	bzero(request, sizeof(inhead));
+	request->signature = htonl(PROTOCOL_SIGNATURE);
+	
+	if ((packetsize != 0) && (db->encryption != CUBESQL_ENCRYPTION_NONE)) packetsize += BLOCK_LEN;
+	
+	request->packetSize = htonl(packetsize);
+	request->command = command;
+	request->selector = selector;
+	request->flag1 = kEMPTY_FIELD;
+	SETBIT(request->flag1, CLIENT_SUPPORT_COMPRESSION);
+	request->flag2 = kEMPTY_FIELD;
+	request->flag3 = kEMPTY_FIELD;
+	request->encryptedPacket = db->encryption;
+	request->numFields = htonl(nfields);
+	request->expandedSize = 0;
+	request->timeout = htonl(db->timeout);
+	
+	if (db->useOldProtocol == kTRUE)
+		request->protocolVersion = k2007PROTOCOL;
+	else
+		request->protocolVersion = k2011PROTOCOL;
+}
+
+csqlc *csql_cursor_alloc (csqldb *db)
+{
+	csqlc *cursor = NULL;
+	
+	cursor = (csqlc*) malloc (sizeof(csqlc));
+	if (cursor == NULL) return NULL;
+	
+	// initialize cursor structure
+	bzero (cursor, sizeof(csqlc));
+	cursor->db = db;
+	cursor->current_row = 1;
+	
+	return cursor;
+}
+
+int csql_cursor_reallocate (csqlc *c) {
+	if (c->nalloc == 0) {
+		c->buffer = (char**) malloc(sizeof(char*) * kNUMBUFFER);
+		if (c->buffer == NULL) return kFALSE;
+
+		c->rowsum = (int**) malloc(sizeof(int*) * kNUMBUFFER);
+		if (c->rowsum == NULL) { free(c->buffer); c->buffer = NULL; return kFALSE; }
+
+		c->rowcount = (int*) malloc(sizeof(int) * kNUMBUFFER);
+		if (c->rowcount == NULL) { free(c->buffer); c->buffer = NULL; free(c->rowsum); c->rowsum = NULL; return kFALSE; }
+
+		c->nalloc = kNUMBUFFER;
+	} else {
+		
+		char **tmp1;
+		int	 **tmp2;
+		int *tmp3;
+		int	 oldsize, newsize;
+		
+		oldsize = sizeof(char*) * c->nalloc;
+		newsize = oldsize + (sizeof(char*) * kNUMBUFFER);
+		tmp1 = (char**) realloc(c->buffer, newsize);
+		if (tmp1 == NULL) return kFALSE;
+		c->buffer = tmp1;
+		
+		oldsize = sizeof(int*) * c->nalloc;
+		newsize = oldsize + (sizeof(int*) * kNUMBUFFER);
+		tmp2 = (int**) realloc(c->rowsum, newsize);
+		if (tmp2 == NULL) return kFALSE;
+		c->rowsum = tmp2;
+		
+		oldsize = sizeof(int) * c->nalloc;
+		newsize = oldsize + (sizeof(int) * kNUMBUFFER);
+		tmp3 = (int*) realloc(c->rowcount, newsize);
+		if (tmp3 == NULL) return kFALSE;
+		c->rowcount = tmp3;
+		
+		c->nalloc += kNUMBUFFER;
+	}	
+	
+	return kTRUE;
+}
+
+int csql_cursor_nchunks (csqlc *c) {
+	int i, n = 0;
+	
+	if (c->cursor_id == kCURSOR_CONCAT) {
+		if (c->buffer) return 1;
+		for (i=0; i<c->nparts; i++) n += csql_cursor_nchunks(c->parts[i]);
+		return n;
+	}
+	return (c->nbuffer) ? c->nbuffer : 1;
+}
+
+int csql_cursor_chunk (csqlc *c, int nindex, csqlchunk *chunk) {
+	int cnum = c->ncols + ((c->has_rowid) ? 1 : 0);
+	
+	bzero(chunk, sizeof(csqlchunk));
+	if ((nindex < 0) || (nindex >= csql_cursor_nchunks(c))) return kFALSE;
+	if (c->cursor_id == kCURSOR_CONCAT) return csql_concat_chunk(c, nindex, chunk);
+	chunk->firstrow = 1;
+	
+	// custom created cursor stores each field in its own buffer
+	if (c->cursor_id == -1) {
+		chunk->size = c->size0;
+		chunk->nrows = c->nrows;
+		return kTRUE;
+	}
+	
+	// no chunk case
+	if (c->nbuffer == 0) {
+		chunk->data = c->data;
+		chunk->size = c->size;
+		chunk->psum = c->psum;
+		chunk->nrows = c->nrows;
+		return kTRUE;
+	}
+	
+	// chunk case (same layout used by cubesql_cursor_field but without touching the current buffer)
+	if (nindex > 0) chunk->firstrow = c->rowcount[nindex-1] + 1;
+	chunk->nrows = c->rowcount[nindex] - (chunk->firstrow - 1);
+	chunk->psum = c->rowsum[nindex];
+	if (nindex == 0) {
+		chunk->data = c->data0;
+		chunk->size = c->size0;
+	} else {
+		chunk->size = (int *) c->buffer[nindex];
+		chunk->data = (char *) chunk->size + (chunk->nrows * cnum * sizeof(int));
+	}
+	return kTRUE;
+}
+
+char *csql_chunk_field (csqlc *c, csqlchunk *chunk, int row, int column, int *len) {
+	// row is 0-based inside the chunk, column is 1-based (0 means the rowid column)
+	int n;
+	
+	if (c->has_rowid) n = (row * (c->ncols + 1)) + column;
+	else n = (row * c->ncols) + (column-1);
+	
+	*len = chunk->size[n];
+	if (*len == -1) return NULL;
+	if (chunk->data == NULL) return c->buffer[n];
+	return (n > 0) ? chunk->data + chunk->psum[n-1] : chunk->data;
+}
+
+csqlsel *csql_selection_alloc (csqlc *c, int nalloc) {
+	csqlsel *sel = (csqlsel *) malloc(sizeof(csqlsel));
+	if (sel == NULL) return NULL;
+	
+	bzero(sel, sizeof(csqlsel));
+	sel->c = c;
+	if (nalloc <= 0) nalloc = kDEFAULT_ALLOC_ROWS;
+	sel->rows = (int *) malloc(sizeof(int) * nalloc);
+	if (sel->rows == NULL) {free(sel); return NULL;}
+	sel->nalloc = nalloc;
+	
+	return sel;
+}
+
+int csql_selection_add (csqlsel *sel, int row) {
+	if (sel->nrows >= sel->nalloc) {
+		int newsize = sel->nalloc * 2;
+		int *tmp = (int *) realloc(sel->rows, sizeof(int) * newsize);
+		if (tmp == NULL) return kFALSE;
+		sel->rows = tmp;
+		sel->nalloc = newsize;
+	}
+	sel->rows[sel->nrows++] = row;
+	return kTRUE;
+}
+
+unsigned long long csql_hash64 (unsigned long long h, const char *data, int len) {
+	// FNV-1a 64 bit, the field length is hashed first so that NULL, empty and adjacent values are different
+	int i;
+	
+	for (i=0; i<(int)sizeof(int); i++) {
+		h ^= (unsigned char)((unsigned int)len >> (i * 8));
+		h *= CSQL_HASH_PRIME;
+	}
+	for (i=0; i<len; i++) {
+		h ^= (unsigned char)data[i];
+		h *= CSQL_HASH_PRIME;
+	}
+	return h;
+}
+
+unsigned long long csql_chunk_rowhash (csqlc *c, csqlchunk *chunk, int row) {
+	// rowid column is never part of the hash
+	unsigned long long h = CSQL_HASH_SEED;
+	char	*field;
+	int		i, len;
+	
+	for (i=1; i<=c->ncols; i++) {
+		field = csql_chunk_field(c, chunk, row, i, &len);
+		h = csql_hash64(h, field, len);
+	}
+	return h;
+}
+
+int csql_cursor_step (csqlc *c) {
+	// prepare header request
+	csql_initrequest(c->db, 0, 0, kCOMMAND_CURSOR_STEP, kNO_SELECTOR);
+	
+	// send header request
+	if (csql_socketwrite(c->db, (char *)&c->db->request, kHEADER_SIZE) != CUBESQL_NOERR) return CUBESQL_ERR;
+	
+	// receive row
+	if (csql_read_cursor(c->db, c) == NULL) return CUBESQL_ERR;
+	
+	return CUBESQL_NOERR;
+}
+
+int csql_cursor_close (csqlc *c) {
+	// prepare header request
+	csql_initrequest(c->db, 0, 0, kCOMMAND_CURSOR_CLOSE, kNO_SELECTOR);
+	
+	// send header request
+	if (csql_socketwrite(c->db, (char *)&c->db->request, kHEADER_SIZE) != CUBESQL_NOERR) return CUBESQL_ERR;
+	
+	return csql_netread(c->db, -1, -1, kFALSE, NULL, NO_TIMEOUT);
+}
+
+// MARK: - SSL -
+
+const char *cubesql_sslversion (void) {
+	#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
+	return SSLeay_version(0);
+	#else
+	return NULL;
+	#endif
+}
+
+unsigned long cubesql_sslversion_num (void) {
+	#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
+	return 0x3080200fL;
+	#endif
+	return 0;
+}
+
+int encryption_is_ssl (int encryption) {
+	if ((encryption == CUBESQL_ENCRYPTION_SSL) || (encryption == CUBESQL_ENCRYPTION_SSL_AES128) ||
+		(encryption == CUBESQL_ENCRYPTION_SSL_AES192) || (encryption == CUBESQL_ENCRYPTION_SSL_AES256)) return kTRUE;
+	return kFALSE;
+}
+
+// MARK: - Utils -
+
+void hash_field (unsigned char hval[], const char *field, int len, int times) {
+	// SHA1(P)
+	csql_sha1((unsigned char *)hval, (const unsigned char*)field, len);
+	
+	// SHA1(SHA1(P))
+	if (times == 2)
+		csql_sha1((unsigned char *)hval, (const unsigned char *)hval, SHA1_DIGEST_SIZE);
+}
+
+void hex_hash_field (char result[], const char *field, int len) {
+	unsigned char hval[SHA1_DIGEST_SIZE];
+	
+	csql_sha1(hval, (const unsigned char *)field, len);
+	
+	// convert result
+	// result must be SHA1_DIGEST_SIZE*2+2 long
+	snprintf(result, SHA1_DIGEST_SIZE*2+2, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
+			 hval[0],hval[1],hval[2],hval[3],hval[4],hval[5],hval[6],hval[7],hval[8],hval[9],hval[10],
+			 hval[11],hval[12],hval[13],hval[14],hval[15],hval[16],hval[17],hval[18],hval[19]);
+}
+
+void hex_hash_field2 (char result[], const char *field, unsigned char *randpoll) {
+	unsigned char hval[SHA1_DIGEST_SIZE];
+	unsigned char randhex[BLOCK_LEN*2+2];
+	char		  buffer[2048];
+	int			  len = 0;
+	
+	if (strlen(field) > 256) return;
+	
+	// hexify randpool
+	snprintf((char *)randhex, sizeof(randhex), "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
+			 randpoll[0],randpoll[1],randpoll[2],randpoll[3],randpoll[4],randpoll[5],randpoll[6],randpoll[7],randpoll[8],
+			 randpoll[9],randpoll[10],randpoll[11],randpoll[12],randpoll[13],randpoll[14],randpoll[15]);
+	
+	//printf("randpool %s\n", randhex);
+	
+	// concat two fields
+	len = snprintf(buffer, sizeof(buffer), "%s%s", field, randhex);
+	
+	// compute hash
+	csql_sha1(hval, (const unsigned char *)buffer, len);
+	
+	// convert result
+	// result must be SHA1_DIGEST_SIZE*2+2 long
+	snprintf(result, SHA1_DIGEST_SIZE*2+2, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
+			 hval[0],hval[1],hval[2],hval[3],hval[4],hval[5],hval[6],hval[7],hval[8],hval[9],hval[10],
+			 hval[11],hval[12],hval[13],hval[14],hval[15],hval[16],hval[17],hval[18],hval[19]);
+	
+	//printf("result %s\n", result);
+}
+
+void random_hash_field (unsigned char hval[], const char *randpoll, const char *field) {
+	char buffer[SHA1_DIGEST_SIZE+kRANDPOOLSIZE];
+	char hval1[SHA1_DIGEST_SIZE];
+	char hval2[SHA1_DIGEST_SIZE];
+	
+	// SHA1(P)
+	csql_sha1((unsigned char *)hval1, (const unsigned char*)field, (int)strlen(field));
+	
+	// SHA1(SHA1(P))
+	csql_sha1((unsigned char *)hval2, (const unsigned char *)hval1, SHA1_DIGEST_SIZE);
+	
+	memcpy(buffer, randpoll, kRANDPOOLSIZE);
+	memcpy(buffer + kRANDPOOLSIZE, hval2, SHA1_DIGEST_SIZE);
+	
+	// SHA1(R;SHA1(SHA1(P)))
+	csql_sha1((unsigned char *)hval, (const unsigned char *)buffer, kRANDPOOLSIZE+SHA1_DIGEST_SIZE);
+}
+
+int encrypt_buffer (char *buffer, int dim, char random[], csql_aes_encrypt_ctx ctx[1]) {
+	char    dbuf[2 * BLOCK_LEN];
+	int		i, len, index=0;
+	char	*b1, *b2;
+	
+	memcpy(dbuf, random, BLOCK_LEN);
+	
+	if (dim < BLOCK_LEN) {
+		// if the buffer is less than one block
+		memcpy(dbuf + BLOCK_LEN, buffer, dim);
+		
+		// xor the file bytes with the random pool
+		for(i = 0; i < dim; ++i)
+			dbuf[i + BLOCK_LEN] ^= dbuf[i];
+		
+		// encrypt the top 16 bytes of the buffer
+		csql_aes_encrypt((const unsigned char*) (dbuf + dim), (unsigned char*)(dbuf + dim), ctx);
+		
+		// copy back encrypted data
+		memcpy(random, dbuf, BLOCK_LEN);
+		memcpy(buffer, dbuf + BLOCK_LEN, dim);
+		
+		return (dim+BLOCK_LEN);
+	}
 	
-	// ipv6 code from https://www.ibm.com/support/knowledgecenter/ssw_ibm_i_72/rzab6/xip6client.htm
-	memset(&hints, 0x00, sizeof(hints));
-	hints.ai_flags    = AI_NUMERICSERV;
-	hints.ai_family   = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	b1 = dbuf;
+	b2 = buffer;
+	len = dim;
 	
-	// check if we were provided the address of the server using
-	// inet_pton() to convert the text form of the address to binary form.
-	// If it is numeric then we want to prevent getaddrinfo() from doing any name resolution.
-	int rc = inet_pton(AF_INET, (const char *) db->host, &serveraddr);
-	if (rc == 1) { /* valid IPv4 text address? */
-		hints.ai_family = AF_INET;
-		hints.ai_flags |= AI_NUMERICHOST;
-	}
-	else {
-		rc = inet_pton(AF_INET6, (const char *) db->host, &serveraddr);
-		if (rc == 1) { /* valid IPv6 text address? */
-			hints.ai_family = AF_INET6;
-			hints.ai_flags |= AI_NUMERICHOST;
+	do {				
+		// do CBC chaining prior to encryption for current block (in b2)
+		for(i = 0; i < BLOCK_LEN; ++i)
+			b1[i] ^= b2[i];
+		
+		// encrypt the block (now in b1)
+		csql_aes_encrypt((const unsigned char*)b1, (unsigned char*)b1, ctx);
+		
+		len -= BLOCK_LEN;
+		
+		if (index == 0)
+			memcpy(buffer, b1, BLOCK_LEN);
+		
+		// advance the buffer pointers
+		if (len >= BLOCK_LEN) {
+			b2 = buffer + (index * BLOCK_LEN);
+			b1 = b2 + BLOCK_LEN;
 		}
+		index++;
 	}
+	while (len >= BLOCK_LEN);
 	
-	// get the address information for the server using getaddrinfo()
-	char port_string[256];
-	snprintf(port_string, sizeof(port_string), "%d", db->port);
-	rc = getaddrinfo((const char *) db->host, port_string, &hints, &addr_list);
-	if (rc != 0 || addr_list == NULL) {
-		csql_seterror(db, ERR_SOCKET, "Error while resolving getaddrinfo (host not found)");
-		return -1;
+	if (len != 0) {	
+		char b3[BLOCK_LEN];
+		char back[BLOCK_LEN];
+		
+		memcpy(b3, buffer + (index * BLOCK_LEN), len);
+		
+		// xor ciphertext into last block
+		for(i = 0; i < len; ++i)
+			b3[i] ^= b1[i];
+		
+		// move 'stolen' ciphertext into last block
+		for(i = len; i < BLOCK_LEN; ++i)
+			b3[i] = b1[i];
+		
+		// encrypt this block
+	   	csql_aes_encrypt((const unsigned char*) b3, (unsigned char*) b3, ctx);
+		
+		// save b1
+		memcpy(back, b1, BLOCK_LEN);
+		
+		// write b3
+		memcpy(buffer+dim-len-BLOCK_LEN, b3, BLOCK_LEN);
+		
+		// write b1
+		memcpy(buffer+dim-len, back, len);
 	}
 	
-	const char *lastConnectionErrorMessage = NULL;
-	int sock_index = 0;
-	int sock_current = 0;
-	int sock_list[MAX_SOCK_LIST] = {0};
-	for (addr = addr_list; addr != NULL; addr = addr->ai_next, ++sock_index) {
-		if (sock_index >= MAX_SOCK_LIST) break;
+	return (dim + BLOCK_LEN);
+}
 
-		// placeholder; successfully instantiated sockets will have > 0
-		sock_list[sock_index] = -1;
+int decrypt_buffer (char *buffer, int dim, csql_aes_decrypt_ctx ctx[1]) {
+	int 	len, nextlen, i, index=0;
+	char	*b1, *b2;
+	char	buf[BLOCK_LEN], b3[BLOCK_LEN];
+	
+	if (dim < 2 * BLOCK_LEN) {
+		len = dim - BLOCK_LEN;
 		
-		// display protocol specific formatted address
-		/*
-		char szHost[256], szPort[16];
-		getnameinfo(addr->ai_addr, addr->ai_addrlen, szHost, sizeof(szHost), szPort, sizeof(szPort), NI_NUMERICHOST | NI_NUMERICSERV);
-		printf("getnameinfo(): host=%s, port=%s, family=%d\n", szHost, szPort, addr->ai_family);
-		*/
-		sock_current = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-		if (sock_current < 0) continue;
+		// decrypt from position len to position len + BLOCK_LEN
+		csql_aes_decrypt((const unsigned char*) (buffer + len), (unsigned char*) (buffer + len), ctx);
 		
-		// set socket options
-		int len = 1;
-		bsd_setsockopt(sock_current, SOL_SOCKET, SO_KEEPALIVE, (const char *) &len, sizeof(len));
-		len = 1;
-		bsd_setsockopt(sock_current, IPPROTO_TCP, TCP_NODELAY, (const char *) &len, sizeof(len));
-		#ifdef SO_NOSIGPIPE
-		len = 1;
-		bsd_setsockopt(sock_current, SOL_SOCKET, SO_NOSIGPIPE, (const char *) &len, sizeof(len));
-		#endif
+		// undo the CBC chaining
+		for(i = 0; i < len; ++i)
+			buffer[i] ^= buffer[i + BLOCK_LEN];
 		
-		// by default, an IPv6 socket created on Windows Vista and later only operates over the IPv6 protocol
-		// in order to make an IPv6 socket into a dual-stack socket, the setsockopt function must be called
-		if (addr->ai_family == AF_INET6) {
-			#ifdef WIN32
-			DWORD ipv6only = 0;
-			#else
-			int   ipv6only = 0;
-			#endif
-			bsd_setsockopt(sock_current, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&ipv6only, sizeof(ipv6only));
+		return 0;
+	}
+	
+	b1 = buffer;
+	b2 = b1 + BLOCK_LEN;
+	len = dim - BLOCK_LEN;
+	
+	do {
+		nextlen = len - BLOCK_LEN;
+		if (nextlen > BLOCK_LEN) nextlen = BLOCK_LEN;
+		
+		// decrypt the b2 block
+		csql_aes_decrypt((const unsigned char*) b2, (unsigned char*) buf, ctx);
+		
+		if(nextlen == 0 || nextlen == BLOCK_LEN) {
+			// no ciphertext stealing
+			// unchain CBC using the previous ciphertext block in b1
+			for(i = 0; i < BLOCK_LEN; ++i)
+				buf[i] ^= b1[i];
+			
+			memcpy(buffer + index*BLOCK_LEN, buf, BLOCK_LEN);
+			
+			index++;
+			len -= BLOCK_LEN;
+			if (len == 0) return 0;
+			
+			b1 = b2;
+			b2 = b2 + BLOCK_LEN;
+		}
+		else {	
+			// partial last block - use ciphertext stealing
+			
+			len = nextlen;
+			// thanks to GuardMalloc
+			//memcpy (b3, b2+BLOCK_LEN, BLOCK_LEN);
+			memcpy (b3, b2+BLOCK_LEN, len);
+			
+			// produce last 'len' bytes of plaintext by xoring with
+			// the lowest 'len' bytes of next block b3 - C[N-1]
+			for(i = 0; i < len; ++i)
+				buf[i] ^= b3[i];
+			
+			// reconstruct the C[N-1] block in b3 by adding in the
+			// last (BLOCK_LEN - len) bytes of C[N-2] in b2
+			for(i = len; i < BLOCK_LEN; ++i)
+				b3[i] = buf[i];
+			
+			// decrypt the C[N-1] block in b3
+			csql_aes_decrypt((const unsigned char*) b3, (unsigned char*) b3, ctx);
+			
+			// produce the last but one plaintext block by xoring with
+			// the last but two ciphertext block
+			for(i = 0; i < BLOCK_LEN; ++i)
+				b3[i] ^= b1[i];
+			
+			memcpy(buffer + index*BLOCK_LEN, b3, BLOCK_LEN);
+			index++;
+			memcpy(buffer + index*BLOCK_LEN, buf, nextlen);
+			
+			return 0;
+		}
+	}
+	while (1);
+}
+
+int generate_session_key (csqldb *db, int encryption, char *password, char *rand1, char *rand2) {
+	int i, keyLen = 0;
+	char dummy1[SHA1_DIGEST_SIZE+kRANDPOOLSIZE+kRANDPOOLSIZE];
+	char dummy2[kRANDPOOLSIZE];
+	char s1[SHA1_DIGEST_SIZE];
+	char s2[SHA1_DIGEST_SIZE];
+	char session_key[32];
+	
+	// password is H(H(P)) (len: SHA1_DIGEST_SIZE = 160bits)
+	// rand1 is X (len: kRANDPOOLSIZE = 20bytes)
+	// rand2 is Y (len: kRANDPOOLSIZE = 20bytes)
+	
+	// dummy1 is H(H(P));X;Y
+	memcpy(dummy1, password, SHA1_DIGEST_SIZE);
+	memcpy(dummy1+SHA1_DIGEST_SIZE, rand1, kRANDPOOLSIZE);
+	memcpy(dummy1+SHA1_DIGEST_SIZE+kRANDPOOLSIZE, rand2, kRANDPOOLSIZE);
+	// s1 is H(H(H(P));X;Y) (len = 20 bytes)
+	hash_field((unsigned char *)s1, (const char *)dummy1, SHA1_DIGEST_SIZE+kRANDPOOLSIZE+kRANDPOOLSIZE, 1);
+	
+	// dummy2 is X^Y
+	for (i=0; i<kRANDPOOLSIZE; i++) dummy2[i] = rand1[i] ^ rand2[i];
+	// s2 is H(X^Y) (len = 20 bytes)
+	hash_field((unsigned char *)s2, (const char *)dummy2, kRANDPOOLSIZE, 1);
+	
+	bzero(session_key, 32);
+	switch (encryption)
+	{
+		case CUBESQL_ENCRYPTION_NONE:
+			keyLen = 0;
+			break;
+			
+		case CUBESQL_ENCRYPTION_AES128:
+			keyLen = 16;
+			memcpy(session_key, s1, 16);
+			break;
+			
+		case CUBESQL_ENCRYPTION_AES192:
+			keyLen = 24;
+			memcpy(session_key, s1, 20);
+			memcpy(session_key, s2, 4);     // should be session_key+20, not modified to retain backward compatibility
+			break;
+			
+		case CUBESQL_ENCRYPTION_AES256:
+			keyLen = 32;
+			memcpy(session_key, s1, 20);
+			memcpy(session_key, s2, 12);    // should be session_key+20, not modified to retain backward compatibility
+			break;
+	}
+	
+	// generate enc/dec keys
+	csql_aes_encrypt_key ((unsigned char*) session_key, keyLen, db->encryptkey);
+	csql_aes_decrypt_key ((unsigned char*) session_key, keyLen, db->decryptkey);
+	
+	return keyLen;
+}
+
+int wildcmp(const char *wild, const char *string) {
+	return wildcmp_len(wild, string, (int)strlen(string), kTRUE);
+}
+
+static int csql_chareq (char a, char b, int nocase) {
+	// ASCII folding, the same used by the SIMD search
+	if (nocase == kFALSE) return (a == b);
+	return (csql_ascii_lower((unsigned char)a) == csql_ascii_lower((unsigned char)b));
+}
+
+int wildcmp_len(const char *wild, const char *string, int len, int nocase) {
+	// Written by Jack Handy
+	// http://www.codeproject.com/Articles/1088/Wildcard-string-compare-globbing
+	// Modified by Marco Bambini
+	// string does not need to be NULL terminated (cursor fields are not)
+	const char *cp = NULL, *mp = NULL;
+	const char *end = string + len;
+	
+	while ((string < end) && (*wild != '*')) {
+		if ((!csql_chareq(*wild, *string, nocase)) && (*wild != '?')) {
+			return 0;
 		}
-		
-		// turn on non-blocking
-		unsigned long ioctl_blocking = 1;    /* ~0; //TRUE; */
-		ioctl(sock_current, FIONBIO, &ioctl_blocking);
-		
-		// initiate non-blocking connect ignoring return code
-		rc = connect(sock_current, addr->ai_addr, addr->ai_addrlen);
-		if (rc < 0) {
-			if (errno != 0 && errno != EINTR && errno != EAGAIN && errno != EINPROGRESS)
-			{
-				// obvious error (e.g. network not reachable) - don't use this socket
-				lastConnectionErrorMessage = strerror(errno);
-				/*
-				printf("connect error: %s (%i)\n", strerror(errno), errno);
-				*/
-				closesocket(sock_current);
-				continue;
+		wild++;
+		string++;
+	}
+	
+	while (string < end) {
+		if (*wild == '*') {
+			if (!*++wild) {
+				return 1;
 			}
+			mp = wild;
+			cp = string+1;
+		} else if ((csql_chareq(*wild, *string, nocase)) || (*wild == '?')) {
+			wild++;
+			string++;
+		} else {
+			wild = mp;
+			string = cp++;
 		}
-		
-		// add sock_current to internal list of trying to connect sockets
-		sock_list[sock_index] = sock_current;
 	}
 	
-	// free not more needed memory
-	freeaddrinfo(addr_list);
-	
-	// calculate the connection timeout and reset timers
-	int connect_timeout = (db->timeout > 0) ? db->timeout : CUBESQL_DEFAULT_TIMEOUT;
-	time_t start = time(NULL);
-	time_t now = start;
-	rc = 0;
+	while (*wild == '*') {
+		wild++;
+	}
 	
-	int sockfd = 0;
-	fd_set write_fds;
-	fd_set except_fds;
-	struct timeval tv;
+	return !*wild;
+}
 
-	while ((now - start) < connect_timeout) {
-		FD_ZERO(&write_fds);
-		FD_ZERO(&except_fds);
-		
-		tv.tv_sec = connect_timeout;
-		tv.tv_usec = 0;
+static int csql_ctz (unsigned int mask) {
+	#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+	#else
+	return __builtin_ctz(mask);
+	#endif
+}
 
-		for (int i=0; i<MAX_SOCK_LIST; ++i) {
-			if (sock_list[i] > 0) {
-				FD_SET(sock_list[i], &write_fds);
-				FD_SET(sock_list[i], &except_fds);
+static int csql_memeq (const char *s, const char *p, int len, int nocase) {
+	// p is already lowercase in the nocase case (ASCII folding, like the SIMD paths)
+	int i;
+	
+	if (nocase == kFALSE) return (memcmp(s, p, len) == 0);
+	for (i=0; i<len; i++) {
+		if (csql_ascii_lower((unsigned char)s[i]) != (unsigned char)p[i]) return kFALSE;
+	}
+	return kTRUE;
+}
 
-				rc = bsd_select(sock_list[i] + 1, NULL, &write_fds, &except_fds, &tv);
-				
-				if (rc == 0) {
-					// timeout - we can't use this socket
-					closesocket(sock_list[i]);
-					sock_list[i] = -1;
-					continue;
-				}
+#if CSQL_SIMD_SSE2
+static __m128i csql_sse2_lower (__m128i v) {
+	// ASCII only: set bit 0x20 for bytes in the 'A'..'Z' range
+	__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A'-1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z'+1)));
+	return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
 
-				if (rc < 0) {
-					if (errno == 0 || errno == EINTR || errno == EAGAIN || errno == EINPROGRESS) {
-						// socket is still connecting
-						continue;
-					}
-					
-					// socket bsd_select error - don't use this socket
-					/*
-					printf("socket bsd_select error: %s (%i)\n", strerror(errno), errno);
-					*/
-					lastConnectionErrorMessage = strerror(errno);
-					closesocket(sock_list[i]);
-					sock_list[i] = -1;
-					continue;
-				}
-			}
-		}
-		
-		// check for error
-		for (int i=0; i<MAX_SOCK_LIST; ++i) {
-			if (sock_list[i] > 0) {
-				if (FD_ISSET(sock_list[i], &except_fds)) {
-					int err = csql_socketerror(sock_list[i]);
-					if (err > 0) {
-						lastConnectionErrorMessage = strerror(err);
-					}
+#if CSQL_SIMD_NEON
+static uint8x16_t csql_neon_lower (uint8x16_t v) {
+	uint8x16_t upper = vandq_u8(vcgeq_u8(v, vdupq_n_u8('A')), vcleq_u8(v, vdupq_n_u8('Z')));
+	return vorrq_u8(v, vandq_u8(upper, vdupq_n_u8(0x20)));
+}
+#endif
 
-					closesocket(sock_list[i]);
-					sock_list[i] = -1;
-				}
+int csql_memfind (const char *s, int slen, const char *p, int plen, int nocase) {
+	// SIMD substring search: compare first and last pattern byte on 16 positions at once
+	// and verify candidates with a full compare (p must be lowercase when nocase is set)
+	int i = 0, last = plen - 1;
+	
+	if (plen == 0) return kTRUE;
+	if (plen > slen) return kFALSE;
+	
+	#if CSQL_SIMD_SSE2
+	{
+		const __m128i vfirst = _mm_set1_epi8(p[0]);
+		const __m128i vlast = _mm_set1_epi8(p[last]);
+		
+		for (; i + last + 16 <= slen; i += 16) {
+			__m128i b0 = _mm_loadu_si128((const __m128i *)(s + i));
+			__m128i b1 = _mm_loadu_si128((const __m128i *)(s + i + last));
+			unsigned int mask;
+			
+			if (nocase) {b0 = csql_sse2_lower(b0); b1 = csql_sse2_lower(b1);}
+			mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(b0, vfirst), _mm_cmpeq_epi8(b1, vlast)));
+			while (mask) {
+				int bit = csql_ctz(mask);
+				if (csql_memeq(s + i + bit, p, plen, nocase)) return kTRUE;
+				mask &= mask - 1;
 			}
 		}
+	}
+	#elif CSQL_SIMD_NEON
+	{
+		const uint8x16_t vfirst = vdupq_n_u8((uint8_t)p[0]);
+		const uint8x16_t vlast = vdupq_n_u8((uint8_t)p[last]);
 		
-		// check which file descriptor is ready for writing (need to check for socket error also)
-		for (int i=0; i<MAX_SOCK_LIST; ++i) {
-			if (sock_list[i] > 0) {
-				if (FD_ISSET(sock_list[i], &write_fds)) {
-					int err = csql_socketerror(sock_list[i]);
-					if (err > 0) {
-						lastConnectionErrorMessage = strerror(err);
-
-						closesocket(sock_list[i]);
-						sock_list[i] = -1;
-					} else {
-						//use this socket - break loop (use first one, don't overwrite sockfd with next possible one)
-						sockfd = sock_list[i];
-						break;
-					}
-				}
+		for (; i + last + 16 <= slen; i += 16) {
+			uint8x16_t b0 = vld1q_u8((const uint8_t *)(s + i));
+			uint8x16_t b1 = vld1q_u8((const uint8_t *)(s + i + last));
+			uint8x16_t eq;
+			uint64_t mask;
+			
+			if (nocase) {b0 = csql_neon_lower(b0); b1 = csql_neon_lower(b1);}
+			eq = vandq_u8(vceqq_u8(b0, vfirst), vceqq_u8(b1, vlast));
+			// narrow the comparison result to 4 bits for each byte
+			mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+			while (mask) {
+				int bit = (mask & 0xFFFFFFFF) ? csql_ctz((unsigned int)mask) : 32 + csql_ctz((unsigned int)(mask >> 32));
+				if (csql_memeq(s + i + (bit >> 2), p, plen, nocase)) return kTRUE;
+				mask &= ~((uint64_t)0xF << (bit & ~3));
 			}
 		}
+	}
+	#endif
+	
+	// scalar tail (and fallback when SIMD is not available)
+	for (; i + last < slen; i++) {
+		if (csql_memeq(s + i, p, plen, nocase)) return kTRUE;
+	}
+	return kFALSE;
+}
 
-		// check if a valid descriptor has been found
-		if (sockfd != 0) break;
-
-		// are there still unclosed sockets trying to connect?
-		int remainingSocketCount = 0;
-		for (int i=0; i<MAX_SOCK_LIST; ++i) {
-			if (sock_list[i] > 0) {
-				remainingSocketCount++;
-			}
-		}
+int csql_format_int64 (int64 value, char *buffer) {
+	// digits are produced two at a time from the end of a local buffer (buffer must hold kNUMBER_SIZE bytes)
+	static const char digits[] =	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+									"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+									"8081828384858687888990919293949596979899";
+	char				tmp[kNUMBER_SIZE], *p = tmp + sizeof(tmp);
+	unsigned long long	u = (value < 0) ? (0ULL - (unsigned long long)value) : (unsigned long long)value;
+	unsigned int		d;
+	int					len;
+	
+	while (u >= 100) {
+		d = (unsigned int)(u % 100) * 2;
+		u /= 100;
+		*--p = digits[d + 1];
+		*--p = digits[d];
+	}
+	if (u >= 10) {
+		d = (unsigned int)u * 2;
+		*--p = digits[d + 1];
+		*--p = digits[d];
+	} else *--p = (char)('0' + u);
+	if (value < 0) *--p = '-';
+	
+	len = (int)((tmp + sizeof(tmp)) - p);
+	memcpy(buffer, p, len);
+	buffer[len] = 0;
+	return len;
+}
 
-		// no sockets remaining - break loop
-		if (remainingSocketCount < 1) break;
+int csql_format_double (double value, char *buffer) {
+	// short text that converts back to exactly the same double (buffer must hold kNUMBER_SIZE bytes)
+	// a value that is n / 10^k with n < 2^53 and k <= 15 is formatted with the digits of n for the smallest k: the division
+	// is correctly rounded like strtod, so the text is exact; the others use the first of %.15g, %.16g, %.17g that round-trips
+	static const double	pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+	char				digits[kNUMBER_SIZE], *p = buffer;
+	double				scaled;
+	long long			m;
+	int					k, n, len, precision;
+	
+	// NaN and infinity keep the previous format
+	if ((value - value) != 0) return snprintf(buffer, kNUMBER_SIZE, "%f", value);
+	
+	for (k=0; k<=15; k++) {
+		scaled = value * pow10[k];
+		if ((scaled >= 9007199254740992.0) || (scaled <= -9007199254740992.0)) break;
+		if ((scaled != (double)(long long)scaled) || (scaled / pow10[k] != value)) continue;
 		
-		// no socket ready yet
-		now = time(NULL);
+		// n / 10^k and (n / 10) / 10^(k-1) are the same number, so trailing zeros are dropped
+		m = (long long)((scaled < 0) ? -scaled : scaled);
+		while ((k > 0) && (m % 10 == 0)) {m /= 10; k--;}
+		n = csql_format_int64(m, digits);
+		if ((value < 0) || ((value == 0) && (1 / value < 0))) *p++ = '-';
+		if (k == 0) {
+			memcpy(p, digits, n); p += n;
+			*p++ = '.'; *p++ = '0';
+		} else if (n <= k) {
+			*p++ = '0'; *p++ = '.';
+			memset(p, '0', k - n); p += k - n;
+			memcpy(p, digits, n); p += n;
+		} else {
+			memcpy(p, digits, n - k); p += n - k;
+			*p++ = '.';
+			memcpy(p, digits + n - k, k); p += k;
+		}
+		*p = 0;
+		return (int)(p - buffer);
 	}
 	
-	// cleanup: close unneeded, still opened sockets
-	for (int i=0; i<MAX_SOCK_LIST; ++i) {
-		if ((sock_list[i] > 0) && (sock_list[i] != sockfd)) closesocket(sock_list[i]);
+	for (precision=15; precision<=17; precision++) {
+		len = snprintf(buffer, kNUMBER_SIZE, "%.*g", precision, value);
+		if (strtod(buffer, NULL) == value) break;
 	}
 	
-	// bail if no socket has been connected because of an error
-	if ((sockfd <= 0) && lastConnectionErrorMessage && (strstr(lastConnectionErrorMessage, "Unknown") == NULL)) {
-		char errorConnectMessage[1024];
+	// the decimal separator of the current locale is not understood by the server
+	for (k=0; k<len; k++) if (buffer[k] == ',') buffer[k] = '.';
+	return len;
+}
 
-		// set error message
-		snprintf(errorConnectMessage, sizeof(errorConnectMessage), "An error occurred while trying to connect: %s", lastConnectionErrorMessage);
-		csql_seterror(db, ERR_SOCKET, errorConnectMessage);
-		return -1;
+char *csql_insert_sql (const char *table, const char *columns, int ncols, int nrows) {
+	// INSERT INTO table (columns) VALUES (?1,?2),(?3,?4)... for nrows rows of ncols values (the result must be freed)
+	char	*sql, *p;
+	int		i, n, len, index;
+	
+	if ((table == NULL) || (columns == NULL) || (ncols <= 0) || (nrows <= 0)) return NULL;
+	
+	// each parameter takes at most kNUMBER_SIZE bytes plus ",?" and each row "(),"
+	len = (int)strlen(table) + (int)strlen(columns) + 32;
+	len += (nrows * 3) + (nrows * ncols * (kNUMBER_SIZE + 2));
+	sql = (char *) malloc(len);
+	if (sql == NULL) return NULL;
+	
+	p = sql + snprintf(sql, len, "INSERT INTO %s (%s) VALUES", table, columns);
+	for (i=0, index=1; i<nrows; i++) {
+		*p++ = (i) ? ',' : ' ';
+		*p++ = '(';
+		for (n=0; n<ncols; n++) {
+			if (n) *p++ = ',';
+			*p++ = '?';
+			p += csql_format_int64(index++, p);
+		}
+		*p++ = ')';
 	}
+	*p++ = ';';
+	*p = 0;
+	return sql;
+}
+
+// MARK: - Arrow IPC -
+
+int csql_fdwrite (int fd, const void *buffer, int64 len) {
+	const char	*p = (const char *)buffer;
+	int64		n;
 	
-	// bail if there was a timeout
-	if ((time(NULL) - start) >= connect_timeout) {
-		csql_seterror(db, ERR_SOCKET_TIMEOUT, "Connection timeout while trying to connect");
-		return -1;
+	while (len > 0) {
+		#ifdef WIN32
+		n = _write(fd, p, (unsigned int)((len > 0x40000000) ? 0x40000000 : len));
+		#else
+		n = write(fd, p, (size_t)len);
+		if ((n < 0) && (errno == EINTR)) continue;
+		#endif
+		if (n <= 0) return kFALSE;
+		p += n;
+		len -= n;
 	}
+	return kTRUE;
+}
+
+void csql_fdclose (int fd) {
+	#ifdef WIN32
+	_close(fd);
+	#else
+	close(fd);
+	#endif
+}
+
+void csql_fb_init (csqlfb *fb) {
+	bzero(fb, sizeof(csqlfb));
+	fb->minalign = 8;
+}
+
+void csql_fb_free (csqlfb *fb) {
+	if (fb->buf) free(fb->buf);
+	csql_fb_init(fb);
+}
+
+static void csql_fb_reset (csqlfb *fb) {
+	// keep the allocated buffer around for the next message
+	fb->size = 0;
+	fb->minalign = 8;
+	fb->nfields = 0;
+}
+
+static unsigned char *csql_fb_head (csqlfb *fb) {
+	return fb->buf + fb->cap - fb->size;
+}
+
+static int csql_fb_reserve (csqlfb *fb, int n) {
+	unsigned char	*p;
+	int				newcap;
 	
-	// bail if no socket has been connected (but we didn't catch an error message to be shown)
-	if (sockfd <= 0) {
-		// set error message
-		csql_seterror(db, ERR_SOCKET, "An error occurred while trying to connect");
-		return -1;
+	if (fb->error) return kFALSE;
+	if (fb->size + n <= fb->cap) return kTRUE;
+	
+	newcap = (fb->cap) ? fb->cap * 2 : 1024;
+	while (newcap < fb->size + n) newcap *= 2;
+	p = (unsigned char *) malloc(newcap);
+	if (p == NULL) {fb->error = kTRUE; return kFALSE;}
+	
+	// content lives at the end of the buffer
+	if (fb->size) memcpy(p + newcap - fb->size, csql_fb_head(fb), fb->size);
+	if (fb->buf) free(fb->buf);
+	fb->buf = p;
+	fb->cap = newcap;
+	return kTRUE;
+}
+
+static void csql_fb_pad (csqlfb *fb, int n) {
+	if ((n <= 0) || (csql_fb_reserve(fb, n) == kFALSE)) return;
+	fb->size += n;
+	bzero(csql_fb_head(fb), n);
+}
+
+static void csql_fb_push (csqlfb *fb, const void *data, int len) {
+	if ((len <= 0) || (csql_fb_reserve(fb, len) == kFALSE)) return;
+	fb->size += len;
+	memcpy(csql_fb_head(fb), data, len);
+}
+
+static void csql_fb_prep (csqlfb *fb, int align, int additional) {
+	// pad so that align is satisfied once additional bytes have been pushed
+	if (align > fb->minalign) fb->minalign = align;
+	csql_fb_pad(fb, (~(fb->size + additional) + 1) & (align - 1));
+}
+
+static void csql_fb_offset (csqlfb *fb, int ref) {
+	// uoffset from the location being written to a previously created object
+	csql_fb_prep(fb, 4, 0);
+	csql_fb_scalar(fb, (unsigned int)(fb->size - ref + 4), 4);
+}
+
+static void csql_fb_slot (csqlfb *fb, int id) {
+	while (fb->nfields <= id) fb->fields[fb->nfields++] = 0;
+	fb->fields[id] = fb->size;
+}
+
+static void csql_le (unsigned char *p, unsigned long long value, int n) {
+	int i;
+	for (i=0; i<n; i++) p[i] = (unsigned char)(value >> (8*i));
+}
+
+void csql_fb_scalar (csqlfb *fb, unsigned long long value, int n) {
+	unsigned char b[8];
+	
+	// flatbuffers are always little endian
+	csql_fb_prep(fb, n, 0);
+	csql_le(b, value, n);
+	csql_fb_push(fb, b, n);
+}
+
+int csql_fb_string (csqlfb *fb, const char *s, int len) {
+	csql_fb_prep(fb, 4, len+1);
+	csql_fb_pad(fb, 1);
+	csql_fb_push(fb, s, len);
+	csql_fb_scalar(fb, (unsigned int)len, 4);
+	return fb->size;
+}
+
+int csql_fb_vector (csqlfb *fb, const int *refs, int n) {
+	int i;
+	
+	csql_fb_prep(fb, 4, 4*n);
+	for (i=n-1; i>=0; i--) csql_fb_offset(fb, refs[i]);
+	csql_fb_scalar(fb, (unsigned int)n, 4);
+	return fb->size;
+}
+
+int csql_fb_structs (csqlfb *fb, const void *data, int elemsize, int n) {
+	// all the structs used by Arrow contain 64bit fields
+	csql_fb_prep(fb, 4, elemsize*n);
+	csql_fb_prep(fb, 8, elemsize*n);
+	csql_fb_push(fb, data, elemsize*n);
+	csql_fb_scalar(fb, (unsigned int)n, 4);
+	return fb->size;
+}
+
+void csql_fb_start (csqlfb *fb) {
+	fb->tstart = fb->size;
+	fb->nfields = 0;
+}
+
+void csql_fb_add_scalar (csqlfb *fb, int id, unsigned long long value, int n) {
+	csql_fb_scalar(fb, value, n);
+	csql_fb_slot(fb, id);
+}
+
+void csql_fb_add_offset (csqlfb *fb, int id, int ref) {
+	csql_fb_offset(fb, ref);
+	csql_fb_slot(fb, id);
+}
+
+int csql_fb_end (csqlfb *fb) {
+	int i, table, vtable;
+	
+	// soffset to the vtable is patched once the vtable has been written
+	csql_fb_scalar(fb, 0, 4);
+	table = fb->size;
+	
+	for (i=fb->nfields-1; i>=0; i--) csql_fb_scalar(fb, (fb->fields[i]) ? (unsigned int)(table - fb->fields[i]) : 0, 2);
+	csql_fb_scalar(fb, (unsigned int)(table - fb->tstart), 2);
+	csql_fb_scalar(fb, (unsigned int)(4 + 2*fb->nfields), 2);
+	vtable = fb->size;
+	
+	if (fb->error == kFALSE) csql_le(fb->buf + fb->cap - table, (unsigned int)(vtable - table), 4);
+	fb->nfields = 0;
+	return table;
+}
+
+int csql_fb_finish (csqlfb *fb, int root) {
+	csql_fb_prep(fb, fb->minalign, 4);
+	csql_fb_offset(fb, root);
+	return (fb->error) ? kFALSE : kTRUE;
+}
+
+int csql_arrow_type (int type) {
+	// values from the Arrow Type union
+	switch (type) {
+		case CUBESQL_Type_Integer: return 2;		// Int
+		case CUBESQL_Type_Float:
+		case CUBESQL_Type_Currency: return 3;		// FloatingPoint
+		case CUBESQL_Type_Blob: return 4;			// Binary
+		case CUBESQL_Type_Boolean: return 6;		// Bool
 	}
+	return 5;										// Utf8 (text, date, time and timestamp)
+}
 
-	// turn off non-blocking
-	unsigned long ioctl_blocking2 = 0;
-	ioctl(sockfd, FIONBIO, &ioctl_blocking2);
+int csql_arrow_schema (csqlfb *fb, csqlc *c) {
+	int		*fields, i, type, len, nameref, children, typeref, vector;
+	char	*name;
+	union {int i; char c;} endian;
 	
-	// socket is connected - now check for SSL
-	#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
-	if (encryption_is_ssl(db->encryption)) {
-		int rc = tls_connect_socket(db->tls_context, sockfd, db->host);
-		if (rc < 0) {
-			db->errcode = ERR_SSL;
-			snprintf(db->errmsg, sizeof(db->errmsg), "Error on tls_connect_socket: %s", tls_error(db->tls_context));
-			closesocket(sockfd);
-			return -1;
+	fields = (int *) malloc(sizeof(int) * ((c->ncols > 0) ? c->ncols : 1));
+	if (fields == NULL) {fb->error = kTRUE; return 0;}
+	
+	for (i=1; i<=c->ncols; i++) {
+		type = csql_arrow_type(cubesql_cursor_columntype(c, i));
+		name = cubesql_cursor_field(c, CUBESQL_COLNAME, i, &len);
+		nameref = csql_fb_string(fb, (name) ? name : "", (name) ? len : 0);
+		children = csql_fb_vector(fb, NULL, 0);
+		
+		// Int has bitWidth and is_signed, FloatingPoint has precision (2 is DOUBLE), others are empty tables
+		csql_fb_start(fb);
+		if (type == 2) {
+			csql_fb_add_scalar(fb, 0, 64, 4);
+			csql_fb_add_scalar(fb, 1, 1, 1);
+		} else if (type == 3) {
+			csql_fb_add_scalar(fb, 0, 2, 2);
 		}
-		db->encryption -= CUBESQL_ENCRYPTION_SSL;
+		typeref = csql_fb_end(fb);
+		
+		// Field: name, nullable, type_type, type, dictionary, children
+		csql_fb_start(fb);
+		csql_fb_add_offset(fb, 0, nameref);
+		csql_fb_add_offset(fb, 3, typeref);
+		csql_fb_add_offset(fb, 5, children);
+		csql_fb_add_scalar(fb, 1, 1, 1);
+		csql_fb_add_scalar(fb, 2, type, 1);
+		fields[i-1] = csql_fb_end(fb);
 	}
-	#endif
-	
-	return sockfd;
+	vector = csql_fb_vector(fb, fields, c->ncols);
+	free(fields);
+	
+	// buffers are written in native byte order so the schema must declare it (0 is Little, 1 is Big)
+	endian.i = 1;
+	csql_fb_start(fb);
+	csql_fb_add_offset(fb, 1, vector);
+	csql_fb_add_scalar(fb, 0, (endian.c == 1) ? 0 : 1, 2);
+	return csql_fb_end(fb);
 }
 
-int csql_bind_value (csqldb *db, int index, int bindtype, char *value, int len) {
-	int field_size[1];
-	int nfields = 0, nsizedim = 0, packet_size = 0, datasize = 0;
+int csql_arrow_message (csqlarrow *w, csqlfb *fb, int header_type, int header, int64 body_len) {
+	unsigned char	prefix[8], zero[8] = {0};
+	int64			*blocks;
+	int				message, metalen, pad;
+	
+	// Message: version, header_type, header, bodyLength
+	csql_fb_start(fb);
+	csql_fb_add_scalar(fb, 3, (unsigned long long)body_len, 8);
+	csql_fb_add_offset(fb, 2, header);
+	csql_fb_add_scalar(fb, 0, CSQL_ARROW_VERSION, 2);
+	csql_fb_add_scalar(fb, 1, header_type, 1);
+	message = csql_fb_end(fb);
+	if (csql_fb_finish(fb, message) == kFALSE) return kFALSE;
+	
+	// encapsulated message: continuation marker, metadata length, metadata padded to 8 bytes
+	pad = (8 - (fb->size % 8)) % 8;
+	metalen = fb->size + pad;
+	csql_le(prefix, CSQL_ARROW_CONTINUATION, 4);
+	csql_le(prefix+4, (unsigned int)metalen, 4);
+	
+	// file footer needs to know where each record batch is located
+	if ((w->format == CUBESQL_ARROW_FILE) && (header_type == 3)) {
+		if (w->nblocks >= w->nalloc) {
+			int nalloc = (w->nalloc) ? w->nalloc * 2 : 64;
+			blocks = (int64 *) realloc(w->blocks, sizeof(int64) * 3 * nalloc);
+			if (blocks == NULL) return kFALSE;
+			w->blocks = blocks;
+			w->nalloc = nalloc;
+		}
+		w->blocks[w->nblocks*3] = w->offset;
+		w->blocks[w->nblocks*3+1] = sizeof(prefix) + metalen;
+		w->blocks[w->nblocks*3+2] = body_len;
+		w->nblocks++;
+	}
 	
-	if ((bindtype == CUBESQL_BIND_NULL) || (bindtype == CUBESQL_BIND_ZEROBLOB)) {
-		value = NULL;
-	} else {
-		if (!value) {value = ""; len = 0;}
+	if (csql_fdwrite(w->fd, prefix, sizeof(prefix)) == kFALSE) return kFALSE;
+	if (csql_fdwrite(w->fd, csql_fb_head(fb), fb->size) == kFALSE) return kFALSE;
+	if ((pad) && (csql_fdwrite(w->fd, zero, pad) == kFALSE)) return kFALSE;
+	w->offset += sizeof(prefix) + metalen;
+	
+	csql_fb_reset(fb);
+	return kTRUE;
+}
+
+int csql_arrow_batch (csqlarrow *w, csqlc *c, csqlchunk *chunk) {
+	csqlarrowbuf	*bufs = NULL, *b;
+	csqlfb			fb;
+	unsigned char	*nodes = NULL, *specs = NULL, *bitmap, zero[8] = {0};
+	char			*field, *values, buf[64];
+	int				*offsets;
+	int				i, j, k, len, type, nbufs = 0, nulls, total, nrows = chunk->nrows, rc = kFALSE;
+	int64			body_len = 0;
+	
+	csql_fb_init(&fb);
+	bufs = (csqlarrowbuf *) calloc(c->ncols * 3 + 1, sizeof(csqlarrowbuf));
+	nodes = (unsigned char *) calloc(c->ncols + 1, 16);
+	specs = (unsigned char *) calloc(c->ncols * 3 + 1, 16);
+	if ((bufs == NULL) || (nodes == NULL) || (specs == NULL)) goto abort;
+	
+	for (i=1; i<=c->ncols; i++) {
+		type = csql_arrow_type(cubesql_cursor_columntype(c, i));
+		
+		// validity bitmap (omitted when the column has no NULL values)
+		bitmap = (unsigned char *) calloc((nrows + 7) / 8, 1);
+		if (bitmap == NULL) goto abort;
+		b = &bufs[nbufs++];
+		b->ptr = (const char *)bitmap;
+		b->len = (nrows + 7) / 8;
+		b->owned = kTRUE;
+		
+		nulls = 0;
+		total = 0;
+		for (j=0; j<nrows; j++) {
+			field = csql_chunk_field(c, chunk, j, i, &len);
+			if (len == -1) ++nulls;
+			else {bitmap[j >> 3] |= (1 << (j & 7)); total += len;}
+		}
+		if (nulls == 0) b->len = 0;
 		
-		// build packet
-		if (value) {
-			if (len == -1) len = (int)strlen(value);
-			nfields = 1;
-			nsizedim = sizeof(int) * nfields;
-			datasize = len;
-			packet_size = datasize + nsizedim;
-			field_size[0] = htonl(datasize);
+		b = &bufs[nbufs++];
+		b->owned = kTRUE;
+		if ((type == 2) || (type == 3)) {
+			// 64bit values parsed the same way as cubesql_cursor_int64 and cubesql_cursor_double
+			int64	*ivalues = NULL;
+			double	*dvalues = NULL;
+			
+			if (type == 2) b->ptr = (const char *)(ivalues = (int64 *) calloc(nrows, sizeof(int64)));
+			else b->ptr = (const char *)(dvalues = (double *) calloc(nrows, sizeof(double)));
+			if (b->ptr == NULL) goto abort;
+			b->len = nrows * 8;
+			
+			for (j=0; j<nrows; j++) {
+				field = csql_chunk_field(c, chunk, j, i, &len);
+				if ((field == NULL) || (len <= 0)) continue;
+				if (len > (int)sizeof(buf)-1) len = (int)sizeof(buf)-1;
+				memcpy(buf, field, len);
+				buf[len] = 0;
+				if (ivalues) ivalues[j] = strtoll(buf, NULL, 0);
+				else dvalues[j] = strtod(buf, NULL);
+			}
+		} else if (type == 6) {
+			// bit packed booleans
+			unsigned char *bits = (unsigned char *) calloc((nrows + 7) / 8, 1);
+			if (bits == NULL) goto abort;
+			b->ptr = (const char *)bits;
+			b->len = (nrows + 7) / 8;
+			
+			for (j=0; j<nrows; j++) {
+				field = csql_chunk_field(c, chunk, j, i, &len);
+				if ((field == NULL) || (len <= 0)) continue;
+				if ((field[0] == 't') || (field[0] == 'T') || ((field[0] >= '1') && (field[0] <= '9'))) bits[j >> 3] |= (1 << (j & 7));
+			}
+		} else if ((c->ncols == 1) && (c->has_rowid == kFALSE) && (chunk->data != NULL)) {
+			// a single column is stored contiguously so psum (with a leading 0) is already the offsets array
+			b->ptr = (const char *)chunk->psum;
+			b->len = nrows * (int)sizeof(int);
+			b->lead = (int)sizeof(int);
+			b->owned = kFALSE;
+			
+			b = &bufs[nbufs++];
+			b->ptr = chunk->data;
+			b->len = chunk->psum[nrows-1];
+		} else {
+			// variable length values gathered from the row major layout
+			offsets = (int *) malloc(sizeof(int) * (nrows + 1));
+			if (offsets == NULL) goto abort;
+			b->ptr = (const char *)offsets;
+			b->len = (nrows + 1) * (int)sizeof(int);
+			
+			b = &bufs[nbufs++];
+			b->owned = kTRUE;
+			b->ptr = values = (char *) malloc((total > 0) ? total : 1);
+			if (values == NULL) goto abort;
+			b->len = total;
+			
+			offsets[0] = 0;
+			for (j=0, k=0; j<nrows; j++) {
+				field = csql_chunk_field(c, chunk, j, i, &len);
+				if ((field) && (len > 0)) {memcpy(values + k, field, len); k += len;}
+				offsets[j+1] = k;
+			}
 		}
+		
+		// FieldNode: length, null_count
+		csql_le(nodes + (i-1)*16, (unsigned long long)nrows, 8);
+		csql_le(nodes + (i-1)*16 + 8, (unsigned long long)nulls, 8);
 	}
 	
-	// prepare BIND command
-	csql_initrequest(db, packet_size, nfields, kVM_BIND, kNO_SELECTOR);
-	db->request.flag3 = (unsigned char) bindtype;
-	db->request.reserved1 = htons(index);
-	if (bindtype == CUBESQL_BIND_ZEROBLOB) db->request.expandedSize = htonl(len);
+	// Buffer: offset, length (each buffer is padded to 8 bytes inside the body)
+	for (k=0; k<nbufs; k++) {
+		len = bufs[k].lead + bufs[k].len;
+		csql_le(specs + k*16, (unsigned long long)body_len, 8);
+		csql_le(specs + k*16 + 8, (unsigned long long)len, 8);
+		body_len += (len + 7) & ~7;
+	}
+	
+	// RecordBatch: length, nodes, buffers
+	{
+		int vnodes = csql_fb_structs(&fb, nodes, 16, c->ncols);
+		int vbuffers = csql_fb_structs(&fb, specs, 16, nbufs);
+		int batch;
+		
+		csql_fb_start(&fb);
+		csql_fb_add_scalar(&fb, 0, (unsigned long long)nrows, 8);
+		csql_fb_add_offset(&fb, 1, vnodes);
+		csql_fb_add_offset(&fb, 2, vbuffers);
+		batch = csql_fb_end(&fb);
+		if (csql_arrow_message(w, &fb, 3, batch, body_len) == kFALSE) goto abort;
+	}
 	
-	// send request
-	csql_netwrite(db, (char *) field_size, nsizedim, (char *)value, datasize);
+	for (k=0; k<nbufs; k++) {
+		len = bufs[k].lead + bufs[k].len;
+		if ((bufs[k].lead) && (csql_fdwrite(w->fd, zero, bufs[k].lead) == kFALSE)) goto abort;
+		if ((bufs[k].len) && (csql_fdwrite(w->fd, bufs[k].ptr, bufs[k].len) == kFALSE)) goto abort;
+		if ((len & 7) && (csql_fdwrite(w->fd, zero, 8 - (len & 7)) == kFALSE)) goto abort;
+	}
+	w->offset += body_len;
+	rc = kTRUE;
 	
-	// read reply
-	return csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT);
+abort:
+	if (bufs) {
+		for (k=0; k<nbufs; k++) if ((bufs[k].owned) && (bufs[k].ptr)) free((void *)bufs[k].ptr);
+		free(bufs);
+	}
+	if (nodes) free(nodes);
+	if (specs) free(specs);
+	csql_fb_free(&fb);
+	return rc;
 }
 
-int csql_bindexecute(csqldb *db, const char *sql, char **colvalue, int *colsize, int *coltype, int nvalues) {
-	int i;
+int csql_arrow_footer (csqlarrow *w, csqlc *c) {
+	csqlfb			fb;
+	unsigned char	*blocks = NULL, tail[10];
+	int				i, schema, vdicts, vbatches, footer, rc = kFALSE;
 	
-	// check for trace function
-	if (db->trace) db->trace(sql, db->data);
+	csql_fb_init(&fb);
+	blocks = (unsigned char *) calloc(w->nblocks + 1, 24);
+	if (blocks == NULL) goto abort;
 	
-	// send sql statement first
-	if (csql_send_statement(db, kCOMMAND_CHUNK_BIND, sql, kFALSE, kFALSE) != CUBESQL_NOERR) return CUBESQL_ERR;
+	// Block: offset, metaDataLength (+ 4 bytes of padding), bodyLength
+	for (i=0; i<w->nblocks; i++) {
+		csql_le(blocks + i*24, (unsigned long long)w->blocks[i*3], 8);
+		csql_le(blocks + i*24 + 8, (unsigned long long)w->blocks[i*3+1], 4);
+		csql_le(blocks + i*24 + 16, (unsigned long long)w->blocks[i*3+2], 8);
+	}
 	
-	// read and check header first
-	if (csql_socketread(db, kTRUE, NO_TIMEOUT) != CUBESQL_NOERR) return CUBESQL_ERR;
-	if (csql_checkheader(db, -1, -1, NULL) != CUBESQL_NOERR) return CUBESQL_ERR;
+	// Footer: version, schema, dictionaries, recordBatches
+	schema = csql_arrow_schema(&fb, c);
+	vdicts = csql_fb_structs(&fb, NULL, 24, 0);
+	vbatches = csql_fb_structs(&fb, blocks, 24, w->nblocks);
+	csql_fb_start(&fb);
+	csql_fb_add_offset(&fb, 1, schema);
+	csql_fb_add_offset(&fb, 2, vdicts);
+	csql_fb_add_offset(&fb, 3, vbatches);
+	csql_fb_add_scalar(&fb, 0, CSQL_ARROW_VERSION, 2);
+	footer = csql_fb_end(&fb);
+	if (csql_fb_finish(&fb, footer) == kFALSE) goto abort;
+	
+	// footer is followed by its length and by the magic string
+	csql_le(tail, (unsigned int)fb.size, 4);
+	memcpy(tail + 4, CSQL_ARROW_MAGIC, 6);
+	if (csql_fdwrite(w->fd, csql_fb_head(&fb), fb.size) == kFALSE) goto abort;
+	if (csql_fdwrite(w->fd, tail, sizeof(tail)) == kFALSE) goto abort;
+	w->offset += fb.size + sizeof(tail);
+	rc = kTRUE;
 	
-	// send individual fields
-	for (i=0; i<nvalues; i++) {
-		// fix to null values
-		if ((coltype[i] == CUBESQL_BIND_NULL) || (coltype[i] == CUBESQL_BIND_TEXT && colvalue[i] == NULL)) {
-			colvalue[i] = "";
-			colsize[i] = 0;
-		}
+abort:
+	if (blocks) free(blocks);
+	csql_fb_free(&fb);
+	return rc;
+}
+
+// MARK: - Export Writer -
+
+void csql_writer_flush (csqlwriter *w) {
+	if ((w->error == kFALSE) && (w->used) && (csql_fdwrite(w->fd, w->buffer, w->used) == kFALSE)) w->error = kTRUE;
+	w->used = 0;
+}
+
+void csql_writer_put (csqlwriter *w, const char *buffer, int len) {
+	if ((w->error) || (len <= 0)) return;
+	
+	if (w->used + len > w->size) {
+		csql_writer_flush(w);
 		
-		// includes the terminal 0
-		if (coltype[i] != CUBESQL_BIND_BLOB) {
-			colsize[i]++;
+		// large values bypass the buffer
+		if (len > w->size) {
+			if (csql_fdwrite(w->fd, buffer, len) == kFALSE) w->error = kTRUE;
+			return;
 		}
+	}
+	memcpy(w->buffer + w->used, buffer, len);
+	w->used += len;
+}
+
+int csql_escape_scan (const char *s, int len, int json) {
+	// returns the index of the first byte that needs to be escaped (len if none)
+	// CSV: comma, quote, CR and LF -- JSON: quote, backslash and control characters
+	int i = 0;
+	
+	#if CSQL_SIMD_SSE2
+	{
+		const __m128i vquote = _mm_set1_epi8('"');
+		const __m128i vsep = _mm_set1_epi8((json) ? '\\' : ',');
+		const __m128i vctrl = _mm_set1_epi8(0x1F);
+		const __m128i vcr = _mm_set1_epi8('\r');
+		const __m128i vlf = _mm_set1_epi8('\n');
 		
-		if (csql_sendchunk(db, colvalue[i], colsize[i], coltype[i], kTRUE) == CUBESQL_ERR)
-			return CUBESQL_ERR;
+		for (; i + 16 <= len; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+			__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, vquote), _mm_cmpeq_epi8(v, vsep));
+			int mask;
+			
+			// unsigned v <= 0x1F is computed as min(v, 0x1F) == v
+			if (json) m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, vctrl), v));
+			else m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, vcr), _mm_cmpeq_epi8(v, vlf)));
+			mask = _mm_movemask_epi8(m);
+			if (mask) return i + csql_ctz((unsigned int)mask);
+		}
+	}
+	#elif CSQL_SIMD_NEON
+	{
+		const uint8x16_t vquote = vdupq_n_u8('"');
+		const uint8x16_t vsep = vdupq_n_u8((json) ? '\\' : ',');
+		const uint8x16_t vctrl = vdupq_n_u8(0x20);
+		const uint8x16_t vcr = vdupq_n_u8('\r');
+		const uint8x16_t vlf = vdupq_n_u8('\n');
 		
-		// read and check header first
-		if (csql_socketread(db, kTRUE, NO_TIMEOUT) != CUBESQL_NOERR) return CUBESQL_ERR;
-		if (csql_checkheader(db, -1, -1, NULL) != CUBESQL_NOERR) return CUBESQL_ERR;
+		for (; i + 16 <= len; i += 16) {
+			uint8x16_t v = vld1q_u8((const uint8_t *)(s + i));
+			uint8x16_t m = vorrq_u8(vceqq_u8(v, vquote), vceqq_u8(v, vsep));
+			uint64_t mask;
+			
+			if (json) m = vorrq_u8(m, vcltq_u8(v, vctrl));
+			else m = vorrq_u8(m, vorrq_u8(vceqq_u8(v, vcr), vceqq_u8(v, vlf)));
+			// narrow the comparison result to 4 bits for each byte
+			mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+			if (mask) return i + (((mask & 0xFFFFFFFF) ? csql_ctz((unsigned int)mask) : 32 + csql_ctz((unsigned int)(mask >> 32))) >> 2);
+		}
 	}
+	#endif
 	
-	// send BIND FINALIZE command
-	return csql_ack(db, kBIND_FINALIZE);
+	// scalar tail (and fallback when SIMD is not available)
+	for (; i<len; i++) {
+		unsigned char ch = (unsigned char)s[i];
+		if (ch == '"') return i;
+		if (json) {
+			if ((ch == '\\') || (ch < 0x20)) return i;
+		} else {
+			if ((ch == ',') || (ch == '\r') || (ch == '\n')) return i;
+		}
+	}
+	return len;
 }
 
-int csql_send_statement (csqldb *db, int command_type, const char *sql, int is_partial, int server_side) {
-	int field_size[1];
-	int nfields, nsizedim, packet_size, datasize = 0;
-	
-	nfields = 1;
-	nsizedim = sizeof(int) * nfields;
-	datasize = (int)strlen(sql) + 1;
-	
-	// build packet
-	packet_size = datasize + nsizedim;
-	csql_initrequest(db, packet_size, nfields, command_type, kNO_SELECTOR);
-	field_size[0] = htonl(datasize);
+void csql_export_csv (csqlwriter *w, const char *s, int len) {
+	// RFC 4180: fields with special characters are quoted and quotes are doubled
+	// an empty string is written as "" so that it differs from NULL
+	int i, n;
 	
-	if (command_type == kCOMMAND_SELECT) {
-		if (server_side == kTRUE) SETBIT(db->request.flag1, CLIENT_REQUEST_SERVER_SIDE);
+	if ((len > 0) && (csql_escape_scan(s, len, kFALSE) == len)) {
+		csql_writer_put(w, s, len);
+		return;
 	}
-	else if (is_partial == kTRUE)
-		SETBIT(db->request.flag1, CLIENT_PARTIAL_PACKET);
 	
-	return csql_netwrite(db, (char *) field_size, nsizedim, (char *) sql, datasize);
+	csql_writer_put(w, "\"", 1);
+	while (len > 0) {
+		// copy up to (and including) the next quote, then double it
+		for (i=0; (i<len) && (s[i] != '"'); i++);
+		n = (i < len) ? i+1 : len;
+		csql_writer_put(w, s, n);
+		if (i < len) csql_writer_put(w, "\"", 1);
+		s += n;
+		len -= n;
+	}
+	csql_writer_put(w, "\"", 1);
 }
 
-csqlc *csql_read_cursor (csqldb *db, csqlc *existing_c) {
-	csqlc	*c = NULL;
-	int		index, gdone = kFALSE, is_partial = kFALSE;
-	int		has_tables, has_rowid, nfields, server_rowcount, server_colcount, cursor_colcount;
-	char	*buffer;
-	int		i, nrows, ncols, count, data_seek = 0, end_chunk;
-	int		*server_types, *server_sizes, *server_sum;
-	char	*server_names, *server_data, *server_tables;
+void csql_export_json (csqlwriter *w, const char *s, int len) {
+	static const char hex[] = "0123456789abcdef";
+	char	esc[6] = {'\\', 'u', '0', '0', 0, 0};
+	int		i;
+	
+	csql_writer_put(w, "\"", 1);
+	while (len > 0) {
+		// copy the clean run found by the SIMD scan
+		i = csql_escape_scan(s, len, kTRUE);
+		csql_writer_put(w, s, i);
+		if (i == len) break;
+		
+		switch (s[i]) {
+			case '"': csql_writer_put(w, "\\\"", 2); break;
+			case '\\': csql_writer_put(w, "\\\\", 2); break;
+			case '\n': csql_writer_put(w, "\\n", 2); break;
+			case '\r': csql_writer_put(w, "\\r", 2); break;
+			case '\t': csql_writer_put(w, "\\t", 2); break;
+			default:
+				esc[4] = hex[((unsigned char)s[i]) >> 4];
+				esc[5] = hex[((unsigned char)s[i]) & 0x0F];
+				csql_writer_put(w, esc, 6);
+		}
+		s += i+1;
+		len -= i+1;
+	}
+	csql_writer_put(w, "\"", 1);
+}
+
+void csql_export_base64 (csqlwriter *w, const unsigned char *s, int len) {
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char	out[256];
+	int		i, n = 0;
 	
-	// allocate basic cursor struct
-	if (existing_c == NULL) {
-		index = 0;
-		c = csql_cursor_alloc(db);
+	csql_writer_put(w, "\"", 1);
+	for (i=0; i<len; i+=3) {
+		unsigned int v = s[i] << 16;
+		if (i+1 < len) v |= s[i+1] << 8;
+		if (i+2 < len) v |= s[i+2];
+		
+		out[n++] = table[(v >> 18) & 0x3F];
+		out[n++] = table[(v >> 12) & 0x3F];
+		out[n++] = (i+1 < len) ? table[(v >> 6) & 0x3F] : '=';
+		out[n++] = (i+2 < len) ? table[v & 0x3F] : '=';
+		if (n >= (int)sizeof(out) - 4) {csql_writer_put(w, out, n); n = 0;}
 	}
-	else {
-		index = 1;
-		c = existing_c;
+	csql_writer_put(w, out, n);
+	csql_writer_put(w, "\"", 1);
+}
+
+int csql_export_isnumber (const char *s, int len) {
+	// strict JSON number grammar, values that do not match are exported as strings
+	int i = 0, digits;
+	
+	if ((i < len) && (s[i] == '-')) i++;
+	if (i == len) return kFALSE;
+	if (s[i] == '0') i++;
+	else if ((s[i] >= '1') && (s[i] <= '9')) {while ((i < len) && (s[i] >= '0') && (s[i] <= '9')) i++;}
+	else return kFALSE;
+	
+	if ((i < len) && (s[i] == '.')) {
+		for (i++, digits = 0; (i < len) && (s[i] >= '0') && (s[i] <= '9'); i++) digits++;
+		if (digits == 0) return kFALSE;
 	}
-			
-	if (c == NULL) {
-		csql_seterror(db, CUBESQL_MEMORY_ERROR, "Unable to allocate cursor struct");
-		return NULL;
+	
+	if ((i < len) && ((s[i] == 'e') || (s[i] == 'E'))) {
+		i++;
+		if ((i < len) && ((s[i] == '+') || (s[i] == '-'))) i++;
+		for (digits = 0; (i < len) && (s[i] >= '0') && (s[i] <= '9'); i++) digits++;
+		if (digits == 0) return kFALSE;
 	}
+	return (i == len);
+}
 
-	// loop to receive cursor
-	do {
-		if (csql_netread (db, -1, -1, kFALSE, &end_chunk, NO_TIMEOUT) != CUBESQL_NOERR) goto abort;
-		if (end_chunk == kTRUE) {
-			
-			gdone = kTRUE;
-			if (c->server_side) c->eof = kTRUE;
-			//else if (db->client_version == k2007PROTOCOL) csql_ack(db, kCHUNK_OK);
-			continue;
-		}
-		
-		// decode reply
-		has_tables = kFALSE;
-		has_rowid = kFALSE;
-		if (TESTBIT(db->reply.flag1, SERVER_HAS_TABLE_NAME)) has_tables = kTRUE;
-		if (TESTBIT(db->reply.flag1, SERVER_PARTIAL_PACKET)) is_partial = kTRUE;
-		if (TESTBIT(db->reply.flag1, SERVER_HAS_ROWID_COLUMN)) has_rowid = kTRUE;
-		if (TESTBIT(db->reply.flag1, SERVER_SERVER_SIDE)) c->server_side = kTRUE;
-		if (c->server_side) is_partial = kFALSE;
-		
-		nfields = ntohl(db->reply.numFields);
-		server_rowcount = ntohl(db->reply.rows);
-		server_colcount = ntohl(db->reply.cols);
-		cursor_colcount = (has_rowid ? server_colcount-1 : server_colcount);
-		nrows = server_rowcount;
-		ncols = cursor_colcount;
-		
-		// adjust pointers
-		buffer = db->inbuffer;
-		if (c->server_side == kFALSE)
-			server_sum = (int *) malloc(server_rowcount * server_colcount * sizeof(int));
-		else
-		{
-			if (c->psum == NULL)
-				server_sum = (int *) malloc(server_rowcount * server_colcount * sizeof(int));
-			else
-				server_sum = c->psum;
-		}
-		if (server_sum == NULL) goto abort_memory;
-		
-		// set buffers
-		server_tables = NULL;
-		if (index == 0) {
-			char	*temp;
-			int		len;
-			
-			if (c->server_side) c->p0 = buffer;
-			server_types = (int *) buffer;
-			server_sizes = (int *) (buffer + (sizeof(int) * server_colcount));
-			server_names = (char *) server_sizes + (server_rowcount * server_colcount * sizeof(int));
-			server_data = server_names;
-			temp = server_names;
-			for (i=0; i < server_colcount; i++) {
-				len = (int)strlen(temp) + 1;
-				data_seek += len;
-				temp += len;
-				server_types[i] = ntohl(server_types[i]);
-			}
-			
-			if (has_tables) {
-				server_tables = server_data + data_seek;
-				temp = server_tables;
-				for (i=0; i < server_colcount; i++) {
-					len = (int)strlen(temp) + 1;
-					data_seek += len;
-					temp += len;
+int csql_export_chunk (csqlc *c, csqlchunk *chunk, void *arg) {
+	csqlexport	*e = (csqlexport *) arg;
+	csqlwriter	*w = &e->w;
+	const char	*eol = (e->options & CUBESQL_EXPORT_CRLF) ? "\r\n" : "\n";
+	int			eollen = (int)strlen(eol);
+	int			jsonlines = (e->options & CUBESQL_EXPORT_JSONLINES);
+	char		*field;
+	int			i, j, len, type;
+	
+	// the first buffer brings column names
+	if (e->started == kFALSE) {
+		e->started = kTRUE;
+		if (e->format == CUBESQL_EXPORT_CSV) {
+			if ((e->options & CUBESQL_EXPORT_NOHEADER) == 0) {
+				for (i=1; i<=c->ncols; i++) {
+					field = cubesql_cursor_field(c, CUBESQL_COLNAME, i, &len);
+					if (i > 1) csql_writer_put(w, ",", 1);
+					csql_export_csv(w, field, len);
 				}
+				csql_writer_put(w, eol, eollen);
 			}
-			server_data += data_seek;
-			c->data_seek = data_seek;
 		} else {
-			server_types = NULL;
-			server_names = NULL;
-			server_tables = NULL;
-			server_sizes = (int *) buffer;
-			server_data = (char *) server_sizes + (server_rowcount * server_colcount * sizeof(int));
-		}
-		
-		// adjust endianess of the size buffer and compute the sum buffer
-		count = server_colcount * server_rowcount;
-		for (i=0; i < count; i++) {
-			server_sizes[i] = ntohl(server_sizes[i]);
-			if (server_sizes[i] == -1) {
-				// special NULL case
-				if (i == 0) server_sum[i] = 0;
-				else server_sum[i] = server_sum[i-1];
-			} else {
-				if (i == 0) server_sum[i] = server_sizes[i];
-				else server_sum[i] = server_sizes[i] + server_sum[i-1];
-			}
-		}
-		
-		if ((is_partial) && (c->nbuffer >= c->nalloc)) {
-			if (csql_cursor_reallocate (c) == kFALSE) { free(server_sum); goto abort_memory; }
-		}
-		
-		// adjust others counters/pointers
-		if (index == 0) {
-			c->types = server_types;
-			c->size = server_sizes;
-			c->names = server_names;
-			c->tables = server_tables;
-			c->data = server_data;
-			c->psum = server_sum;
-			
-			// to speedup cubesql_cursor_value in the in_chunk case
-			c->data0 = server_data;
-			c->size0 = server_sizes;
-		}
-		
-		// adjust pointers for server side cursors
-		if ((c->server_side) && (index > 0)) {
-			c->index++;
-			if ((c->index > 1) && (c->p0 != (char *)c->size)) free(c->size);
-			c->types = (int *) c->p0;
-			c->names = (char *) (c->p0 + (sizeof(int) * server_colcount));
-			c->size = server_sizes;
-			c->data = server_data;
-			c->psum = server_sum;
+			// escape keys once, they are written in front of each value
+			csqlwriter kw;
 			
-			// to speedup csqlcursor_value in the in_chunk case
-			c->data0 = c->data;
-			c->size0 = c->size;
+			bzero(&kw, sizeof(csqlwriter));
+			kw.fd = -1;
+			for (i=1; i<=c->ncols; i++) {
+				cubesql_cursor_field(c, CUBESQL_COLNAME, i, &len);
+				kw.size += (len * 6) + 3;
+			}
+			kw.buffer = e->keys = (char *) malloc(kw.size + 1);
+			e->keylen = (int *) malloc(sizeof(int) * (c->ncols + 1));
+			if ((e->keys == NULL) || (e->keylen == NULL)) {w->error = kTRUE; return kFALSE;}
+			for (i=1; i<=c->ncols; i++) {
+				field = cubesql_cursor_field(c, CUBESQL_COLNAME, i, &len);
+				csql_export_json(&kw, field, len);
+				csql_writer_put(&kw, ":", 1);
+				e->keylen[i] = kw.used;
+			}
+			e->keylen[0] = 0;
+			if (kw.error) {w->error = kTRUE; return kFALSE;}
+			if (jsonlines == 0) csql_writer_put(w, "[", 1);
 		}
-		 
-		//if (db->protocol == k2009PROTOCOL) c->cursor_id = ntohs(db->reply.index);
-		c->has_rowid = has_rowid;
-		c->nrows += nrows;
-		c->ncols = ncols;
-		
-		if (is_partial == kFALSE) {
-			c->p = buffer;
-			c->psum = server_sum;
+	}
+	
+	for (j=0; j<chunk->nrows; j++) {
+		if (e->format == CUBESQL_EXPORT_CSV) {
+			for (i=1; i<=c->ncols; i++) {
+				if (i > 1) csql_writer_put(w, ",", 1);
+				field = csql_chunk_field(c, chunk, j, i, &len);
+				if (len != -1) csql_export_csv(w, field, len);
+			}
+			csql_writer_put(w, eol, eollen);
 		} else {
-			c->buffer[c->nbuffer] = buffer;
-			c->rowsum[c->nbuffer] = server_sum;
-			c->rowcount[c->nbuffer] = c->nrows;
-			c->nbuffer++;
+			if (jsonlines == 0) csql_writer_put(w, (e->nrows) ? ",\n{" : "\n{", (e->nrows) ? 3 : 2);
+			else csql_writer_put(w, "{", 1);
+			
+			for (i=1; i<=c->ncols; i++) {
+				if (i > 1) csql_writer_put(w, ",", 1);
+				csql_writer_put(w, e->keys + e->keylen[i-1], e->keylen[i] - e->keylen[i-1]);
+				
+				field = csql_chunk_field(c, chunk, j, i, &len);
+				type = cubesql_cursor_columntype(c, i);
+				if (len == -1) csql_writer_put(w, "null", 4);
+				else if (type == CUBESQL_Type_Blob) csql_export_base64(w, (const unsigned char *)field, len);
+				else if (type == CUBESQL_Type_Boolean) {
+					if ((len > 0) && ((field[0] == 't') || (field[0] == 'T') || ((field[0] >= '1') && (field[0] <= '9')))) csql_writer_put(w, "true", 4);
+					else csql_writer_put(w, "false", 5);
+				}
+				else if (((type == CUBESQL_Type_Integer) || (type == CUBESQL_Type_Float) || (type == CUBESQL_Type_Currency)) && (csql_export_isnumber(field, len))) csql_writer_put(w, field, len);
+				else csql_export_json(w, field, len);
+			}
+			csql_writer_put(w, "}", 1);
+			if (jsonlines) csql_writer_put(w, eol, eollen);
 		}
-		
-		// reset inbuffer
-		db->inbuffer = NULL;
-		db->insize = 0;
-		
-		// send ACK only in case of chunk cursor
-		if ((is_partial == kTRUE) && (c->server_side == kFALSE)) csql_ack(db, kCHUNK_OK);
-		else gdone = kTRUE;
-		index++;
+		e->nrows++;
 	}
-	while (gdone != kTRUE);
-	return c;
+	
+	return (w->error) ? kFALSE : kTRUE;
+}
 
-abort_memory:
-	csql_seterror(db, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate buffer required to build the cursor");
+// MARK: - Result Cache -
+
+int64 csql_mstime (void) {
+	#ifdef WIN32
+	return (int64)GetTickCount64();
+	#else
+	struct timeval tv;
 	
-abort:
-	if ((c) && (existing_c == NULL)) cubesql_cursor_free(c);
-	return NULL;
+	gettimeofday(&tv, NULL);
+	return ((int64)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+	#endif
 }
 
-int csql_connect_encrypted (csqldb *db) {
-	unsigned char	rand1[kRANDPOOLSIZE], rand2[kRANDPOOLSIZE], rand3[kRANDPOOLSIZE];
-	unsigned char	hash1[SHA1_DIGEST_SIZE], hash2[SHA1_DIGEST_SIZE], hash3[SHA1_DIGEST_SIZE];
-	char			buffer1[SHA1_DIGEST_SIZE+kRANDPOOLSIZE];
-	char			hash[SHA1_DIGEST_SIZE*2+2];
-	char			*p = NULL;
-	int				len, nfields, nsizedim, datasize0, packet_size, field_size[4];
-	int				encryption = db->encryption;
-	int				len2 = 0, is_token = kFALSE;
-	char			*token = NULL, *enc_token = NULL;
-	csql_aes_encrypt_ctx ctx[1];
-	csql_aes_decrypt_ctx ctxd[1];
+int64 csql_cursor_bytes (csqlc *c) {
+	// approximate memory used by a cursor (sizes, offsets and field data)
+	csqlchunk	chunk;
+	int64		bytes = sizeof(csqlc);
+	int			i, j, n, nchunks, cnum = c->ncols + ((c->has_rowid) ? 1 : 0);
+	
+	bytes += cnum * (sizeof(int) + 64);
+	nchunks = csql_cursor_nchunks(c);
+	for (i=0; i<nchunks; i++) {
+		csql_cursor_chunk(c, i, &chunk);
+		n = chunk.nrows * cnum;
+		bytes += n * sizeof(int) * 2;
+		if (n == 0) continue;
+		
+		if (chunk.data) bytes += chunk.psum[n-1];
+		else for (j=0; j<n; j++) if (chunk.size[j] > 0) bytes += chunk.size[j];
+	}
+	return bytes;
+}
+
+static int csql_sql_token (const char *sql, int *pos, const char **tok, int *len) {
+	// returns 'w' for words, 'q' for quoted identifiers, 's' for string literals,
+	// the character itself for punctuation and 0 at the end of the statement
+	const char	*s = sql + *pos;
+	char		close;
 	
-	// reset encryption
-	// because session key hasn't yet been computed
-	db->encryption = CUBESQL_ENCRYPTION_NONE;
+	while (1) {
+		while ((*s) && (isspace((unsigned char)*s))) s++;
+		if ((s[0] == '-') && (s[1] == '-')) {
+			while ((*s) && (*s != '\n')) s++;
+			continue;
+		}
+		if ((s[0] == '/') && (s[1] == '*')) {
+			s += 2;
+			while ((*s) && !((s[0] == '*') && (s[1] == '/'))) s++;
+			if (*s) s += 2;
+			continue;
+		}
+		break;
+	}
 	
-	// check if its a token connect
-	token = cubesql_gettoken(db);
-	if (token != NULL) is_token = kTRUE;
+	*tok = s;
+	*len = 0;
+	if (*s == 0) {*pos = (int)(s - sql); return 0;}
 	
-	// ENCRYPT CONNECT PHASE 1
-	// CLIENT SENDS HASH(USERNAME,X)
-	// AND AESCBC(X;H(X),H(H(P))) WHERE X is a 20-byte random number
+	if ((isalnum((unsigned char)*s)) || (*s == '_') || (*s == '$') || ((unsigned char)*s >= 0x80)) {
+		while ((isalnum((unsigned char)*s)) || (*s == '_') || (*s == '$') || ((unsigned char)*s >= 0x80)) s++;
+		*len = (int)(s - *tok);
+		*pos = (int)(s - sql);
+		return 'w';
+	}
 	
-	// Generate the 20-byte random number X
-	csql_rand_fill((char *)rand1);
+	if ((*s == '\'') || (*s == '"') || (*s == '`') || (*s == '[')) {
+		int type = (*s == '\'') ? 's' : 'q';
+		close = (*s == '[') ? ']' : *s;
+		*tok = ++s;
+		while (*s) {
+			if (*s == close) {
+				// doubled quote is an escaped quote
+				if ((close != ']') && (s[1] == close)) {s += 2; continue;}
+				break;
+			}
+			s++;
+		}
+		*len = (int)(s - *tok);
+		if (*s) s++;
+		*pos = (int)(s - sql);
+		return type;
+	}
 	
-	// Compute H(X)
-	hash_field ((unsigned char*) hash1, (const char *)rand1, kRANDPOOLSIZE, 1);
+	*len = 1;
+	*pos = (int)(s + 1 - sql);
+	return *s;
+}
+
+static int csql_sql_keyword (const char *tok, int len, const char *keyword) {
+	int i;
 	
-	// Compute H(H(P))
-	hash_field ((unsigned char*) hash2, (const char *)db->password, (int)strlen(db->password), 2);
+	for (i=0; i<len; i++) {
+		if (keyword[i] == 0) return kFALSE;
+		if (toupper((unsigned char)tok[i]) != keyword[i]) return kFALSE;
+	}
+	return (keyword[len] == 0);
+}
+
+static int csql_tables_add (char **list, int *len, int *nalloc, const char *name, int namelen) {
+	// list is a sequence of lowercase NULL terminated names, duplicates are skipped
+	char	*p;
+	int		i;
 	
-	// Prepare the 128 bit encryption key
-	csql_aes_encrypt_key ((unsigned char*) hash2, 16, ctx);
+	if (namelen <= 0) return kTRUE;
+	for (p = *list; p < *list + *len; p += strlen(p) + 1) {
+		if ((int)strlen(p) != namelen) continue;
+		for (i=0; i<namelen; i++) if (p[i] != (char)tolower((unsigned char)name[i])) break;
+		if (i == namelen) return kTRUE;
+	}
 	
-	// Prepare X;H(X)
-	memcpy (buffer1, rand1, kRANDPOOLSIZE);
-	memcpy (buffer1+kRANDPOOLSIZE, hash1, SHA1_DIGEST_SIZE);
+	if (*len + namelen + 2 > *nalloc) {
+		int newsize = (*nalloc * 2) + namelen + 2;
+		char *tmp = (char *) realloc(*list, newsize);
+		if (tmp == NULL) return kFALSE;
+		*list = tmp;
+		*nalloc = newsize;
+	}
+	for (i=0; i<namelen; i++) (*list)[*len + i] = (char)tolower((unsigned char)name[i]);
+	(*list)[*len + namelen] = 0;
+	*len += namelen + 1;
+	return kTRUE;
+}
+
+char *csql_sql_tables (const char *sql, const char *coltables, int ncoltables, int *is_write) {
+	// extract the tables referenced by a statement (names following FROM, JOIN, INTO, UPDATE and TABLE)
+	// is_write is set for statements that could modify data
+	const char	*tok, *pending = NULL;
+	char		*list;
+	int			type, len, pendinglen = 0, pos = 0, i;
+	int			first = kTRUE, expect = kFALSE, in_from = kFALSE, is_create = kFALSE;
+	int			listlen = 0, nalloc = 128;
+	
+	if (is_write) *is_write = 0;
+	list = (char *) malloc(nalloc);
+	if (list == NULL) return NULL;
+	
+	while ((type = csql_sql_token(sql, &pos, &tok, &len)) != 0) {
+		// a schema prefix is discarded, the name that follows replaces it
+		if (pending) {
+			if (type == '.') {pending = NULL; expect = kTRUE; continue;}
+			if (csql_tables_add(&list, &listlen, &nalloc, pending, pendinglen) == kFALSE) goto abort;
+			pending = NULL;
+		}
+		
+		if (type == 'w') {
+			if (first) {
+				first = kFALSE;
+				is_create = csql_sql_keyword(tok, len, "CREATE");
+				if ((is_write) && (*is_write == 0)) {
+					if (!csql_sql_keyword(tok, len, "SELECT") && !csql_sql_keyword(tok, len, "EXPLAIN") &&
+							 !csql_sql_keyword(tok, len, "SHOW") && !csql_sql_keyword(tok, len, "VALUES") &&
+							 !csql_sql_keyword(tok, len, "BEGIN") && !csql_sql_keyword(tok, len, "COMMIT") &&
+							 !csql_sql_keyword(tok, len, "END") && !csql_sql_keyword(tok, len, "SAVEPOINT") &&
+							 !csql_sql_keyword(tok, len, "RELEASE") && !csql_sql_keyword(tok, len, "PING") &&
+							 !csql_sql_keyword(tok, len, "SET") && !csql_sql_keyword(tok, len, "USE") &&
+							 !csql_sql_keyword(tok, len, "UNSET")) *is_write = 1;
+				}
+			}
+			
+			if (expect) {
+				if (csql_sql_keyword(tok, len, "IF") || csql_sql_keyword(tok, len, "NOT") || csql_sql_keyword(tok, len, "EXISTS") ||
+					csql_sql_keyword(tok, len, "OR") || csql_sql_keyword(tok, len, "REPLACE") || csql_sql_keyword(tok, len, "IGNORE") ||
+					csql_sql_keyword(tok, len, "ABORT") || csql_sql_keyword(tok, len, "FAIL") || csql_sql_keyword(tok, len, "ROLLBACK") ||
+					csql_sql_keyword(tok, len, "ONLY")) continue;
+				pending = tok;
+				pendinglen = len;
+				expect = kFALSE;
+				continue;
+			}
+			
+			if (csql_sql_keyword(tok, len, "FROM")) {expect = kTRUE; in_from = kTRUE;}
+			else if (csql_sql_keyword(tok, len, "JOIN")) {expect = kTRUE; in_from = kTRUE;}
+			else if (csql_sql_keyword(tok, len, "INTO") || csql_sql_keyword(tok, len, "UPDATE") || csql_sql_keyword(tok, len, "TABLE")) {expect = kTRUE; in_from = kFALSE;}
+			else if ((is_create) && (csql_sql_keyword(tok, len, "ON"))) {expect = kTRUE; in_from = kFALSE;}
+			else if (csql_sql_keyword(tok, len, "WHERE") || csql_sql_keyword(tok, len, "GROUP") || csql_sql_keyword(tok, len, "ORDER") ||
+					 csql_sql_keyword(tok, len, "LIMIT") || csql_sql_keyword(tok, len, "HAVING") || csql_sql_keyword(tok, len, "UNION") ||
+					 csql_sql_keyword(tok, len, "EXCEPT") || csql_sql_keyword(tok, len, "INTERSECT") || csql_sql_keyword(tok, len, "ON") ||
+					 csql_sql_keyword(tok, len, "USING") || csql_sql_keyword(tok, len, "SET") || csql_sql_keyword(tok, len, "VALUES") ||
+					 csql_sql_keyword(tok, len, "SELECT") || csql_sql_keyword(tok, len, "WINDOW")) in_from = kFALSE;
+			continue;
+		}
+		
+		if (type == 'q') {
+			if (expect) {pending = tok; pendinglen = len; expect = kFALSE;}
+			continue;
+		}
+		
+		if (type == 's') continue;
+		
+		// punctuation
+		expect = kFALSE;
+		if (type == ',') expect = in_from;
+		else if ((type == '(') || (type == ')')) in_from = kFALSE;
+		else if (type == ';') {first = kTRUE; in_from = kFALSE; is_create = kFALSE;}
+	}
+	if (pending) {
+		if (csql_tables_add(&list, &listlen, &nalloc, pending, pendinglen) == kFALSE) goto abort;
+	}
 	
-	// Generate AESCBC(X;H(X),H(H(P)))
-	csql_rand_fill((char *)rand2);
-	len = encrypt_buffer (buffer1, SHA1_DIGEST_SIZE+kRANDPOOLSIZE, (char *)rand2, ctx);
+	// merge table names reported by the server for each column
+	if (coltables) {
+		for (i=0; i<ncoltables; i++) {
+			len = (int)strlen(coltables);
+			if (csql_tables_add(&list, &listlen, &nalloc, coltables, len) == kFALSE) goto abort;
+			coltables += len + 1;
+		}
+	}
 	
-	// PHASE 1: SEND DATA
+	list[listlen] = 0;
+	return list;
 	
-	// build packet
-	nfields = 2;
-	nsizedim = sizeof(int) * nfields;
+abort:
+	free(list);
+	return NULL;
+}
+
+int csql_tables_match (const char *tables, const char *table) {
+	// an empty list means that dependencies are unknown so the entry matches any table
+	const char	*p;
+	int			i, len;
 	
-	if (db->useOldProtocol == kFALSE) {
-		hex_hash_field2(hash, db->username, rand2);
-		datasize0 = (int)strlen(hash) + 1;
-		p = (char *)hash;
-	} else {
-		p = (char *)db->username;
-		datasize0 = (int)strlen(db->username) + 1;
+	if (tables[0] == 0) return kTRUE;
+	
+	// schema prefix is ignored
+	p = strrchr(table, '.');
+	if (p) table = p + 1;
+	len = (int)strlen(table);
+	
+	for (p = tables; *p; p += strlen(p) + 1) {
+		if ((int)strlen(p) != len) continue;
+		for (i=0; i<len; i++) if (p[i] != (char)tolower((unsigned char)table[i])) break;
+		if (i == len) return kTRUE;
 	}
+	return kFALSE;
+}
+
+int csql_sql_isuse (const char *sql) {
+	// USE DATABASE and UNSET CURRENT DATABASE change the current database
+	int len;
 	
-	packet_size = datasize0 + len + nsizedim;
-	csql_initrequest(db, packet_size, nfields, kCOMMAND_CONNECT, (is_token) ? kENCRYPT_TOKEN_CONNECT1 : kENCRYPT_CONNECT_PHASE1);
-	db->request.encryptedPacket = encryption;
-	field_size[0] = htonl(datasize0);
-	field_size[1] = htonl(len);
+	while ((*sql) && (isspace((unsigned char)*sql))) sql++;
+	for (len = 0; isalpha((unsigned char)sql[len]); len++);
+	return (csql_sql_keyword(sql, len, "USE") || csql_sql_keyword(sql, len, "UNSET"));
+}
+
+unsigned long long csql_cache_scope (csqldb *db) {
+	// connections to the same server, with the same user and the same current database share entries
+	unsigned long long h;
 	
-	// send header request
-	if (csql_socketwrite(db, (char *)&db->request, kHEADER_SIZE) != CUBESQL_NOERR) goto abort_connect;
+	h = csql_hash64(CSQL_HASH_SEED, db->host, (int)strlen(db->host));
+	h = csql_hash64(h, (const char *)&db->port, sizeof(int));
+	h = csql_hash64(h, db->username, (int)strlen(db->username));
+	return csql_hash64(h, (const char *)&db->cache_scope, sizeof(unsigned long long));
+}
+
+char *csql_cache_key (csqldb *db, const char *sql, const char *params, int paramslen, int *keylen) {
+	// comments, whitespace outside literals and trailing semicolons do not change the key
+	// (a comment counts as whitespace, so it is removed before the whitespace is collapsed)
+	unsigned long long	scope = csql_cache_scope(db);
+	char				*key, *p, quote = 0;
+	int					sqllen = (int)strlen(sql), space;
+	
+	if ((params == NULL) || (paramslen < 0)) paramslen = 0;
+	key = (char *) malloc(sizeof(unsigned long long) + sqllen + 1 + paramslen);
+	if (key == NULL) return NULL;
+	
+	memcpy(key, &scope, sizeof(unsigned long long));
+	p = key + sizeof(unsigned long long);
+	for (; *sql; sql++) {
+		space = kFALSE;
+		if (quote) {
+			if (*sql == quote) quote = 0;
+		} else if ((*sql == '\'') || (*sql == '"') || (*sql == '`')) {
+			quote = *sql;
+		} else if (*sql == '[') {
+			quote = ']';
+		} else if ((sql[0] == '-') && (sql[1] == '-')) {
+			// up to the end of the line (the line break is whitespace too)
+			while ((sql[1]) && (sql[1] != '\n')) sql++;
+			space = kTRUE;
+		} else if ((sql[0] == '/') && (sql[1] == '*')) {
+			for (sql += 2; (sql[0]) && ((sql[0] != '*') || (sql[1] != '/')); sql++);
+			if (sql[0] == 0) break;
+			sql++;
+			space = kTRUE;
+		} else if (isspace((unsigned char)*sql)) {
+			space = kTRUE;
+		}
+		
+		if (space == kFALSE) *p++ = *sql;
+		else if ((p > key + sizeof(unsigned long long)) && (p[-1] != ' ')) *p++ = ' ';
+	}
+	while ((p > key + sizeof(unsigned long long)) && ((p[-1] == ' ') || (p[-1] == ';'))) p--;
+	*p++ = 0;
 	
-	// send size array
-	if (csql_socketwrite(db, (char *)field_size, nsizedim) != CUBESQL_NOERR) goto abort_connect;
+	if (paramslen) memcpy(p, params, paramslen);
+	*keylen = (int)(p - key) + paramslen;
+	return key;
+}
+
+csqlcacheentry *csql_cache_lookup (csqlcache *cache, unsigned long long hash, const char *key, int keylen) {
+	// must be called with the cache locked
+	csqlcacheentry *e;
 	
-	// send username
-	if (csql_socketwrite(db, (char *)p, datasize0) != CUBESQL_NOERR) goto abort_connect;
+	for (e = cache->slots[hash % cache->nslots]; e; e = e->hnext) {
+		if ((e->hash == hash) && (e->keylen == keylen) && (memcmp(e->key, key, keylen) == 0)) return e;
+	}
+	return NULL;
+}
+
+void csql_cache_touch (csqlcache *cache, csqlcacheentry *e) {
+	// move entry to the head of the LRU list (cache must be locked)
+	if (cache->head == e) return;
 	
-	// send rand2
-	if (csql_socketwrite(db, (char *)rand2, BLOCK_LEN) != CUBESQL_NOERR) goto abort_connect;
+	if (e->prev) e->prev->next = e->next;
+	if (e->next) e->next->prev = e->prev;
+	if (cache->tail == e) cache->tail = e->prev;
 	
-	// send encrypted data
-	if (csql_socketwrite(db, (char *)buffer1, SHA1_DIGEST_SIZE+kRANDPOOLSIZE) != CUBESQL_NOERR) goto abort_connect;
+	e->prev = NULL;
+	e->next = cache->head;
+	if (cache->head) cache->head->prev = e;
+	cache->head = e;
+}
+
+csqlc *csql_cache_view (csqlcacheentry *e, csqldb *db) {
+	// shallow copy of the cached cursor, each view has its own position (cache must be locked)
+	csqlc *c = (csqlc *) malloc(sizeof(csqlc));
+	if (c == NULL) return NULL;
 	
-	// ENCRYPT CONNECT PHASE 1.5
-	// CLIENT RECEIVES A 20B RANDOM NUMBER FROM THE SERVER:
-	// AESCBC(Y;H(Y),H(H(P))) WHERE Y is a 20-byte random number
+	memcpy(c, e->c, sizeof(csqlc));
+	c->db = db;
+	c->shared = e;
+	e->refcount++;
+	e->cache->refcount++;
+	return c;
+}
+
+void csql_cache_entry_free (csqlcacheentry *e) {
+	cubesql_cursor_free(e->c);
+	free(e->key);
+	free(e->tables);
+	free(e);
+}
+
+void csql_cache_unlink (csqlcache *cache, csqlcacheentry *e) {
+	// remove entry from the cache (cache must be locked), memory is released when no cursor is using it
+	csqlcacheentry **p;
 	
-	// read reply (encrypted random pool)
-	if (csql_netread(db, BLOCK_LEN + kRANDPOOLSIZE + SHA1_DIGEST_SIZE, 1, kFALSE, NULL, CONNECT_TIMEOUT) != CUBESQL_NOERR) goto abort_connect;
+	for (p = &cache->slots[e->hash % cache->nslots]; *p; p = &(*p)->hnext) {
+		if (*p == e) {*p = e->hnext; break;}
+	}
 	
-	// Decrypt message using H(H(P))
-	// Prepare the 128 bit decryption key
-	csql_aes_decrypt_key ((unsigned char*) hash2, 16, ctxd);
-	decrypt_buffer(db->inbuffer, db->insize, ctxd);
+	if (e->prev) e->prev->next = e->next;
+	if (e->next) e->next->prev = e->prev;
+	if (cache->head == e) cache->head = e->next;
+	if (cache->tail == e) cache->tail = e->prev;
+	e->prev = e->next = e->hnext = NULL;
 	
-	// Now inbuffer is Y;H(Y)
-	// Generate H(Y) from Y and compares it to the H(Y) sent by the server 
-	hash_field (hash3, (const char *)db->inbuffer, kRANDPOOLSIZE, 1);
-	if (memcmp((const void *)hash3, (const void *) (db->inbuffer+kRANDPOOLSIZE), SHA1_DIGEST_SIZE) != 0) goto abort_connect;
+	cache->bytes -= e->bytes;
+	cache->count--;
+	if (--e->refcount == 0) csql_cache_entry_free(e);
+}
+
+void csql_cache_entry_release (csqlcacheentry *e) {
+	csqlcache	*cache = e->cache;
+	int			dofree;
 	
-	// Generate SessionKey by both client and server
-	generate_session_key(db, encryption, (char *)hash2, (char *)rand1, (char *)db->inbuffer);
+	csql_mutex_lock(&cache->mutex);
+	dofree = (--e->refcount == 0);
+	csql_mutex_unlock(&cache->mutex);
 	
-	// ENCRYPT CONNECT PHASE 2
-	// CLIENT SENDS AESCBC(H(P),S) where S is the session_key
+	if (dofree) csql_cache_entry_free(e);
+	csql_cache_release(cache);
+}
+
+void csql_cache_release (csqlcache *cache) {
+	int refcount;
 	
-	// Compute H(P)
-	hash_field ((unsigned char*) hash2, (const char *)db->password, (int)strlen(db->password), 1);
-	csql_rand_fill ((char *)rand2);
-	len = encrypt_buffer ((char *)hash2, SHA1_DIGEST_SIZE, (char *)rand2, db->encryptkey);
+	csql_mutex_lock(&cache->mutex);
+	refcount = --cache->refcount;
+	csql_mutex_unlock(&cache->mutex);
+	if (refcount > 0) return;
 	
-	if (is_token) {
-		int tlen = 0;
-		csql_rand_fill ((char *)rand3);
-		tlen = (int)strlen(token)+1;
-		enc_token = (char *) malloc(tlen + kRANDPOOLSIZE);
-		if (enc_token == NULL) goto abort_connect;
-		enc_token[0] = 0;
-		strcpy(enc_token, token);
-		len2 = encrypt_buffer ((char *)enc_token, tlen, (char *)rand3, db->encryptkey);
+	// last reference, no cursor is using the remaining entries
+	while (cache->head) csql_cache_unlink(cache, cache->head);
+	while (cache->flights) {
+		csqlflight *f = cache->flights;
+		cache->flights = f->next;
+		csql_flight_release(f);
 	}
+	csql_cond_destroy(&cache->cond);
+	csql_mutex_destroy(&cache->mutex);
+	free(cache->slots);
+	free(cache);
+}
+
+void csql_cache_written (csqldb *db, const char *sql) {
+	// invalidate entries that depend on the tables touched by a statement
+	char	*tables, *p;
+	int		is_write;
 	
-	// PHASE 1: SEND DATA
-	nfields = 1;
-	if (is_token) nfields++;
-	nsizedim = sizeof(int) * nfields;
+	tables = csql_sql_tables(sql, NULL, 0, &is_write);
 	
-	// build packet
-	packet_size = len + nsizedim;
-	if (is_token) packet_size += len2;
-	csql_initrequest(db, packet_size, nfields, kCOMMAND_CONNECT, (is_token) ? kENCRYPT_TOKEN_CONNECT2 : kENCRYPT_CONNECT_PHASE2);
-	field_size[0] = htonl(len);
-	if (is_token) field_size[1] = htonl(len2);
+	if ((tables == NULL) || ((is_write) && (tables[0] == 0))) cubesql_cache_invalidate(db->cache, NULL);
+	else if (is_write) {
+		for (p = tables; *p; p += strlen(p) + 1) cubesql_cache_invalidate(db->cache, p);
+	}
+	if (tables) free(tables);
+}
+
+int csql_cond_wait (csql_cond *cond, csql_mutex *mutex, int ms) {
+	// returns kTRUE if the wait timed out (0 ms means no timeout)
+	#ifdef WIN32
+	if (SleepConditionVariableCS(cond, mutex, (ms > 0) ? (DWORD)ms : INFINITE)) return kFALSE;
+	return (GetLastError() == ERROR_TIMEOUT);
+	#else
+	struct timeval	tv;
+	struct timespec	ts;
 	
-	// send header request
-	if (csql_socketwrite(db, (char *)&db->request, kHEADER_SIZE) != CUBESQL_NOERR) goto abort_connect;
+	if (ms <= 0) {
+		pthread_cond_wait(cond, mutex);
+		return kFALSE;
+	}
 	
-	// send size array
-	if (csql_socketwrite(db, (char *)field_size, nsizedim) != CUBESQL_NOERR) goto abort_connect;
+	gettimeofday(&tv, NULL);
+	ts.tv_sec = tv.tv_sec + (ms / 1000);
+	ts.tv_nsec = (tv.tv_usec * 1000) + ((ms % 1000) * 1000000);
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	return (pthread_cond_timedwait(cond, mutex, &ts) == ETIMEDOUT);
+	#endif
+}
+
+csqlflight *csql_flight_lookup (csqlcache *cache, unsigned long long hash, const char *key, int keylen) {
+	// must be called with the cache locked
+	csqlflight *f;
 	
-	// send rand2
-	if (csql_socketwrite(db, (char *)rand2, BLOCK_LEN) != CUBESQL_NOERR) goto abort_connect;
+	for (f = cache->flights; f; f = f->next) {
+		if ((f->hash == hash) && (f->keylen == keylen) && (memcmp(f->key, key, keylen) == 0)) return f;
+	}
+	return NULL;
+}
+
+csqlflight *csql_flight_begin (csqlcache *cache, unsigned long long hash, const char *key, int keylen, csqldb *leader) {
+	// must be called with the cache locked, on memory errors identical queries are simply not merged
+	csqlflight *f = (csqlflight *) malloc(sizeof(csqlflight));
+	if (f == NULL) return NULL;
+	
+	bzero(f, sizeof(csqlflight));
+	f->key = (char *) malloc(keylen);
+	if (f->key == NULL) {free(f); return NULL;}
+	memcpy(f->key, key, keylen);
+	f->keylen = keylen;
+	f->hash = hash;
+	f->leader = leader;
+	f->refcount = 1;
+	
+	f->next = cache->flights;
+	cache->flights = f;
+	return f;
+}
+
+void csql_flight_release (csqlflight *f) {
+	// must be called with the cache locked
+	if (--f->refcount > 0) return;
 	
-	// send hash2
-	if (csql_socketwrite(db, (char *)hash2, SHA1_DIGEST_SIZE) != CUBESQL_NOERR) goto abort_connect;
+	if ((f->result) && (--f->result->refcount == 0)) csql_cache_entry_free(f->result);
+	free(f->key);
+	free(f);
+}
+
+// MARK: - Refresh Merge -
+
+csqlc *csql_refresh_newcursor (csqlc *src, int nrows) {
+	// empty custom cursor with the same columns of src (the rowid column is not part of the merged rows)
+	csqlc	*c;
+	int		*types, i;
+	char	**names;
 	
-	// send token
-	if (is_token) {
-		if (csql_socketwrite(db, (char *)rand3, BLOCK_LEN) != CUBESQL_NOERR) goto abort_connect;
-		if (csql_socketwrite(db, (char *)enc_token, (int)strlen(token)+1) != CUBESQL_NOERR) goto abort_connect;
+	types = (int *) malloc(sizeof(int) * src->ncols);
+	names = (char **) malloc(sizeof(char *) * src->ncols);
+	if ((types == NULL) || (names == NULL)) {
+		if (types) free(types);
+		if (names) free(names);
+		return NULL;
 	}
 	
-	// read header reply and sanity check it
-	if (csql_netread(db, 0, 0, kFALSE, NULL, CONNECT_TIMEOUT) != CUBESQL_NOERR) goto abort_connect;
-	
-	if ((is_token) && (enc_token)) free(enc_token);
-	db->encryption = encryption;
-	return CUBESQL_NOERR;
+	for (i=1; i<=src->ncols; i++) {
+		types[i-1] = cubesql_cursor_columntype(src, i);
+		names[i-1] = cubesql_cursor_field(src, CUBESQL_COLNAME, i, NULL);
+	}
+	c = cubesql_cursor_create(src->db, nrows, src->ncols, types, names);
 	
-abort_connect:
-	if ((is_token) && (enc_token)) free(enc_token);
-	db->encryption = encryption;
-	return CUBESQL_ERR;
+	free(types);
+	free(names);
+	return c;
 }
 
-int csql_connect (csqldb *db, int encryption) {
-	int		field_size[2];
-	int		is_token = kFALSE;
-	int		nfields, nsizedim, packet_size, datasize = 0;
-	char	hval[SHA1_DIGEST_SIZE];
-	char	hash[SHA1_DIGEST_SIZE*2+2];
-	char	*token = NULL, *p = NULL;
+int csql_refresh_addrow (csqlc *c, csqlc *src, csqlchunk *chunk, int row) {
+	// append row (0-based inside chunk) of src, capacity grows geometrically
+	char	*field;
+	int		i, n, len;
 	
-	db->sockfd = csql_socketconnect(db);
-	if (db->sockfd <= 0) goto abort_connect;
+	if (c->nalloc < c->nrows + 1) {
+		int newsize = (c->nalloc > 0) ? c->nalloc * 2 : kDEFAULT_ALLOC_ROWS;
+		
+		char **tmp_buffer = (char **) realloc(c->buffer, sizeof(char *) * c->ncols * newsize);
+		if (tmp_buffer == NULL) return kFALSE;
+		c->buffer = tmp_buffer;
+		
+		int *tmp_size = (int *) realloc(c->size0, sizeof(int) * c->ncols * newsize);
+		if (tmp_size == NULL) return kFALSE;
+		c->size0 = tmp_size;
+		
+		c->nalloc = newsize;
+	}
 	
-	if (encryption_is_ssl(encryption)) encryption -= CUBESQL_ENCRYPTION_SSL;
-	if (encryption != CUBESQL_ENCRYPTION_NONE) return csql_connect_encrypted (db);
+	n = c->nrows * c->ncols;
+	for (i=1; i<=c->ncols; i++, n++) {
+		field = csql_chunk_field(src, chunk, row, i, &len);
+		c->buffer[n] = (char *) malloc((len > 0) ? len : 1);
+		if (c->buffer[n] == NULL) {
+			while (n > c->nrows * c->ncols) free(c->buffer[--n]);
+			return kFALSE;
+		}
+		if (len > 0) memcpy(c->buffer[n], field, len);
+		c->size0[n] = len;
+	}
 	
-	// check if its a token connect
-	token = cubesql_gettoken(db);
-	if (token != NULL) is_token = kTRUE;
+	c->nrows++;
+	if (c->current_row == -1) c->current_row = 1;
+	return kTRUE;
+}
+
+int csql_refresh_compare (const char *s1, int len1, const char *s2, int len2, int numeric) {
+	// NULL values are the lowest ones
+	char	buf1[64], buf2[64];
+	double	d1, d2;
+	int		n;
 	
-	// CLEAR CONNECT PHASE 1
-	// CLIENT SENDS HASH(USERNAME)
-	// AND RECEIVE A 20bytes RANDOM POOL DATA FROM THE SERVER
-	// in the old protocol username was sent in clear
-	nfields = 1;
-	nsizedim = sizeof(int) * nfields;
-	if (db->useOldProtocol == kFALSE) {
-		hex_hash_field(hash, db->username, (int)strlen(db->username));
-		datasize = (int)strlen(hash) + 1;
-		p = (char *)hash;
-	} else {
-		datasize = (int)strlen(db->username) + 1;
-		p = (char *)db->username;
+	if ((len1 < 0) || (len2 < 0)) return (len1 < 0) ? ((len2 < 0) ? 0 : -1) : 1;
+	
+	if ((numeric) && (len1 < (int)sizeof(buf1)) && (len2 < (int)sizeof(buf2))) {
+		memcpy(buf1, s1, len1); buf1[len1] = 0;
+		memcpy(buf2, s2, len2); buf2[len2] = 0;
+		d1 = strtod(buf1, NULL);
+		d2 = strtod(buf2, NULL);
+		return (d1 < d2) ? -1 : ((d1 > d2) ? 1 : 0);
 	}
 	
-	// build packet
-	packet_size = datasize + nsizedim;
-	csql_initrequest(db, packet_size, nfields, kCOMMAND_CONNECT, (is_token) ? kCLEAR_TOKEN_CONNECT1 : kCLEAR_CONNECT_PHASE1);
-	field_size[0] = htonl(datasize);
+	n = memcmp(s1, s2, (len1 < len2) ? len1 : len2);
+	if (n) return n;
+	return len1 - len2;
+}
+
+int csql_refresh_mark (csqlrefresh *r, const char *field, int len) {
+	// raise the high-water mark, NULL values are ignored
+	char *tmp;
 	
-	// send header
-	if (csql_socketwrite(db, (char *)&db->request, kHEADER_SIZE) != CUBESQL_NOERR) goto abort_connect;
+	if (len < 0) return kTRUE;
+	if ((r->hwm) && (csql_refresh_compare(field, len, r->hwm, r->hwmlen, r->hwmnumeric) <= 0)) return kTRUE;
 	
-	// send size array
-	if (csql_socketwrite(db, (char *)field_size, nsizedim) != CUBESQL_NOERR) goto abort_connect;
+	tmp = (char *) realloc(r->hwm, (len > 0) ? len : 1);
+	if (tmp == NULL) return kFALSE;
+	if (len > 0) memcpy(tmp, field, len);
+	r->hwm = tmp;
+	r->hwmlen = len;
+	return kTRUE;
+}
+
+int csql_refresh_find (csqlrefresh *r, const char *key, int keylen) {
+	// returns the 1-based row with the given key or 0
+	csqlc	*c = r->c;
+	int		i, row, n;
 	
-	// send hash (username)
-	if (csql_socketwrite(db, (char *)p, datasize) != CUBESQL_NOERR) goto abort_connect;
+	if ((r->nslots == 0) || (keylen < 0)) return 0;
 	
-	// read random pool
-	if (csql_netread(db, kRANDPOOLSIZE, 1, kFALSE, NULL, CONNECT_TIMEOUT) != CUBESQL_NOERR) goto abort_connect;
+	i = (int)(csql_hash64(CSQL_HASH_SEED, key, keylen) & (unsigned long long)(r->nslots - 1));
+	while ((row = r->slots[i]) != 0) {
+		n = ((row - 1) * c->ncols) + (r->keycolumn - 1);
+		if ((c->size0[n] == keylen) && (memcmp(c->buffer[n], key, keylen) == 0)) return row;
+		i = (i + 1) & (r->nslots - 1);
+	}
+	return 0;
+}
+
+int csql_refresh_index (csqlrefresh *r, int row) {
+	// add row to the key index (row 0 means rebuild the whole index), NULL keys are not indexed
+	csqlc	*c = r->c;
+	int		i, n, nslots;
+	
+	if ((row == 0) || ((c->nrows * 2) > r->nslots)) {
+		for (nslots = 64; nslots < (c->nrows * 2); nslots *= 2);
+		if (nslots != r->nslots) {
+			int *tmp = (int *) realloc(r->slots, sizeof(int) * nslots);
+			if (tmp == NULL) return kFALSE;
+			r->slots = tmp;
+			r->nslots = nslots;
+		}
+		bzero(r->slots, sizeof(int) * r->nslots);
+		
+		for (row = 1; row <= c->nrows; row++) {
+			n = ((row - 1) * c->ncols) + (r->keycolumn - 1);
+			if (c->size0[n] < 0) continue;
+			i = (int)(csql_hash64(CSQL_HASH_SEED, c->buffer[n], c->size0[n]) & (unsigned long long)(r->nslots - 1));
+			while (r->slots[i]) i = (i + 1) & (r->nslots - 1);
+			r->slots[i] = row;
+		}
+		return kTRUE;
+	}
 	
-	// CLEAR CONNECT PHASE 2
-	// CLIENT ENCRYPT PASSWORD WITH THE RANDOM POOL
-	// AND SEND ITS HASH TO THE SERVER
+	n = ((row - 1) * c->ncols) + (r->keycolumn - 1);
+	if (c->size0[n] < 0) return kTRUE;
+	i = (int)(csql_hash64(CSQL_HASH_SEED, c->buffer[n], c->size0[n]) & (unsigned long long)(r->nslots - 1));
+	while (r->slots[i]) i = (i + 1) & (r->nslots - 1);
+	r->slots[i] = row;
+	return kTRUE;
+}
+
+int csql_refresh_full (csqlrefresh *r) {
+	// reload all rows, deleted rows disappear and the high-water mark is computed again
+	csqlc		*src, *c = NULL;
+	csqlchunk	chunk;
+	char		*field;
+	int			i, j, len, nchunks, type;
+	
+	src = cubesql_select(r->db, r->sql, kFALSE);
+	if (src == NULL) return -1;
+	
+	// resolve the mark column by name
+	r->markcolumn = 0;
+	for (i=1; i<=src->ncols; i++) {
+		field = cubesql_cursor_field(src, CUBESQL_COLNAME, i, NULL);
+		if ((field) && (strcasecmp(field, r->mark) == 0)) {r->markcolumn = i; break;}
+	}
+	if (r->markcolumn == 0) {
+		csql_seterror(r->db, CUBESQL_PARAMETER_ERROR, "Unable to find the high-water mark column in the refreshed query");
+		goto abort;
+	}
+	if (r->keycolumn == 0) r->keycolumn = r->markcolumn;
+	if (r->keycolumn > src->ncols) {
+		csql_seterror(r->db, CUBESQL_PARAMETER_ERROR, "Key column out of range in the refreshed query");
+		goto abort;
+	}
+	type = cubesql_cursor_columntype(src, r->markcolumn);
+	
+	c = csql_refresh_newcursor(src, src->nrows);
+	if (c == NULL) goto abort_memory;
+	
+	if (r->hwm) free(r->hwm);
+	r->hwm = NULL;
+	r->hwmlen = 0;
+	r->hwmnumeric = ((type == CUBESQL_Type_Integer) || (type == CUBESQL_Type_Float) || (type == CUBESQL_Type_Currency));
+	
+	nchunks = csql_cursor_nchunks(src);
+	for (i=0; i<nchunks; i++) {
+		csql_cursor_chunk(src, i, &chunk);
+		for (j=0; j<chunk.nrows; j++) {
+			if (csql_refresh_addrow(c, src, &chunk, j) == kFALSE) goto abort_memory;
+			field = csql_chunk_field(src, &chunk, j, r->markcolumn, &len);
+			if ((r->hwmnumeric) && (len >= 0) && (csql_export_isnumber(field, len) == kFALSE)) r->hwmnumeric = kFALSE;
+			if (csql_refresh_mark(r, field, len) == kFALSE) goto abort_memory;
+		}
+	}
+	cubesql_cursor_free(src);
 	
-	// encrypt password with random pool
-	random_hash_field((unsigned char *)hval, (const char *)db->inbuffer, db->password);
+	if (r->c) cubesql_cursor_free(r->c);
+	r->c = c;
+	r->count = 0;
+	if (csql_refresh_index(r, 0) == kFALSE) {
+		csql_seterror(r->db, CUBESQL_MEMORY_ERROR, "Not enough memory to index refreshed rows");
+		return -1;
+	}
+	return c->nrows;
 	
-	nfields = 1;
-	if (is_token) nfields++;
-	nsizedim = sizeof(int) * nfields;
-	datasize = SHA1_DIGEST_SIZE;
-	if (is_token) datasize += strlen(token)+1;
+abort_memory:
+	csql_seterror(r->db, CUBESQL_MEMORY_ERROR, "Not enough memory to copy refreshed rows");
+abort:
+	if (c) cubesql_cursor_free(c);
+	cubesql_cursor_free(src);
+	return -1;
+}
+
+int csql_refresh_equal (csqlc *c, int row, csqlc *delta, csqlchunk *chunk, int j) {
+	// kTRUE if the 1-based row of the merged cursor has the same values as the row j of the delta chunk
+	char	*field;
+	int		k, len, n = (row - 1) * c->ncols;
 	
-	// build packet
-	packet_size = datasize + nsizedim;
-	csql_initrequest(db, packet_size, nfields, kCOMMAND_CONNECT, (is_token) ? kCLEAR_TOKEN_CONNECT2 : kCLEAR_CONNECT_PHASE2);
-	field_size[0] = htonl(SHA1_DIGEST_SIZE);
-	if (is_token) field_size[1] = htonl(strlen(token)+1);
+	for (k=1; k<=c->ncols; k++) {
+		field = csql_chunk_field(delta, chunk, j, k, &len);
+		if ((len != c->size0[n+k-1]) || ((len > 0) && (memcmp(field, c->buffer[n+k-1], len) != 0))) return kFALSE;
+	}
+	return kTRUE;
+}
 	
-	// send header
-	if (csql_socketwrite(db, (char *)&db->request, kHEADER_SIZE) != CUBESQL_NOERR) goto abort_connect;
+int csql_refresh_merge (csqlrefresh *r, csqlc *delta) {
+	// rows with a known key replace the old values, the others are appended
+	// returns the number of changes, -1 in case of error or -2 if the rows must be reloaded
+	csqlc		*c = r->c;
+	csqlchunk	chunk;
+	char		*key, *field, *value;
+	int			i, j, k, n, len, keylen, row, nchunks, nchanges = 0;
+	
+	nchunks = csql_cursor_nchunks(delta);
+	for (i=0; i<nchunks; i++) {
+		csql_cursor_chunk(delta, i, &chunk);
+		for (j=0; j<chunk.nrows; j++) {
+			key = csql_chunk_field(delta, &chunk, j, r->keycolumn, &keylen);
+			
+			// a NULL key does not identify a row (it is not indexed): an identical row is unchanged, any other
+			// one could be new or a modified version of an old one
+			if (keylen < 0) {
+				for (row=1; row<=c->nrows; row++) {
+					if ((c->size0[((row - 1) * c->ncols) + (r->keycolumn - 1)] < 0) && (csql_refresh_equal(c, row, delta, &chunk, j))) break;
+				}
+				if (row > c->nrows) return -2;
+				continue;
+			}
+			row = csql_refresh_find(r, key, keylen);
+			
+			if (row == 0) {
+				if (csql_refresh_addrow(c, delta, &chunk, j) == kFALSE) goto abort;
+				if (csql_refresh_index(r, c->nrows) == kFALSE) goto abort;
+			} else {
+				// skip rows that did not change (the ones with a mark equal to the high-water mark)
+				if (csql_refresh_equal(c, row, delta, &chunk, j)) continue;
+				
+				n = (row - 1) * c->ncols;
+				for (k=1; k<=c->ncols; k++) {
+					field = csql_chunk_field(delta, &chunk, j, k, &len);
+					value = (char *) malloc((len > 0) ? len : 1);
+					if (value == NULL) goto abort;
+					if (len > 0) memcpy(value, field, len);
+					free(c->buffer[n+k-1]);
+					c->buffer[n+k-1] = value;
+					c->size0[n+k-1] = len;
+				}
+			}
+			
+			field = csql_chunk_field(delta, &chunk, j, r->markcolumn, &len);
+			if ((r->hwmnumeric) && (len >= 0) && (csql_export_isnumber(field, len) == kFALSE)) r->hwmnumeric = kFALSE;
+			if (csql_refresh_mark(r, field, len) == kFALSE) goto abort;
+			nchanges++;
+		}
+	}
+	return nchanges;
 	
-	// send size array
-	if (csql_socketwrite(db, (char *)field_size, nsizedim) != CUBESQL_NOERR) goto abort_connect;
+abort:
+	csql_seterror(r->db, CUBESQL_MEMORY_ERROR, "Not enough memory to merge refreshed rows");
+	return -1;
+}
+
+// MARK: - Pager Prefetch -
+
+void csql_sql_strip (char *sql) {
+	// remove trailing semicolons and spaces so that the statement can be used as a subquery
+	int len = (int)strlen(sql);
 	
-	// send SH1 (Encrypted password)
-	if (csql_socketwrite(db, (char *)hval, SHA1_DIGEST_SIZE) != CUBESQL_NOERR) goto abort_connect;
+	while ((len > 0) && ((sql[len-1] == ';') || (isspace((unsigned char)sql[len-1])))) sql[--len] = 0;
+}
+
+char *csql_sql_identifier (char *p, const char *name) {
+	// append a double quoted identifier, p must have room for twice the name plus 2 bytes
+	*p++ = '"';
+	while (*name) {
+		if (*name == '"') *p++ = '"';
+		*p++ = *name++;
+	}
+	*p++ = '"';
+	return p;
+}
+
+char *csql_sql_literal (char *p, const char *value, int len, int numeric) {
+	// append a number or a single quoted string, p must have room for twice the value plus 2 bytes
+	int i;
 	
-	// send token
-	if (is_token) if (csql_socketwrite(db, (char *)token, (int)strlen(token)+1) != CUBESQL_NOERR) goto abort_connect;
+	if (numeric) {
+		memcpy(p, value, len);
+		return p + len;
+	}
 	
-	// read header reply and sanity check it
-	if (csql_netread(db, 0, 0, kFALSE, NULL, CONNECT_TIMEOUT) != CUBESQL_NOERR) goto abort_connect;
+	*p++ = '\'';
+	for (i=0; i<len; i++) {
+		if (value[i] == '\'') *p++ = '\'';
+		*p++ = value[i];
+	}
+	*p++ = '\'';
+	return p;
+}
+
+csqlc *csql_pager_fetch (csqlpager *p, csqldb *db, char **query) {
+	// query of the page that follows the last returned key (first page if there is no last key yet),
+	// it is returned in query (to be freed by the caller) when query is not NULL
+	csqlc	*c;
+	char	*sql, *s;
 	
-	return CUBESQL_NOERR;
+	sql = (char *) malloc(strlen(p->sql) + (strlen(p->key) * 4) + (p->lastlen * 2) + 128);
+	if (sql == NULL) {
+		csql_seterror(db, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate page query");
+		return NULL;
+	}
 	
-abort_connect:
-	return CUBESQL_ERR;
+	s = sql + sprintf(sql, "SELECT * FROM (%s) ", p->sql);
+	if (p->last) {
+		s += sprintf(s, "WHERE ");
+		s = csql_sql_identifier(s, p->key);
+		s += sprintf(s, " > ");
+		s = csql_sql_literal(s, p->last, p->lastlen, p->numeric);
+		*s++ = ' ';
+	}
+	s += sprintf(s, "ORDER BY ");
+	s = csql_sql_identifier(s, p->key);
+	sprintf(s, " LIMIT %d;", p->pagesize);
+	
+	c = cubesql_select(db, sql, kFALSE);
+	if (query) *query = sql;
+	else free(sql);
+	return c;
 }
 
-int csql_netread (csqldb *db, int expected_size, int expected_nfields, int is_chunk, int *end_chunk, int timeout) {
-	int is_end_chunk = kFALSE;
+void csql_pager_join (csqlpager *p) {
+	// waits for the prefetch thread, then the prefetch connection can be used (or disconnected) again
+	if (p->running == kFALSE) return;
 	
-	// read header first
-	if (csql_socketread(db, kTRUE, timeout) != CUBESQL_NOERR) return CUBESQL_ERR;
-	
-	// check header
-	if (csql_checkheader(db, expected_size, expected_nfields, &is_end_chunk) != CUBESQL_NOERR) return CUBESQL_ERR;
+	csql_thread_join(p->thread);
+	p->running = kFALSE;
 	
-	// check end_chunk case
-	if (end_chunk) *end_chunk = is_end_chunk;
-	if ((is_chunk) && (is_end_chunk)) {*end_chunk = is_end_chunk; return CUBESQL_NOERR;}
-	if (db->toread == 0) return CUBESQL_NOERR;
+	if (p->nextsql) {
+		csql_trace(p->prefetchdb, p->nextsql);
+		free(p->nextsql);
+		p->nextsql = NULL;
+	}
+}
 	
-	// if there is something more to read, then read everything into the inbuffer
-	if (csql_checkinbuffer(db) != CUBESQL_NOERR) return CUBESQL_ERR;
-	if (csql_socketread(db, kFALSE, timeout) != CUBESQL_NOERR) return CUBESQL_ERR;
+CSQL_THREAD_PROC csql_pager_thread (void *arg) {
+	// p->last is not modified until the thread is joined
+	csqlpager *p = (csqlpager *)arg;
 	
-	// check if packet is encrypted
-	if (db->reply.encryptedPacket != CUBESQL_ENCRYPTION_NONE)
-		decrypt_buffer(db->inbuffer, db->toread, db->decryptkey);
+	csql_untraced = 1;
+	p->next = csql_pager_fetch(p, p->prefetchdb, &p->nextsql);
+	return 0;
+}
+
+int csql_pager_advance (csqlpager *p, csqlc *c) {
+	// remember the key of the last row, a short page is the last one
+	csqlchunk	chunk;
+	char		*field, *tmp;
+	int			i, len, nchunks, type;
 	
-	// check if packet is compressed
-	if (TESTBIT(db->reply.flag1, SERVER_COMPRESSED_PACKET)) {
-		int		exp_size = ntohl(db->reply.expandedSize);
-		uLong	zExpSize = (uLong)exp_size;
-		char	*buffer;
-		
-		buffer = (char *) malloc(exp_size);
-		if (buffer == NULL) {
-			csql_seterror(db, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate buffer required by the cursor");
-			return CUBESQL_ERR;
+	if (p->keycolumn == 0) {
+		for (i=1; i<=c->ncols; i++) {
+			field = cubesql_cursor_field(c, CUBESQL_COLNAME, i, NULL);
+			if ((field) && (strcasecmp(field, p->key) == 0)) {p->keycolumn = i; break;}
 		}
-		
-		if (uncompress((Bytef *)buffer, &zExpSize, (Bytef *)db->inbuffer, (uLong)db->toread) != Z_OK) {
-			csql_seterror(db, CUBESQL_ZLIB_ERROR, "An error occurred while trying to uncompress received cursor");
-			free(buffer);
-			return CUBESQL_ERR;
+		if (p->keycolumn == 0) {
+			csql_seterror(p->db, CUBESQL_PARAMETER_ERROR, "Unable to find the key column in the paged query");
+			return kFALSE;
 		}
-		
-		free (db->inbuffer);
-		db->inbuffer = buffer;
-		db->insize = exp_size;
+		type = cubesql_cursor_columntype(c, p->keycolumn);
+		p->numeric = ((type == CUBESQL_Type_Integer) || (type == CUBESQL_Type_Float) || (type == CUBESQL_Type_Currency));
 	}
 	
-	return CUBESQL_NOERR;
-}
-
-int csql_checkinbuffer (csqldb *db) {
-	if (db->insize >= db->toread) return CUBESQL_NOERR;
+	if (c->nrows < p->pagesize) p->eof = kTRUE;
+	if (c->nrows == 0) return kTRUE;
 	
-	if (db->inbuffer) free(db->inbuffer);
-	db->insize = 0;
-	db->inbuffer = (char *) malloc (db->toread);
-	if (db->inbuffer == NULL) {
-		csql_seterror(db, CUBESQL_MEMORY_ERROR, "Unable to allocate inbuffer");
-		return CUBESQL_ERR;
+	nchunks = csql_cursor_nchunks(c);
+	csql_cursor_chunk(c, nchunks - 1, &chunk);
+	while ((chunk.nrows == 0) && (nchunks > 1)) csql_cursor_chunk(c, --nchunks - 1, &chunk);
+	field = csql_chunk_field(c, &chunk, chunk.nrows - 1, p->keycolumn, &len);
+	
+	// NULL keys sort first so a NULL last key means that no other page can be selected
+	if (len < 0) {
+		p->eof = kTRUE;
+		return kTRUE;
 	}
-		
-	db->insize = db->toread;
-	return CUBESQL_NOERR;
+	if ((p->numeric) && (csql_export_isnumber(field, len) == kFALSE)) p->numeric = kFALSE;
+	
+	tmp = (char *) realloc(p->last, (len > 0) ? len : 1);
+	if (tmp == NULL) {
+		csql_seterror(p->db, CUBESQL_MEMORY_ERROR, "Not enough memory to store the last page key");
+		return kFALSE;
+	}
+	if (len > 0) memcpy(tmp, field, len);
+	p->last = tmp;
+	p->lastlen = len;
+	return kTRUE;
 }
 
-int csql_netwrite (csqldb *db, char *size_array, int nsize_array, char *buffer, int nbuffer) {
-	char rand1[kRANDPOOLSIZE], *encbuffer = NULL;
-	
-	// send header request
-	if (csql_socketwrite(db, (char *)&db->request, kHEADER_SIZE) != CUBESQL_NOERR) return CUBESQL_ERR;
+// MARK: - Parallel Select -
+
+int csql_parallel_bounds (csqldb *db, const char *sql, const char *partcolumn, int64 *lo, int64 *hi) {
+	// smallest and largest value of the partition column, a non integer column results in a single range
+	csqlc	*c;
+	char	*query, *p, *field, *end, buffer[32];
+	int		len, i, ok[2] = {kFALSE, kFALSE};
+	int64	v[2] = {0, 0};
 	
-	// send size array
-	if (size_array) if (csql_socketwrite(db, size_array, nsize_array) != CUBESQL_NOERR) return CUBESQL_ERR;
+	query = (char *) malloc(strlen(sql) + (strlen(partcolumn) * 4) + 64);
+	if (query == NULL) {
+		csql_seterror(db, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate parallel select");
+		return kFALSE;
+	}
+	p = query + sprintf(query, "SELECT MIN(");
+	p = csql_sql_identifier(p, partcolumn);
+	p += sprintf(p, "), MAX(");
+	p = csql_sql_identifier(p, partcolumn);
+	sprintf(p, ") FROM (%s);", sql);
+	
+	c = cubesql_select(db, query, kFALSE);
+	free(query);
+	if (c == NULL) return kFALSE;
+	
+	for (i=0; i<2; i++) {
+		field = cubesql_cursor_field(c, 1, i+1, &len);
+		if ((field == NULL) || (len <= 0) || (len >= (int)sizeof(buffer))) continue;
+		memcpy(buffer, field, len);
+		buffer[len] = 0;
+		v[i] = (int64) strtoll(buffer, &end, 10);
+		ok[i] = ((*end == 0) && (end != buffer));
+	}
+	cubesql_cursor_free(c);
 	
-	// send buffer as is if it's a not encrypted channel
-	if (db->encryption == CUBESQL_ENCRYPTION_NONE) {
-		if (buffer) if (csql_socketwrite(db, buffer, nbuffer) != CUBESQL_NOERR) return CUBESQL_ERR;
-		return CUBESQL_NOERR;
+	*lo = *hi = 0;
+	if ((ok[0]) && (ok[1]) && (v[0] <= v[1])) {
+		*lo = v[0];
+		*hi = v[1];
 	}
+	return kTRUE;
+}
+
+char *csql_parallel_sql (const char *sql, const char *partcolumn, int first, int last, int64 lo, int64 hi) {
+	// range [lo, hi), the first range also contains NULL values and the last one has no upper bound
+	char	*query, *p;
 	
-	// case buffer is NULL
-	if (buffer == NULL) return CUBESQL_NOERR;
+	query = (char *) malloc(strlen(sql) + (strlen(partcolumn) * 6) + 128);
+	if (query == NULL) return NULL;
 	
-	// generate random pool and encrypt buffer
-	csql_rand_fill(rand1);
-	encbuffer = (char *) malloc (nbuffer+1);
-	if (encbuffer == NULL) {
-		csql_seterror(db, CUBESQL_MEMORY_ERROR, "Unable to allocate encbuffer");
-		return CUBESQL_ERR;
+	p = query + sprintf(query, "SELECT * FROM (%s)", sql);
+	if ((first) && (last)) {
+		strcpy(p, ";");
+		return query;
 	}
-	memcpy (encbuffer, buffer, nbuffer);
-	encrypt_buffer ((char *)encbuffer, nbuffer, rand1, db->encryptkey);
-	
-	// send random pool
-	if (csql_socketwrite(db, rand1, BLOCK_LEN) != CUBESQL_NOERR) goto abort;
 	
-	// send encrypted buffer
-	if (csql_socketwrite(db, encbuffer, nbuffer) != CUBESQL_NOERR) goto abort;
+	p += sprintf(p, " WHERE ");
+	if (first) {
+		*p++ = '(';
+		p = csql_sql_identifier(p, partcolumn);
+		p += sprintf(p, " < %lld OR ", (long long)hi);
+		p = csql_sql_identifier(p, partcolumn);
+		sprintf(p, " IS NULL);");
+		return query;
+	}
 	
-	if (encbuffer) free(encbuffer);
-	return CUBESQL_NOERR;
+	p = csql_sql_identifier(p, partcolumn);
+	p += sprintf(p, " >= %lld", (long long)lo);
+	if (last == kFALSE) {
+		p += sprintf(p, " AND ");
+		p = csql_sql_identifier(p, partcolumn);
+		p += sprintf(p, " < %lld", (long long)hi);
+	}
+	strcpy(p, ";");
+	return query;
+}
 
-abort:
-	if (encbuffer) free(encbuffer);
-	return CUBESQL_ERR;
+CSQL_THREAD_PROC csql_parallel_thread (void *arg) {
+	// also called on the calling thread, every part is traced by csql_parts_run after the join
+	csqlpart	*part = (csqlpart *)arg;
+	csqldb		*db;
+	int			untraced = csql_untraced;
+	
+	db = (part->pool) ? cubesql_pool_acquire(part->pool, 0) : part->db;
+	csql_untraced = 1;
+	part->c = cubesql_select(db, part->sql, kFALSE);
+	csql_untraced = untraced;
+	part->tracedb = db;
+	if (part->c == NULL) {
+		part->errcode = db->errcode;
+		snprintf(part->errmsg, sizeof(part->errmsg), "%s", db->errmsg);
+	}
+	if (part->pool) cubesql_pool_release(part->pool, db);
+	return 0;
 }
 
-int csql_sendchunk (csqldb *db, char *buffer, int bufferlen, int buffertype, int is_bind) {
-	int		err, bsize, is_compressed;
-	char	*b, *dest;
-	uLong	newlen;
-	
-	b = buffer;
-	dest = NULL;
-	bsize = bufferlen;
-	is_compressed = kFALSE;
+csqlc *csql_parts_run (csqlpart *parts, int n, csqldb *errdb) {
+	// run all the parts concurrently (the last one in the calling thread, a part whose thread cannot be created also)
+	// and concatenate the results, in case of error every cursor is freed and the error is set on errdb
+	csqlc	**cursors, *c = NULL;
+	int		i, nok = 0;
 	
-	// try to compress buffer, in case of error just use the uncompressed one
-	newlen = compressBound(bufferlen);
-	dest = (char *) malloc (newlen);
-	if (dest != NULL) {
-		if (compress2((Bytef*)dest, &newlen, (Bytef*)buffer, (uLong)bufferlen, Z_DEFAULT_COMPRESSION) == Z_OK) {
-			b = dest;
-			bsize = (int)newlen;
-			is_compressed = kTRUE;
-		} else {free(dest); dest = NULL;}
+	cursors = (csqlc **) malloc(sizeof(csqlc *) * n);
+	if (cursors == NULL) {
+		csql_seterror(errdb, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate concurrent select");
+		return NULL;
 	}
 	
-	// build packet, the chunk command never sends the field_size, nfield should be set to 1
-	if (is_bind) {
-		csql_initrequest(db, bsize, 1, kCOMMAND_CHUNK_BIND, kBIND_STEP);
-		db->request.flag3 = (unsigned char) buffertype;
+	for (i=0; i<n-1; i++) {
+		if (csql_thread_create(&parts[i].thread, csql_parallel_thread, &parts[i]) == 0) parts[i].running = kTRUE;
+		else csql_parallel_thread(&parts[i]);
 	}
-	else csql_initrequest(db, bsize, 1, kCOMMAND_CHUNK, kNO_SELECTOR);
-	SETBIT(db->request.flag1, CLIENT_PARTIAL_PACKET);
+	csql_parallel_thread(&parts[n-1]);
+	for (i=0; i<n-1; i++) {
+		if (parts[i].running) csql_thread_join(parts[i].thread);
+		parts[i].running = kFALSE;
+	}
+	for (i=0; i<n; i++) csql_trace(parts[i].tracedb, parts[i].sql);
 	
-	if (is_compressed == kTRUE) {
-		SETBIT(db->request.flag1, CLIENT_COMPRESSED_PACKET);
-		db->request.expandedSize = htonl(bufferlen);
+	for (i=0; i<n; i++) {
+		if (parts[i].c == NULL) {
+			csql_seterror(errdb, parts[i].errcode, parts[i].errmsg);
+			goto abort;
+		}
+		cursors[nok++] = parts[i].c;
+		parts[i].c = NULL;
 	}
 	
-	err = csql_netwrite(db, NULL, 0, b, bsize);
-	if (dest != NULL) free(b);
+	c = csql_cursor_concat(cursors, nok);
+	if (c == NULL) {
+		if (cursors[0]->db != errdb) csql_seterror(errdb, cursors[0]->db->errcode, cursors[0]->db->errmsg);
+		goto abort;
+	}
+	free(cursors);
+	return c;
 	
-	return err;
+abort:
+	for (i=0; i<nok; i++) cubesql_cursor_free(cursors[i]);
+	for (i=0; i<n; i++) {
+		if (parts[i].c) cubesql_cursor_free(parts[i].c);
+		parts[i].c = NULL;
+	}
+	free(cursors);
+	return NULL;
 }
 
-char *csql_receivechunk (csqldb *db, int *len, int *is_end_chunk) {
-	int err = csql_netread(db, -1, -1, kTRUE, is_end_chunk, NO_TIMEOUT);
-	if (err == CUBESQL_ERR) csql_ack(db, kCHUNK_ABORT);
-	if (err != CUBESQL_NOERR) return NULL;
+csqlc *csql_cursor_concat (csqlc **parts, int nparts) {
+	// on success the parts are owned by the returned cursor (a single part is returned as is)
+	csqlc	*c, *first = parts[0];
+	int		i;
 	
-	*len = db->insize;
-	return db->inbuffer;
+	for (i=1; i<nparts; i++) {
+		if ((parts[i]->ncols != first->ncols) || (parts[i]->has_rowid != first->has_rowid)) {
+			csql_seterror(first->db, CUBESQL_PARAMETER_ERROR, "Parallel select returned a different layout in each range");
+			return NULL;
+		}
+	}
+	for (i=0; i<nparts; i++) {
+		if ((parts[i]->server_side) || (parts[i]->shared) || (parts[i]->cursor_id == -1)) {
+			csql_seterror(first->db, CUBESQL_PARAMETER_ERROR, "Unable to concatenate custom or server side cursors");
+			return NULL;
+		}
+	}
+	if (nparts == 1) return first;
+	
+	c = (csqlc *) malloc(sizeof(csqlc));
+	if (c == NULL) goto abort_memory;
+	bzero(c, sizeof(csqlc));
+	
+	c->parts = (csqlc **) malloc(sizeof(csqlc *) * nparts);
+	c->rowcount = (int *) malloc(sizeof(int) * nparts);
+	if ((c->parts == NULL) || (c->rowcount == NULL)) {
+		if (c->parts) free(c->parts);
+		if (c->rowcount) free(c->rowcount);
+		free(c);
+		goto abort_memory;
+	}
+	
+	for (i=0; i<nparts; i++) {
+		c->parts[i] = parts[i];
+		c->nrows += parts[i]->nrows;
+		c->rowcount[i] = c->nrows;
+	}
+	c->nparts = nparts;
+	c->cursor_id = kCURSOR_CONCAT;
+	c->db = first->db;
+	c->ncols = first->ncols;
+	c->has_rowid = first->has_rowid;
+	c->names = first->names;
+	c->tables = first->tables;
+	c->types = first->types;
+	c->current_row = 1;
+	return c;
+	
+abort_memory:
+	csql_seterror(first->db, CUBESQL_MEMORY_ERROR, "Not enough memory to concatenate cursors");
+	return NULL;
 }
 
-int csql_ack(csqldb *db, int chunk_code) {
-	if (chunk_code == kCOMMAND_ENDCHUNK) {
-		csql_initrequest(db, 0, 0, kCOMMAND_ENDCHUNK, kNO_SELECTOR);
-		csql_netwrite(db, NULL, 0, NULL, 0);
-		goto read_reply;
-	}
+int csql_concat_chunk (csqlc *c, int nindex, csqlchunk *chunk) {
+	// chunks of the parts one after the other, firstrow is relative to the concatenated cursor
+	int i, n;
 	
-	if ((chunk_code == kBIND_FINALIZE) || (chunk_code == kBIND_ABORT)) {
-		csql_initrequest(db, 0, 0, kCOMMAND_CHUNK_BIND, chunk_code);
-		csql_netwrite(db, NULL, 0, NULL, 0);
-		goto read_reply;
+	// merged rows are a single chunk of field pointers
+	if (c->buffer) {
+		chunk->firstrow = 1;
+		chunk->nrows = c->nrows;
+		chunk->size = c->size0;
+		return kTRUE;
 	}
 	
-	// other cases
-	csql_initrequest(db, 0, 0, kCOMMAND_CHUNK, chunk_code);
-	return csql_netwrite(db, NULL, 0, NULL, 0);
+	for (i=0; i<c->nparts; i++) {
+		n = csql_cursor_nchunks(c->parts[i]);
+		if (nindex < n) break;
+		nindex -= n;
+	}
+	if (i == c->nparts) return kFALSE;
 	
-read_reply:	
-	return csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT);
+	if (csql_cursor_chunk(c->parts[i], nindex, chunk) == kFALSE) return kFALSE;
+	if (i > 0) chunk->firstrow += c->rowcount[i-1];
+	return kTRUE;
 }
 
-int csql_socketwrite (csqldb *db, const char *buffer, int nbuffer) {
-	int fd, ret, nwritten, nleft = nbuffer;
-	const char *ptr = buffer;
-	fd_set except_fds;
-	fd_set write_fds;
-	struct timeval tv;
+char *csql_concat_field (csqlc *c, int row, int column, int *len) {
+	// parts and their chunks are searched without touching their current buffer (views can share the parts)
+	csqlchunk	chunk;
+	csqlc		*part;
+	char		*field;
+	int			lo, hi, mid, n;
 	
-	fd = db->sockfd;
-	while (nleft > 0) {
-		FD_ZERO(&write_fds);
-		FD_SET(fd, &write_fds);
-		FD_ZERO(&except_fds);
-		FD_SET(fd, &except_fds);
-		
-		tv.tv_sec = db->timeout;
-		tv.tv_usec = 0;
-		
-		ret = bsd_select(fd+1, NULL, &write_fds, &except_fds, &tv);
-		
-		// something wrong occurred
-		if (FD_ISSET(fd, &except_fds)) {
-			csql_seterror(db, ERR_SOCKET, "select returns except_fds inside csql_socketwrite");
-			return CUBESQL_ERR;
-		}
-		
-		// check if it is a real error
-		if (ret == -1) {
-			int err = csql_socketerror(fd);
-			if (err == 0) continue;
-			
-			csql_seterror(db, err, "An error occurred inside csql_socketwrite");
-			return CUBESQL_ERR;
-		}
-		
-		// ret = 0 means timeout
-		if (ret <= 0) {
-			csql_seterror(db, ERR_SOCKET_TIMEOUT, "A timeout error occurred inside csql_socketwrite");
-			return CUBESQL_ERR;
+	if ((row <= 0) || (row > c->nrows)) return NULL;
+	if (column == CUBESQL_ROWID) {
+		if (c->has_rowid == kFALSE) return NULL;
+		column = 0;
+	}
+	
+	// merged rows point to the fields of the parts
+	if (c->buffer) {
+		if (c->has_rowid) n = ((row-1) * (c->ncols + 1)) + column;
+		else n = ((row-1) * c->ncols) + (column-1);
+		if (len) *len = c->size0[n];
+		return (c->size0[n] == -1) ? NULL : c->buffer[n];
+	}
+	
+	// first part whose cumulative row count reaches row
+	lo = 0; hi = c->nparts - 1;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (c->rowcount[mid] >= row) hi = mid;
+		else lo = mid + 1;
+	}
+	part = c->parts[lo];
+	if (lo > 0) row -= c->rowcount[lo-1];
+	
+	// then the chunk of the part
+	n = 0;
+	if (part->nbuffer) {
+		lo = 0; hi = part->nbuffer - 1;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (part->rowcount[mid] >= row) hi = mid;
+			else lo = mid + 1;
 		}
-		
-		if (FD_ISSET(fd, &write_fds)) {
-			FD_CLR(fd, &write_fds);
+		n = lo;
+	}
+	if (csql_cursor_chunk(part, n, &chunk) == kFALSE) return NULL;
+	
+	field = csql_chunk_field(part, &chunk, row - chunk.firstrow, column, &n);
+	if (len) *len = n;
+	return field;
+}
 
-			#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
-			nwritten = (db->tls_context) ? (int)tls_write(db->tls_context, ptr, nleft) : (int)sock_write(fd, ptr, nleft);
-			if (nwritten == TLS_WANT_POLLIN || nwritten == TLS_WANT_POLLOUT) continue;
-			#else
-			nwritten = (int)sock_write(fd, ptr, nleft);
-			#endif
+// MARK: - Shards Merge -
 
-			if (nwritten <= 0) {
-				csql_seterror(db, ERR_SOCKET_WRITE, "An error occurred while trying to execute sock_write");
-				return CUBESQL_ERR;
-			}
+unsigned long long csql_hash_mix (unsigned long long h) {
+	// FNV-1a of short similar strings (shard names, keys) is not spread enough to be placed on a ring
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
 
-			nleft -= nwritten;
-			ptr += nwritten;
-		}
-	}
+static int csql_ring_compare (const void *p1, const void *p2) {
+	const csqlringpoint *a = (const csqlringpoint *)p1;
+	const csqlringpoint *b = (const csqlringpoint *)p2;
 	
-	return CUBESQL_NOERR;
+	if (a->hash != b->hash) return (a->hash < b->hash) ? -1 : 1;
+	return a->shard - b->shard;
 }
 
-int csql_socketread (csqldb *db, int is_header, int timeout) {
-	int		nread, nleft, ret, fd = db->sockfd;
-	char	*ptr;
-	fd_set read_fds;
-	fd_set except_fds;
-	struct timeval tv;
+int csql_shards_ring (csqlshards *s) {
+	// each shard is placed kSHARD_POINTS times so that keys are evenly distributed
+	char	buffer[32];
+	int		i, j, n;
 	
-	if (is_header == kTRUE) {
-		ptr = (char *)&db->reply;
-		nleft = kHEADER_SIZE;
+	s->ring = (csqlringpoint *) malloc(sizeof(csqlringpoint) * s->count * kSHARD_POINTS);
+	if (s->ring == NULL) return kFALSE;
+	
+	for (i=0, n=0; i<s->count; i++) {
+		for (j=0; j<kSHARD_POINTS; j++, n++) {
+			s->ring[n].hash = csql_hash64(CSQL_HASH_SEED, s->names[i], (int)strlen(s->names[i]));
+			snprintf(buffer, sizeof(buffer), "#%d", j);
+			s->ring[n].hash = csql_hash_mix(csql_hash64(s->ring[n].hash, buffer, (int)strlen(buffer)));
+			s->ring[n].shard = i;
+		}
 	}
-	else {
-		ptr = (char *)db->inbuffer;
-		nleft = db->toread;
+	qsort(s->ring, n, sizeof(csqlringpoint), csql_ring_compare);
+	s->nring = n;
+	return kTRUE;
+}
+
+int csql_sql_orderby (const char *sql, csqlc *c, csqlsortkey *keys, int maxkeys) {
+	// resolve the ORDER BY terms of the outer statement against the columns of c, returns 0 if there is no
+	// ORDER BY and -1 if it cannot be reproduced on the client (expressions, collations, NULLS FIRST/LAST)
+	const char	*tok, *name;
+	char		*field;
+	int			pos = 0, depth = 0, type, len, namelen, nkeys = 0, i, n, orderpos = -1;
+	
+	// last ORDER BY outside parentheses
+	while ((type = csql_sql_token(sql, &pos, &tok, &len)) != 0) {
+		if (type == '(') depth++;
+		else if (type == ')') depth--;
+		else if ((type == 'w') && (depth == 0) && (csql_sql_keyword(tok, len, "ORDER"))) {
+			n = pos;
+			if ((csql_sql_token(sql, &n, &tok, &len) == 'w') && (csql_sql_keyword(tok, len, "BY"))) {
+				orderpos = n;
+				pos = n;
+			}
+		}
 	}
+	if (orderpos < 0) return 0;
 	
+	pos = orderpos;
 	while (1) {
-		FD_ZERO(&read_fds);
-		FD_SET(fd, &read_fds);
-		FD_ZERO(&except_fds);
-		FD_SET(fd, &except_fds);
-		
-		if (timeout != NO_TIMEOUT) {
-			tv.tv_sec = timeout;
-			tv.tv_usec = 0;
-			ret = bsd_select(fd+1, &read_fds, NULL, &except_fds, &tv);
-		} else
-			ret = bsd_select(fd+1, &read_fds, NULL, &except_fds, NULL);
+		if (nkeys == maxkeys) return -1;
 		
-		if (FD_ISSET(fd, &except_fds)) {
-			// this may only happen on Windows
-			csql_seterror(db, ERR_SOCKET_READ, "select returns except_fds inside csql_socketread");
-			return CUBESQL_ERR;
+		// term is a (qualified) column name or a column position
+		type = csql_sql_token(sql, &pos, &name, &namelen);
+		if ((type != 'w') && (type != 'q')) return -1;
+		n = pos;
+		while (csql_sql_token(sql, &n, &tok, &len) == '.') {
+			type = csql_sql_token(sql, &n, &name, &namelen);
+			if ((type != 'w') && (type != 'q')) return -1;
+			pos = n;
 		}
 		
-		// check if it is a real error
-		if (ret == -1) {
-			int err = csql_socketerror(fd);
-			if (err == 0) continue;
-			
-			csql_seterror(db, err, "An error occurred while executing csql_socketread");
-			return CUBESQL_ERR;
-		}
-
-		// ret = 0 means timeout
-		if (ret <= 0) {
-			csql_seterror(db, ERR_SOCKET_TIMEOUT, "A timeout error occurred inside csql_socketread");
-			return CUBESQL_ERR;
+		keys[nkeys].column = -1;
+		if ((type == 'w') && (isdigit((unsigned char)name[0]))) {
+			i = atoi(name);
+			if ((i <= 0) || (i > c->ncols)) return -1;
+			keys[nkeys].column = i;
+		} else {
+			for (i=1; i<=c->ncols; i++) {
+				field = cubesql_cursor_field(c, CUBESQL_COLNAME, i, NULL);
+				if ((field) && ((int)strlen(field) == namelen) && (strncasecmp(field, name, namelen) == 0)) {keys[nkeys].column = i; break;}
+			}
+			if ((keys[nkeys].column == -1) && (c->has_rowid) && (namelen == 5) && (strncasecmp(name, "rowid", 5) == 0)) keys[nkeys].column = 0;
+			if (keys[nkeys].column == -1) return -1;
 		}
+		i = (keys[nkeys].column) ? cubesql_cursor_columntype(c, keys[nkeys].column) : CUBESQL_Type_Integer;
+		keys[nkeys].numeric = ((i == CUBESQL_Type_Integer) || (i == CUBESQL_Type_Float) || (i == CUBESQL_Type_Currency));
+		keys[nkeys].desc = kFALSE;
 		
-		#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
-		nread = (db->tls_context) ? (int)tls_read(db->tls_context, ptr, nleft) : (int)sock_read(fd, ptr, nleft);
-		if (nread == TLS_WANT_POLLIN || nread == TLS_WANT_POLLOUT) continue;
-		#else
-		nread = (int)sock_read(fd, ptr, nleft);
-		#endif
-
-		if (nread <= 0) {
-			csql_seterror(db, ERR_SOCKET_READ, "An error occurred while executing sock_read");
-			return CUBESQL_ERR;
+		type = csql_sql_token(sql, &pos, &tok, &len);
+		if ((type == 'w') && ((csql_sql_keyword(tok, len, "ASC")) || (csql_sql_keyword(tok, len, "DESC")))) {
+			keys[nkeys].desc = csql_sql_keyword(tok, len, "DESC");
+			type = csql_sql_token(sql, &pos, &tok, &len);
 		}
+		nkeys++;
 		
-		nleft -= nread;
-		ptr += nread;
-		
-		if (nleft == 0)
-			return CUBESQL_NOERR;
+		if (type == ',') continue;
+		if ((type == 0) || (type == ';')) break;
+		if ((type == 'w') && ((csql_sql_keyword(tok, len, "LIMIT")) || (csql_sql_keyword(tok, len, "OFFSET")))) break;
+		return -1;
 	}
+	return nkeys;
 }
-
-void csql_seterror(csqldb *db, int errcode, const char *errmsg) {
-	db->errcode = errcode;
-	snprintf(db->errmsg, sizeof(db->errmsg), "%s", errmsg);
-}
-
-int csql_socketerror (int fd) {
-	int			err, sockerr;
-	socklen_t	errlen = sizeof(err);
-
-	sockerr = bsd_getsockopt(fd, SOL_SOCKET, SO_ERROR, (char *)&err, &errlen);
-
-	if (sockerr < 0)
-		return -1;
-	
-	if (err == 0 || err == EINTR || err == EAGAIN || err == EINPROGRESS)
-		return 0;
 	
-	return err;	
-}
-
-int csql_checkheader(csqldb *db, int expected_size, int expected_nfields, int *end_chunk) {
-	outhead *header = &db->reply;
-	unsigned int	signature;
-	int	err, dsize, nfields;
+static int csql_sql_integer (const char *sql, int *pos, int *value) {
+	// optionally signed integer literal, negative values are returned as -1
+	const char	*tok;
+	int			type, len, i, sign = 1;
+	long long	n = 0;
 	
-	if (end_chunk) *end_chunk = kFALSE;
-	db->toread = 0;
-
-	signature = ntohl(header->signature);
-	if (signature != PROTOCOL_SIGNATURE) {
-		csql_seterror (db, ERR_WRONG_SIGNATURE, "Wrong SIGNATURE HEADER from the server");
-		return CUBESQL_ERR;
+	type = csql_sql_token(sql, pos, &tok, &len);
+	if ((type == '-') || (type == '+')) {
+		if (type == '-') sign = -1;
+		type = csql_sql_token(sql, pos, &tok, &len);
 	}
-	
-	err = ntohs(header->errorCode);
-	if (err == END_CHUNK) {
-		if (end_chunk) *end_chunk = kTRUE;
-		err = 0;
+	if (type != 'w') return kFALSE;
+	for (i=0; i<len; i++) {
+		if (!isdigit((unsigned char)tok[i])) return kFALSE;
+		if (n < 0x7FFFFFFF) n = (n * 10) + (tok[i] - '0');
 	}
+	if (n > 0x7FFFFFFF) n = 0x7FFFFFFF;
+	*value = (sign < 0) ? ((n) ? -1 : 0) : (int)n;
+	return kTRUE;
+}
 	
-	dsize = ntohl(header->packetSize);
-	if ((err == 0) && (expected_size != -1) && (expected_size != dsize)) {
-		csql_seterror (db, ERR_WRONG_SIGNATURE, "Wrong PACKET SIZE received from the server");
-		return CUBESQL_ERR;
+int csql_sql_limit (const char *sql, int *limit, int *offset) {
+	// offset of the LIMIT clause that ends the outer statement or -1 if there is none; limit (-1 for no limit) and
+	// offset are set for LIMIT n, LIMIT n OFFSET m and LIMIT m, n with integer literals, otherwise limit is -2
+	const char	*tok;
+	int			pos = 0, depth = 0, type, len, start = -1, limitpos = -1, n1, n2, sep;
+	
+	*limit = -1;
+	*offset = 0;
+	
+	// last LIMIT outside parentheses
+	while ((type = csql_sql_token(sql, &pos, &tok, &len)) != 0) {
+		if (type == '(') depth++;
+		else if (type == ')') depth--;
+		else if ((type == 'w') && (depth == 0) && (csql_sql_keyword(tok, len, "LIMIT"))) {
+			start = (int)(tok - sql);
+			limitpos = pos;
+		}
 	}
-	db->toread = dsize;
+	if (limitpos < 0) return -1;
+	
+	pos = limitpos;
+	*limit = -2;
+	if (csql_sql_integer(sql, &pos, &n1) == kFALSE) return start;
 	
-	nfields = ntohl(header->numFields);
-	if ((err == 0) && (expected_nfields != -1) && (expected_nfields != nfields)) {
-		csql_seterror (db, ERR_WRONG_SIGNATURE, "Wrong NUMBER OF FIELDS received from the server");
-		return CUBESQL_ERR;
+	type = csql_sql_token(sql, &pos, &tok, &len);
+	if ((type == 0) || (type == ';')) {
+		*limit = n1;
+		return start;
 	}
 	
-	if ((err != 0) && (dsize)) {
-		// read error string
-		// it is an error and it is dsize long, so check if we can reuse the static buffer
-		int	use_static = kFALSE;
+	if ((type != ',') && ((type != 'w') || (csql_sql_keyword(tok, len, "OFFSET") == kFALSE))) return start;
+	sep = type;
+	if (csql_sql_integer(sql, &pos, &n2) == kFALSE) return start;
+	if (((type = csql_sql_token(sql, &pos, &tok, &len)) != 0) && (type != ';')) return start;
+	
+	// LIMIT m, n has the offset first
+	*limit = (sep == ',') ? n2 : n1;
+	*offset = (sep == ',') ? n1 : n2;
+	if (*offset < 0) *offset = 0;
+	return start;
+}
+
+int csql_merge_compare (csqlmergepos *a, csqlmergepos *b, csqlsortkey *keys, int nkeys) {
+	char	*f1, *f2;
+	int		i, n, len1, len2;
+	
+	for (i=0; i<nkeys; i++) {
+		f1 = csql_chunk_field(a->c, &a->chunk, a->row, keys[i].column, &len1);
+		f2 = csql_chunk_field(b->c, &b->chunk, b->row, keys[i].column, &len2);
+		n = csql_refresh_compare(f1, len1, f2, len2, keys[i].numeric);
+		if (n) return (keys[i].desc) ? -n : n;
+	}
+	return 0;
+}
+
+int csql_merge_next (csqlmergepos *m) {
+	// move to the next row of the part, returns kFALSE when the part has no more rows
+	m->row++;
+	while (m->row >= m->chunk.nrows) {
+		if (++m->nchunk >= csql_cursor_nchunks(m->c)) return kFALSE;
+		csql_cursor_chunk(m->c, m->nchunk, &m->chunk);
+		m->row = 0;
+	}
+	return kTRUE;
+}
+
+int csql_cursor_merge (csqlc *c, csqlsortkey *keys, int nkeys, int offset, int limit) {
+	// k-way merge of the parts (each one already sorted by the server) using a binary heap of positions, the first
+	// offset merged rows are skipped and at most limit rows (-1 for all) are kept; the merged cursor points to the
+	// fields of the parts so no data is copied
+	csqlmergepos	*pos = NULL;
+	int				*heap = NULL;
+	int				i, j, k, n, nheap = 0, nrows, cnum, row, tmp;
+	char			*field;
+	int				len;
+	
+	cnum = c->ncols + ((c->has_rowid) ? 1 : 0);
+	nrows = (offset < c->nrows) ? c->nrows - offset : 0;
+	if ((limit >= 0) && (limit < nrows)) nrows = limit;
+	
+	pos = (csqlmergepos *) malloc(sizeof(csqlmergepos) * c->nparts);
+	heap = (int *) malloc(sizeof(int) * c->nparts);
+	c->buffer = (char **) malloc(sizeof(char *) * ((nrows * cnum) + 1));
+	c->size0 = (int *) malloc(sizeof(int) * ((nrows * cnum) + 1));
+	if ((pos == NULL) || (heap == NULL) || (c->buffer == NULL) || (c->size0 == NULL)) goto abort;
+	
+	for (i=0; i<c->nparts; i++) {
+		pos[i].c = c->parts[i];
+		pos[i].nchunk = 0;
+		pos[i].row = -1;
+		csql_cursor_chunk(pos[i].c, 0, &pos[i].chunk);
+		if (csql_merge_next(&pos[i]) == kFALSE) continue;
 		
-		if (dsize < sizeof(db->errmsg)) {
-			use_static = kTRUE;
-			db->inbuffer = db->errmsg;
-			db->inbuffer[dsize] = 0;
-			db->insize = dsize;
-			db->errcode = err;
+		// sift up (ties keep the order of the parts)
+		j = nheap++;
+		heap[j] = i;
+		while (j > 0) {
+			k = (j - 1) / 2;
+			n = csql_merge_compare(&pos[heap[j]], &pos[heap[k]], keys, nkeys);
+			if ((n > 0) || ((n == 0) && (heap[j] > heap[k]))) break;
+			tmp = heap[j]; heap[j] = heap[k]; heap[k] = tmp;
+			j = k;
 		}
-		else if (csql_checkinbuffer(db) != CUBESQL_NOERR) return CUBESQL_ERR;
-		
-		if (csql_socketread(db, kFALSE, NO_TIMEOUT) != CUBESQL_NOERR) {
-			if (use_static) { db->inbuffer = NULL; db->insize = 0; }
-			return CUBESQL_ERR;
+	}
+	
+	for (row=-offset; (row < nrows) && (nheap > 0); row++) {
+		i = heap[0];
+		for (k=0; (k<cnum) && (row >= 0); k++) {
+			field = csql_chunk_field(pos[i].c, &pos[i].chunk, pos[i].row, (c->has_rowid) ? k : k+1, &len);
+			c->buffer[(row * cnum) + k] = field;
+			c->size0[(row * cnum) + k] = len;
 		}
-		db->toread = 0;
-		
-		if (db->reply.encryptedPacket != CUBESQL_ENCRYPTION_NONE)
-			decrypt_buffer(db->inbuffer, dsize, db->decryptkey);
 		
-		if (use_static == kFALSE) csql_seterror (db, err, db->inbuffer);
-		if ((use_static == kFALSE) && (db->inbuffer)) free(db->inbuffer);
+		if (csql_merge_next(&pos[i]) == kFALSE) heap[0] = heap[--nheap];
 		
-		db->inbuffer = NULL;
-		db->insize = 0;
-		return CUBESQL_ERR;
+		// sift down
+		j = 0;
+		while (1) {
+			k = j;
+			for (n = (2 * j) + 1; (n <= (2 * j) + 2) && (n < nheap); n++) {
+				tmp = csql_merge_compare(&pos[heap[n]], &pos[heap[k]], keys, nkeys);
+				if ((tmp < 0) || ((tmp == 0) && (heap[n] < heap[k]))) k = n;
+			}
+			if (k == j) break;
+			tmp = heap[j]; heap[j] = heap[k]; heap[k] = tmp;
+			j = k;
+		}
 	}
 	
-	return CUBESQL_NOERR;
+	c->nrows = (row > 0) ? row : 0;
+	c->current_row = 1;
+	free(pos);
+	free(heap);
+	return kTRUE;
+	
+abort:
+	if (pos) free(pos);
+	if (heap) free(heap);
+	if (c->buffer) free(c->buffer);
+	if (c->size0) free(c->size0);
+	c->buffer = NULL;
+	c->size0 = NULL;
+	return kFALSE;
 }
 
-void csql_initrequest (csqldb *db, int packetsize, int nfields, char command, char selector) {
-	inhead *request = &db->request;
+// MARK: - Replicas Routing -
+
+int csql_sql_isread (const char *sql) {
+	// only plain queries are sent to the replicas (WITH could introduce a write statement)
+	const char	*tok;
+	int			pos = 0, len;
 	
-	bzero(request, sizeof(inhead));
-	request->signature = htonl(PROTOCOL_SIGNATURE);
+	if (csql_sql_token(sql, &pos, &tok, &len) != 'w') return kFALSE;
+	return (csql_sql_keyword(tok, len, "SELECT") || csql_sql_keyword(tok, len, "EXPLAIN") || csql_sql_keyword(tok, len, "VALUES"));
+}
+
+int csql_sql_transaction (const char *sql) {
+	// 1 if the statement opens a transaction, -1 if it closes it, 0 otherwise
+	const char	*tok;
+	int			pos = 0, len, type;
 	
-	if ((packetsize != 0) && (db->encryption != CUBESQL_ENCRYPTION_NONE)) packetsize += BLOCK_LEN;
+	if (csql_sql_token(sql, &pos, &tok, &len) != 'w') return 0;
+	if (csql_sql_keyword(tok, len, "BEGIN") || csql_sql_keyword(tok, len, "SAVEPOINT")) return 1;
+	if (csql_sql_keyword(tok, len, "COMMIT") || csql_sql_keyword(tok, len, "END")) return -1;
+	if (csql_sql_keyword(tok, len, "ROLLBACK") == kFALSE) return 0;
 	
-	request->packetSize = htonl(packetsize);
-	request->command = command;
-	request->selector = selector;
-	request->flag1 = kEMPTY_FIELD;
-	SETBIT(request->flag1, CLIENT_SUPPORT_COMPRESSION);
-	request->flag2 = kEMPTY_FIELD;
-	request->flag3 = kEMPTY_FIELD;
-	request->encryptedPacket = db->encryption;
-	request->numFields = htonl(nfields);
-	request->expandedSize = 0;
-	request->timeout = htonl(db->timeout);
+	// ROLLBACK TO a savepoint does not end the transaction
+	while ((type = csql_sql_token(sql, &pos, &tok, &len)) != 0) {
+		if ((type == 'w') && (csql_sql_keyword(tok, len, "TO"))) return 0;
+	}
+	return -1;
+}
+
+void csql_router_track (csqldb *db, const char *sql) {
+	// called after a statement has been successfully executed on the primary
+	csqlrouter	*router = db->router;
+	int			i, tx = csql_sql_transaction(sql);
 	
-	if (db->useOldProtocol == kTRUE)
-		request->protocolVersion = k2007PROTOCOL;
-	else
-		request->protocolVersion = k2011PROTOCOL;
+	if (tx) {
+		router->intransaction = (tx > 0);
+	} else if (csql_sql_isuse(sql)) {
+		for (i=0; i<router->count; i++) {
+			if (cubesql_execute(router->replicas[i].db, sql) != CUBESQL_NOERR) router->replicas[i].retry = csql_mstime() + kREPLICA_RETRY;
+		}
+	}
 }
 
-csqlc *csql_cursor_alloc (csqldb *db)
-{
-	csqlc *cursor = NULL;
+csqlreplica *csql_router_pick (csqldb *db, const char *sql) {
+	// replica with the lowest average latency (not measured ones first) or NULL if the primary must be used
+	csqlrouter	*router = db->router;
+	csqlreplica	*r, *best = NULL;
+	int64		now;
+	int			i;
 	
-	cursor = (csqlc*) malloc (sizeof(csqlc));
-	if (cursor == NULL) return NULL;
+	if ((router->count == 0) || (router->intransaction) || (csql_sql_isread(sql) == kFALSE)) return NULL;
 	
-	// initialize cursor structure
-	bzero (cursor, sizeof(csqlc));
-	cursor->db = db;
-	cursor->current_row = 1;
+	now = csql_mstime();
+	for (i=0; i<router->count; i++) {
+		r = &router->replicas[i];
+		if (r->retry > now) continue;
+		if ((best == NULL) || (r->latency < best->latency)) best = r;
+	}
+	return best;
+}
+
+void csql_router_sample (csqlreplica *r, int64 start) {
+	// samples are at least 0.1 ms so that a measured replica is never seen as not measured
+	double ms = (double)(csql_mstime() - start);
 	
-	return cursor;
+	if (ms < 0.1) ms = 0.1;
+	r->latency = (r->latency > 0) ? (r->latency * (1.0 - kREPLICA_WEIGHT)) + (ms * kREPLICA_WEIGHT) : ms;
+	r->retry = 0;
 }
 
-int csql_cursor_reallocate (csqlc *c) {
-	if (c->nalloc == 0) {
-		c->buffer = (char**) malloc(sizeof(char*) * kNUMBUFFER);
-		if (c->buffer == NULL) return kFALSE;
+int csql_router_failed (csqldb *db, csqlreplica *r) {
+	// returns kTRUE if the statement must be sent to the primary (the replica cannot be reached)
+	// otherwise the error of the statement is reported by db
+	if (csql_isneterror(r->db->errcode)) {
+		r->retry = csql_mstime() + kREPLICA_RETRY;
+		return kTRUE;
+	}
+	csql_seterror(db, r->db->errcode, r->db->errmsg);
+	return kFALSE;
+}
 
-		c->rowsum = (int**) malloc(sizeof(int*) * kNUMBUFFER);
-		if (c->rowsum == NULL) { free(c->buffer); c->buffer = NULL; return kFALSE; }
+void csql_router_free (csqldb *db) {
+	int i;
+	
+	for (i=0; i<db->router->count; i++) db->router->replicas[i].db->primary = NULL;
+	if (db->router->replicas) free(db->router->replicas);
+	free(db->router);
+	db->router = NULL;
+}
 
-		c->rowcount = (int*) malloc(sizeof(int) * kNUMBUFFER);
-		if (c->rowcount == NULL) { free(c->buffer); c->buffer = NULL; free(c->rowsum); c->rowsum = NULL; return kFALSE; }
+// MARK: - Multiple Hosts -
 
-		c->nalloc = kNUMBUFFER;
-	} else {
-		
-		char **tmp1;
-		int	 **tmp2;
-		int *tmp3;
-		int	 oldsize, newsize;
+static csqlhosts csql_hosts;
+	
+void csql_hosts_init (void) {
+	bzero(&csql_hosts, sizeof(csqlhosts));
+	csql_mutex_init(&csql_hosts.mutex);
+}
+
+int csql_hosts_parse (const char *list, int port, csqlcandidate *candidates, int max) {
+	// comma separated list of host, host:port, [ipv6] or [ipv6]:port
+	const char	*p = list, *end, *colon;
+	int			count = 0, len;
+	
+	while ((*p) && (count < max)) {
+		while ((*p == ',') || (isspace((unsigned char)*p))) p++;
+		if (*p == 0) break;
 		
-		oldsize = sizeof(char*) * c->nalloc;
-		newsize = oldsize + (sizeof(char*) * kNUMBUFFER);
-		tmp1 = (char**) realloc(c->buffer, newsize);
-		if (tmp1 == NULL) return kFALSE;
-		c->buffer = tmp1;
+		end = p;
+		while ((*end) && (*end != ',')) end++;
+		len = (int)(end - p);
+		while ((len > 0) && (isspace((unsigned char)p[len-1]))) len--;
 		
-		oldsize = sizeof(int*) * c->nalloc;
-		newsize = oldsize + (sizeof(int*) * kNUMBUFFER);
-		tmp2 = (int**) realloc(c->rowsum, newsize);
-		if (tmp2 == NULL) return kFALSE;
-		c->rowsum = tmp2;
+		bzero(&candidates[count], sizeof(csqlcandidate));
+		candidates[count].port = port;
+		candidates[count].index = count;
 		
-		oldsize = sizeof(int) * c->nalloc;
-		newsize = oldsize + (sizeof(int) * kNUMBUFFER);
-		tmp3 = (int*) realloc(c->rowcount, newsize);
-		if (tmp3 == NULL) return kFALSE;
-		c->rowcount = tmp3;
+		// a port is specified only after a closing bracket or in a name with a single colon (a plain ipv6 has many)
+		colon = NULL;
+		if (*p == '[') {
+			const char *close = (const char *)memchr(p, ']', len);
+			if (close) {
+				if ((close + 1 < p + len) && (close[1] == ':')) colon = close + 1;
+				if (close - p - 1 < (int)sizeof(candidates[count].host)) memcpy(candidates[count].host, p + 1, close - p - 1);
+			}
+		} else {
+			const char *c1 = (const char *)memchr(p, ':', len);
+			if ((c1) && (memchr(c1 + 1, ':', len - (c1 + 1 - p)) == NULL)) colon = c1;
+			len = (colon) ? (int)(colon - p) : len;
+			if (len < (int)sizeof(candidates[count].host)) memcpy(candidates[count].host, p, len);
+		}
+		if ((colon) && (atoi(colon + 1) > 0)) candidates[count].port = atoi(colon + 1);
 		
-		c->nalloc += kNUMBUFFER;
-	}	
-	
-	return kTRUE;
+		if (candidates[count].host[0]) count++;
+		p = end;
+	}
+	return count;
 }
 
-int csql_cursor_step (csqlc *c) {
-	// prepare header request
-	csql_initrequest(c->db, 0, 0, kCOMMAND_CURSOR_STEP, kNO_SELECTOR);
-	
-	// send header request
-	if (csql_socketwrite(c->db, (char *)&c->db->request, kHEADER_SIZE) != CUBESQL_NOERR) return CUBESQL_ERR;
-	
-	// receive row
-	if (csql_read_cursor(c->db, c) == NULL) return CUBESQL_ERR;
-	
-	return CUBESQL_NOERR;
+void csql_hosts_name (csqlcandidate *c, char *name, int size) {
+	snprintf(name, size, "%s:%d", c->host, c->port);
 }
 
-int csql_cursor_close (csqlc *c) {
-	// prepare header request
-	csql_initrequest(c->db, 0, 0, kCOMMAND_CURSOR_CLOSE, kNO_SELECTOR);
+csqlhost *csql_hosts_lookup (const char *name, int add) {
+	// must be called with the hosts mutex locked, the least recently sampled host is replaced when the table is full
+	csqlhost	*h;
+	int			i, oldest = 0;
 	
-	// send header request
-	if (csql_socketwrite(c->db, (char *)&c->db->request, kHEADER_SIZE) != CUBESQL_NOERR) return CUBESQL_ERR;
+	for (i=0; i<csql_hosts.count; i++) {
+		if (strcmp(csql_hosts.hosts[i].name, name) == 0) return &csql_hosts.hosts[i];
+		if (csql_hosts.hosts[i].sampled < csql_hosts.hosts[oldest].sampled) oldest = i;
+	}
+	if (add == kFALSE) return NULL;
 	
-	return csql_netread(c->db, -1, -1, kFALSE, NULL, NO_TIMEOUT);
+	h = (csql_hosts.count < kMAX_HOSTS) ? &csql_hosts.hosts[csql_hosts.count++] : &csql_hosts.hosts[oldest];
+	bzero(h, sizeof(csqlhost));
+	snprintf(h->name, sizeof(h->name), "%s", name);
+	return h;
 }
 
-// MARK: - SSL -
+void csql_hosts_record (csqlcandidate *c, int ok, double ms) {
+	char		name[520];
+	csqlhost	*h;
+	int64		now = csql_mstime(), cooldown;
+	
+	csql_hosts_name(c, name, sizeof(name));
+	csql_mutex_lock(&csql_hosts.mutex);
+	h = csql_hosts_lookup(name, kTRUE);
+	h->sampled = now;
+	
+	if (ok) {
+		// samples are at least 0.1 ms so that a measured host is never seen as not measured
+		if (ms < 0.1) ms = 0.1;
+		h->latency = (h->latency > 0) ? (h->latency * (1.0 - kHOST_WEIGHT)) + (ms * kHOST_WEIGHT) : ms;
+		h->failures = 0;
+		h->open_until = 0;
+	} else {
+		// each consecutive failure doubles the time the host is skipped
+		cooldown = (h->failures < 16) ? ((int64)kHOST_COOLDOWN << h->failures) : kHOST_MAXCOOLDOWN;
+		if (cooldown > kHOST_MAXCOOLDOWN) cooldown = kHOST_MAXCOOLDOWN;
+		h->failures++;
+		h->open_until = now + cooldown;
+	}
+	csql_mutex_unlock(&csql_hosts.mutex);
+}
 
-const char *cubesql_sslversion (void) {
-	#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
-	return SSLeay_version(0);
-	#else
-	return NULL;
-	#endif
+int csql_hosts_compare (const void *a, const void *b) {
+	// not measured hosts first, then by latency and finally in connection string order
+	const csqlcandidate *c1 = (const csqlcandidate *)a;
+	const csqlcandidate *c2 = (const csqlcandidate *)b;
+	
+	if (c1->latency < c2->latency) return -1;
+	if (c1->latency > c2->latency) return 1;
+	return c1->index - c2->index;
 }
 
-unsigned long cubesql_sslversion_num (void) {
-	#ifndef CUBESQL_DISABLE_SSL_ENCRYPTION
-	return 0x3080200fL;
-	#endif
+CSQL_THREAD_PROC csql_hosts_thread (void *arg) {
+	// only the TCP connect is measured, no session is opened on the server
+	csqlprobe	*probe = (csqlprobe *)arg;
+	csqldb		*db;
+	int64		start;
+	int			i, fd;
+	
+	db = (csqldb *) malloc(sizeof(csqldb));
+	for (i=0; (db) && (i<probe->count); i++) {
+		bzero(db, sizeof(csqldb));
+		snprintf(db->host, sizeof(db->host), "%s", probe->candidates[i].host);
+		db->port = probe->candidates[i].port;
+		db->timeout = probe->timeout;
+		
+		start = csql_mstime();
+		fd = csql_socketconnect(db);
+		csql_hosts_record(&probe->candidates[i], (fd > 0), (double)(csql_mstime() - start));
+		if (fd > 0) {
+			db->sockfd = fd;
+			csql_socketclose(db);
+		}
+	}
+	if (db) free(db);
+	
+	free(probe->candidates);
+	free(probe);
+	
+	csql_mutex_lock(&csql_hosts.mutex);
+	csql_hosts.probing = kFALSE;
+	csql_mutex_unlock(&csql_hosts.mutex);
 	return 0;
 }
 
-int encryption_is_ssl (int encryption) {
-	if ((encryption == CUBESQL_ENCRYPTION_SSL) || (encryption == CUBESQL_ENCRYPTION_SSL_AES128) ||
-		(encryption == CUBESQL_ENCRYPTION_SSL_AES192) || (encryption == CUBESQL_ENCRYPTION_SSL_AES256)) return kTRUE;
-	return kFALSE;
+void csql_hosts_probe (csqlcandidate *candidates, int count, int timeout) {
+	// refresh in background the hosts that have not been sampled recently (failed hosts included, so they can recover)
+	csqlprobe	*probe;
+	int64		now = csql_mstime();
+	int			i, n = 0;
+	
+	csql_mutex_lock(&csql_hosts.mutex);
+	if (csql_hosts.probing) goto abort;
+	if (csql_hosts.joinable) {
+		csql_thread_join(csql_hosts.probe);
+		csql_hosts.joinable = kFALSE;
+	}
+	
+	probe = (csqlprobe *) malloc(sizeof(csqlprobe));
+	if (probe == NULL) goto abort;
+	probe->candidates = (csqlcandidate *) malloc(sizeof(csqlcandidate) * count);
+	if (probe->candidates == NULL) {free(probe); goto abort;}
+	
+	for (i=0; i<count; i++) {
+		if (now - candidates[i].sampled >= kHOST_PROBE_INTERVAL) probe->candidates[n++] = candidates[i];
+	}
+	probe->count = n;
+	probe->timeout = timeout;
+	
+	if ((n == 0) || (csql_thread_create(&csql_hosts.probe, csql_hosts_thread, probe) != 0)) {
+		free(probe->candidates);
+		free(probe);
+		goto abort;
+	}
+	csql_hosts.probing = kTRUE;
+	csql_hosts.joinable = kTRUE;
+	
+abort:
+	csql_mutex_unlock(&csql_hosts.mutex);
 }
 
-// MARK: - Utils -
-
-void hash_field (unsigned char hval[], const char *field, int len, int times) {
-	// SHA1(P)
-	csql_sha1((unsigned char *)hval, (const unsigned char*)field, len);
+int csql_connect_hosts (csqldb **db, const char *host, int port, const char *username, const char *password, int timeout, int encryption, char *token, int useOldProtocol, const char *ssl_certificate, const char *root_certificate, const char *ssl_certificate_password, const char *ssl_chiper_list) {
+	// hosts with an open circuit are skipped, the others are tried from the fastest one
+	csqlcandidate	candidates[kMAX_HOSTS], ready[kMAX_HOSTS];
+	csqldb			*rdb = NULL, *last = NULL;
+	csqlhost		*h;
+	char			name[520];
+	int64			now, start;
+	int				i, count, nready = 0, rc = CUBESQL_ERR;
+	
+	count = csql_hosts_parse(host, port, candidates, kMAX_HOSTS);
+	if (count == 0) return CUBESQL_PARAMETER_ERROR;
+	
+	now = csql_mstime();
+	csql_mutex_lock(&csql_hosts.mutex);
+	for (i=0; i<count; i++) {
+		csql_hosts_name(&candidates[i], name, sizeof(name));
+		h = csql_hosts_lookup(name, kFALSE);
+		if (h) {
+			candidates[i].latency = h->latency;
+			candidates[i].sampled = h->sampled;
+			if (h->open_until > now) continue;
+		}
+		ready[nready++] = candidates[i];
+	}
+	csql_mutex_unlock(&csql_hosts.mutex);
+	qsort(ready, nready, sizeof(csqlcandidate), csql_hosts_compare);
+	
+	for (i=0; i<nready; i++) {
+		start = csql_mstime();
+		rdb = NULL;
+		rc = cubesql_connect_token(&rdb, ready[i].host, ready[i].port, username, password, timeout, encryption, token, useOldProtocol, ssl_certificate, root_certificate, ssl_certificate_password, ssl_chiper_list);
+		if ((rc == CUBESQL_NOERR) || (rdb == NULL) || (csql_isneterror(rdb->errcode) == kFALSE)) {
+			// connected or failed for a reason that does not depend on the host (wrong password, ssl setup, ...)
+			if (rc == CUBESQL_NOERR) {
+				csql_hosts_record(&ready[i], kTRUE, (double)(csql_mstime() - start));
+				candidates[ready[i].index].sampled = csql_mstime();
+			}
+			if (last) cubesql_disconnect(last, kFALSE);
+			if (rdb == NULL) return rc;
+			last = rdb;
+			break;
+		}
+		
+		csql_hosts_record(&ready[i], kFALSE, 0);
+		candidates[ready[i].index].sampled = csql_mstime();
+		if (last) cubesql_disconnect(last, kFALSE);
+		last = rdb;
+	}
+	if (last == NULL) {
+		// every host is in its cooldown period
+		last = csql_dbinit(candidates[0].host, candidates[0].port, username, password, timeout, encryption, ssl_certificate, root_certificate, ssl_certificate_password, ssl_chiper_list);
+		if (last == NULL) return CUBESQL_MEMORY_ERROR;
+		csql_seterror(last, ERR_SOCKET, "All the hosts are temporarily unavailable");
+		rc = CUBESQL_ERR;
+	}
+	*db = last;
 	
-	// SHA1(SHA1(P))
-	if (times == 2)
-		csql_sha1((unsigned char *)hval, (const unsigned char *)hval, SHA1_DIGEST_SIZE);
+	if ((rc == CUBESQL_NOERR) && (count > 1)) csql_hosts_probe(candidates, count, timeout);
+	return rc;
 }
 
-void hex_hash_field (char result[], const char *field, int len) {
-	unsigned char hval[SHA1_DIGEST_SIZE];
+// MARK: - Scheduler Queue -
+
+csqldb *csql_pool_tryacquire (csqlpool *pool) {
+	csqldb	*db = NULL;
+	int		i;
 	
-	csql_sha1(hval, (const unsigned char *)field, len);
+	csql_mutex_lock(&pool->mutex);
+	for (i=0; i<pool->count; i++) {
+		if (pool->busy[i] == kFALSE) {
+			pool->busy[i] = kTRUE;
+			db = pool->dbs[i];
+			break;
+		}
+	}
+	csql_mutex_unlock(&pool->mutex);
 	
-	// convert result
-	// result must be SHA1_DIGEST_SIZE*2+2 long
-	snprintf(result, SHA1_DIGEST_SIZE*2+2, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-			 hval[0],hval[1],hval[2],hval[3],hval[4],hval[5],hval[6],hval[7],hval[8],hval[9],hval[10],
-			 hval[11],hval[12],hval[13],hval[14],hval[15],hval[16],hval[17],hval[18],hval[19]);
+	return db;
 }
 
-void hex_hash_field2 (char result[], const char *field, unsigned char *randpoll) {
-	unsigned char hval[SHA1_DIGEST_SIZE];
-	unsigned char randhex[BLOCK_LEN*2+2];
-	char		  buffer[2048];
-	int			  len = 0;
+int csql_sched_eligible (csqlsched *s, int priority) {
+	// must be called with the scheduler locked
+	csqlclass	*c = &s->classes[priority];
+	int			cap = c->maxactive;
 	
-	if (strlen(field) > 256) return;
+	if (c->head == NULL) return kFALSE;
+	if (cap == -1) cap = (s->pool->count > 1) ? s->pool->count - 1 : 1;
+	return ((cap == 0) || (c->active < cap));
+}
+
+int csql_sched_pick (csqlsched *s) {
+	// waiting class with the lowest virtual time (the most urgent one in case of tie), -1 if none can be served
+	int i, best = -1;
 	
-	// hexify randpool
-	snprintf((char *)randhex, sizeof(randhex), "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-			 randpoll[0],randpoll[1],randpoll[2],randpoll[3],randpoll[4],randpoll[5],randpoll[6],randpoll[7],randpoll[8],
-			 randpoll[9],randpoll[10],randpoll[11],randpoll[12],randpoll[13],randpoll[14],randpoll[15]);
+	for (i=0; i<kSCHED_CLASSES; i++) {
+		if (csql_sched_eligible(s, i) == kFALSE) continue;
+		if ((best == -1) || (s->classes[i].vtime < s->classes[best].vtime)) best = i;
+	}
+	return best;
+}
+
+void csql_sched_dispatch (csqlsched *s) {
+	// must be called with the scheduler locked, hands free connections to the waiters
+	csqlclass	*c;
+	csqlwaiter	*w;
+	csqldb		*db;
+	int			i, granted = kFALSE;
 	
-	//printf("randpool %s\n", randhex);
+	while ((i = csql_sched_pick(s)) != -1) {
+		db = csql_pool_tryacquire(s->pool);
+		if (db == NULL) break;
+		
+		c = &s->classes[i];
+		w = c->head;
+		c->head = w->next;
+		if (c->head == NULL) c->tail = NULL;
+		
+		// each grant costs 1/weight of virtual time to its class
+		s->vclock = c->vtime;
+		c->vtime += 1.0 / c->weight;
+		c->active++;
+		
+		db->sched = s;
+		db->sched_class = i;
+		w->db = db;
+		granted = kTRUE;
+	}
 	
-	// concat two fields
-	len = snprintf(buffer, sizeof(buffer), "%s%s", field, randhex);
+	if (granted) csql_cond_broadcast(&s->cond);
+}
+
+void csql_sched_dequeue (csqlsched *s, int priority, csqlwaiter *w) {
+	csqlclass	*c = &s->classes[priority];
+	csqlwaiter	*prev = NULL, *p;
 	
-	// compute hash
-	csql_sha1(hval, (const unsigned char *)buffer, len);
+	for (p = c->head; p; prev = p, p = p->next) {
+		if (p != w) continue;
+		if (prev) prev->next = p->next;
+		else c->head = p->next;
+		if (c->tail == p) c->tail = prev;
+		break;
+	}
+}
+
+void csql_sched_throttle (csqldb *db) {
+	// bulk transfers pause between chunks while a more urgent class is waiting for a connection
+	csqlsched	*s = db->sched;
+	int			i, ms, waiting = kFALSE;
 	
-	// convert result
-	// result must be SHA1_DIGEST_SIZE*2+2 long
-	snprintf(result, SHA1_DIGEST_SIZE*2+2, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-			 hval[0],hval[1],hval[2],hval[3],hval[4],hval[5],hval[6],hval[7],hval[8],hval[9],hval[10],
-			 hval[11],hval[12],hval[13],hval[14],hval[15],hval[16],hval[17],hval[18],hval[19]);
+	csql_mutex_lock(&s->mutex);
+	ms = s->classes[db->sched_class].throttle;
+	for (i=0; i<db->sched_class; i++) {
+		if (s->classes[i].head) waiting = kTRUE;
+	}
+	csql_mutex_unlock(&s->mutex);
+	
+	if ((ms > 0) && (waiting)) mssleep(ms);
+}
+
+// MARK: - Shared Queue -
+
+void csql_shared_push (csqlshared *s, csqlresult *r) {
+	// intrusive multiple producers single consumer queue (wait-free for the producers)
+	csqlresult *prev;
 	
-	//printf("result %s\n", result);
+	csql_atomic_store(&r->next, (csqlresult *)NULL);
+	prev = (csqlresult *) csql_atomic_xchg(&s->head, r);
+	csql_atomic_store(&prev->next, r);
 }
 
-void random_hash_field (unsigned char hval[], const char *randpoll, const char *field) {
-	char buffer[SHA1_DIGEST_SIZE+kRANDPOOLSIZE];
-	char hval1[SHA1_DIGEST_SIZE];
-	char hval2[SHA1_DIGEST_SIZE];
+csqlresult *csql_shared_pop (csqlshared *s) {
+	// used only by the I/O thread, NULL means empty (or a producer is in the middle of a push)
+	csqlresult	*tail = s->tail;
+	csqlresult	*next = (csqlresult *) csql_atomic_load(&tail->next);
 	
-	// SHA1(P)
-	csql_sha1((unsigned char *)hval1, (const unsigned char*)field, (int)strlen(field));
+	if (tail == &s->stub) {
+		if (next == NULL) return NULL;
+		s->tail = next;
+		tail = next;
+		next = (csqlresult *) csql_atomic_load(&next->next);
+	}
 	
-	// SHA1(SHA1(P))
-	csql_sha1((unsigned char *)hval2, (const unsigned char *)hval1, SHA1_DIGEST_SIZE);
+	if (next) {
+		s->tail = next;
+		return tail;
+	}
 	
-	memcpy(buffer, randpoll, kRANDPOOLSIZE);
-	memcpy(buffer + kRANDPOOLSIZE, hval2, SHA1_DIGEST_SIZE);
+	if (tail != (csqlresult *) csql_atomic_load(&s->head)) return NULL;
 	
-	// SHA1(R;SHA1(SHA1(P)))
-	csql_sha1((unsigned char *)hval, (const unsigned char *)buffer, kRANDPOOLSIZE+SHA1_DIGEST_SIZE);
+	// tail is the last request, the stub is queued again so that tail can be detached
+	csql_shared_push(s, &s->stub);
+	next = (csqlresult *) csql_atomic_load(&tail->next);
+	if (next) {
+		s->tail = next;
+		return tail;
+	}
+	return NULL;
 }
 
-int encrypt_buffer (char *buffer, int dim, char random[], csql_aes_encrypt_ctx ctx[1]) {
-	char    dbuf[2 * BLOCK_LEN];
-	int		i, len, index=0;
-	char	*b1, *b2;
+csqlresult *csql_shared_submit (csqlshared *s, const char *sql, int is_select) {
+	// queue the request and wait for the I/O thread to serve it
+	csqlresult *r;
 	
-	memcpy(dbuf, random, BLOCK_LEN);
+	if ((s == NULL) || (sql == NULL)) return NULL;
 	
-	if (dim < BLOCK_LEN) {
-		// if the buffer is less than one block
-		memcpy(dbuf + BLOCK_LEN, buffer, dim);
-		
-		// xor the file bytes with the random pool
-		for(i = 0; i < dim; ++i)
-			dbuf[i + BLOCK_LEN] ^= dbuf[i];
-		
-		// encrypt the top 16 bytes of the buffer
-		csql_aes_encrypt((const unsigned char*) (dbuf + dim), (unsigned char*)(dbuf + dim), ctx);
-		
-		// copy back encrypted data
-		memcpy(random, dbuf, BLOCK_LEN);
-		memcpy(buffer, dbuf + BLOCK_LEN, dim);
-		
-		return (dim+BLOCK_LEN);
-	}
+	r = (csqlresult *) malloc(sizeof(csqlresult));
+	if (r == NULL) return NULL;
+	bzero(r, sizeof(csqlresult));
 	
-	b1 = dbuf;
-	b2 = buffer;
-	len = dim;
+	r->sql = strdup(sql);
+	if (r->sql == NULL) {free(r); return NULL;}
+	r->is_select = is_select;
 	
-	do {				
-		// do CBC chaining prior to encryption for current block (in b2)
-		for(i = 0; i < BLOCK_LEN; ++i)
-			b1[i] ^= b2[i];
-		
-		// encrypt the block (now in b1)
-		csql_aes_encrypt((const unsigned char*)b1, (unsigned char*)b1, ctx);
-		
-		len -= BLOCK_LEN;
-		
-		if (index == 0)
-			memcpy(buffer, b1, BLOCK_LEN);
-		
-		// advance the buffer pointers
-		if (len >= BLOCK_LEN) {
-			b2 = buffer + (index * BLOCK_LEN);
-			b1 = b2 + BLOCK_LEN;
-		}
-		index++;
-	}
-	while (len >= BLOCK_LEN);
+	csql_shared_push(s, r);
 	
-	if (len != 0) {	
-		char b3[BLOCK_LEN];
-		char back[BLOCK_LEN];
-		
-		memcpy(b3, buffer + (index * BLOCK_LEN), len);
-		
-		// xor ciphertext into last block
-		for(i = 0; i < len; ++i)
-			b3[i] ^= b1[i];
-		
-		// move 'stolen' ciphertext into last block
-		for(i = len; i < BLOCK_LEN; ++i)
-			b3[i] = b1[i];
-		
-		// encrypt this block
-	   	csql_aes_encrypt((const unsigned char*) b3, (unsigned char*) b3, ctx);
-		
-		// save b1
-		memcpy(back, b1, BLOCK_LEN);
-		
-		// write b3
-		memcpy(buffer+dim-len-BLOCK_LEN, b3, BLOCK_LEN);
-		
-		// write b1
-		memcpy(buffer+dim-len, back, len);
-	}
+	// the I/O thread checks the queue with the mutex locked, so this wakeup cannot be lost
+	csql_mutex_lock(&s->mutex);
+	csql_cond_broadcast(&s->queued);
+	while (r->done == kFALSE) csql_cond_wait(&s->served, &s->mutex, 0);
+	csql_mutex_unlock(&s->mutex);
 	
-	return (dim + BLOCK_LEN);
+	return r;
 }
 
-int decrypt_buffer (char *buffer, int dim, csql_aes_decrypt_ctx ctx[1]) {
-	int 	len, nextlen, i, index=0;
-	char	*b1, *b2;
-	char	buf[BLOCK_LEN], b3[BLOCK_LEN];
+void csql_shared_complete (csqlshared *s, csqlresult *r) {
+	csql_mutex_lock(&s->mutex);
+	r->done = kTRUE;
+	csql_cond_broadcast(&s->served);
+	csql_mutex_unlock(&s->mutex);
+}
+
+void csql_shared_serve (csqlshared *s, csqlresult *r) {
+	csqldb *db = s->db;
 	
-	if (dim < 2 * BLOCK_LEN) {
-		len = dim - BLOCK_LEN;
-		
-		// decrypt from position len to position len + BLOCK_LEN
-		csql_aes_decrypt((const unsigned char*) (buffer + len), (unsigned char*) (buffer + len), ctx);
-		
-		// undo the CBC chaining
-		for(i = 0; i < len; ++i)
-			buffer[i] ^= buffer[i + BLOCK_LEN];
-		
-		return 0;
+	if (r->is_select) r->c = cubesql_select(db, r->sql, kFALSE);
+	else {
+		if (cubesql_execute(db, r->sql) == CUBESQL_NOERR) {
+			int tx = csql_sql_transaction(r->sql);
+			if (tx) s->intransaction = (tx > 0);
+		}
 	}
+	r->errcode = db->errcode;
+	snprintf(r->errmsg, sizeof(r->errmsg), "%s", db->errmsg);
+	csql_shared_complete(s, r);
+}
+
+csqlresult *csql_shared_next (csqlshared *s, int ms) {
+	// next request to serve, waits at most ms (0 means until a request is queued or the connection is freed)
+	csqlresult	*r;
+	int64		deadline = (ms > 0) ? csql_mstime() + ms : 0, left = 0;
 	
-	b1 = buffer;
-	b2 = b1 + BLOCK_LEN;
-	len = dim - BLOCK_LEN;
+	if (s->pending) {
+		r = s->pending;
+		s->pending = NULL;
+		return r;
+	}
 	
-	do {
-		nextlen = len - BLOCK_LEN;
-		if (nextlen > BLOCK_LEN) nextlen = BLOCK_LEN;
-		
-		// decrypt the b2 block
-		csql_aes_decrypt((const unsigned char*) b2, (unsigned char*) buf, ctx);
-		
-		if(nextlen == 0 || nextlen == BLOCK_LEN) {
-			// no ciphertext stealing
-			// unchain CBC using the previous ciphertext block in b1
-			for(i = 0; i < BLOCK_LEN; ++i)
-				buf[i] ^= b1[i];
-			
-			memcpy(buffer + index*BLOCK_LEN, buf, BLOCK_LEN);
-			
-			index++;
-			len -= BLOCK_LEN;
-			if (len == 0) return 0;
-			
-			b1 = b2;
-			b2 = b2 + BLOCK_LEN;
-		}
-		else {	
-			// partial last block - use ciphertext stealing
-			
-			len = nextlen;
-			// thanks to GuardMalloc
-			//memcpy (b3, b2+BLOCK_LEN, BLOCK_LEN);
-			memcpy (b3, b2+BLOCK_LEN, len);
-			
-			// produce last 'len' bytes of plaintext by xoring with
-			// the lowest 'len' bytes of next block b3 - C[N-1]
-			for(i = 0; i < len; ++i)
-				buf[i] ^= b3[i];
-			
-			// reconstruct the C[N-1] block in b3 by adding in the
-			// last (BLOCK_LEN - len) bytes of C[N-2] in b2
-			for(i = len; i < BLOCK_LEN; ++i)
-				b3[i] = buf[i];
-			
-			// decrypt the C[N-1] block in b3
-			csql_aes_decrypt((const unsigned char*) b3, (unsigned char*) b3, ctx);
-			
-			// produce the last but one plaintext block by xoring with
-			// the last but two ciphertext block
-			for(i = 0; i < BLOCK_LEN; ++i)
-				b3[i] ^= b1[i];
-			
-			memcpy(buffer + index*BLOCK_LEN, b3, BLOCK_LEN);
-			index++;
-			memcpy(buffer + index*BLOCK_LEN, buf, nextlen);
-			
-			return 0;
+	csql_mutex_lock(&s->mutex);
+	while (((r = csql_shared_pop(s)) == NULL) && (s->stopping == kFALSE)) {
+		if (deadline) {
+			left = deadline - csql_mstime();
+			if (left <= 0) break;
 		}
+		csql_cond_wait(&s->queued, &s->mutex, (int)left);
 	}
-	while (1);
+	csql_mutex_unlock(&s->mutex);
+	return r;
 }
 
-int generate_session_key (csqldb *db, int encryption, char *password, char *rand1, char *rand2) {
-	int i, keyLen = 0;
-	char dummy1[SHA1_DIGEST_SIZE+kRANDPOOLSIZE+kRANDPOOLSIZE];
-	char dummy2[kRANDPOOLSIZE];
-	char s1[SHA1_DIGEST_SIZE];
-	char s2[SHA1_DIGEST_SIZE];
-	char session_key[32];
+int csql_shared_coalescable (csqlshared *s, csqlresult *r) {
+	const char	*tok;
+	int			pos = 0, len, window;
 	
-	// password is H(H(P)) (len: SHA1_DIGEST_SIZE = 160bits)
-	// rand1 is X (len: kRANDPOOLSIZE = 20bytes)
-	// rand2 is Y (len: kRANDPOOLSIZE = 20bytes)
+	csql_mutex_lock(&s->mutex);
+	window = s->window;
+	csql_mutex_unlock(&s->mutex);
 	
-	// dummy1 is H(H(P));X;Y
-	memcpy(dummy1, password, SHA1_DIGEST_SIZE);
-	memcpy(dummy1+SHA1_DIGEST_SIZE, rand1, kRANDPOOLSIZE);
-	memcpy(dummy1+SHA1_DIGEST_SIZE+kRANDPOOLSIZE, rand2, kRANDPOOLSIZE);
-	// s1 is H(H(H(P));X;Y) (len = 20 bytes)
-	hash_field((unsigned char *)s1, (const char *)dummy1, SHA1_DIGEST_SIZE+kRANDPOOLSIZE+kRANDPOOLSIZE, 1);
+	if ((window == 0) || (s->intransaction) || (r->is_select)) return kFALSE;
+	if (csql_sql_token(r->sql, &pos, &tok, &len) != 'w') return kFALSE;
+	return (csql_sql_keyword(tok, len, "INSERT") || csql_sql_keyword(tok, len, "UPDATE") ||
+			csql_sql_keyword(tok, len, "DELETE") || csql_sql_keyword(tok, len, "REPLACE"));
+}
+
+CSQL_THREAD_PROC csql_shared_thread (void *arg) {
+	// the only thread that touches the connection, requests are answered in FIFO order
+	// (chunked replies need an ACK from the client, so only coalesced writes are pipelined)
+	csqlshared	*s = (csqlshared *)arg;
+	csqlresult	**batch, *r;
+	int64		deadline;
+	int			n, max, left;
 	
-	// dummy2 is X^Y
-	for (i=0; i<kRANDPOOLSIZE; i++) dummy2[i] = rand1[i] ^ rand2[i];
-	// s2 is H(X^Y) (len = 20 bytes)
-	hash_field((unsigned char *)s2, (const char *)dummy2, kRANDPOOLSIZE, 1);
+	batch = (csqlresult **) malloc(sizeof(csqlresult *) * kMAX_COALESCE);
 	
-	bzero(session_key, 32);
-	switch (encryption)
-	{
-		case CUBESQL_ENCRYPTION_NONE:
-			keyLen = 0;
-			break;
-			
-		case CUBESQL_ENCRYPTION_AES128:
-			keyLen = 16;
-			memcpy(session_key, s1, 16);
-			break;
-			
-		case CUBESQL_ENCRYPTION_AES192:
-			keyLen = 24;
-			memcpy(session_key, s1, 20);
-			memcpy(session_key, s2, 4);     // should be session_key+20, not modified to retain backward compatibility
-			break;
-			
-		case CUBESQL_ENCRYPTION_AES256:
-			keyLen = 32;
-			memcpy(session_key, s1, 20);
-			memcpy(session_key, s2, 12);    // should be session_key+20, not modified to retain backward compatibility
-			break;
+	while ((r = csql_shared_next(s, 0)) != NULL) {
+		if ((batch == NULL) || (csql_shared_coalescable(s, r) == kFALSE)) {
+			csql_shared_serve(s, r);
+			continue;
+		}
+		
+		// collect the writes that arrive within the window, the first other request closes the batch
+		csql_mutex_lock(&s->mutex);
+		deadline = csql_mstime() + s->window;
+		max = s->maxbatch;
+		csql_mutex_unlock(&s->mutex);
+		
+		n = 0;
+		batch[n++] = r;
+		while ((n < max) && ((left = (int)(deadline - csql_mstime())) > 0)) {
+			r = csql_shared_next(s, left);
+			if (r == NULL) break;
+			if (csql_shared_coalescable(s, r) == kFALSE) {
+				s->pending = r;
+				break;
+			}
+			batch[n++] = r;
+		}
+		
+		if (n == 1) csql_shared_serve(s, batch[0]);
+		else csql_shared_batch(s, batch, n);
 	}
 	
-	// generate enc/dec keys
-	csql_aes_encrypt_key ((unsigned char*) session_key, keyLen, db->encryptkey);
-	csql_aes_decrypt_key ((unsigned char*) session_key, keyLen, db->decryptkey);
-	
-	return keyLen;
+	if (batch) free(batch);
+	return 0;
 }
 
-int wildcmp(const char *wild, const char *string) {
-	// Written by Jack Handy
-	// http://www.codeproject.com/Articles/1088/Wildcard-string-compare-globbing
-	// Modified by Marco Bambini
-	const char *cp = NULL, *mp = NULL;
+void csql_shared_batch (csqlshared *s, csqlresult **batch, int n) {
+	// the writes are sent back-to-back inside BEGIN/COMMIT and their replies read afterwards
+	// each write is followed by a BEGIN that fails while the transaction is open: if a write ends the transaction
+	// (OR ROLLBACK, SQLITE_FULL...) the next writes run in a new transaction instead of autocommit, so in case
+	// of error the final ROLLBACK leaves nothing applied and each write is executed (and reported) on its own
+	csqldb	*db = s->db;
+	int		i, sent = 0, failed = kFALSE;
+	
+	// a batch that cannot start a transaction is executed one write at a time
+	if (cubesql_execute(db, "BEGIN TRANSACTION;") != CUBESQL_NOERR) {
+		if (csql_isneterror(db->errcode)) goto abort_network;
+		for (i=0; i<n; i++) csql_shared_serve(s, batch[i]);
+		return;
+	}
 	
-	while ((*string) && (*wild != '*')) {
-		if ((toupper(*wild) != toupper(*string)) && (*wild != '?')) {
-			return 0;
+	for (i=0; i<n; i++, sent++) {
+		csql_trace(db, batch[i]->sql);
+		if (csql_send_statement(db, kCOMMAND_EXECUTE, batch[i]->sql, kFALSE, kFALSE) != CUBESQL_NOERR) break;
+		if (csql_send_statement(db, kCOMMAND_EXECUTE, "BEGIN TRANSACTION;", kFALSE, kFALSE) != CUBESQL_NOERR) break;
+	}
+	
+	// every request that has been sent has a reply, also when a previous one failed
+	for (i=0; i<sent; i++) {
+		if (csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT) != CUBESQL_NOERR) {
+			if (csql_isneterror(db->errcode)) goto abort_network;
+			failed = kTRUE;
 		}
-		wild++;
-		string++;
+		
+		// the BEGIN after the write is expected to fail, if it succeeds the write has ended the transaction
+		if (csql_netread(db, -1, -1, kFALSE, NULL, NO_TIMEOUT) == CUBESQL_NOERR) failed = kTRUE;
+		else if (csql_isneterror(db->errcode)) goto abort_network;
 	}
+	if (sent < n) goto abort_network;
 	
-	while (*string) {
-		if (*wild == '*') {
-			if (!*++wild) {
-				return 1;
+	if (failed == kFALSE) {
+		if (cubesql_execute(db, "COMMIT;") == CUBESQL_NOERR) {
+			for (i=0; i<n; i++) {
+				if (db->cache) csql_cache_written(db, batch[i]->sql);
+				csql_shared_complete(s, batch[i]);
 			}
-			mp = wild;
-			cp = string+1;
-		} else if ((toupper(*wild) == toupper(*string)) || (*wild == '?')) {
-			wild++;
-			string++;
-		} else {
-			wild = mp;
-			string = cp++;
+			return;
 		}
+		if (csql_isneterror(db->errcode)) goto abort_network;
 	}
 	
-	while (*wild == '*') {
-		wild++;
+	// writes are executed again only when the rollback proves that none of them has been applied
+	if (cubesql_execute(db, "ROLLBACK;") == CUBESQL_NOERR) {
+		for (i=0; i<n; i++) csql_shared_serve(s, batch[i]);
+		return;
 	}
 	
-	return !*wild;
+abort_network:
+	// the connection is lost (or the state of the transaction is unknown), every write of the batch reports the error
+	for (i=0; i<n; i++) {
+		batch[i]->errcode = db->errcode;
+		snprintf(batch[i]->errmsg, sizeof(batch[i]->errmsg), "%s", db->errmsg);
+		csql_shared_complete(s, batch[i]);
+	}
 }
+	
\ No newline at end of file
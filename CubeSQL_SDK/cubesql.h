@@ -74,6 +74,32 @@ extern "C" {
 #define CUBESQL_SEEKLAST                    -4
 #define CUBESQL_SEEKPREV                    -5
 	
+// priority classes used in cubesql_sched_acquire (up to 4 classes, 0 is the most urgent)
+#define CUBESQL_PRIORITY_INTERACTIVE        0
+#define CUBESQL_PRIORITY_BULK               1
+	
+// flags used in cubesql_cursor_filter (NOCASE can be combined with WILDCARD, case is folded for ASCII letters only)
+#define CUBESQL_FILTER_CASE                 0
+#define CUBESQL_FILTER_NOCASE               1
+#define CUBESQL_FILTER_WILDCARD             2
+	
+// row lists returned by cubesql_diff_rows
+#define CUBESQL_DIFF_INSERTED               1
+#define CUBESQL_DIFF_DELETED                2
+#define CUBESQL_DIFF_UPDATED                3
+#define CUBESQL_DIFF_UPDATED_OLD            4
+	
+// formats used in cubesql_cursor_arrow
+#define CUBESQL_ARROW_STREAM                0
+#define CUBESQL_ARROW_FILE                  1
+	
+// formats and options used in cubesql_export
+#define CUBESQL_EXPORT_CSV                  0
+#define CUBESQL_EXPORT_JSON                 1
+#define CUBESQL_EXPORT_NOHEADER             0x01
+#define CUBESQL_EXPORT_CRLF                 0x02
+#define CUBESQL_EXPORT_JSONLINES            0x04
+	
 #ifndef int64
 #ifdef WIN32
 typedef __int64 int64;
@@ -109,7 +135,18 @@ enum {
 typedef struct csqldb csqldb;
 typedef struct csqlc csqlc;
 typedef struct csqlvm csqlvm;
+typedef struct csqlsel csqlsel;
+typedef struct csqldiff csqldiff;
+typedef struct csqlcache csqlcache;
+typedef struct csqlrefresh csqlrefresh;
+typedef struct csqlpager csqlpager;
+typedef struct csqlpool csqlpool;
+typedef struct csqlshards csqlshards;
+typedef struct csqlsched csqlsched;
+typedef struct csqlshared csqlshared;
+typedef struct csqlresult csqlresult;
 typedef void (*cubesql_trace_callback) (const char *, void *);
+typedef int (*cubesql_blob_reader) (void *ctx, char *buffer, int64 offset, int len);
 	
 // function prototypes
 CUBESQL_APIEXPORT const char *cubesql_version (void);
@@ -140,7 +177,10 @@ CUBESQL_APIEXPORT int       cubesql_send_data (csqldb *db, const char *buffer, i
 CUBESQL_APIEXPORT int       cubesql_send_enddata (csqldb *db);
 CUBESQL_APIEXPORT char      *cubesql_receive_data (csqldb *db, int *len, int *is_end_chunk);
 	
+CUBESQL_APIEXPORT int       cubesql_export (csqldb *db, const char *sql, int format, int fd, int options);
+	
 CUBESQL_APIEXPORT csqlvm	*cubesql_vmprepare (csqldb *db, const char *sql);
+CUBESQL_APIEXPORT csqlvm	*cubesql_vmprepare_cached (csqldb *db, const char *sql);
 CUBESQL_APIEXPORT int		cubesql_vmbind_int (csqlvm *vm, int index, int value);
 CUBESQL_APIEXPORT int		cubesql_vmbind_double (csqlvm *vm, int index, double value);
 CUBESQL_APIEXPORT int		cubesql_vmbind_text (csqlvm *vm, int index, char *value, int len);
@@ -148,9 +188,16 @@ CUBESQL_APIEXPORT int		cubesql_vmbind_blob (csqlvm *vm, int index, void *value,
 CUBESQL_APIEXPORT int		cubesql_vmbind_null (csqlvm *vm, int index);
 CUBESQL_APIEXPORT int		cubesql_vmbind_int64 (csqlvm *vm, int index, int64 value);
 CUBESQL_APIEXPORT int		cubesql_vmbind_zeroblob (csqlvm *vm, int index, int len);
+CUBESQL_APIEXPORT int		cubesql_vmbind_blob_stream (csqlvm *vm, int index, int len, cubesql_blob_reader reader, void *ctx);
+CUBESQL_APIEXPORT int		cubesql_vmbind_blob_fd (csqlvm *vm, int index, int fd);
 CUBESQL_APIEXPORT int		cubesql_vmexecute (csqlvm *vm);
 CUBESQL_APIEXPORT csqlc		*cubesql_vmselect (csqlvm *vm);
 CUBESQL_APIEXPORT int		cubesql_vmclose (csqlvm *vm);
+CUBESQL_APIEXPORT int		cubesql_vmbind_errindex (csqlvm *vm);
+// cubesql_vmexecute_batch with transaction set to 0 stops at the first failed row: the rows before it are committed
+// and the rows after it in the same window (sent before its reply was read) are executed too; changes (if not NULL)
+// is set to -1 only for the rows that did not execute; a row whose bind fails is never executed
+CUBESQL_APIEXPORT int		cubesql_vmexecute_batch (csqlvm *vm, int nrows, int ncols, char **values, int *sizes, int *types, int transaction, int64 *changes);
 	
 CUBESQL_APIEXPORT int		cubesql_cursor_numrows (csqlc *c);
 CUBESQL_APIEXPORT int		cubesql_cursor_numcolumns (csqlc *c);
@@ -166,7 +213,77 @@ CUBESQL_APIEXPORT double	cubesql_cursor_double (csqlc *c, int row, int column, d
 CUBESQL_APIEXPORT char		*cubesql_cursor_cstring (csqlc *c, int row, int column);
 CUBESQL_APIEXPORT char		*cubesql_cursor_cstring_static (csqlc *c, int row, int column, char *static_buffer, int bufferlen);	
 CUBESQL_APIEXPORT void		cubesql_cursor_free (csqlc *c);
+	
+CUBESQL_APIEXPORT csqlsel	*cubesql_cursor_filter (csqlc *c, int column, const char *pattern, int flags);
+CUBESQL_APIEXPORT int		cubesql_selection_count (csqlsel *sel);
+CUBESQL_APIEXPORT int		cubesql_selection_row (csqlsel *sel, int index);
+CUBESQL_APIEXPORT char		*cubesql_selection_field (csqlsel *sel, int index, int column, int *len);
+CUBESQL_APIEXPORT void		cubesql_selection_free (csqlsel *sel);
+	
+CUBESQL_APIEXPORT int64		cubesql_cursor_rowhash (csqlc *c, int row);
+CUBESQL_APIEXPORT csqldiff	*cubesql_cursor_diff (csqlc *oldc, csqlc *newc, int keycolumn);
+CUBESQL_APIEXPORT csqlsel	*cubesql_diff_rows (csqldiff *diff, int kind);
+CUBESQL_APIEXPORT void		cubesql_diff_free (csqldiff *diff);
 
+CUBESQL_APIEXPORT int		cubesql_cursor_arrow (csqlc *c, int fd, int format);
+	
+CUBESQL_APIEXPORT csqlcache	*cubesql_cache_create (int64 max_bytes, int ttl);
+CUBESQL_APIEXPORT void		cubesql_cache_free (csqlcache *cache);
+CUBESQL_APIEXPORT void		cubesql_set_cache (csqldb *db, csqlcache *cache);
+CUBESQL_APIEXPORT void		cubesql_cache_invalidate (csqlcache *cache, const char *table);
+CUBESQL_APIEXPORT csqlc		*cubesql_cache_get (csqldb *db, const char *sql, const char *params, int paramslen);
+CUBESQL_APIEXPORT csqlc		*cubesql_cache_put (csqldb *db, const char *sql, const char *params, int paramslen, csqlc *c);
+CUBESQL_APIEXPORT csqlc		*cubesql_cache_select (csqldb *db, const char *sql);
+CUBESQL_APIEXPORT void		cubesql_cache_stats (csqlcache *cache, int64 *hits, int64 *misses, int64 *merged);
+	
+CUBESQL_APIEXPORT int		cubesql_replica_add (csqldb *db, csqldb *replica);
+CUBESQL_APIEXPORT void		cubesql_replica_remove (csqldb *db, csqldb *replica);
+CUBESQL_APIEXPORT int		cubesql_replica_count (csqldb *db);
+CUBESQL_APIEXPORT double	cubesql_replica_latency (csqldb *db, int index);
+	
+CUBESQL_APIEXPORT csqlrefresh *cubesql_refresh_create (csqldb *db, const char *sql, const char *markcolumn, int keycolumn, int resync);
+CUBESQL_APIEXPORT int		cubesql_refresh (csqlrefresh *r, int full);
+CUBESQL_APIEXPORT csqlc		*cubesql_refresh_cursor (csqlrefresh *r);
+CUBESQL_APIEXPORT void		cubesql_refresh_free (csqlrefresh *r);
+	
+CUBESQL_APIEXPORT csqlpager *cubesql_pager_create (csqldb *db, csqldb *prefetchdb, const char *sql, const char *keycolumn, int pagesize);
+CUBESQL_APIEXPORT csqlc		*cubesql_pager_next (csqlpager *p);
+CUBESQL_APIEXPORT int		cubesql_pager_eof (csqlpager *p);
+CUBESQL_APIEXPORT void		cubesql_pager_free (csqlpager *p);
+	
+CUBESQL_APIEXPORT csqlpool	*cubesql_pool_create (void);
+CUBESQL_APIEXPORT int		cubesql_pool_add (csqlpool *pool, csqldb *db);
+CUBESQL_APIEXPORT int		cubesql_pool_size (csqlpool *pool);
+CUBESQL_APIEXPORT csqldb	*cubesql_pool_acquire (csqlpool *pool, int timeout_ms);
+CUBESQL_APIEXPORT void		cubesql_pool_release (csqlpool *pool, csqldb *db);
+CUBESQL_APIEXPORT void		cubesql_pool_free (csqlpool *pool);
+CUBESQL_APIEXPORT csqlc		*cubesql_parallel_select (csqlpool *pool, const char *sql, const char *partcolumn, int n);
+	
+CUBESQL_APIEXPORT csqlsched	*cubesql_sched_create (csqlpool *pool);
+CUBESQL_APIEXPORT int		cubesql_sched_setclass (csqlsched *s, int priority, int weight, int maxactive, int throttle_ms);
+CUBESQL_APIEXPORT csqldb	*cubesql_sched_acquire (csqlsched *s, int priority, int timeout_ms);
+CUBESQL_APIEXPORT void		cubesql_sched_release (csqlsched *s, csqldb *db);
+CUBESQL_APIEXPORT int		cubesql_sched_waiting (csqlsched *s, int priority);
+CUBESQL_APIEXPORT void		cubesql_sched_free (csqlsched *s);
+	
+CUBESQL_APIEXPORT csqlshared *cubesql_shared_create (csqldb *db);
+CUBESQL_APIEXPORT csqlresult *cubesql_shared_execute (csqlshared *s, const char *sql);
+CUBESQL_APIEXPORT csqlresult *cubesql_shared_select (csqlshared *s, const char *sql);
+CUBESQL_APIEXPORT int		cubesql_shared_coalesce (csqlshared *s, int window_ms, int maxstatements);
+CUBESQL_APIEXPORT void		cubesql_shared_free (csqlshared *s);
+CUBESQL_APIEXPORT int		cubesql_result_errcode (csqlresult *r);
+CUBESQL_APIEXPORT const char *cubesql_result_errmsg (csqlresult *r);
+CUBESQL_APIEXPORT csqlc		*cubesql_result_cursor (csqlresult *r);
+CUBESQL_APIEXPORT void		cubesql_result_free (csqlresult *r);
+	
+CUBESQL_APIEXPORT csqlshards *cubesql_shards_create (void);
+CUBESQL_APIEXPORT int		cubesql_shards_add (csqlshards *s, csqldb *db, const char *name);
+CUBESQL_APIEXPORT int		cubesql_shards_count (csqlshards *s);
+CUBESQL_APIEXPORT int		cubesql_shards_index (csqlshards *s, const char *key, int keylen);
+CUBESQL_APIEXPORT csqldb	*cubesql_shards_route (csqlshards *s, const char *key, int keylen);
+CUBESQL_APIEXPORT csqlc		*cubesql_shards_select (csqlshards *s, const char *sql);
+CUBESQL_APIEXPORT void		cubesql_shards_free (csqlshards *s);
+	
 // private functions
 int		cubesql_connect_token (csqldb **db, const char *host, int port, const char *username, const char *password,
 							   int timeout, int encryption, char *token, int useOldProtocol, const char *ssl_certificate,
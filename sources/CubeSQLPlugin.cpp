@@ -10,8 +10,11 @@
 #include "CubeSQLPlugin.h"
 #include "rb_plugin.h"
 #include <stdarg.h>
+#include <sys/stat.h>
 
 #include <string>
+#include <vector>
+#include <map>
 #include <sstream>
 #include <iostream>
 using namespace std;
@@ -44,6 +47,32 @@ static Boolean nullAsString	= true;
 static Boolean blobAsString = true;
 static Boolean booleanAsInteger = true;
 
+// Class refs and framework methods resolved once in PluginEntry
+typedef int (*vartype_callback) (void *);
+static REALclassRef vmClassRef = NULL;
+static REALclassRef prepareClassRef = NULL;
+static REALclassRef memoryBlockClassRef = NULL;
+static REALclassRef pictureClassRef = NULL;
+static vartype_callback varTypeFunc = NULL;
+
+// Records added with AddRow while insert batching is enabled
+struct cubeSQLInsertBatch {
+	int					maxBytes;				// the rows are flushed when their values reach this size
+	int					ncols;
+	int					nrows;
+	std::string			table;
+	std::string			columns;				// column list shared by all the buffered rows
+	std::string			values;					// values of all the rows back to back, each one 0-terminated
+	std::vector<int>	offsets;				// offset of each value in values (-1 for NULL)
+	std::vector<int>	sizes;
+	std::vector<int>	types;
+};
+
+// INSERT statements generated by AddRow, by table and column list
+struct cubeSQLInsertCache {
+	std::map<std::string, std::string>	statements;
+};
+
 // MARK: - Database API -
 
 void DatabaseConstructor(REALobject instance) {
@@ -77,6 +106,12 @@ void DatabaseDestructor(REALobject instance) {
 	if (data == NULL) return;
 	
 	DatabaseClose(data);
+	if ((data->cache) && (data->sharedCache == false)) cubesql_cache_free(data->cache);
+	data->cache = NULL;
+	delete data->insertBatch;
+	data->insertBatch = NULL;
+	delete data->insertCache;
+	data->insertCache = NULL;
 }
 
 void DatabaseClose(dbDatabase *database) {
@@ -147,6 +182,8 @@ Boolean DatabaseConnect(REALdbDatabase instance) {
 	int err = cubesql_connect_token(&db, s1, database->port, s2, s3, database->timeout, database->encryption, token,
 									useREALServerProtocol, sslCertificate, rootCertificate, sslCertificatePassword, sslCipherList);
 	database->db = db;
+	if (err == CUBESQL_NOERR) cubesql_setuserptr(db, database);
+	if ((err == CUBESQL_NOERR) && (database->cache)) cubesql_set_cache(db, database->cache);
 	if (err != CUBESQL_NOERR) {
 		if (err == CUBESQL_SSL_ERROR) DatabaseSetTempError(database, "SSL Library Not Found", kTempError4);
 		else if (err == CUBESQL_PARAMETER_ERROR) DatabaseSetTempError(database, "Parameters Error", kTempError3);
@@ -211,6 +248,7 @@ void DatabaseUnlock(dbDatabase *database) {
 	if (database->referenceCount > 0) return;
 	
 	PingTimerStop(database);
+	DatabaseFlushInserts(database);
 	if ((database->db) && (database->isConnected))
 		cubesql_disconnect(database->db, kFALSE);
 
@@ -263,6 +301,7 @@ REALstring DatabaseErrMessage (REALobject instance) {
 REALdbCursor DatabaseTableSchema(dbDatabase *database) {
 	DEBUG_WRITE("DatabaseTableSchema");
 	if (database->isConnected == false) return NULL;
+	if (DatabaseFlushInserts(database) == false) return NULL;
 	csqlc *c = cubesql_select(database->db, "SELECT name as TableName FROM sqlite_master WHERE type='table' ORDER BY TableName;", 0);
 	if (c == NULL) return NULL;
 	return REALdbCursorFromDBCursor(CursorCreate(c), &CubeSQLFieldSchemaCursor);
@@ -271,6 +310,7 @@ REALdbCursor DatabaseTableSchema(dbDatabase *database) {
 REALdbCursor DatabaseIndexSchema(dbDatabase *database, REALstring tableName) {
 	DEBUG_WRITE("DatabaseIndexSchema");
 	if (database->isConnected == false) return NULL;
+	if (DatabaseFlushInserts(database) == false) return NULL;
 	char sql[512];
 	snprintf(sql, sizeof(sql), "SELECT name as IndexName FROM sqlite_master WHERE type='index' AND tbl_name='%s';", REALGetCString(tableName));
 	csqlc *c = cubesql_select(database->db, sql, 0);
@@ -281,6 +321,7 @@ REALdbCursor DatabaseIndexSchema(dbDatabase *database, REALstring tableName) {
 REALdbCursor DatabaseFieldSchema(dbDatabase *database, REALstring tableName) {
 	DEBUG_WRITE("DatabaseFieldSchema");
 	if (database->isConnected == false) return NULL;
+	if (DatabaseFlushInserts(database) == false) return NULL;
 	char sql[512];
 	
 	if (database->useREALServerProtocol)
@@ -298,6 +339,7 @@ REALdbCursor DatabaseFieldSchema(dbDatabase *database, REALstring tableName) {
 void DatabaseSQLExecute(dbDatabase *database, REALstring sql) {
 	DEBUG_WRITE("DatabaseSQLExecute %s", REALGetCString(sql));
 	if (database->isConnected == false) return;
+	if (DatabaseFlushInserts(database) == false) return;
 	database->endChunkReceived = false;
 	cubesql_execute(database->db, REALGetCString(sql));
 }
@@ -305,77 +347,173 @@ void DatabaseSQLExecute(dbDatabase *database, REALstring sql) {
 REALdbCursor DatabaseSQLSelect(dbDatabase *database, REALstring sql) {
 	DEBUG_WRITE("DatabaseSQLSelect");
 	if (database->isConnected == false) return NULL;
+	if (DatabaseFlushInserts(database) == false) return NULL;
 	database->endChunkReceived = false;
-	csqlc *c = cubesql_select(database->db, REALGetCString(sql), 0);
+	csqlc *c = cubesql_cache_select(database->db, REALGetCString(sql));
 	if (c == NULL) return NULL;
 	return REALdbCursorFromDBCursor(CursorCreate(c), &CubeSQLCursor);
 }
 
-void DatabaseAddTableRecord(dbDatabase *database, REALstring tableName, REALcolumnValue *values) {
-	DEBUG_WRITE("DatabaseAddTableRecord %s", REALGetCString(tableName));
+Boolean DatabaseFlushInserts(dbDatabase *database) {
+	// sends the buffered records as a single INSERT INTO table (columns) VALUES (?1,?2),(?3,?4)... statement
+	cubeSQLInsertBatch *batch = database->insertBatch;
+	if ((batch == NULL) || (batch->nrows == 0)) return true;
+	if (database->isConnected == false) return false;
+	
+	char *sql = csql_insert_sql(batch->table.c_str(), batch->columns.c_str(), batch->ncols, batch->nrows);
+	if (sql == NULL) {
+		cubesql_seterror(database->db, CUBESQL_MEMORY_ERROR, "Not enough memory to flush the inserted rows");
+		DatabaseDiscardInserts(database);
+		return false;
+	}
+	DEBUG_WRITE("Flushing %d rows into %s", batch->nrows, batch->table.c_str());
 	
-	// retrieve information about the DatabaseRecord
-	int		ncols = 0;
-	int	   	index = 1;
-	string 	cols = "";
- 	string  vals = "";
+	int nvalues = batch->nrows * batch->ncols;
+	std::vector<char *> colvalue(nvalues);
+	for (int i=0; i<nvalues; ++i) colvalue[i] = (batch->offsets[i] < 0) ? NULL : &batch->values[batch->offsets[i]];
+	
+	int rc = cubesql_bind(database->db, sql, colvalue.data(), batch->sizes.data(), batch->types.data(), nvalues);
+	free(sql);
+	
+	// on error the rows are discarded (so that they do not fail every following statement) and the call that caused
+	// the flush reports which rows were lost
+	if (rc != CUBESQL_NOERR) {
+		char msg[512];
+		snprintf(msg, sizeof(msg), "%d rows added to %s were not inserted: %s", batch->nrows, batch->table.c_str(), cubesql_errmsg(database->db));
+		cubesql_seterror(database->db, cubesql_errcode(database->db), msg);
+	}
+	DatabaseDiscardInserts(database);
+	return (rc == CUBESQL_NOERR);
+}
+
+void DatabaseDiscardInserts(dbDatabase *database) {
+	cubeSQLInsertBatch *batch = database->insertBatch;
+	if (batch == NULL) return;
+	
+	batch->nrows = 0;
+	batch->values.clear();
+	batch->offsets.clear();
+	batch->sizes.clear();
+	batch->types.clear();
+}
+
+Boolean VMFlushInserts(csqlvm *vm) {
+	// records added with AddRow must reach the table before a prepared statement runs
+	dbDatabase *database = (vm && vm->db) ? (dbDatabase *)cubesql_getuserptr(vm->db) : NULL;
+	return (database) ? DatabaseFlushInserts(database) : true;
+}
+
+static void DatabaseBatchTableRecord(dbDatabase *database, REALstring tableName, REALcolumnValue *values) {
+	// the buffered rows are sent before adding a record that does not fit, if that fails they are discarded, the record
+	// is not added and AddRow reports the error
+	cubeSQLInsertBatch *batch = database->insertBatch;
+	std::string	columns;
+	int			ncols = 0, nbytes = 0;
 	
 	for (REALcolumnValue *value = values; value != NULL; value = value->nextColumn) {
-		cols += REALGetCString(value->columnName);
-		stringstream temp;
-		temp<<index;
-		vals += "?" + temp.str();
-		
-		if (value->nextColumn) {
-			cols += ",";
-			vals += ",";
+		if (ncols) columns += ",";
+		columns += REALGetCString(value->columnName);
+		nbytes += (int)REALStringLength(value->columnValue) + 1;
+		ncols++;
+	}
+	
+	// a different table or column set, a packet over the limit or too many rows or parameters, flush the buffered rows first
+	if ((batch->nrows > 0) && ((batch->table != REALGetCString(tableName)) || (batch->columns != columns) ||
+		((int)batch->values.size() + nbytes > batch->maxBytes) || (batch->nrows >= MAX_BATCH_ROWS) ||
+		((batch->nrows + 1) * ncols > MAX_BATCH_PARAMS))) {
+		if (DatabaseFlushInserts(database) == false) return;
+	}
+	
+	if (batch->nrows == 0) {
+		batch->table = REALGetCString(tableName);
+		batch->columns = columns;
+		batch->ncols = ncols;
+	}
+	
+	for (REALcolumnValue *value = values; value != NULL; value = value->nextColumn) {
+		char *realvalue = (char *)REALGetCString(value->columnValue);
+		int size = (int)REALStringLength(value->columnValue);
+		if ((value->columnType == dbTypeBoolean) && (booleanAsInteger)) {
+			realvalue = REALbasicBoolean2Integer(realvalue);
+			size = 1;
 		}
 		
-		index++;
-		ncols++;
+		batch->sizes.push_back(size);
+		batch->types.push_back(REALbasic2CubeSQLColumnType(value->columnType));
+		if (realvalue == NULL) {
+			batch->offsets.push_back(-1);
+			continue;
+		}
+		batch->offsets.push_back((int)batch->values.size());
+		batch->values.append(realvalue, size);
+		batch->values.push_back(0);
 	}
+	batch->nrows++;
 	
-	// build sql bind string
-	std::string sql = "INSERT INTO ";
-	sql += REALGetCString(tableName);
-	sql += " (";
-	sql += cols;
-	sql += ") VALUES (";
-	sql += vals;
-	sql += ");";
-	DEBUG_WRITE("Bind string is %s", sql.c_str());
+	// a buffered record has no error (the framework reports the last one of the connection)
+	cubesql_seterror(database->db, CUBESQL_NOERR, "");
+}
+
+void DatabaseAddTableRecord(dbDatabase *database, REALstring tableName, REALcolumnValue *values) {
+	DEBUG_WRITE("DatabaseAddTableRecord %s", REALGetCString(tableName));
 	
-	// build arrays needed by the cubesql_bind function
-	char	**colvalue = NULL;
-	int		*colsize = NULL;
-	int		*coltype = NULL;
-	char	*realvalue;
+	if (database->isConnected == false) return;
+	if (values == NULL) {
+		cubesql_seterror(database->db, CUBESQL_PARAMETER_ERROR, "No column values to insert");
+		return;
+	}
 	
-	colvalue = (char **) malloc(sizeof(char*)*ncols);
-	colsize = (int *) malloc(sizeof(int)*ncols);
-	coltype = (int *) malloc(sizeof(int)*ncols);
-    if ((colvalue == NULL) || (colsize == NULL) || (coltype == NULL)) {
-        if (colvalue) free((void *)colvalue);
-        if (colsize) free((void *)colsize);
-        if (coltype) free((void *)coltype);
-        return;
-    }
+	// records are buffered and sent as a multi-row INSERT when insert batching is enabled
+	if (database->insertBatch) {
+		DatabaseBatchTableRecord(database, tableName, values);
+		return;
+	}
 	
-	index = 0;
+	// the statement generated for a table and a column list is reused, the connection keeps it prepared
+	// so that the next record with the same columns only sends its values
+	std::string key = REALGetCString(tableName);
 	for (REALcolumnValue *value = values; value != NULL; value = value->nextColumn) {
-		realvalue = (char *)REALGetCString(value->columnValue);
-		if ((value->columnType == dbTypeBoolean) && (booleanAsInteger)) realvalue = REALbasicBoolean2Integer(realvalue);
-		colvalue[index] = realvalue;
-		colsize[index] = (int)REALStringLength(value->columnValue);
-		coltype[index] = REALbasic2CubeSQLColumnType(value->columnType);
-		index++;
+		key += (value == values) ? "\n" : ",";
+		key += REALGetCString(value->columnName);
 	}
 	
-	cubesql_bind (database->db, sql.c_str(), colvalue, colsize, coltype, ncols);
+	if (database->insertCache == NULL) database->insertCache = new cubeSQLInsertCache();
+	std::map<std::string, std::string> &statements = database->insertCache->statements;
+	std::map<std::string, std::string>::iterator it = statements.find(key);
+	if (it == statements.end()) {
+		// build sql bind string
+		int ncols = 0;
+		for (REALcolumnValue *value = values; value != NULL; value = value->nextColumn) ncols++;
+		char *sql = csql_insert_sql(REALGetCString(tableName), key.c_str() + key.find('\n') + 1, ncols, 1);
+		if (sql == NULL) {
+			cubesql_seterror(database->db, CUBESQL_MEMORY_ERROR, "Not enough memory to build the INSERT statement");
+			return;
+		}
+		
+		if (statements.size() >= MAX_INSERT_STATEMENTS) statements.clear();
+		it = statements.insert(std::make_pair(key, std::string(sql))).first;
+		free(sql);
+	}
+	DEBUG_WRITE("Bind string is %s", it->second.c_str());
 	
-	free((void *)colvalue);
-	free((void *)colsize);
-	free((void *)coltype);
+	csqlvm *vm = cubesql_vmprepare_cached(database->db, it->second.c_str());
+	if (vm == NULL) return;
+	
+	int index = 1;
+	for (REALcolumnValue *value = values; value != NULL; value = value->nextColumn, ++index) {
+		char *realvalue = (char *)REALGetCString(value->columnValue);
+		int size = (int)REALStringLength(value->columnValue);
+		int type = REALbasic2CubeSQLColumnType(value->columnType);
+		if ((value->columnType == dbTypeBoolean) && (booleanAsInteger)) {
+			realvalue = REALbasicBoolean2Integer(realvalue);
+			size = 1;
+		}
+		
+		if ((type == CUBESQL_BIND_NULL) || (realvalue == NULL)) cubesql_vmbind_null(vm, index);
+		else csql_bind_value(vm, index, type, realvalue, size);
+	}
+	
+	cubesql_vmexecute(vm);
 }
 
 void DatabaseGetSupportedTypes(int32_t **dataTypes, char **dataNames, size_t *count) {
@@ -395,6 +533,7 @@ long long DatabaseLastRowID(REALobject instance) {
 	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
 	if (data == NULL) return 0;
 	if (data->isConnected == false) return 0;
+	if (DatabaseFlushInserts(data) == false) return 0;
 	
 	csqlc *c = cubesql_select(data->db, "SHOW LASTROWID;", 0);
 	if (c == NULL) return 0;
@@ -483,40 +622,83 @@ REALstring DatabaseReceiveChunk(REALobject instance) {
 
 // MARK: - New DB API 2.0 -
 
+REALstring VariantStringValue(REALobject item) {
+    // StringValue of a Variant, the string must be unlocked by the caller (nullptr if it cannot be read)
+    REALstring value = nullptr;
+    if (!REALGetPropValueString(item, "StringValue", &value)) return nullptr;
+    return value;
+}
+
 REALstring ConvertObjectToMemoryBlockString(REALobject obj) {
+    // bytes of a MemoryBlock or of a Picture (as PNG), the string must be unlocked by the caller
     // check if respond to StringValue first
-    REALstring value = nullptr;
-    if (REALGetPropValueString(obj, "StringValue", &value)) return value;
+    REALstring value = VariantStringValue(obj);
+    if (value) return value;
     
-    static REALclassRef memblockRef = NULL;
-    static REALclassRef pictureRef = NULL;
-    if (!memblockRef) memblockRef = REALGetClassRef("MemoryBlock");
-    if (!pictureRef ) pictureRef = REALGetClassRef("Picture");
+    if (!memoryBlockClassRef) memoryBlockClassRef = REALGetClassRef("MemoryBlock");
+    if (!pictureClassRef) pictureClassRef = REALGetClassRef("Picture");
     
     // MemoryBlock case
     REALmemoryBlock mb = NULL;
-    if (REALObjectIsA(obj, memblockRef)) {
+    Boolean created = false;
+    if (REALObjectIsA(obj, memoryBlockClassRef)) {
         mb = (REALmemoryBlock)obj;
     } else {
         // Picture case
-        if (REALObjectIsA(obj, pictureRef)) {
+        if (REALObjectIsA(obj, pictureClassRef)) {
             // load ToData function
             REALmemoryBlock (*toDataFunc)(REALobject,RBInteger,RBInteger) = NULL;
             toDataFunc = (REALmemoryBlock (*)(REALobject,RBInteger,RBInteger))REALLoadObjectMethod(obj, "ToData(format As Picture.Formats, quality As Integer) As MemoryBlock");
             RBInteger quality = -1; // QualityDefault
             RBInteger format = 150; // PNG
             mb = (toDataFunc) ? toDataFunc(obj, format, quality) : NULL;
+            created = true;
         }
     }
     
-    if (mb && REALGetPropValueString(mb, "StringValue", &value)) return value;
-    return NULL;
+    if (mb && !REALGetPropValueString(mb, "StringValue", &value)) value = NULL;
+    
+    // the MemoryBlock created by ToData is released once its bytes are read
+    if (created && mb) REALUnlockObject((REALobject)mb);
+    return value;
+}
+
+void BindStringToVM(csqlvm *vm, int index, REALstring value, Boolean isBlob) {
+    REALstringData sdata;
+    if (!REALGetStringData(value, (isBlob) ? kREALTextEncodingUnknown : kREALTextEncodingUTF8, &sdata)) {
+        cubesql_vmbind_null(vm, index);
+        return;
+    }
+    if (isBlob) cubesql_vmbind_blob(vm, index, (void *)sdata.data, (int)sdata.length);
+    else cubesql_vmbind_text(vm, index, (char *)sdata.data, (int)sdata.length);
+    REALDisposeStringData(&sdata);
+}
+
+Boolean BindFileToVM(csqlvm *vm, int index, REALfolderItem file) {
+    // the file is not loaded in memory, the SDK owns the descriptor and streams its content when the statement is executed
+    if ((vm == NULL) || (file == NULL)) return false;
+    
+    REALstring path = REALbasicPathFromFolderItem(file);
+    if (path == NULL) return false;
+    #if WIN32
+    int fd = _open(REALGetCString(path), _O_RDONLY | _O_BINARY);
+    #else
+    int fd = open(REALGetCString(path), O_RDONLY);
+    #endif
+    REALUnlockString(path);
+    
+    if (fd < 0) {
+        csql_seterror(vm->db, CUBESQL_PARAMETER_ERROR, "Unable to open the file to bind");
+        return false;
+    }
+    return (cubesql_vmbind_blob_fd(vm, index, fd) == CUBESQL_NOERR);
 }
 
-void BindVariantObjectToVM(REALobject vm, int index, REALobject item) {
+void BindVariantObjectToVM(csqlvm *vm, int index, REALobject item) {
+    // binds straight to the csqlvm, no CubeSQLVM object is involved
     RBInteger varType = GetVarType(item);
     if (varType == -1) { // was (!REALGetPropValueInteger(item, "Type", &varType)) {
-        CubeSQLVMBindNull(vm, index);
+        cubesql_vmbind_null(vm, index);
         return;
     }
     
@@ -525,31 +707,31 @@ void BindVariantObjectToVM(REALobject vm, int index, REALobject item) {
     
     switch (varType) {
         case 0: { // TypeNil
-            CubeSQLVMBindNull(vm, index);
+            cubesql_vmbind_null(vm, index);
         } break;
             
         case 2: { // TypeInt32
             int32_t value = 0;
-            if (!REALGetPropValueInt32(item, "Int32Value", &value)) CubeSQLVMBindNull(vm, index);
-            else CubeSQLVMBindInt(vm, index, (int)value);
+            if (!REALGetPropValueInt32(item, "Int32Value", &value)) cubesql_vmbind_null(vm, index);
+            else cubesql_vmbind_int(vm, index, (int)value);
         } break;
             
         case 3: { // TypeInt64
             RBInt64 value = 0;
-            if (!REALGetPropValueInt64(item, "Int64Value", &value)) CubeSQLVMBindNull(vm, index);
-            else CubeSQLVMBindInt64(vm, index, (int64)value);
+            if (!REALGetPropValueInt64(item, "Int64Value", &value)) cubesql_vmbind_null(vm, index);
+            else cubesql_vmbind_int64(vm, index, (int64)value);
         } break;
             
         case 4: { // TypeSingle
             float value = 0.0;
-            if (!REALGetPropValueSingle(item, "SingleValue", &value)) CubeSQLVMBindNull(vm, index);
-            else CubeSQLVMBindDouble(vm, index, (double)value);
+            if (!REALGetPropValueSingle(item, "SingleValue", &value)) cubesql_vmbind_null(vm, index);
+            else cubesql_vmbind_double(vm, index, (double)value);
         } break;
             
         case 5: { // TypeDouble
             double value = 0.0;
-            if (!REALGetPropValueDouble(item, "DoubleValue", &value)) CubeSQLVMBindNull(vm, index);
-            else CubeSQLVMBindDouble(vm, index, (double)value);
+            if (!REALGetPropValueDouble(item, "DoubleValue", &value)) cubesql_vmbind_null(vm, index);
+            else cubesql_vmbind_double(vm, index, (double)value);
         } break;
             
 //        case 6: { // TypeCurrency
@@ -561,11 +743,15 @@ void BindVariantObjectToVM(REALobject vm, int index, REALobject item) {
         case 7:
         case 38: { // TypeDate and TypeDateTime
             REALobject value = nullptr;
-            if (!REALGetPropValueObject(item, "DateTimeValue", &value)) CubeSQLVMBindNull(vm, index);
+            if (!REALGetPropValueObject(item, "DateTimeValue", &value)) cubesql_vmbind_null(vm, index);
             else {
                 REALstring svalue = nullptr;
-                if (!REALGetPropValueString(value, "SQLDateTime", &svalue)) CubeSQLVMBindNull(vm, index);
-                else CubeSQLVMBindText(vm, index, svalue);
+                if (!REALGetPropValueString(value, "SQLDateTime", &svalue)) cubesql_vmbind_null(vm, index);
+                else {
+                    BindStringToVM(vm, index, svalue, false);
+                    REALUnlockString(svalue);
+                }
+                REALUnlockObject(value);
             }
         } break;
             
@@ -576,9 +762,12 @@ void BindVariantObjectToVM(REALobject vm, int index, REALobject item) {
         case 20:
         case 21:
         case 37: { // TypeString, CString, WString, PString, CFStringRef and TypeText
-            REALstring value = nullptr;
-            if (!REALGetPropValueString(item, "StringValue", &value)) CubeSQLVMBindNull(vm, index);
-            else CubeSQLVMBindText(vm, index, value);
+            REALstring value = VariantStringValue(item);
+            if (value == nullptr) cubesql_vmbind_null(vm, index);
+            else {
+                BindStringToVM(vm, index, value, false);
+                REALUnlockString(value);
+            }
         } break;
             
         case 9: { // TypeObject
@@ -589,20 +778,23 @@ void BindVariantObjectToVM(REALobject vm, int index, REALobject item) {
             
             // try to convert object to a buffer
             REALstring svalue = ConvertObjectToMemoryBlockString(item);
-            if (svalue) CubeSQLVMBindBlob(vm, index, svalue);
-            else CubeSQLVMBindNull(vm, index);
+            if (svalue == nullptr) cubesql_vmbind_null(vm, index);
+            else {
+                BindStringToVM(vm, index, svalue, true);
+                REALUnlockString(svalue);
+            }
         } break;
             
         case 11:  { // TypeBoolean
             bool value = false;
-            if (!REALGetPropValueBoolean(item, "BooleanValue", &value)) CubeSQLVMBindNull(vm, index);
-            else CubeSQLVMBindInt(vm, index, value ? 1 : 0);
+            if (!REALGetPropValueBoolean(item, "BooleanValue", &value)) cubesql_vmbind_null(vm, index);
+            else cubesql_vmbind_int(vm, index, value ? 1 : 0);
         } break;
             
         case 16:  { // TypeColor
             RBColor value = 0;
-            if (!REALGetPropValueColor(item, "ColorValue", &value)) CubeSQLVMBindNull(vm, index);
-            else CubeSQLVMBindInt(vm, index, (int)value);
+            if (!REALGetPropValueColor(item, "ColorValue", &value)) cubesql_vmbind_null(vm, index);
+            else cubesql_vmbind_int(vm, index, (int)value);
         } break;
             
 //            case 18: {
@@ -663,7 +855,7 @@ void BindVariantObjectToVM(REALobject vm, int index, REALobject item) {
             // TypeOSType
             // TypePtr
             // TypeStructure
-            CubeSQLVMBindNull(vm, index);
+            cubesql_vmbind_null(vm, index);
         } break;
             
 //            case 37: {
@@ -681,12 +873,12 @@ void BindVariantObjectToVM(REALobject vm, int index, REALobject item) {
             
         default: {
             // TypeArray (4096, logically OR'ed with the element type)
-            CubeSQLVMBindNull(vm, index);
+            cubesql_vmbind_null(vm, index);
         } break;
     }
 }
 
-void BindVariantArrayToVM(REALobject vm, REALarray params) {
+void BindVariantArrayToVM(csqlvm *vm, REALarray params) {
     RBInteger count = REALGetArrayUBound(params);
     
     // loop REALarray
@@ -697,12 +889,68 @@ void BindVariantArrayToVM(REALobject vm, REALarray params) {
     }
 }
 
+Boolean CacheKeyFromVariantArray(REALarray params, std::string &key) {
+    // type and value of each parameter, false if a value cannot be represented
+    RBInteger count = REALGetArrayUBound(params);
+    
+    for (RBInteger i=0; i<=count; ++i) {
+        REALobject item = nullptr;
+        REALGetArrayValueObject(params, i, &item);
+        
+        RBInteger varType = (item) ? GetVarType(item) : 0;
+        REALstring value = nullptr;
+        RBInt64 n = 0;
+        double d = 0.0;
+        
+        key.append((const char *)&varType, sizeof(RBInteger));
+        switch (varType) {
+            case -1:
+            case 0: break;
+            
+            case 2:
+            case 3: {
+                if (!REALGetPropValueInt64(item, "Int64Value", &n)) return false;
+                key.append((const char *)&n, sizeof(RBInt64));
+            } break;
+            
+            case 11: {
+                bool b = false;
+                if (!REALGetPropValueBoolean(item, "BooleanValue", &b)) return false;
+                key.append(b ? "1" : "0", 1);
+            } break;
+            
+            case 4:
+            case 5: {
+                if (!REALGetPropValueDouble(item, "DoubleValue", &d)) return false;
+                key.append((const char *)&d, sizeof(double));
+            } break;
+            
+            default: {
+                if (varType & 4096) return false;
+                value = (varType == 9) ? ConvertObjectToMemoryBlockString(item) : VariantStringValue(item);
+                if (value == nullptr) return false;
+                
+                REALstringData sdata;
+                Boolean ok = REALGetStringData(value, kREALTextEncodingUnknown, &sdata);
+                REALUnlockString(value);
+                if (!ok) return false;
+                int len = (int)sdata.length;
+                key.append((const char *)&len, sizeof(int));
+                key.append((const char *)sdata.data, sdata.length);
+                REALDisposeStringData(&sdata);
+            } break;
+        }
+    }
+    return true;
+}
+
 // Runs the SQL select statement with the supplied parameters
 // sql -- the sql select statement to execute
 // params -- variant array of parameters, can be empty or null
 REALdbCursor DatabaseSelectSQL(dbDatabase *instance, REALstring sql, REALarray params) {
     DEBUG_WRITE("DatabaseSelect: %s", REALGetCString(sql));
     if (instance->isConnected == false) return NULL;
+    if (DatabaseFlushInserts(instance) == false) return NULL;
     instance->endChunkReceived = false;
     
     RBInteger count = REALGetArrayUBound(params);
@@ -710,23 +958,33 @@ REALdbCursor DatabaseSelectSQL(dbDatabase *instance, REALstring sql, REALarray p
     
     if (isParamsEmpty) {
         // simpler case without params
-        csqlc *c = cubesql_select(instance->db, REALGetCString(sql), 0);
+        csqlc *c = cubesql_cache_select(instance->db, REALGetCString(sql));
         if (c == NULL) return NULL;
         return REALNewRowSetFromDBCursor(CursorCreate(c), &CubeSQLCursor);
     }
     
-    // more complex case with params so a VM is required
-    csqlvm *_vm = cubesql_vmprepare(instance->db, REALGetCString(sql));
-    if (!_vm) return NULL;
+    // bound values are part of the cache key
+    std::string key;
+    Boolean useCache = (instance->cache != NULL) && CacheKeyFromVariantArray(params, key);
+    if (useCache) {
+        csqlc *c = cubesql_cache_get(instance->db, REALGetCString(sql), key.data(), (int)key.size());
+        if (c) return REALNewRowSetFromDBCursor(CursorCreate(c), &CubeSQLCursor);
+    }
+    
+    // more complex case with params so a VM is required, the connection keeps it prepared for the next call
+    // (after a cache miss the result must always be reported to the cache, other connections could be waiting for it)
+    csqlc *c = NULL;
+    csqlvm *_vm = cubesql_vmprepare_cached(instance->db, REALGetCString(sql));
+    if (!_vm) goto abort;
     
-    REALobject result = REALnewInstanceWithClass(REALGetClassRef("CubeSQLVM"));
-    if (!result) { cubesql_vmclose(_vm); return NULL; }
-    ClassData(CubeSQLVMClass, result, cubeSQLVM, vm);
-    if (!vm) { cubesql_vmclose(_vm); return NULL; }
-    vm->vm = _vm;
-
-    BindVariantArrayToVM(result, params);
-    return CubeSQLVMSelectRowSet(result);
+    BindVariantArrayToVM(_vm, params);
+    c = cubesql_vmselect(_vm);
+    if (!useCache) return (c) ? REALNewRowSetFromDBCursor(CursorCreate(c), &CubeSQLCursor) : NULL;
+    
+abort:
+    if (useCache) c = cubesql_cache_put(instance->db, REALGetCString(sql), key.data(), (int)key.size(), c);
+    if (c == NULL) return NULL;
+    return REALNewRowSetFromDBCursor(CursorCreate(c), &CubeSQLCursor);
 }
 
 // Executes the SQL statement with the supplied parameters
@@ -735,6 +993,7 @@ REALdbCursor DatabaseSelectSQL(dbDatabase *instance, REALstring sql, REALarray p
 void DatabaseExecuteSQL(dbDatabase *instance, REALstring sql, REALarray params) {
     DEBUG_WRITE("DatabaseExecute: %s", REALGetCString(sql));
     if (instance->isConnected == false) return;
+    if (DatabaseFlushInserts(instance) == false) return;
     instance->endChunkReceived = false;
     
     RBInteger count = REALGetArrayUBound(params); // COUNT ARRAY
@@ -745,29 +1004,28 @@ void DatabaseExecuteSQL(dbDatabase *instance, REALstring sql, REALarray params)
         return;
     }
 
-    // more complex case with params so a VM is required
-    csqlvm *_vm = cubesql_vmprepare(instance->db, REALGetCString(sql));
+    // more complex case with params so a VM is required, the connection keeps it prepared for the next call
+    csqlvm *_vm = cubesql_vmprepare_cached(instance->db, REALGetCString(sql));
     if (!_vm) return;
 
-    REALobject result = REALnewInstanceWithClass(REALGetClassRef("CubeSQLVM"));
-    if (!result) { cubesql_vmclose(_vm); return; }
-    ClassData(CubeSQLVMClass, result, cubeSQLVM, vm);
-    if (!vm) { cubesql_vmclose(_vm); return; }
-    vm->vm = _vm;
-
-    BindVariantArrayToVM(result, params);
-    CubeSQLVMExecute(result);
+    BindVariantArrayToVM(_vm, params);
+    cubesql_vmexecute(_vm);
 }
 
 void DatabaseCommit(dbDatabase *instance) {
+    // a failed flush discards its rows and reports them, the transaction is left open to commit the rest or roll back
+    if (DatabaseFlushInserts(instance) == false) return;
     cubesql_commit(instance->db);
 }
 
 void DatabaseRollback(dbDatabase *instance) {
+    // rows that cannot be sent are discarded, they are part of the work that is rolled back
+    DatabaseFlushInserts(instance);
     cubesql_rollback(instance->db);
 }
 
 void BeginTransaction(dbDatabase *instance) {
+    if (DatabaseFlushInserts(instance) == false) return;
     cubesql_begintransaction(instance->db);
 }
 
@@ -779,11 +1037,13 @@ REALobject DatabasePrepareStatement(dbDatabase *database, REALstring statement)
     
     DEBUG_WRITE("DatabasePrepareStatement");
     if (database->isConnected == false) return NULL;
+    if (DatabaseFlushInserts(database) == false) return NULL;
     
     csqlvm *cvm = cubesql_vmprepare(database->db, REALGetCString(statement));
     if (cvm == NULL) return NULL;
     
-    REALobject result = REALnewInstanceWithClass(REALGetClassRef("CubeSQLPreparedStatement"));
+    if (!prepareClassRef) prepareClassRef = REALGetClassRef("CubeSQLPreparedStatement");
+    REALobject result = REALnewInstanceWithClass(prepareClassRef);
     if (result == NULL) { cubesql_vmclose(cvm); return NULL; }
     ClassData(CubeSQLPrepareClass, result, cubeSQLPrepare, vm);
     vm->vm = cvm;
@@ -860,7 +1120,9 @@ void CubeSQLPrepareBindValueType (REALobject instance, int index, REALobject obj
             if (!svalue) cubesql_vmbind_null(vm, index);
             else {
                 REALstringData sdata;
-                if (!REALGetStringData(svalue, kREALTextEncodingUnknown, &sdata)) {
+                Boolean ok = REALGetStringData(svalue, kREALTextEncodingUnknown, &sdata);
+                REALUnlockString(svalue);
+                if (!ok) {
                     cubesql_vmbind_null(vm, index);
                     return;
                 }
@@ -890,11 +1152,13 @@ void CubeSQLPrepareBindValueType (REALobject instance, int index, REALobject obj
         break;
             
         default: { // CUBESQL_TEXT
-            REALstring value = nullptr;
-            if (!REALGetPropValueString(object, "StringValue", &value)) cubesql_vmbind_null(vm, index);
+            REALstring value = VariantStringValue(object);
+            if (value == nullptr) cubesql_vmbind_null(vm, index);
             else {
                 REALstringData sdata;
-                if (!REALGetStringData(value, kREALTextEncodingUTF8, &sdata)) {
+                Boolean ok = REALGetStringData(value, kREALTextEncodingUTF8, &sdata);
+                REALUnlockString(value);
+                if (!ok) {
                     cubesql_vmbind_null(vm, index);
                     return;
                 }
@@ -946,6 +1210,7 @@ void CubeSQLPrepareExecuteSQL (REALobject instance, REALarray values) {
     if (values && (REALGetArrayUBound(values) >= 0)) CubeSQLPrepareBindValues(instance, values);
         
     ClassData(CubeSQLPrepareClass, instance, cubeSQLPrepare, data);
+    if (VMFlushInserts(data->vm) == false) return;
     cubesql_vmexecute(data->vm);
 }
 
@@ -959,6 +1224,7 @@ REALdbCursor CubeSQLPrepareSelectSQL (REALobject instance, REALarray values) {
     if (values && (REALGetArrayUBound(values) >= 0)) CubeSQLPrepareBindValues(instance, values);
     
     ClassData(CubeSQLPrepareClass, instance, cubeSQLPrepare, data);
+    if (VMFlushInserts(data->vm) == false) return NULL;
     csqlc *c = cubesql_vmselect(data->vm);
     if (c == NULL) return NULL;
     return REALNewRowSetFromDBCursor(CursorCreate(c), &CubeSQLCursor);
@@ -969,11 +1235,140 @@ REALdbCursor CubeSQLPrepareSQLSelect (REALobject instance, REALarray params) {
     if (params && (REALGetArrayUBound(params) >= 0)) CubeSQLPrepareBindValues(instance, params);
     
     ClassData(CubeSQLPrepareClass, instance, cubeSQLPrepare, data);
+    if (VMFlushInserts(data->vm) == false) return NULL;
     csqlc *c = cubesql_vmselect(data->vm);
     if (c == NULL) return NULL;
     return REALdbCursorFromDBCursor(CursorCreate(c), &CubeSQLCursor);
 }
 
+Boolean CubeSQLPrepareBindFile (REALobject instance, int index, REALfolderItem file) {
+    DEBUG_WRITE("CubeSQLPrepareBindFile");
+    ClassData(CubeSQLPrepareClass, instance, cubeSQLPrepare, data);
+    
+    // sqlite3 on server side expects a 1-based index (while Xojo requires a 0-based index)
+    return BindFileToVM(data->vm, index + 1, file);
+}
+
+Boolean BatchValueFromVariant(REALobject item, int type, std::string &value, int &bindtype) {
+    // converts a parameter of ExecuteBatch, false if the value cannot be read (type is the one set with BindType, 0 to guess
+    // it from the variant), bindtype is CUBESQL_BIND_NULL for Nil
+    RBInteger varType = (item) ? GetVarType(item) : 0;
+    bindtype = CUBESQL_BIND_NULL;
+    if (varType & 4096) return false;
+    if (varType <= 0) return true;
+    
+    if (type == 0) {
+        switch (varType) {
+            case 2: case 3: case 11: case 16: type = CUBESQL_BIND_INT64; break;
+            case 4: case 5: type = CUBESQL_BIND_DOUBLE; break;
+            case 9: type = CUBESQL_BIND_BLOB; break;
+            default: type = CUBESQL_BIND_TEXT; break;
+        }
+    }
+    
+    char buffer[kNUMBER_SIZE];
+    bindtype = type;
+    switch (type) {
+        case CUBESQL_BIND_NULL: return true;
+            
+        case CUBESQL_BIND_INTEGER:
+        case CUBESQL_BIND_INT64:
+        case CUBESQL_BIND_ZEROBLOB: {
+            RBInt64 n = 0;
+            if (varType == 11) {
+                bool b = false;
+                if (!REALGetPropValueBoolean(item, "BooleanValue", &b)) return false;
+                n = (b) ? 1 : 0;
+            } else if (varType == 16) {
+                RBColor color = 0;
+                if (!REALGetPropValueColor(item, "ColorValue", &color)) return false;
+                n = (RBInt64)color;
+            } else if (!REALGetPropValueInt64(item, "Int64Value", &n)) return false;
+            value.assign(buffer, csql_format_int64((int64)n, buffer));
+        } break;
+            
+        case CUBESQL_BIND_DOUBLE: {
+            double d = 0.0;
+            if (!REALGetPropValueDouble(item, "DoubleValue", &d)) return false;
+            value.assign(buffer, csql_format_double(d, buffer));
+        } break;
+            
+        default: {
+            REALstring svalue = (type == CUBESQL_BIND_BLOB) ? ConvertObjectToMemoryBlockString(item) : VariantStringValue(item);
+            if (svalue == nullptr) return false;
+            
+            REALstringData sdata;
+            Boolean result = REALGetStringData(svalue, (type == CUBESQL_BIND_BLOB) ? kREALTextEncodingUnknown : kREALTextEncodingUTF8, &sdata);
+            REALUnlockString(svalue);
+            if (!result) return false;
+            value.assign((const char *)sdata.data, sdata.length);
+            REALDisposeStringData(&sdata);
+        } break;
+    }
+    return true;
+}
+
+int CubeSQLPrepareExecuteBatchAffected (REALobject instance, REALarray values, int columnCount, RBBoolean useTransaction, REALarray affected) {
+    // values holds the parameters of all the rows one after the other (columnCount per row), rows are pipelined
+    // returns 0 on success, the 1-based index of the first failed row or -1 (errors are reported by the database)
+    // without a transaction the rows sent together with the failed one are executed anyway, affected tells which
+    // nothing is sent if a row is incomplete or one of the values cannot be read
+    DEBUG_WRITE("CubeSQLPrepareExecuteBatch");
+    ClassData(CubeSQLPrepareClass, instance, cubeSQLPrepare, data);
+    if ((data->vm == NULL) || (values == NULL) || (columnCount <= 0)) return -1;
+    
+    int ncols = columnCount;
+    int count = (int)(REALGetArrayUBound(values) + 1);
+    int nrows = count / ncols;
+    if (count % ncols) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "ExecuteBatch: %d values are not a whole number of rows of %d columns", count, ncols);
+        cubesql_seterror(data->vm->db, CUBESQL_PARAMETER_ERROR, msg);
+        return -1;
+    }
+    if (nrows == 0) return 0;
+    if (VMFlushInserts(data->vm) == false) return -1;
+    
+    std::vector<std::string> buffers(count);
+    std::vector<char *> cvalues(count, (char *)NULL);
+    std::vector<int> sizes(count, 0);
+    std::vector<int> types(count, CUBESQL_BIND_NULL);
+    std::vector<int64> changes((affected) ? nrows : 0);
+    
+    for (int i=0; i<count; ++i) {
+        REALobject item = nullptr;
+        REALGetArrayValueObject(values, i, &item);
+        
+        int col = i % ncols;
+        int type = (col < MAX_TYPES_COUNT) ? data->types[col] : 0;
+        if (!BatchValueFromVariant(item, type, buffers[i], types[i])) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "ExecuteBatch: row %d, parameter %d cannot be bound", (i / ncols) + 1, col + 1);
+            cubesql_seterror(data->vm->db, CUBESQL_PARAMETER_ERROR, msg);
+            return -1;
+        }
+        if (types[i] == CUBESQL_BIND_NULL) continue;
+        
+        // the value of a zeroblob is its length
+        if (types[i] == CUBESQL_BIND_ZEROBLOB) {sizes[i] = atoi(buffers[i].c_str()); continue;}
+        sizes[i] = (int)buffers[i].size();
+        cvalues[i] = (char *)buffers[i].data();
+    }
+    
+    int rc = cubesql_vmexecute_batch(data->vm, nrows, ncols, cvalues.data(), sizes.data(), types.data(), (useTransaction) ? kTRUE : kFALSE, (affected) ? changes.data() : NULL);
+    
+    // affected must be sized by the caller, it receives the number of changes of each row (-1 if the row failed)
+    if (affected) {
+        RBInteger ubound = REALGetArrayUBound(affected);
+        for (int i=0; (i<nrows) && (i<=ubound); ++i) REALSetArrayValueInt64(affected, i, (RBInt64)changes[i]);
+    }
+    return rc;
+}
+
+int CubeSQLPrepareExecuteBatch (REALobject instance, REALarray values, int columnCount, RBBoolean useTransaction) {
+    return CubeSQLPrepareExecuteBatchAffected(instance, values, columnCount, useTransaction, NULL);
+}
+
 // MARK: - Cursor API -
 
 dbCursor *CursorCreate(csqlc *c) {
@@ -989,6 +1384,13 @@ dbCursor *CursorCreate(csqlc *c) {
 	return cursor;
 }
 
+Boolean CursorFlushInserts(dbCursor *cursor) {
+	// records added with AddRow must reach the table before the cursor edits it
+	csqldb *db = cubesql_cursor_db(cursor->c);
+	dbDatabase *database = (db) ? (dbDatabase *)cubesql_getuserptr(db) : NULL;
+	return (database) ? DatabaseFlushInserts(database) : true;
+}
+
 void CursorDestroy(dbCursor* cursor) {
 	DEBUG_WRITE("CursorDestroy");
 	if (cursor == NULL) return;
@@ -1114,6 +1516,7 @@ void CursorFieldSchemaColumnValue(dbCursor *cursor, int column, void **value, un
 
 void CursorDelete(dbCursor *cursor) {
 	DEBUG_WRITE("CursorDelete");
+	if (CursorFlushInserts(cursor) == false) return;
     
 	int64 rowid = cubesql_cursor_rowid(cursor->c, CUBESQL_CURROW);
 	if (rowid == 0) return;
@@ -1131,6 +1534,7 @@ void CursorDelete(dbCursor *cursor) {
 
 void CursorUpdate(dbCursor *cursor, REALcursorUpdate *updates) {
 	DEBUG_WRITE("CursorUpdate");
+	if (CursorFlushInserts(cursor) == false) return;
 	int64 rowid = cubesql_cursor_rowid(cursor->c, CUBESQL_CURROW);
 	if (rowid == 0) return;
     
@@ -1263,6 +1667,7 @@ void CursorClose(dbCursor *cursor) {
 void CursorEdit(dbCursor *cursor) {
 	DEBUG_WRITE("CursorEdit");
 	CursorCheckClearLock(cursor);
+	if (CursorFlushInserts(cursor) == false) return;
 	
 	int64 rowid = cubesql_cursor_rowid(cursor->c, CUBESQL_CURROW);
 	if (rowid == 0) return;
@@ -1306,6 +1711,59 @@ Boolean CursorGoToRow(REALobject instance, REALdbCursor rs, int index) {
 	return false;
 }
 
+REALarray CursorFilterRows(REALobject instance, REALdbCursor rs, int column, REALstring pattern, int flags) {
+	// returns the 1-based index of the matching rows (to be used with GoToRow)
+	dbCursor *cursor = NULL;
+	csqlsel *sel = NULL;
+	
+	DEBUG_WRITE("CursorFilterRows");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if (data == NULL) return REALCreateArray(kTypeInteger, -1);
+	
+	cursor = REALGetCursorFromREALdbCursor(rs);
+	if ((cursor == NULL) || (cursor->c == NULL)) return REALCreateArray(kTypeInteger, -1);
+	
+	sel = cubesql_cursor_filter(cursor->c, column, (pattern) ? REALGetCString(pattern) : "", flags);
+	int count = cubesql_selection_count(sel);
+	
+	REALarray result = REALCreateArray(kTypeInteger, count-1);
+	for (int i=0; i<count; i++) {
+		REALSetArrayValueInteger(result, i, cubesql_selection_row(sel, i+1));
+	}
+	
+	cubesql_selection_free(sel);
+	return result;
+}
+
+REALobject CursorDiffRows(REALobject instance, REALdbCursor oldrs, REALdbCursor newrs) {
+	// rowid column is used when available, otherwise rows are matched on the first column
+	return CursorDiffRowsKey(instance, oldrs, newrs, 1);
+}
+
+REALobject CursorDiffRowsKey(REALobject instance, REALdbCursor oldrs, REALdbCursor newrs, int keycolumn) {
+	dbCursor *oldc = NULL, *newc = NULL;
+	csqldiff *diff = NULL;
+	REALobject result = NULL;
+	
+	DEBUG_WRITE("CursorDiffRows");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if (data == NULL) return NULL;
+	
+	oldc = REALGetCursorFromREALdbCursor(oldrs);
+	newc = REALGetCursorFromREALdbCursor(newrs);
+	if ((oldc == NULL) || (oldc->c == NULL)) return NULL;
+	if ((newc == NULL) || (newc->c == NULL)) return NULL;
+	
+	diff = cubesql_cursor_diff(oldc->c, newc->c, keycolumn);
+	if (diff == NULL) return NULL;
+	
+	result = REALnewInstanceWithClass(REALGetClassRef("CubeSQLRowSetDiff"));
+	ClassData(CubeSQLDiffClass, result, cubeSQLDiff, d);
+	d->diff = diff;
+	
+	return result;
+}
+
 REALstring CursorTableName(REALobject instance, REALdbCursor rs) {
 	dbCursor *cursor = NULL;
 	char *s = NULL, *tname = NULL;
@@ -1331,6 +1789,274 @@ emptyResult:
 	return REALBuildStringWithEncoding("", 0, kREALTextEncodingUTF8);
 }
 
+// MARK: - Export API -
+
+Boolean DatabaseExportQuery(REALobject instance, REALstring sql, REALfolderItem file, int format) {
+	return DatabaseExportQueryOptions(instance, sql, file, format, 0);
+}
+
+Boolean DatabaseExportQueryOptions(REALobject instance, REALstring sql, REALfolderItem file, int format, int options) {
+	// rows are streamed by the SDK straight to the file, no RowSet is created
+	REALstring path = NULL;
+	int fd = -1, rc;
+	
+	DEBUG_WRITE("DatabaseExportQuery");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if ((data == NULL) || (data->isConnected == false) || (file == NULL)) return false;
+	
+	path = REALbasicPathFromFolderItem(file);
+	if (path == NULL) return false;
+	#if WIN32
+	fd = _open(REALGetCString(path), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+	#else
+	fd = open(REALGetCString(path), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	#endif
+	REALUnlockString(path);
+	
+	if (fd < 0) {
+		csql_seterror(data->db, CUBESQL_PARAMETER_ERROR, "Unable to create export file");
+		return false;
+	}
+	
+	data->endChunkReceived = false;
+	rc = (DatabaseFlushInserts(data)) ? cubesql_export(data->db, REALGetCString(sql), format, fd, options) : CUBESQL_ERR;
+	
+	#if WIN32
+	_close(fd);
+	#else
+	close(fd);
+	#endif
+	return (rc == CUBESQL_NOERR);
+}
+
+// MARK: - Cache API -
+
+static csqlcache *sharedCache = NULL;
+
+static void DatabaseSetCache(dbDatabase *data, csqlcache *cache, Boolean shared) {
+	if (data->db) cubesql_set_cache(data->db, cache);
+	if ((data->cache) && (data->sharedCache == false)) cubesql_cache_free(data->cache);
+	data->cache = cache;
+	data->sharedCache = shared;
+}
+
+void DatabaseEnableCache(REALobject instance, RBInt64 maxBytes, int ttlSeconds) {
+	// cache used only by this connection
+	DEBUG_WRITE("DatabaseEnableCache");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if (data == NULL) return;
+	
+	csqlcache *cache = cubesql_cache_create((int64)maxBytes, (ttlSeconds > 0) ? ttlSeconds * 1000 : 0);
+	if (cache == NULL) return;
+	DatabaseSetCache(data, cache, false);
+}
+
+void DatabaseEnableSharedCache(REALobject instance, RBInt64 maxBytes, int ttlSeconds) {
+	// cache shared by all connections of the process (budget and ttl are set by the first call)
+	DEBUG_WRITE("DatabaseEnableSharedCache");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if (data == NULL) return;
+	
+	if (sharedCache == NULL) sharedCache = cubesql_cache_create((int64)maxBytes, (ttlSeconds > 0) ? ttlSeconds * 1000 : 0);
+	if (sharedCache == NULL) return;
+	DatabaseSetCache(data, sharedCache, true);
+}
+
+void DatabaseDisableCache(REALobject instance) {
+	DEBUG_WRITE("DatabaseDisableCache");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if (data == NULL) return;
+	
+	DatabaseSetCache(data, NULL, false);
+}
+
+void DatabaseInvalidateCache(REALobject instance) {
+	DEBUG_WRITE("DatabaseInvalidateCache");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if ((data == NULL) || (data->cache == NULL)) return;
+	
+	cubesql_cache_invalidate(data->cache, NULL);
+}
+
+RBInt64 DatabaseCacheHits(REALobject instance) {
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	int64 hits = 0;
+	
+	if (data) cubesql_cache_stats(data->cache, &hits, NULL, NULL);
+	return (RBInt64)hits;
+}
+
+RBInt64 DatabaseCacheMisses(REALobject instance) {
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	int64 misses = 0;
+	
+	if (data) cubesql_cache_stats(data->cache, NULL, &misses, NULL);
+	return (RBInt64)misses;
+}
+
+RBInt64 DatabaseCacheMerged(REALobject instance) {
+	// selects served by an identical query already in progress on another connection
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	int64 merged = 0;
+	
+	if (data) cubesql_cache_stats(data->cache, NULL, NULL, &merged);
+	return (RBInt64)merged;
+}
+
+REALobject DatabaseCreateRefreshable(REALobject instance, REALstring sql, REALstring markColumn, int keyColumn, int resyncEvery) {
+	// markColumn is the rowid or a modification timestamp column, keyColumn 0 means markColumn
+	DEBUG_WRITE("DatabaseCreateRefreshable");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if (data == NULL) return NULL;
+	if (data->isConnected == false) {
+		DatabaseSetTempError(data, "The database is not connected", kTempError3);
+		return NULL;
+	}
+	if ((sql == NULL) || (REALStringLength(sql) == 0)) {
+		cubesql_seterror(data->db, CUBESQL_PARAMETER_ERROR, "The query of the refreshable RowSet cannot be empty");
+		return NULL;
+	}
+	if (DatabaseFlushInserts(data) == false) return NULL;
+	
+	// errors of the query are reported by the database
+	const char *mark = ((markColumn) && (REALStringLength(markColumn) > 0)) ? REALGetCString(markColumn) : NULL;
+	data->endChunkReceived = false;
+	csqlrefresh *refresh = cubesql_refresh_create(data->db, REALGetCString(sql), mark, keyColumn, resyncEvery);
+	if (refresh == NULL) return NULL;
+	
+	REALobject result = REALnewInstanceWithClass(REALGetClassRef("CubeSQLRefreshableRowSet"));
+	if (result == NULL) {
+		cubesql_refresh_free(refresh);
+		cubesql_seterror(data->db, CUBESQL_MEMORY_ERROR, "Unable to create the refreshable RowSet");
+		return NULL;
+	}
+	ClassData(CubeSQLRefreshClass, result, cubeSQLRefresh, r);
+	r->refresh = refresh;
+	r->db = data->db;
+	r->database = instance;
+	REALLockObject(instance);
+	
+	return result;
+}
+
+REALobject DatabaseCreatePager(REALobject instance, REALstring sql, REALstring keyColumn, int pageSize) {
+	DEBUG_WRITE("DatabaseCreatePager");
+	return DatabaseCreatePagerPrefetch(instance, sql, keyColumn, pageSize, NULL);
+}
+
+REALobject DatabaseCreatePagerPrefetch(REALobject instance, REALstring sql, REALstring keyColumn, int pageSize, REALobject prefetch) {
+	// prefetch is a second connection used to fetch the next page in background (it must not be used meanwhile)
+	DEBUG_WRITE("DatabaseCreatePagerPrefetch");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if ((data == NULL) || (data->isConnected == false) || (sql == NULL) || (keyColumn == NULL)) return NULL;
+	if (DatabaseFlushInserts(data) == false) return NULL;
+	
+	csqldb *prefetchdb = NULL;
+	if ((prefetch) && (prefetch != instance)) {
+		ClassData(CubeSQLDatabaseClass, prefetch, dbDatabase, pdata);
+		if ((pdata == NULL) || (pdata->isConnected == false)) return NULL;
+		prefetchdb = pdata->db;
+	} else prefetch = NULL;
+	
+	csqlpager *pager = cubesql_pager_create(data->db, prefetchdb, REALGetCString(sql), REALGetCString(keyColumn), pageSize);
+	if (pager == NULL) return NULL;
+	
+	REALobject result = REALnewInstanceWithClass(REALGetClassRef("CubeSQLPager"));
+	if (result == NULL) {cubesql_pager_free(pager); return NULL;}
+	ClassData(CubeSQLPagerClass, result, cubeSQLPager, p);
+	p->pager = pager;
+	p->db = data->db;
+	p->database = instance;
+	p->prefetch = prefetch;
+	REALLockObject(instance);
+	if (prefetch) REALLockObject(prefetch);
+	
+	return result;
+}
+
+bool DatabaseAddReplica(REALobject instance, REALobject replica) {
+	// read statements are then sent to the fastest replica, the replica is detached when one of the two connections is closed
+	DEBUG_WRITE("DatabaseAddReplica");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if ((data == NULL) || (data->isConnected == false) || (replica == NULL)) return false;
+	
+	ClassData(CubeSQLDatabaseClass, replica, dbDatabase, rdata);
+	if ((rdata == NULL) || (rdata->isConnected == false)) return false;
+	
+	return (cubesql_replica_add(data->db, rdata->db) == CUBESQL_NOERR);
+}
+
+void DatabaseRemoveReplica(REALobject instance, REALobject replica) {
+	DEBUG_WRITE("DatabaseRemoveReplica");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if ((data == NULL) || (data->isConnected == false) || (replica == NULL)) return;
+	
+	ClassData(CubeSQLDatabaseClass, replica, dbDatabase, rdata);
+	if ((rdata == NULL) || (rdata->isConnected == false)) return;
+	
+	cubesql_replica_remove(data->db, rdata->db);
+}
+
+int DatabaseReplicaCount(REALobject instance) {
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if ((data == NULL) || (data->isConnected == false)) return 0;
+	
+	return cubesql_replica_count(data->db);
+}
+
+double DatabaseReplicaLatency(REALobject instance, int index) {
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if ((data == NULL) || (data->isConnected == false)) return -1;
+	
+	return cubesql_replica_latency(data->db, index);
+}
+
+void DatabaseInvalidateCacheTable(REALobject instance, REALstring table) {
+	DEBUG_WRITE("DatabaseInvalidateCacheTable");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if ((data == NULL) || (data->cache == NULL) || (table == NULL)) return;
+	
+	cubesql_cache_invalidate(data->cache, REALGetCString(table));
+}
+
+// MARK: - Insert Batching API -
+
+void DatabaseEnableInsertBatching(REALobject instance, int maxBytes) {
+	// consecutive AddRow into the same table with the same columns become a single multi-row INSERT, sent when
+	// the values reach maxBytes, the table or the columns change, or before any other statement (select, commit...)
+	// rows that fail to be sent are kept and sent again by the next flush, Rollback drops them
+	DEBUG_WRITE("DatabaseEnableInsertBatching %d", maxBytes);
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if (data == NULL) return;
+	
+	if (maxBytes <= 0) {
+		DatabaseDisableInsertBatching(instance);
+		return;
+	}
+	
+	if (data->insertBatch == NULL) data->insertBatch = new cubeSQLInsertBatch();
+	data->insertBatch->maxBytes = maxBytes;
+}
+
+void DatabaseDisableInsertBatching(REALobject instance) {
+	DEBUG_WRITE("DatabaseDisableInsertBatching");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if ((data == NULL) || (data->insertBatch == NULL)) return;
+	
+	// rows that cannot be sent are discarded, their error is left on the connection
+	DatabaseFlushInserts(data);
+	delete data->insertBatch;
+	data->insertBatch = NULL;
+}
+
+Boolean DatabaseInsertFlush(REALobject instance) {
+	DEBUG_WRITE("DatabaseInsertFlush");
+	ClassData(CubeSQLDatabaseClass, instance, dbDatabase, data);
+	if (data == NULL) return false;
+	
+	return DatabaseFlushInserts(data);
+}
+
 // MARK: - VM API -
 
 REALobject DatabasePrepare (REALobject instance, REALstring sql) {
@@ -1342,11 +2068,13 @@ REALobject DatabasePrepare (REALobject instance, REALstring sql) {
 	
 	if (data == NULL) return NULL;
 	if (data->isConnected == false) return NULL;
+	if (DatabaseFlushInserts(data) == false) return NULL;
 	
 	cvm = cubesql_vmprepare(data->db, REALGetCString(sql));
 	if (cvm == NULL) return NULL;
 	
-	result = REALnewInstanceWithClass(REALGetClassRef("CubeSQLVM"));
+	if (!vmClassRef) vmClassRef = REALGetClassRef("CubeSQLVM");
+	result = REALnewInstanceWithClass(vmClassRef);
 	ClassData(CubeSQLVMClass, result, cubeSQLVM, vm);
 	vm->vm = cvm;
 	
@@ -1421,15 +2149,23 @@ void CubeSQLVMBindText (REALobject instance, int index, REALstring str) {
 	REALDisposeStringData(&sdata);
 }
 
+Boolean CubeSQLVMBindFile (REALobject instance, int index, REALfolderItem file) {
+	DEBUG_WRITE("CubeSQLVMBindFile");
+	ClassData(CubeSQLVMClass, instance, cubeSQLVM, data);
+	return BindFileToVM(data->vm, index, file);
+}
+
 void CubeSQLVMExecute (REALobject instance) {
 	DEBUG_WRITE("CubeSQLVMExecute");
 	ClassData(CubeSQLVMClass, instance, cubeSQLVM, data);
+	if (VMFlushInserts(data->vm) == false) return;
 	cubesql_vmexecute(data->vm);
 }
 
 REALdbCursor CubeSQLVMSelect (REALobject instance) {
 	DEBUG_WRITE("CubeSQLVMSelect");
 	ClassData(CubeSQLVMClass, instance, cubeSQLVM, data);
+	if (VMFlushInserts(data->vm) == false) return NULL;
 	csqlc *c = cubesql_vmselect(data->vm);
 	if (c == NULL) return NULL;
 	return REALdbCursorFromDBCursor(CursorCreate(c), &CubeSQLCursor);
@@ -1438,11 +2174,361 @@ REALdbCursor CubeSQLVMSelect (REALobject instance) {
 REALdbCursor CubeSQLVMSelectRowSet (REALobject instance) {
     DEBUG_WRITE("CubeSQLVMSelectRowSet");
     ClassData(CubeSQLVMClass, instance, cubeSQLVM, data);
+    if (VMFlushInserts(data->vm) == false) return NULL;
     csqlc *c = cubesql_vmselect(data->vm);
     if (c == NULL) return NULL;
     return REALNewRowSetFromDBCursor(CursorCreate(c), &CubeSQLCursor);
 }
 
+int CubeSQLVMBindErrorIndex (REALobject instance) {
+	// binds are sent by VMExecute/VMSelect, this is the parameter that made them fail (0 if none)
+	ClassData(CubeSQLVMClass, instance, cubeSQLVM, data);
+	return cubesql_vmbind_errindex(data->vm);
+}
+
+// MARK: - Diff API -
+
+void CubeSQLDiffConstructor (REALobject instance) {
+	DEBUG_WRITE("CubeSQLDiffConstructor");
+	ClassData(CubeSQLDiffClass, instance, cubeSQLDiff, data);
+	memset((void *)data, 0, sizeof(cubeSQLDiff));
+}
+
+void CubeSQLDiffDestructor (REALobject instance) {
+	DEBUG_WRITE("CubeSQLDiffDestructor");
+	ClassData(CubeSQLDiffClass, instance, cubeSQLDiff, data);
+	cubesql_diff_free(data->diff);
+	data->diff = NULL;
+}
+
+static REALarray CubeSQLDiffRows (REALobject instance, int kind) {
+	// returns the 1-based index of the rows (to be used with GoToRow)
+	ClassData(CubeSQLDiffClass, instance, cubeSQLDiff, data);
+	csqlsel *sel = cubesql_diff_rows(data->diff, kind);
+	int count = cubesql_selection_count(sel);
+	
+	REALarray result = REALCreateArray(kTypeInteger, count-1);
+	for (int i=0; i<count; i++) {
+		REALSetArrayValueInteger(result, i, cubesql_selection_row(sel, i+1));
+	}
+	return result;
+}
+
+REALarray CubeSQLDiffInserted (REALobject instance) {
+	DEBUG_WRITE("CubeSQLDiffInserted");
+	return CubeSQLDiffRows(instance, CUBESQL_DIFF_INSERTED);
+}
+
+REALarray CubeSQLDiffDeleted (REALobject instance) {
+	DEBUG_WRITE("CubeSQLDiffDeleted");
+	return CubeSQLDiffRows(instance, CUBESQL_DIFF_DELETED);
+}
+
+REALarray CubeSQLDiffUpdated (REALobject instance) {
+	DEBUG_WRITE("CubeSQLDiffUpdated");
+	return CubeSQLDiffRows(instance, CUBESQL_DIFF_UPDATED);
+}
+
+REALarray CubeSQLDiffUpdatedOld (REALobject instance) {
+	DEBUG_WRITE("CubeSQLDiffUpdatedOld");
+	return CubeSQLDiffRows(instance, CUBESQL_DIFF_UPDATED_OLD);
+}
+
+// MARK: - Refreshable API -
+
+void CubeSQLRefreshConstructor (REALobject instance) {
+	DEBUG_WRITE("CubeSQLRefreshConstructor");
+	ClassData(CubeSQLRefreshClass, instance, cubeSQLRefresh, data);
+	memset((void *)data, 0, sizeof(cubeSQLRefresh));
+}
+
+void CubeSQLRefreshDestructor (REALobject instance) {
+	DEBUG_WRITE("CubeSQLRefreshDestructor");
+	ClassData(CubeSQLRefreshClass, instance, cubeSQLRefresh, data);
+	cubesql_refresh_free(data->refresh);
+	data->refresh = NULL;
+	if (data->database) REALUnlockObject(data->database);
+	data->database = NULL;
+}
+
+static int CubeSQLRefreshRows (REALobject instance, int full) {
+	// connection could have been closed after the object was created
+	ClassData(CubeSQLRefreshClass, instance, cubeSQLRefresh, data);
+	if ((data->refresh == NULL) || (data->database == NULL)) return -1;
+	
+	ClassData(CubeSQLDatabaseClass, data->database, dbDatabase, database);
+	if ((database == NULL) || (database->isConnected == false) || (database->db != data->db)) return -1;
+	if (DatabaseFlushInserts(database) == false) return -1;
+	
+	database->endChunkReceived = false;
+	return cubesql_refresh(data->refresh, full);
+}
+
+int CubeSQLRefreshRefresh (REALobject instance) {
+	DEBUG_WRITE("CubeSQLRefreshRefresh");
+	return CubeSQLRefreshRows(instance, kFALSE);
+}
+
+int CubeSQLRefreshResync (REALobject instance) {
+	DEBUG_WRITE("CubeSQLRefreshResync");
+	return CubeSQLRefreshRows(instance, kTRUE);
+}
+
+REALdbCursor CubeSQLRefreshRowSet (REALobject instance) {
+	// each RowSet is a snapshot, it is not modified by later refreshes
+	DEBUG_WRITE("CubeSQLRefreshRowSet");
+	ClassData(CubeSQLRefreshClass, instance, cubeSQLRefresh, data);
+	csqlc *c = cubesql_refresh_cursor(data->refresh);
+	if (c == NULL) return NULL;
+	return REALNewRowSetFromDBCursor(CursorCreate(c), &CubeSQLCursor);
+}
+
+// MARK: - Pager API -
+
+void CubeSQLPagerConstructor (REALobject instance) {
+	DEBUG_WRITE("CubeSQLPagerConstructor");
+	ClassData(CubeSQLPagerClass, instance, cubeSQLPager, data);
+	memset((void *)data, 0, sizeof(cubeSQLPager));
+}
+
+void CubeSQLPagerDestructor (REALobject instance) {
+	// a prefetch in progress is waited before the connections are unlocked
+	DEBUG_WRITE("CubeSQLPagerDestructor");
+	ClassData(CubeSQLPagerClass, instance, cubeSQLPager, data);
+	cubesql_pager_free(data->pager);
+	data->pager = NULL;
+	if (data->database) REALUnlockObject(data->database);
+	if (data->prefetch) REALUnlockObject(data->prefetch);
+	data->database = NULL;
+	data->prefetch = NULL;
+}
+
+REALdbCursor CubeSQLPagerNextPage (REALobject instance) {
+	// returns Nil after the last page
+	DEBUG_WRITE("CubeSQLPagerNextPage");
+	ClassData(CubeSQLPagerClass, instance, cubeSQLPager, data);
+	if ((data->pager == NULL) || (data->database == NULL)) return NULL;
+	
+	// the connection could have been closed after the object was created (a closed prefetch connection
+	// is detached by the SDK, then the pages are fetched on the connection of the pager only)
+	ClassData(CubeSQLDatabaseClass, data->database, dbDatabase, database);
+	if (database == NULL) return NULL;
+	if ((database->isConnected == false) || (database->db != data->db)) {
+		if (database->isConnected) cubesql_seterror(database->db, CUBESQL_PARAMETER_ERROR, "The connection of the pager has been closed");
+		else DatabaseSetTempError(database, "The connection of the pager has been closed", kTempError3);
+		return NULL;
+	}
+	if (DatabaseFlushInserts(database) == false) return NULL;
+	
+	database->endChunkReceived = false;
+	csqlc *c = cubesql_pager_next(data->pager);
+	if (c == NULL) return NULL;
+	return REALNewRowSetFromDBCursor(CursorCreate(c), &CubeSQLCursor);
+}
+
+Boolean CubeSQLPagerEOF (REALobject instance) {
+	DEBUG_WRITE("CubeSQLPagerEOF");
+	ClassData(CubeSQLPagerClass, instance, cubeSQLPager, data);
+	return (cubesql_pager_eof(data->pager)) ? true : false;
+}
+
+// MARK: - Pool API -
+
+void CubeSQLPoolConstructor (REALobject instance) {
+	DEBUG_WRITE("CubeSQLPoolConstructor");
+	ClassData(CubeSQLPoolClass, instance, cubeSQLPool, data);
+	memset((void *)data, 0, sizeof(cubeSQLPool));
+}
+
+void CubeSQLPoolDestructor (REALobject instance) {
+	DEBUG_WRITE("CubeSQLPoolDestructor");
+	ClassData(CubeSQLPoolClass, instance, cubeSQLPool, data);
+	for (int i=0; i<data->count; i++) REALUnlockObject(data->databases[i]);
+	if (data->databases) free(data->databases);
+	data->databases = NULL;
+	data->count = 0;
+	data->nalloc = 0;
+}
+
+void CubeSQLPoolAdd (REALobject instance, REALobject database) {
+	DEBUG_WRITE("CubeSQLPoolAdd");
+	ClassData(CubeSQLPoolClass, instance, cubeSQLPool, data);
+	if (database == NULL) return;
+	
+	for (int i=0; i<data->count; i++) {
+		if (data->databases[i] == database) return;
+	}
+	
+	if (data->count >= data->nalloc) {
+		int newsize = (data->nalloc) ? data->nalloc * 2 : 8;
+		REALobject *databases = (REALobject *) realloc(data->databases, sizeof(REALobject) * newsize);
+		if (databases == NULL) return;
+		data->databases = databases;
+		data->nalloc = newsize;
+	}
+	data->databases[data->count++] = database;
+	REALLockObject(database);
+}
+
+int CubeSQLPoolCount (REALobject instance) {
+	DEBUG_WRITE("CubeSQLPoolCount");
+	ClassData(CubeSQLPoolClass, instance, cubeSQLPool, data);
+	return data->count;
+}
+
+REALdbCursor CubeSQLPoolSelectParallel (REALobject instance, REALstring sql, REALstring partitionColumn, int n) {
+	// only the connected databases take part, in case of error it is reported by the first one of them
+	// (or by the first database of the pool when none of them is connected)
+	DEBUG_WRITE("CubeSQLPoolSelectParallel");
+	ClassData(CubeSQLPoolClass, instance, cubeSQLPool, data);
+	if (data->count == 0) return NULL;
+	
+	// the SDK pool is rebuilt each time because a database could have been disconnected or reconnected
+	dbDatabase *first = NULL;
+	csqlpool *pool = cubesql_pool_create();
+	int err = (pool == NULL) ? CUBESQL_MEMORY_ERROR : CUBESQL_NOERR;
+	for (int i=0; i<data->count; i++) {
+		ClassData(CubeSQLDatabaseClass, data->databases[i], dbDatabase, database);
+		if ((database == NULL) || (database->isConnected == false)) continue;
+		if (first == NULL) first = database;
+		database->endChunkReceived = false;
+		if (err == CUBESQL_NOERR) err = cubesql_pool_add(pool, database->db);
+	}
+	
+	if (first == NULL) {
+		ClassData(CubeSQLDatabaseClass, data->databases[0], dbDatabase, database);
+		DatabaseSetTempError(database, "No connected database in the pool", kTempError3);
+		if (pool) cubesql_pool_free(pool);
+		return NULL;
+	}
+	if (err != CUBESQL_NOERR) {
+		cubesql_seterror(first->db, CUBESQL_MEMORY_ERROR, "Not enough memory to allocate parallel select");
+		if (pool) cubesql_pool_free(pool);
+		return NULL;
+	}
+	if ((sql == NULL) || (partitionColumn == NULL)) {
+		cubesql_seterror(first->db, CUBESQL_PARAMETER_ERROR, "SQL and partition column cannot be NULL");
+		cubesql_pool_free(pool);
+		return NULL;
+	}
+	
+	csqlc *c = cubesql_parallel_select(pool, REALGetCString(sql), REALGetCString(partitionColumn), n);
+	cubesql_pool_free(pool);
+	
+	if (c == NULL) return NULL;
+	return REALNewRowSetFromDBCursor(CursorCreate(c), &CubeSQLCursor);
+}
+
+// MARK: - Shard Group API -
+
+void CubeSQLShardsConstructor (REALobject instance) {
+	DEBUG_WRITE("CubeSQLShardsConstructor");
+	ClassData(CubeSQLShardsClass, instance, cubeSQLShards, data);
+	memset((void *)data, 0, sizeof(cubeSQLShards));
+}
+
+void CubeSQLShardsDestructor (REALobject instance) {
+	DEBUG_WRITE("CubeSQLShardsDestructor");
+	ClassData(CubeSQLShardsClass, instance, cubeSQLShards, data);
+	for (int i=0; i<data->count; i++) {
+		REALUnlockObject(data->databases[i]);
+		free(data->names[i]);
+	}
+	if (data->databases) free(data->databases);
+	if (data->names) free(data->names);
+	data->databases = NULL;
+	data->names = NULL;
+	data->count = 0;
+	data->nalloc = 0;
+}
+
+void CubeSQLShardsAdd (REALobject instance, REALobject database, REALstring name) {
+	// name must not change between runs otherwise keys are routed to different shards (empty means host:port)
+	DEBUG_WRITE("CubeSQLShardsAdd");
+	ClassData(CubeSQLShardsClass, instance, cubeSQLShards, data);
+	if (database == NULL) return;
+	
+	char buffer[600];
+	const char *s = ((name) && (REALStringLength(name) > 0)) ? REALGetCString(name) : NULL;
+	if (s == NULL) {
+		ClassData(CubeSQLDatabaseClass, database, dbDatabase, db);
+		REALstring host = REALGetDBHost((REALdbDatabase) database);
+		snprintf(buffer, sizeof(buffer), "%s:%d", (host) ? REALGetCString(host) : "", db->port);
+		if (host) REALUnlockString(host);
+		s = buffer;
+	}
+	
+	if (data->count >= data->nalloc) {
+		int newsize = (data->nalloc) ? data->nalloc * 2 : 8;
+		REALobject *databases = (REALobject *) realloc(data->databases, sizeof(REALobject) * newsize);
+		if (databases) data->databases = databases;
+		char **names = (char **) realloc(data->names, sizeof(char *) * newsize);
+		if (names) data->names = names;
+		if ((databases == NULL) || (names == NULL)) return;
+		data->nalloc = newsize;
+	}
+	
+	char *copy = strdup(s);
+	if (copy == NULL) return;
+	data->names[data->count] = copy;
+	data->databases[data->count++] = database;
+	REALLockObject(database);
+}
+
+int CubeSQLShardsCount (REALobject instance) {
+	DEBUG_WRITE("CubeSQLShardsCount");
+	ClassData(CubeSQLShardsClass, instance, cubeSQLShards, data);
+	return data->count;
+}
+
+static csqlshards *CubeSQLShardsCreate (cubeSQLShards *data) {
+	// disconnected databases keep their place on the ring, a database could also have been reconnected
+	csqlshards *shards = cubesql_shards_create();
+	if (shards == NULL) return NULL;
+	
+	for (int i=0; i<data->count; i++) {
+		ClassData(CubeSQLDatabaseClass, data->databases[i], dbDatabase, database);
+		csqldb *db = ((database) && (database->isConnected)) ? database->db : NULL;
+		if (db) database->endChunkReceived = false;
+		if (cubesql_shards_add(shards, db, data->names[i]) != CUBESQL_NOERR) {
+			cubesql_shards_free(shards);
+			return NULL;
+		}
+	}
+	return shards;
+}
+
+REALobject CubeSQLShardsShard (REALobject instance, REALstring key) {
+	// database that owns key, statements about a single key can be executed directly on it
+	DEBUG_WRITE("CubeSQLShardsShard");
+	ClassData(CubeSQLShardsClass, instance, cubeSQLShards, data);
+	if ((key == NULL) || (data->count == 0)) return NULL;
+	
+	csqlshards *shards = CubeSQLShardsCreate(data);
+	if (shards == NULL) return NULL;
+	int index = cubesql_shards_index(shards, (const char *)REALGetCString(key), (int)REALStringLength(key));
+	cubesql_shards_free(shards);
+	if (index < 0) return NULL;
+	
+	REALLockObject(data->databases[index]);
+	return data->databases[index];
+}
+
+REALdbCursor CubeSQLShardsSelectSQL (REALobject instance, REALstring sql) {
+	// in case of error it is reported by the first connected database
+	DEBUG_WRITE("CubeSQLShardsSelectSQL");
+	ClassData(CubeSQLShardsClass, instance, cubeSQLShards, data);
+	if ((sql == NULL) || (data->count == 0)) return NULL;
+	
+	csqlshards *shards = CubeSQLShardsCreate(data);
+	if (shards == NULL) return NULL;
+	csqlc *c = cubesql_shards_select(shards, REALGetCString(sql));
+	cubesql_shards_free(shards);
+	
+	if (c == NULL) return NULL;
+	return REALNewRowSetFromDBCursor(CursorCreate(c), &CubeSQLCursor);
+}
+
 // MARK: - Properties -
 
 REALstring ServerVersionGetter(REALobject instance, long param) {
@@ -1513,6 +2599,7 @@ void AutoCommitSetter(REALobject instance, long param, Boolean value) {
 	if (data == NULL) return;
 	
 	if (data->autoCommit == value) return;
+	if (DatabaseFlushInserts(data) == false) return;
 	
 	// send command to the server
 	if (value == true)
@@ -1742,11 +2829,9 @@ void BooleanAsIntegerSetter(Boolean value) {
 }
 
 // MARK: - Utils -
-typedef int (*vartype_callback) (void *);
 int GetVarType (REALobject value) {
-    static vartype_callback vartype = NULL;
-    if (!vartype) vartype = (vartype_callback) REALLoadFrameworkMethod("VarType (value As Variant) As Integer");
-    return (vartype) ? vartype(value) : -1;
+    if (!varTypeFunc) varTypeFunc = (vartype_callback) REALLoadFrameworkMethod("VarType (value As Variant) As Integer");
+    return (varTypeFunc) ? varTypeFunc(value) : -1;
 }
 
 csqlc *REALServerBuildFieldSchemaCursor (csqlc *pragmac) {
@@ -1911,5 +2996,32 @@ void PluginEntry() {
     SetClassConsoleSafe(&CubeSQLPrepareClass);
     REALRegisterClass(&CubeSQLPrepareClass);
 	
+	// register the CubeSQLRowSetDiff class
+	SetClassConsoleSafe(&CubeSQLDiffClass);
+	REALRegisterClass(&CubeSQLDiffClass);
+	
+	// register the CubeSQLRefreshableRowSet class
+	SetClassConsoleSafe(&CubeSQLRefreshClass);
+	REALRegisterClass(&CubeSQLRefreshClass);
+	
+	// register the CubeSQLPager class
+	SetClassConsoleSafe(&CubeSQLPagerClass);
+	REALRegisterClass(&CubeSQLPagerClass);
+	
+	// register the CubeSQLPool class
+	SetClassConsoleSafe(&CubeSQLPoolClass);
+	REALRegisterClass(&CubeSQLPoolClass);
+	
+	// register the CubeSQLShardGroup class
+	SetClassConsoleSafe(&CubeSQLShardsClass);
+	REALRegisterClass(&CubeSQLShardsClass);
+	
 	REALRegisterModule(&CubeSQLModule);
+	
+	// resolved once instead of at each query or bound parameter (the users fall back to a lookup if one is still missing)
+	vmClassRef = REALGetClassRef("CubeSQLVM");
+	prepareClassRef = REALGetClassRef("CubeSQLPreparedStatement");
+	memoryBlockClassRef = REALGetClassRef("MemoryBlock");
+	pictureClassRef = REALGetClassRef("Picture");
+	varTypeFunc = (vartype_callback) REALLoadFrameworkMethod("VarType (value As Variant) As Integer");
 }
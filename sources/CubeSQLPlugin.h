@@ -16,6 +16,9 @@
 #define PLUGIN_VERSION		"3.4.0"
 #define SSL_NOVERSION		"N/A"
 #define MAX_TYPES_COUNT     512
+#define MAX_BATCH_PARAMS	999		// sqlite default limit of the parameters of a statement
+#define MAX_BATCH_ROWS		500		// rows of a multi-row INSERT built by insert batching
+#define MAX_INSERT_STATEMENTS	256		// INSERT statements generated by AddRow kept for reuse
 
 #define kTempError1			100
 #define kTempError2			101
@@ -25,6 +28,9 @@
 #define kTempError6			105
 #define kTempError7			106
 
+struct cubeSQLInsertBatch;
+struct cubeSQLInsertCache;
+
 #if _MSC_VER
 #define snprintf _snprintf
 #pragma pack(push, 1)
@@ -48,6 +54,10 @@ struct dbDatabase {
 	Boolean				useREALServerProtocol;	// flag to set if you want to use the old REALSQLServer protocol
 	char				tempErrorMsg[256];		// temporary error string
 	int					tempErrorCode;			// temporary error code
+	csqlcache			*cache;					// optional result cache
+	Boolean				sharedCache;			// flag to check if cache is the process-wide one
+	cubeSQLInsertBatch	*insertBatch;			// optional buffer of the records added with AddRow
+	cubeSQLInsertCache	*insertCache;			// INSERT statements generated by AddRow
 	
 	char				filler[3];
 	Boolean				traceEnabled;
@@ -70,6 +80,36 @@ struct cubeSQLVM {
 	csqlvm              *vm;
 };
 
+struct cubeSQLDiff {
+	csqldiff			*diff;
+};
+
+struct cubeSQLRefresh {
+	csqlrefresh			*refresh;
+	csqldb				*db;					// connection the refresh was created on
+	REALobject			database;				// locked so that the connection outlives the object
+};
+
+struct cubeSQLPager {
+	csqlpager			*pager;
+	csqldb				*db;					// connection the pager was created on
+	REALobject			database;				// both locked so that the connections outlive the object
+	REALobject			prefetch;
+};
+
+struct cubeSQLPool {
+	REALobject			*databases;				// CubeSQLServer instances (locked)
+	int					count;
+	int					nalloc;
+};
+
+struct cubeSQLShards {
+	REALobject			*databases;				// CubeSQLServer instances (locked)
+	char				**names;				// names used to place the shards on the hash ring
+	int					count;
+	int					nalloc;
+};
+
 struct cubeSQLPrepare {
     csqlvm              *vm;
     int                 types[MAX_TYPES_COUNT];
@@ -98,6 +138,9 @@ REALdbCursor	DatabaseFieldSchema(dbDatabase *database, REALstring tableName);
 void			DatabaseSQLExecute(dbDatabase *aDatabase, REALstring sql);
 REALdbCursor	DatabaseSQLSelect(dbDatabase *aDatabase, REALstring sql);
 void			DatabaseAddTableRecord(dbDatabase *database, REALstring tableName, REALcolumnValue *values);
+Boolean			DatabaseFlushInserts(dbDatabase *database);
+void			DatabaseDiscardInserts(dbDatabase *database);
+Boolean			VMFlushInserts(csqlvm *vm);
 void			DatabaseGetSupportedTypes(int32_t **dataTypes, char **dataNames, size_t *count);
 REALobject		DatabasePrepare(REALobject instance, REALstring sql);
 
@@ -111,9 +154,11 @@ void			CubeSQLVMBindInt64 (REALobject instance, int index, int64 n);
 void			CubeSQLVMBindNull (REALobject instance, int index);
 void			CubeSQLVMBindZeroBlob (REALobject instance, int index, int len);
 void			CubeSQLVMBindText (REALobject instance, int index, REALstring str);
+Boolean			CubeSQLVMBindFile (REALobject instance, int index, REALfolderItem file);
 void			CubeSQLVMExecute (REALobject instance);
 REALdbCursor	CubeSQLVMSelect (REALobject instance);
 REALdbCursor    CubeSQLVMSelectRowSet (REALobject instance);
+int				CubeSQLVMBindErrorIndex (REALobject instance);
 // prepare class
 void            CubeSQLPrepareConstructor (REALobject instance);
 void            CubeSQLPrepareDestructor (REALobject instance);
@@ -122,12 +167,15 @@ void            CubeSQLPrepareBindValueType (REALobject instance, int index, REA
 void            CubeSQLPrepareBindValues (REALobject instance, REALarray values);
 void            CubeSQLPrepareBindType (REALobject instance, int index, int type);
 void            CubeSQLPrepareBindTypes (REALobject instance, REALarray types);
+Boolean         CubeSQLPrepareBindFile (REALobject instance, int index, REALfolderItem file);
 void            CubeSQLPrepareExecuteSQL (REALobject instance, REALarray values);
 REALdbCursor    CubeSQLPrepareSelectSQL (REALobject instance, REALarray values);
 //void            CubeSQLPrepareExecuteSQLNoValues (REALobject instance);
 //REALdbCursor    CubeSQLPrepareSelectSQLNoValues (REALobject instance);
 void            CubeSQLPrepareSQLExecute (REALobject instance, REALarray params);
 REALdbCursor    CubeSQLPrepareSQLSelect (REALobject instance, REALarray params);
+int             CubeSQLPrepareExecuteBatch (REALobject instance, REALarray values, int columnCount, RBBoolean useTransaction);
+int             CubeSQLPrepareExecuteBatchAffected (REALobject instance, REALarray values, int columnCount, RBBoolean useTransaction, REALarray affected);
 
 // new methods
 void			DatabaseSetTempError(dbDatabase *db, const char *errorMsg, int errorCode);
@@ -145,6 +193,7 @@ REALstring		DatabaseReceiveChunk(REALobject instance);
 // cursor methods
 dbCursor		*CursorCreate(csqlc *c);
 void			CursorDestroy(dbCursor* cursor);
+Boolean			CursorFlushInserts(dbCursor *cursor);
 int				CursorColumnCount(dbCursor *cursor);
 int				CursorRowCount(dbCursor *cursor);
 REALstring		CursorColumnName(dbCursor *cursor, int column);
@@ -162,6 +211,65 @@ void			CursorEdit(dbCursor *cursor);
 void			CursorCheckClearLock(dbCursor *cursor);
 REALstring		CursorTableName(REALobject instance, REALdbCursor rs);
 Boolean			CursorGoToRow(REALobject instance, REALdbCursor rs, int index);
+REALarray		CursorFilterRows(REALobject instance, REALdbCursor rs, int column, REALstring pattern, int flags);
+REALobject		CursorDiffRows(REALobject instance, REALdbCursor oldrs, REALdbCursor newrs);
+REALobject		CursorDiffRowsKey(REALobject instance, REALdbCursor oldrs, REALdbCursor newrs, int keycolumn);
+Boolean			DatabaseExportQuery(REALobject instance, REALstring sql, REALfolderItem file, int format);
+Boolean			DatabaseExportQueryOptions(REALobject instance, REALstring sql, REALfolderItem file, int format, int options);
+void			DatabaseEnableCache(REALobject instance, RBInt64 maxBytes, int ttlSeconds);
+void			DatabaseEnableSharedCache(REALobject instance, RBInt64 maxBytes, int ttlSeconds);
+void			DatabaseDisableCache(REALobject instance);
+void			DatabaseInvalidateCache(REALobject instance);
+void			DatabaseInvalidateCacheTable(REALobject instance, REALstring table);
+RBInt64			DatabaseCacheHits(REALobject instance);
+RBInt64			DatabaseCacheMisses(REALobject instance);
+RBInt64			DatabaseCacheMerged(REALobject instance);
+void			DatabaseEnableInsertBatching(REALobject instance, int maxBytes);
+void			DatabaseDisableInsertBatching(REALobject instance);
+Boolean			DatabaseInsertFlush(REALobject instance);
+REALobject		DatabaseCreateRefreshable(REALobject instance, REALstring sql, REALstring markColumn, int keyColumn, int resyncEvery);
+REALobject		DatabaseCreatePager(REALobject instance, REALstring sql, REALstring keyColumn, int pageSize);
+REALobject		DatabaseCreatePagerPrefetch(REALobject instance, REALstring sql, REALstring keyColumn, int pageSize, REALobject prefetch);
+bool			DatabaseAddReplica(REALobject instance, REALobject replica);
+void			DatabaseRemoveReplica(REALobject instance, REALobject replica);
+int				DatabaseReplicaCount(REALobject instance);
+double			DatabaseReplicaLatency(REALobject instance, int index);
+
+// diff class
+void			CubeSQLDiffConstructor (REALobject instance);
+void			CubeSQLDiffDestructor (REALobject instance);
+REALarray		CubeSQLDiffInserted (REALobject instance);
+REALarray		CubeSQLDiffDeleted (REALobject instance);
+REALarray		CubeSQLDiffUpdated (REALobject instance);
+REALarray		CubeSQLDiffUpdatedOld (REALobject instance);
+
+// refreshable class
+void			CubeSQLRefreshConstructor (REALobject instance);
+void			CubeSQLRefreshDestructor (REALobject instance);
+int				CubeSQLRefreshRefresh (REALobject instance);
+int				CubeSQLRefreshResync (REALobject instance);
+REALdbCursor	CubeSQLRefreshRowSet (REALobject instance);
+
+// pager class
+void			CubeSQLPagerConstructor (REALobject instance);
+void			CubeSQLPagerDestructor (REALobject instance);
+REALdbCursor	CubeSQLPagerNextPage (REALobject instance);
+Boolean			CubeSQLPagerEOF (REALobject instance);
+
+// pool class
+void			CubeSQLPoolConstructor (REALobject instance);
+void			CubeSQLPoolDestructor (REALobject instance);
+void			CubeSQLPoolAdd (REALobject instance, REALobject database);
+int				CubeSQLPoolCount (REALobject instance);
+REALdbCursor	CubeSQLPoolSelectParallel (REALobject instance, REALstring sql, REALstring partitionColumn, int n);
+
+// shard group class
+void			CubeSQLShardsConstructor (REALobject instance);
+void			CubeSQLShardsDestructor (REALobject instance);
+void			CubeSQLShardsAdd (REALobject instance, REALobject database, REALstring name);
+int				CubeSQLShardsCount (REALobject instance);
+REALobject		CubeSQLShardsShard (REALobject instance, REALstring key);
+REALdbCursor	CubeSQLShardsSelectSQL (REALobject instance, REALstring sql);
 
 // properties
 REALstring		ServerVersionGetter(REALobject instance, long param);
@@ -230,6 +338,29 @@ REALmethodDefinition CubeSQLDatabaseMethods[] = {
     { (REALproc) CubeSQLDatabasePrepare, REALnoImplementation, "Prepare(statement As String) as CubeSQLPreparedStatement", REALconsoleSafe},
 	{ (REALproc) CursorGoToRow, REALnoImplementation, "GoToRow(rs As RecordSet, index As Integer) As Boolean", REALconsoleSafe},
 	{ (REALproc) CursorTableName, REALnoImplementation, "TableName(rs As RecordSet) As String", REALconsoleSafe},
+	{ (REALproc) CursorFilterRows, REALnoImplementation, "FilterRows(rs As RowSet, column As Integer, pattern As String, flags As Integer) As Integer()", REALconsoleSafe},
+	{ (REALproc) CursorDiffRows, REALnoImplementation, "DiffRowSets(oldRows As RowSet, newRows As RowSet) As CubeSQLRowSetDiff", REALconsoleSafe},
+	{ (REALproc) CursorDiffRowsKey, REALnoImplementation, "DiffRowSets(oldRows As RowSet, newRows As RowSet, keyColumn As Integer) As CubeSQLRowSetDiff", REALconsoleSafe},
+	{ (REALproc) DatabaseExportQuery, REALnoImplementation, "ExportQuery(sql As String, file As FolderItem, format As Integer) As Boolean", REALconsoleSafe},
+	{ (REALproc) DatabaseExportQueryOptions, REALnoImplementation, "ExportQuery(sql As String, file As FolderItem, format As Integer, options As Integer) As Boolean", REALconsoleSafe},
+	{ (REALproc) DatabaseEnableCache, REALnoImplementation, "EnableCache(maxBytes As Int64, ttlSeconds As Integer)", REALconsoleSafe},
+	{ (REALproc) DatabaseEnableSharedCache, REALnoImplementation, "EnableSharedCache(maxBytes As Int64, ttlSeconds As Integer)", REALconsoleSafe},
+	{ (REALproc) DatabaseDisableCache, REALnoImplementation, "DisableCache()", REALconsoleSafe},
+	{ (REALproc) DatabaseInvalidateCache, REALnoImplementation, "InvalidateCache()", REALconsoleSafe},
+	{ (REALproc) DatabaseInvalidateCacheTable, REALnoImplementation, "InvalidateCache(table As String)", REALconsoleSafe},
+	{ (REALproc) DatabaseCacheHits, REALnoImplementation, "CacheHits() As Int64", REALconsoleSafe},
+	{ (REALproc) DatabaseCacheMisses, REALnoImplementation, "CacheMisses() As Int64", REALconsoleSafe},
+	{ (REALproc) DatabaseCacheMerged, REALnoImplementation, "CacheMerged() As Int64", REALconsoleSafe},
+	{ (REALproc) DatabaseEnableInsertBatching, REALnoImplementation, "EnableInsertBatching(maxBytes As Integer)", REALconsoleSafe},
+	{ (REALproc) DatabaseDisableInsertBatching, REALnoImplementation, "DisableInsertBatching()", REALconsoleSafe},
+	{ (REALproc) DatabaseInsertFlush, REALnoImplementation, "FlushInserts() As Boolean", REALconsoleSafe},
+	{ (REALproc) DatabaseCreateRefreshable, REALnoImplementation, "CreateRefreshable(sql As String, markColumn As String, keyColumn As Integer, resyncEvery As Integer) As CubeSQLRefreshableRowSet", REALconsoleSafe},
+	{ (REALproc) DatabaseCreatePager, REALnoImplementation, "CreatePager(sql As String, keyColumn As String, pageSize As Integer) As CubeSQLPager", REALconsoleSafe},
+	{ (REALproc) DatabaseCreatePagerPrefetch, REALnoImplementation, "CreatePager(sql As String, keyColumn As String, pageSize As Integer, prefetch As CubeSQLServer) As CubeSQLPager", REALconsoleSafe},
+	{ (REALproc) DatabaseAddReplica, REALnoImplementation, "AddReplica(replica As CubeSQLServer) As Boolean", REALconsoleSafe},
+	{ (REALproc) DatabaseRemoveReplica, REALnoImplementation, "RemoveReplica(replica As CubeSQLServer)", REALconsoleSafe},
+	{ (REALproc) DatabaseReplicaCount, REALnoImplementation, "ReplicaCount() As Integer", REALconsoleSafe},
+	{ (REALproc) DatabaseReplicaLatency, REALnoImplementation, "ReplicaLatency(index As Integer) As Double", REALconsoleSafe},
 };
 
 REALproperty CubeSQLDatabaseProperties[] = {
@@ -268,6 +399,14 @@ REALconstant CubeSQLConstants[] = {
 	{"kAES192 = 3", NULL, 0},
 	{"kAES256 = 4", NULL, 0},
 	{"kSSL = 8", NULL, 0},
+	{"kFilterCase = 0", NULL, 0},
+	{"kFilterNoCase = 1", NULL, 0},
+	{"kFilterWildcard = 2", NULL, 0},
+	{"kExportCSV = 0", NULL, 0},
+	{"kExportJSON = 1", NULL, 0},
+	{"kExportNoHeader = 1", NULL, 0},
+	{"kExportCRLF = 2", NULL, 0},
+	{"kExportJSONLines = 4", NULL, 0},
 };
 
 REALconstant CubeSQLPrepareConstants[] = {
@@ -302,15 +441,18 @@ REALmethodDefinition CubeSQLVMMethods[] = {
 	{ (REALproc) CubeSQLVMBindInt64, NULL, "BindInt64(index As Integer, value As Int64)", REALconsoleSafe},
 	{ (REALproc) CubeSQLVMBindNull, NULL, "BindNull(index As Integer)", REALconsoleSafe},
 	{ (REALproc) CubeSQLVMBindZeroBlob, NULL, "BindZeroBlob(index As Integer, length As Integer)", REALconsoleSafe},
+	{ (REALproc) CubeSQLVMBindFile, NULL, "BindFile(index As Integer, file As FolderItem) As Boolean", REALconsoleSafe},
 	{ (REALproc) CubeSQLVMExecute, NULL, "VMExecute()", REALconsoleSafe},
 	{ (REALproc) CubeSQLVMSelect, NULL, "VMSelect() As RecordSet", REALconsoleSafe},
     { (REALproc) CubeSQLVMSelectRowSet, NULL, "VMSelectRowSet() As RowSet", REALconsoleSafe},
+	{ (REALproc) CubeSQLVMBindErrorIndex, NULL, "BindErrorIndex() As Integer", REALconsoleSafe},
 };
 
 REALmethodDefinition CubeSQLPrepareMethods[] = {
     { (REALproc) CubeSQLPrepareBindValue, NULL, "Bind(index As Integer, value As Variant)", REALconsoleSafe},
     { (REALproc) CubeSQLPrepareBindValueType, NULL, "Bind(index As Integer, value As Variant, type As Integer)", REALconsoleSafe},
     { (REALproc) CubeSQLPrepareBindValues, NULL, "Bind(values() As Variant)", REALconsoleSafe},
+    { (REALproc) CubeSQLPrepareBindFile, NULL, "BindFile(index As Integer, file As FolderItem) As Boolean", REALconsoleSafe},
     
     { (REALproc) CubeSQLPrepareBindType, NULL, "BindType(index As Integer, type As Integer)", REALconsoleSafe},
     { (REALproc) CubeSQLPrepareBindTypes, NULL, "BindType(types() As Integer)", REALconsoleSafe},
@@ -319,6 +461,8 @@ REALmethodDefinition CubeSQLPrepareMethods[] = {
     { (REALproc) CubeSQLPrepareSelectSQL, REALnoImplementation, "SelectSQL(ParamArray params As Variant) As RowSet", REALconsoleSafe},
     { (REALproc) CubeSQLPrepareSQLExecute, REALnoImplementation, "SQLExecute(ParamArray params As Variant)", REALconsoleSafe},
     { (REALproc) CubeSQLPrepareExecuteSQL, REALnoImplementation, "ExecuteSQL(ParamArray params As Variant)", REALconsoleSafe},
+    { (REALproc) CubeSQLPrepareExecuteBatch, REALnoImplementation, "ExecuteBatch(values() As Variant, columnCount As Integer, useTransaction As Boolean) As Integer", REALconsoleSafe},
+    { (REALproc) CubeSQLPrepareExecuteBatchAffected, REALnoImplementation, "ExecuteBatch(values() As Variant, columnCount As Integer, useTransaction As Boolean, affected() As Int64) As Integer", REALconsoleSafe},
 };
 
 REALclassDefinition CubeSQLVMClass = {
@@ -336,6 +480,112 @@ REALclassDefinition CubeSQLVMClass = {
 	NULL,0,
 };
 
+REALmethodDefinition CubeSQLDiffMethods[] = {
+	{ (REALproc) CubeSQLDiffInserted, NULL, "Inserted() As Integer()", REALconsoleSafe},
+	{ (REALproc) CubeSQLDiffDeleted, NULL, "Deleted() As Integer()", REALconsoleSafe},
+	{ (REALproc) CubeSQLDiffUpdated, NULL, "Updated() As Integer()", REALconsoleSafe},
+	{ (REALproc) CubeSQLDiffUpdatedOld, NULL, "UpdatedOld() As Integer()", REALconsoleSafe},
+};
+
+REALclassDefinition CubeSQLDiffClass = {
+	kCurrentREALControlVersion,
+	"CubeSQLRowSetDiff",
+	NULL,
+	sizeof(cubeSQLDiff),
+	0,
+	(REALproc) CubeSQLDiffConstructor,
+	(REALproc) CubeSQLDiffDestructor,
+	NULL,
+	0,
+	CubeSQLDiffMethods,
+	sizeof(CubeSQLDiffMethods) / sizeof(REALmethodDefinition),
+	NULL,0,
+};
+
+REALmethodDefinition CubeSQLRefreshMethods[] = {
+	{ (REALproc) CubeSQLRefreshRefresh, NULL, "Refresh() As Integer", REALconsoleSafe},
+	{ (REALproc) CubeSQLRefreshResync, NULL, "Resync() As Integer", REALconsoleSafe},
+	{ (REALproc) CubeSQLRefreshRowSet, NULL, "RowSet() As RowSet", REALconsoleSafe},
+};
+
+REALclassDefinition CubeSQLRefreshClass = {
+	kCurrentREALControlVersion,
+	"CubeSQLRefreshableRowSet",
+	NULL,
+	sizeof(cubeSQLRefresh),
+	0,
+	(REALproc) CubeSQLRefreshConstructor,
+	(REALproc) CubeSQLRefreshDestructor,
+	NULL,
+	0,
+	CubeSQLRefreshMethods,
+	sizeof(CubeSQLRefreshMethods) / sizeof(REALmethodDefinition),
+	NULL,0,
+};
+
+REALmethodDefinition CubeSQLPagerMethods[] = {
+	{ (REALproc) CubeSQLPagerNextPage, NULL, "NextPage() As RowSet", REALconsoleSafe},
+	{ (REALproc) CubeSQLPagerEOF, NULL, "EOF() As Boolean", REALconsoleSafe},
+};
+
+REALclassDefinition CubeSQLPagerClass = {
+	kCurrentREALControlVersion,
+	"CubeSQLPager",
+	NULL,
+	sizeof(cubeSQLPager),
+	0,
+	(REALproc) CubeSQLPagerConstructor,
+	(REALproc) CubeSQLPagerDestructor,
+	NULL,
+	0,
+	CubeSQLPagerMethods,
+	sizeof(CubeSQLPagerMethods) / sizeof(REALmethodDefinition),
+	NULL,0,
+};
+
+REALmethodDefinition CubeSQLPoolMethods[] = {
+	{ (REALproc) CubeSQLPoolAdd, NULL, "Add(database As CubeSQLServer)", REALconsoleSafe},
+	{ (REALproc) CubeSQLPoolCount, NULL, "Count() As Integer", REALconsoleSafe},
+	{ (REALproc) CubeSQLPoolSelectParallel, NULL, "SelectParallel(sql As String, partitionColumn As String, n As Integer) As RowSet", REALconsoleSafe},
+};
+
+REALclassDefinition CubeSQLPoolClass = {
+	kCurrentREALControlVersion,
+	"CubeSQLPool",
+	NULL,
+	sizeof(cubeSQLPool),
+	0,
+	(REALproc) CubeSQLPoolConstructor,
+	(REALproc) CubeSQLPoolDestructor,
+	NULL,
+	0,
+	CubeSQLPoolMethods,
+	sizeof(CubeSQLPoolMethods) / sizeof(REALmethodDefinition),
+	NULL,0,
+};
+
+REALmethodDefinition CubeSQLShardsMethods[] = {
+	{ (REALproc) CubeSQLShardsAdd, NULL, "Add(database As CubeSQLServer, name As String)", REALconsoleSafe},
+	{ (REALproc) CubeSQLShardsCount, NULL, "Count() As Integer", REALconsoleSafe},
+	{ (REALproc) CubeSQLShardsShard, NULL, "Shard(key As String) As CubeSQLServer", REALconsoleSafe},
+	{ (REALproc) CubeSQLShardsSelectSQL, NULL, "SelectSQL(sql As String) As RowSet", REALconsoleSafe},
+};
+
+REALclassDefinition CubeSQLShardsClass = {
+	kCurrentREALControlVersion,
+	"CubeSQLShardGroup",
+	NULL,
+	sizeof(cubeSQLShards),
+	0,
+	(REALproc) CubeSQLShardsConstructor,
+	(REALproc) CubeSQLShardsDestructor,
+	NULL,
+	0,
+	CubeSQLShardsMethods,
+	sizeof(CubeSQLShardsMethods) / sizeof(REALmethodDefinition),
+	NULL,0,
+};
+
 REALclassDefinition CubeSQLPrepareClass = {
     kCurrentREALControlVersion,
     "CubeSQLPreparedStatement",
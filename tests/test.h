@@ -0,0 +1,27 @@
+/*
+ *  test.h
+ *  CubeSQL SDK tests
+ *
+ *  Behaviour tests of the parts of the SDK that do not need a server,
+ *  each test program returns a non zero exit code if a check fails.
+ *
+ */
+
+#ifndef __CSQL_TEST__
+#define __CSQL_TEST__
+
+#include "cubesql.h"
+#include "csql.h"
+
+static int test_failures = 0;
+static int test_checks = 0;
+
+#define CHECK(_cond)		do { test_checks++; if (!(_cond)) { test_failures++; fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #_cond); } } while(0)
+#define CHECK_STR(_s1, _s2)	do { const char *_a = (_s1), *_b = (_s2); test_checks++; if ((_a == NULL) || (_b == NULL) || (strcmp(_a, _b) != 0)) { test_failures++; fprintf(stderr, "%s:%d: expected \"%s\" got \"%s\"\n", __FILE__, __LINE__, (_b) ? _b : "(null)", (_a) ? _a : "(null)"); } } while(0)
+
+static int test_report (const char *name) {
+	fprintf(stderr, "%s: %d checks, %d failed\n", name, test_checks, test_failures);
+	return (test_failures) ? 1 : 0;
+}
+
+#endif
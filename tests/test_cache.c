@@ -0,0 +1,70 @@
+/*
+ *  test_cache.c
+ *  CubeSQL SDK tests
+ *
+ *  Normalization of the SQL used as key of the result cache (and of the single-flight lookups).
+ *
+ */
+
+#include "test.h"
+
+static csqldb	test_db;
+
+static char *test_key (const char *sql) {
+	// SQL part of the key (without the scope prefix)
+	static char	buffer[1024];
+	char		*key;
+	int			keylen;
+	
+	key = csql_cache_key(&test_db, sql, NULL, 0, &keylen);
+	if (key == NULL) return NULL;
+	snprintf(buffer, sizeof(buffer), "%s", key + sizeof(unsigned long long));
+	free(key);
+	return buffer;
+}
+
+static int test_same (const char *sql1, const char *sql2) {
+	char *key = test_key(sql1);
+	char *copy = (key) ? strdup(key) : NULL;
+	int result = (copy) && (strcmp(copy, test_key(sql2)) == 0);
+	if (copy) free(copy);
+	return result;
+}
+
+int main (void) {
+	char	*key1, *key2;
+	int		len1, len2;
+	
+	snprintf(test_db.host, sizeof(test_db.host), "localhost");
+	snprintf(test_db.username, sizeof(test_db.username), "admin");
+	test_db.port = CUBESQL_DEFAULT_PORT;
+	
+	// whitespace and trailing semicolons
+	CHECK_STR(test_key("  SELECT *\n\tFROM  t ;; "), "SELECT * FROM t");
+	CHECK_STR(test_key("SELECT 'a  b' FROM t;"), "SELECT 'a  b' FROM t");
+	
+	// comments are removed before the whitespace is collapsed
+	CHECK_STR(test_key("SELECT * FROM t -- all rows\nWHERE a = 1;"), "SELECT * FROM t WHERE a = 1");
+	CHECK_STR(test_key("SELECT * FROM t --\nWHERE a = 1"), "SELECT * FROM t WHERE a = 1");
+	CHECK_STR(test_key("SELECT a/* x */FROM t"), "SELECT a FROM t");
+	CHECK_STR(test_key("SELECT * FROM t /* unterminated"), "SELECT * FROM t");
+	CHECK(test_same("SELECT * FROM t -- WHERE a = 1\n;", "SELECT * FROM t;"));
+	CHECK(!test_same("SELECT * FROM t -- x\nWHERE a = 1", "SELECT * FROM t"));
+	
+	// comment and whitespace markers inside literals and quoted identifiers are kept
+	CHECK_STR(test_key("SELECT '--  x', \"/* y */\", [a -- b] FROM t"), "SELECT '--  x', \"/* y */\", [a -- b] FROM t");
+	CHECK(!test_same("SELECT * FROM t WHERE a = '-- x'", "SELECT * FROM t WHERE a = ''"));
+	
+	// bound values and the current database are part of the key
+	key1 = csql_cache_key(&test_db, "SELECT ?1", "1", 1, &len1);
+	key2 = csql_cache_key(&test_db, "SELECT ?1", "2", 1, &len2);
+	CHECK((len1 == len2) && (memcmp(key1, key2, len1) != 0));
+	free(key2);
+	test_db.cache_scope = 1;
+	key2 = csql_cache_key(&test_db, "SELECT ?1", "1", 1, &len2);
+	CHECK((len1 == len2) && (memcmp(key1, key2, len1) != 0));
+	free(key1);
+	free(key2);
+	
+	return test_report("test_cache");
+}
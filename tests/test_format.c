@@ -0,0 +1,70 @@
+/*
+ *  test_format.c
+ *  CubeSQL SDK tests
+ *
+ *  Text of the integer and double values bound to prepared statements.
+ *
+ */
+
+#include "test.h"
+
+static void test_int64 (int64 value, const char *expected) {
+	char	buffer[kNUMBER_SIZE];
+	int		len = csql_format_int64(value, buffer);
+	
+	CHECK_STR(buffer, expected);
+	CHECK(len == (int)strlen(expected));
+}
+
+static void test_double (double value, const char *expected) {
+	char	buffer[kNUMBER_SIZE];
+	int		len = csql_format_double(value, buffer);
+	
+	if (expected) CHECK_STR(buffer, expected);
+	CHECK(len == (int)strlen(buffer));
+	CHECK(strtod(buffer, NULL) == value);
+	CHECK(strchr(buffer, ',') == NULL);
+}
+
+int main (void) {
+	double	value;
+	int		i;
+	
+	test_int64(0, "0");
+	test_int64(7, "7");
+	test_int64(10, "10");
+	test_int64(-1, "-1");
+	test_int64(1234567890, "1234567890");
+	test_int64(-9876543210LL, "-9876543210");
+	test_int64(INT64_MAX, "9223372036854775807");
+	test_int64(INT64_MIN, "-9223372036854775808");
+	
+	test_double(0.0, "0.0");
+	test_double(1.0, "1.0");
+	test_double(-2.0, "-2.0");
+	test_double(0.1, "0.1");
+	test_double(0.25, "0.25");
+	test_double(-3.14, "-3.14");
+	test_double(123456.789, "123456.789");
+	test_double(9007199254740991.0, "9007199254740991.0");
+	
+	// -0.0 keeps its sign, the other values only need to round-trip
+	test_double(-0.0, "-0.0");
+	test_double(1e-5, NULL);
+	test_double(1e20, NULL);
+	test_double(1.7976931348623157e308, NULL);
+	test_double(4.9e-324, NULL);
+	test_double(1.0 / 3.0, NULL);
+	test_double(0.1 + 0.2, NULL);
+	
+	// values spread over the whole range
+	value = 1.0;
+	for (i=0; i<600; i++) {
+		test_double(value, NULL);
+		test_double(-value / 7.0, NULL);
+		value *= 3.3;
+		if (value > 1e300) value = 1e-300;
+	}
+	
+	return test_report("test_format");
+}
@@ -0,0 +1,42 @@
+/*
+ *  test_insert.c
+ *  CubeSQL SDK tests
+ *
+ *  INSERT statements generated for the records added with AddRow (single and multi-row).
+ *
+ */
+
+#include "test.h"
+
+static void test_sql (const char *table, const char *columns, int ncols, int nrows, const char *expected) {
+	char *sql = csql_insert_sql(table, columns, ncols, nrows);
+	CHECK_STR(sql, expected);
+	if (sql) free(sql);
+}
+
+int main (void) {
+	char	*sql;
+	int		len;
+	
+	test_sql("t", "a", 1, 1, "INSERT INTO t (a) VALUES (?1);");
+	test_sql("t", "a,b,c", 3, 1, "INSERT INTO t (a,b,c) VALUES (?1,?2,?3);");
+	test_sql("t", "a", 1, 3, "INSERT INTO t (a) VALUES (?1),(?2),(?3);");
+	test_sql("t", "a,b", 2, 3, "INSERT INTO t (a,b) VALUES (?1,?2),(?3,?4),(?5,?6);");
+	
+	CHECK(csql_insert_sql("t", "a", 0, 1) == NULL);
+	CHECK(csql_insert_sql("t", "a", 1, 0) == NULL);
+	CHECK(csql_insert_sql(NULL, "a", 1, 1) == NULL);
+	
+	// the largest batch (999 parameters) numbers every parameter in order
+	sql = csql_insert_sql("t", "a,b,c", 3, 333);
+	CHECK(sql != NULL);
+	if (sql) {
+		len = (int)strlen(sql);
+		CHECK(strncmp(sql, "INSERT INTO t (a,b,c) VALUES (?1,?2,?3),(?4,", 44) == 0);
+		CHECK(strcmp(sql + len - 17, "(?997,?998,?999);") == 0);
+		CHECK(strstr(sql, "?1000") == NULL);
+		free(sql);
+	}
+	
+	return test_report("test_insert");
+}
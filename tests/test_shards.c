@@ -0,0 +1,153 @@
+/*
+ *  test_shards.c
+ *  CubeSQL SDK tests
+ *
+ *  LIMIT/OFFSET parsing and ordered merge of the results of a shard group select.
+ *
+ */
+
+#include "test.h"
+
+static csqlc *test_cursor (const char **ids, int nrows) {
+	// (id, name) cursor with the rows already sorted by id, laid out in a single buffer as read from the server
+	int		i, n, len, ncols = 2, nfields = nrows * 2;
+	char	*p, name[32];
+	
+	csqlc *c = csql_cursor_alloc(NULL);
+	c->p = (char *) malloc((sizeof(int) * (ncols + nfields)) + 16 + (nfields * 32));
+	c->psum = (int *) malloc(sizeof(int) * nfields);
+	
+	c->types = (int *) c->p;
+	c->size = c->size0 = c->types + ncols;
+	c->names = (char *) (c->size + nfields);
+	c->types[0] = CUBESQL_Type_Integer;
+	c->types[1] = CUBESQL_Type_Text;
+	memcpy(c->names, "id\0name\0", 8);
+	c->data = c->data0 = p = c->names + 8;
+	
+	for (i=0, n=0; i<nrows; i++) {
+		snprintf(name, sizeof(name), "row%s", ids[i]);
+		len = (int)strlen(ids[i]);
+		memcpy(p, ids[i], len); p += len;
+		c->size[n] = len;
+		c->psum[n] = len + ((n > 0) ? c->psum[n-1] : 0); n++;
+		len = (int)strlen(name);
+		memcpy(p, name, len); p += len;
+		c->size[n] = len;
+		c->psum[n] = len + c->psum[n-1]; n++;
+	}
+	c->ncols = ncols;
+	c->nrows = nrows;
+	return c;
+}
+
+static csqlc *test_shards (void) {
+	static const char *s1[] = {"1", "4", "5", "9"};
+	static const char *s2[] = {"2", "3", "8"};
+	static const char *s3[] = {"6", "7", "10"};
+	csqlc *parts[3];
+	
+	parts[0] = test_cursor(s1, 4);
+	parts[1] = test_cursor(s2, 3);
+	parts[2] = test_cursor(s3, 3);
+	return csql_cursor_concat(parts, 3);
+}
+
+static void test_rows (csqlc *c, const char *expected) {
+	// ids of the rows separated by commas
+	char	buffer[256], *field;
+	int		i, len, n = 0;
+	
+	buffer[0] = 0;
+	for (i=1; i<=cubesql_cursor_numrows(c); i++) {
+		field = cubesql_cursor_field(c, i, 1, &len);
+		n += snprintf(buffer + n, sizeof(buffer) - n, "%s%.*s", (i > 1) ? "," : "", len, field);
+	}
+	CHECK_STR(buffer, expected);
+}
+
+static void test_limit (void) {
+	int limit, offset;
+	const char *sql;
+	
+	CHECK(csql_sql_limit("SELECT * FROM t ORDER BY id;", &limit, &offset) == -1);
+	CHECK((limit == -1) && (offset == 0));
+	
+	sql = "SELECT * FROM t ORDER BY id LIMIT 5;";
+	CHECK(csql_sql_limit(sql, &limit, &offset) == (int)(strstr(sql, "LIMIT") - sql));
+	CHECK((limit == 5) && (offset == 0));
+	
+	CHECK(csql_sql_limit("SELECT * FROM t ORDER BY id LIMIT 5 OFFSET 10", &limit, &offset) > 0);
+	CHECK((limit == 5) && (offset == 10));
+	
+	// LIMIT m, n has the offset first
+	CHECK(csql_sql_limit("SELECT * FROM t ORDER BY id limit 10, 5;", &limit, &offset) > 0);
+	CHECK((limit == 5) && (offset == 10));
+	
+	CHECK(csql_sql_limit("SELECT * FROM t LIMIT -1 OFFSET 3;", &limit, &offset) > 0);
+	CHECK((limit == -1) && (offset == 3));
+	
+	// a LIMIT inside a subquery does not count
+	CHECK(csql_sql_limit("SELECT * FROM (SELECT * FROM t LIMIT 2) ORDER BY id;", &limit, &offset) == -1);
+	CHECK(csql_sql_limit("SELECT * FROM t WHERE a = 'LIMIT 3' -- LIMIT 4\n;", &limit, &offset) == -1);
+	
+	// expressions and parameters cannot be applied to the merged rows
+	CHECK(csql_sql_limit("SELECT * FROM t LIMIT ?1;", &limit, &offset) > 0);
+	CHECK(limit == -2);
+	CHECK(csql_sql_limit("SELECT * FROM t LIMIT 2 + 3 OFFSET 1;", &limit, &offset) > 0);
+	CHECK(limit == -2);
+	CHECK(csql_sql_limit("SELECT * FROM t LIMIT 2 OFFSET (SELECT 1);", &limit, &offset) > 0);
+	CHECK(limit == -2);
+}
+
+static void test_merge (void) {
+	csqlsortkey	keys[kMAX_SORTKEYS];
+	csqlc		*c;
+	int			len;
+	
+	// ORDER BY of result columns
+	c = test_shards();
+	CHECK(csql_sql_orderby("SELECT id, name FROM t ORDER BY id;", c, keys, kMAX_SORTKEYS) == 1);
+	CHECK(csql_sql_orderby("SELECT id, name FROM t ORDER BY 2 DESC, t.id LIMIT 3;", c, keys, kMAX_SORTKEYS) == 2);
+	CHECK(csql_sql_orderby("SELECT id, name FROM t;", c, keys, kMAX_SORTKEYS) == 0);
+	CHECK(csql_sql_orderby("SELECT id, name FROM t ORDER BY id + 1;", c, keys, kMAX_SORTKEYS) == -1);
+	CHECK(csql_sql_orderby("SELECT id, name FROM t ORDER BY missing;", c, keys, kMAX_SORTKEYS) == -1);
+	
+	CHECK(csql_sql_orderby("SELECT id, name FROM t ORDER BY id;", c, keys, kMAX_SORTKEYS) == 1);
+	CHECK(csql_cursor_merge(c, keys, 1, 0, -1) == kTRUE);
+	test_rows(c, "1,2,3,4,5,6,7,8,9,10");
+	cubesql_cursor_free(c);
+	
+	// LIMIT n OFFSET m over the merged rows is the same as on a single server
+	c = test_shards();
+	csql_sql_orderby("SELECT id, name FROM t ORDER BY id;", c, keys, kMAX_SORTKEYS);
+	CHECK(csql_cursor_merge(c, keys, 1, 3, 4) == kTRUE);
+	test_rows(c, "4,5,6,7");
+	CHECK(strncmp(cubesql_cursor_field(c, 1, 2, &len), "row4", 4) == 0);
+	CHECK(len == 4);
+	cubesql_cursor_free(c);
+	
+	c = test_shards();
+	csql_sql_orderby("SELECT id, name FROM t ORDER BY id;", c, keys, kMAX_SORTKEYS);
+	CHECK(csql_cursor_merge(c, keys, 1, 8, 5) == kTRUE);
+	test_rows(c, "9,10");
+	cubesql_cursor_free(c);
+	
+	c = test_shards();
+	csql_sql_orderby("SELECT id, name FROM t ORDER BY id;", c, keys, kMAX_SORTKEYS);
+	CHECK(csql_cursor_merge(c, keys, 1, 20, -1) == kTRUE);
+	CHECK(cubesql_cursor_numrows(c) == 0);
+	cubesql_cursor_free(c);
+	
+	// without an ORDER BY the parts are concatenated and then limited
+	c = test_shards();
+	CHECK(csql_cursor_merge(c, keys, 0, 2, 3) == kTRUE);
+	test_rows(c, "5,9,2");
+	cubesql_cursor_free(c);
+}
+
+int main (void) {
+	test_limit();
+	test_merge();
+	return test_report("test_shards");
+}